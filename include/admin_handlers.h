@@ -0,0 +1,143 @@
+/**
+ * @file admin_handlers.h HTTP handlers for Homestead's administrative
+ * (statistics) URLs.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef ADMIN_HANDLERS_H__
+#define ADMIN_HANDLERS_H__
+
+#include "httpstack.h"
+#include "statisticsmanager.h"
+#include "heavy_hitters.h"
+#include "negative_cache.h"
+#include "assoc_impu_writer.h"
+
+/// Handler for the /stats/latency URL.  Reports the number of samples and the
+/// 50th, 99th and 99.9th percentile latencies (in microseconds) for each stage
+/// of request processing, as a JSON object keyed by stage name.  Each stage
+/// covers the current stats period so far and the last complete period.
+class StageLatencyHandler : public HttpStack::HandlerInterface
+{
+public:
+  StageLatencyHandler(StatisticsManager* stats) : _stats(stats) {}
+  virtual ~StageLatencyHandler() {}
+
+  void process_request(HttpStack::Request& req, SAS::TrailId trail);
+
+  /// Build the JSON report.  Public for UT.
+  std::string build_report();
+
+private:
+  StatisticsManager* _stats;
+};
+
+/// Handler for the /stats/cache URL.  Reports the latency percentiles (in
+/// microseconds) and the number of operations completed with each result code
+/// for each type of cache operation, as a JSON object keyed by operation name.
+class CacheOperationStatsHandler : public HttpStack::HandlerInterface
+{
+public:
+  CacheOperationStatsHandler(StatisticsManager* stats) : _stats(stats) {}
+  virtual ~CacheOperationStatsHandler() {}
+
+  void process_request(HttpStack::Request& req, SAS::TrailId trail);
+
+  /// Build the JSON report.  Public for UT.
+  std::string build_report();
+
+private:
+  StatisticsManager* _stats;
+};
+
+/// Handler for the /stats/hot-subscribers URL.  Reports the subscribers making
+/// the most requests to each endpoint in the last measurement window, with
+/// their request counts and rates (per second).
+class HotSubscribersHandler : public HttpStack::HandlerInterface
+{
+public:
+  HotSubscribersHandler(HotSubscribers* hot_subscribers) :
+    _hot_subscribers(hot_subscribers)
+  {}
+  virtual ~HotSubscribersHandler() {}
+
+  void process_request(HttpStack::Request& req, SAS::TrailId trail);
+
+  /// Build the JSON report.  Public for UT.
+  std::string build_report();
+
+private:
+  HotSubscribers* _hot_subscribers;
+};
+
+/// Handler for the /negative-cache URL.  A GET reports the size of the
+/// negative cache and the hits, misses and inserts for each Diameter command.
+/// A DELETE clears the cache, or (with an id parameter) forgets the entries
+/// for one identity - provisioning tools use this after adding a subscriber.
+class NegativeCacheHandler : public HttpStack::HandlerInterface
+{
+public:
+  NegativeCacheHandler(NegativeCache* negative_cache) :
+    _negative_cache(negative_cache)
+  {}
+  virtual ~NegativeCacheHandler() {}
+
+  void process_request(HttpStack::Request& req, SAS::TrailId trail);
+
+  /// Build the JSON report.  Public for UT.
+  std::string build_report();
+
+private:
+  NegativeCache* _negative_cache;
+};
+
+/// Handler for the /stats/write-behind URL.  Reports the number of
+/// associated public ID writes outstanding, and the number written,
+/// coalesced, overflowed (written by the request instead) and failed.
+class WriteBehindStatsHandler : public HttpStack::HandlerInterface
+{
+public:
+  WriteBehindStatsHandler(AssocImpuWriter* writer) : _writer(writer) {}
+  virtual ~WriteBehindStatsHandler() {}
+
+  void process_request(HttpStack::Request& req, SAS::TrailId trail);
+
+  /// Build the JSON report.  Public for UT.
+  std::string build_report();
+
+private:
+  AssocImpuWriter* _writer;
+};
+
+#endif
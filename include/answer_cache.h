@@ -0,0 +1,160 @@
+/**
+ * @file answer_cache.h Short-lived cache of the HSS's answers.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef ANSWER_CACHE_H__
+#define ANSWER_CACHE_H__
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+
+/// @class AnswerCache
+///
+/// Remembers, for a short time, the responses built from the HSS's answers
+/// to a type of Diameter request, so that repeated queries for busy
+/// subscribers don't each cost a request to the HSS.
+///
+/// Responses are keyed by a subscriber identity and by the other parameters
+/// on the query.  All the responses for an identity are forgotten together
+/// when homestead learns that the subscriber's S-CSCF assignment may have
+/// changed.  A response can also be tied to a second identity, so that it's
+/// forgotten when either identity is.  Every entry has the same TTL, so the
+/// entries are kept in insertion order - which is also expiry order - and
+/// the oldest is evicted when the cache is full.
+class AnswerCache
+{
+public:
+  /// Constructor.
+  ///
+  /// @param capacity - The maximum number of entries.
+  /// @param ttl_ms - How long a response is cached for.
+  AnswerCache(size_t capacity = DEFAULT_CAPACITY,
+              unsigned long ttl_ms = DEFAULT_TTL_MS);
+  virtual ~AnswerCache();
+
+  /// Build the params for a query from its parameters (up to three).
+  static std::string make_params(const std::string& param1,
+                                 const std::string& param2 = "",
+                                 const std::string& param3 = "");
+
+  /// Look up a cached response.
+  ///
+  /// @param id - The subscriber identity being queried.
+  /// @param params - The other parameters on the query (see make_params).
+  /// @param body - (out) The cached response body.
+  /// @return true if a response was found.
+  bool get(const std::string& id,
+           const std::string& params,
+           std::string& body);
+
+  /// Cache a response, replacing any existing one.
+  ///
+  /// @param other_id - Another identity the response depends on, if any.
+  ///                   Invalidating it also forgets the response.
+  void put(const std::string& id,
+           const std::string& params,
+           const std::string& body,
+           const std::string& other_id = "");
+
+  /// Forget every response for (or tied to) an identity.
+  void invalidate(const std::string& id);
+
+  /// Forget every response.
+  void clear();
+
+  /// @return the number of entries.
+  size_t size();
+
+  inline uint64_t hits() const { return _hits; }
+  inline uint64_t misses() const { return _misses; }
+  inline uint64_t invalidations() const { return _invalidations; }
+  inline uint64_t evictions() const { return _evictions; }
+
+  /// @return how long responses are cached for, in milliseconds.
+  inline unsigned long ttl_ms() const { return _ttl_ms; }
+
+  static const size_t DEFAULT_CAPACITY = 10000;
+  static const unsigned long DEFAULT_TTL_MS = 5000;
+
+private:
+  struct Entry
+  {
+    std::string id;
+    std::string other_id;
+    std::string params;
+    std::string body;
+    uint64_t expiry_ms;
+  };
+
+  typedef std::list<Entry>::iterator EntryIt;
+
+  // The entries for (or tied to) an identity, keyed by the other query
+  // parameters.  There are only ever a handful, so a linear search is fine.
+  typedef std::list<std::pair<std::string, EntryIt> > Variants;
+
+  // Remove an entry from the list and the index.  Must be called with the
+  // lock held.
+  void remove(EntryIt entry);
+
+  // Remove an entry from the variants for one identity.  Must be called with
+  // the lock held.
+  void unindex(const std::string& id, EntryIt entry);
+
+  // Remove expired entries from the front of the list.  Must be called with
+  // the lock held.
+  void expire(uint64_t now);
+
+  // Disallow copying.
+  AnswerCache(const AnswerCache&);
+  void operator=(const AnswerCache&);
+
+  size_t _capacity;
+  unsigned long _ttl_ms;
+
+  std::mutex _lock;
+  std::list<Entry> _entries;
+  std::unordered_map<std::string, Variants> _index;
+
+  std::atomic<uint64_t> _hits;
+  std::atomic<uint64_t> _misses;
+  std::atomic<uint64_t> _invalidations;
+  std::atomic<uint64_t> _evictions;
+};
+
+#endif
@@ -0,0 +1,140 @@
+/**
+ * @file assoc_impu_writer.h Write-behind of associated public IDs.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef ASSOC_IMPU_WRITER_H__
+#define ASSOC_IMPU_WRITER_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <stdint.h>
+
+#include "cache.h"
+#include "sas.h"
+
+/// @class AssocImpuWriter
+///
+/// Writes the associations between private and public IDs learned from
+/// Multimedia-Auth answers to the cache in the background ("write-behind"),
+/// so the digest can be returned to Sprout without waiting for Cassandra.
+///
+/// The number of writes outstanding is bounded.  Writes of an association
+/// that is already being written are coalesced - the association is written
+/// once more when the current write completes, rather than once per request.
+class AssocImpuWriter
+{
+public:
+  /// Constructor.
+  ///
+  /// @param cache - The cache to write to.
+  /// @param max_pending - The maximum number of associations being written
+  ///                      at once.
+  AssocImpuWriter(Cache* cache, size_t max_pending = DEFAULT_MAX_PENDING);
+
+  /// Destructor.  Waits for outstanding writes to complete.
+  virtual ~AssocImpuWriter();
+
+  /// Queue a write of an association.
+  ///
+  /// @return false if too many writes are outstanding, in which case the
+  ///         caller should write the association itself.
+  bool write(const std::string& impi,
+             const std::string& impu,
+             int32_t ttl,
+             SAS::TrailId trail);
+
+  /// Wait for outstanding writes to complete.
+  ///
+  /// @param timeout_ms - How long to wait.
+  /// @return true if every write completed.
+  bool flush(unsigned long timeout_ms = DEFAULT_FLUSH_TIMEOUT_MS);
+
+  /// @return the number of associations being written.
+  size_t pending();
+
+  inline uint64_t written() const { return _written; }
+  inline uint64_t coalesced() const { return _coalesced; }
+  inline uint64_t overflowed() const { return _overflowed; }
+  inline uint64_t failed() const { return _failed; }
+
+  static const size_t DEFAULT_MAX_PENDING = 1000;
+  static const unsigned long DEFAULT_FLUSH_TIMEOUT_MS = 5000;
+
+private:
+  struct Write
+  {
+    std::string impi;
+    std::string impu;
+    int32_t ttl;
+    SAS::TrailId trail;
+
+    // Whether the association was written again while this write was
+    // outstanding, so must be rewritten when it completes.
+    bool rewrite;
+  };
+
+  // The transaction for a write.  It is a handler cache transaction, so that
+  // the write is counted in the same stats as the handlers' own cache writes.
+  // It's defined in assoc_impu_writer.cpp, as handlers.h includes this file.
+  class Transaction;
+
+  // Issue the cache write for an association.  Must be called without the
+  // lock held, as the cache may complete the write immediately.
+  void issue(const std::string& key, const Write& write);
+
+  // Called when the cache write for an association completes.
+  void complete(const std::string& key, bool success);
+
+  // Disallow copying.
+  AssocImpuWriter(const AssocImpuWriter&);
+  void operator=(const AssocImpuWriter&);
+
+  Cache* _cache;
+  size_t _max_pending;
+
+  std::mutex _lock;
+  std::condition_variable _cond;
+  std::map<std::string, Write> _pending;
+
+  std::atomic<uint64_t> _written;
+  std::atomic<uint64_t> _coalesced;
+  std::atomic<uint64_t> _overflowed;
+  std::atomic<uint64_t> _failed;
+};
+
+#endif
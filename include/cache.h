@@ -36,10 +36,13 @@
 #ifndef CACHE_H_
 #define CACHE_H_
 
+#include <functional>
+
 #include "cassandra_store.h"
 #include "reg_state.h"
 #include "charging_addresses.h"
 #include "authvector.h"
+#include "shared_payload.h"
 
 class Cache : public CassandraStore::Store
 {
@@ -61,13 +64,239 @@ protected:
   Cache(Cache const&);
   void operator=(Cache const&);
 
+  /// Use the embedded store (if configured) rather than a Cassandra client.
+  virtual CassandraStore::Client* get_client();
+  virtual void release_client();
+
+  CassandraStore::Client* _embedded_store;
+
 public:
+  /// Serve all cache operations from an in-process store rather than
+  /// Cassandra.  Must be called before the cache is started.  The cache does
+  /// not take ownership of the store.
+  ///
+  /// @param store - The store to use, or NULL to use Cassandra.
+  void configure_embedded_store(CassandraStore::Client* store);
+
+  /// The default maximum number of mutations sent to Cassandra in a single
+  /// batch_mutate call.
+  static const size_t DEFAULT_MAX_BATCH_SIZE = 100;
+
+  /// @class MutationBatch builds up the column writes and deletions made by a
+  /// cache operation, and sends them to Cassandra using as few batch_mutate
+  /// calls as possible.  Batches that grow beyond the maximum size are split.
+  ///
+  /// All mutations in a batch share the same timestamp.
+  class MutationBatch
+  {
+  public:
+    MutationBatch(const int64_t timestamp,
+                  const size_t max_batch_size = DEFAULT_MAX_BATCH_SIZE);
+    virtual ~MutationBatch();
+
+    /// Write some columns to a single row.
+    ///
+    /// @param table - The table containing the row.
+    /// @param key - The row key.
+    /// @param columns - The column names and values to write.
+    /// @param ttl - The TTL of the written columns (0 for no expiry).
+    void put_columns(const std::string& table,
+                     const std::string& key,
+                     const std::map<std::string, std::string>& columns,
+                     const int32_t ttl = 0);
+
+    /// Write a single column to a single row.
+    ///
+    /// @param table - The table containing the row.
+    /// @param key - The row key.
+    /// @param name - The column name.
+    /// @param value - The column value.
+    /// @param ttl - The TTL of the written column (0 for no expiry).
+    void put_column(const std::string& table,
+                    const std::string& key,
+                    const std::string& name,
+                    const std::string& value,
+                    const int32_t ttl = 0);
+
+    /// Write columns to several rows.
+    ///
+    /// @param rows - The rows and columns to write.
+    /// @param ttl - The TTL of the written columns (0 for no expiry).
+    void put_columns(const std::vector<CassandraStore::RowColumns>& rows,
+                     const int32_t ttl = 0);
+
+    /// Delete a whole row.
+    ///
+    /// @param table - The table containing the row.
+    /// @param key - The row key.
+    void delete_row(const std::string& table, const std::string& key);
+
+    /// Delete some columns from a single row.  If no columns are specified
+    /// the whole row is deleted.
+    ///
+    /// @param table - The table containing the row.
+    /// @param key - The row key.
+    /// @param columns - The columns to delete (the values are ignored).
+    void delete_columns(const std::string& table,
+                        const std::string& key,
+                        const std::map<std::string, std::string>& columns);
+
+    /// Delete columns from several rows.  Rows with no columns specified are
+    /// deleted entirely.
+    ///
+    /// @param rows - The rows and columns to delete.
+    void delete_columns(const std::vector<CassandraStore::RowColumns>& rows);
+
+    /// Add a mutation that has already been built, for example one captured
+    /// from another cache operation.  The mutation keeps its own timestamp.
+    ///
+    /// @param table - The table containing the row.
+    /// @param key - The row key.
+    /// @param mutation - The mutation to add.
+    void add_mutation(const std::string& table,
+                      const std::string& key,
+                      const org::apache::cassandra::Mutation& mutation);
+
+    /// @return the number of mutations in the batch.
+    inline size_t size() const { return _mutations.size(); }
+
+    /// @return the number of distinct rows modified by the batch.
+    size_t rows() const;
+
+    /// @return the approximate number of bytes the batch sends to Cassandra
+    /// (row keys, column names and column values).
+    inline uint64_t bytes() const { return _bytes; }
+
+    /// Send the batch to Cassandra, split into batch_mutate calls of at most
+    /// the maximum batch size.  Batches are only split between rows, so a
+    /// row with more mutations than the maximum is sent in a batch of its
+    /// own.  Exceptions from the client are passed up to the caller.
+    ///
+    /// @param client - The client to use.
+    void execute(CassandraStore::Client* client);
+
+  private:
+    struct KeyedMutation
+    {
+      std::string table;
+      std::string key;
+      org::apache::cassandra::Mutation mutation;
+    };
+
+    int64_t _timestamp;
+    size_t _max_batch_size;
+    std::vector<KeyedMutation> _mutations;
+    uint64_t _bytes;
+  };
+
+  /// The types of operation performed on the cache.  Statistics are kept
+  /// separately for each type.
+  enum OperationType
+  {
+    OP_PUT_REG_DATA = 0,
+    OP_PUT_ASSOCIATED_PRIVATE_ID,
+    OP_PUT_ASSOCIATED_PUBLIC_ID,
+    OP_PUT_AUTH_VECTOR,
+    OP_GET_REG_DATA,
+    OP_GET_ASSOCIATED_PUBLIC_IDS,
+    OP_GET_ASSOCIATED_PRIMARY_PUBLIC_IDS,
+    OP_GET_AUTH_VECTOR,
+    OP_DELETE_PUBLIC_IDS,
+    OP_DELETE_PRIVATE_IDS,
+    OP_DELETE_IMPI_MAPPING,
+    OP_DISSOCIATE_IRS_FROM_IMPI,
+    OP_SCAN_IMPUS,
+    OP_SCAN_IMPIS,
+    OP_GET_REG_DATA_BATCH,
+    NUM_OPERATION_TYPES
+  };
+
+  /// @return a short name for an operation type, suitable for use in
+  /// statistics names.
+  static const char* operation_name(OperationType type);
+
+  /// @class CacheOperation is the base class for all cache operations.  As
+  /// well as performing the operation it counts the rows and bytes read from
+  /// and written to Cassandra, so that the cost of each type of operation can
+  /// be tracked.
+  class CacheOperation : public CassandraStore::Operation
+  {
+  public:
+    CacheOperation(OperationType type);
+    virtual ~CacheOperation();
+
+    /// @return the type of this operation.
+    inline OperationType type() const { return _type; }
+
+    /// @return the number of rows read or modified by this operation.
+    inline uint64_t rows_touched() const { return _rows_touched; }
+
+    /// @return the number of bytes read from Cassandra by this operation.
+    inline uint64_t bytes_read() const { return _bytes_read; }
+
+    /// @return the number of bytes written to Cassandra by this operation.
+    inline uint64_t bytes_written() const { return _bytes_written; }
+
+  protected:
+    /// Account for the columns read from a single row.
+    void record_read(const std::vector<org::apache::cassandra::ColumnOrSuperColumn>& columns);
+
+    /// Account for the columns read from several rows.
+    void record_read(const std::map<std::string, std::vector<org::apache::cassandra::ColumnOrSuperColumn> >& rows);
+
+    /// Account for a batch of mutations sent to Cassandra.
+    void record_write(const MutationBatch& batch);
+
+  private:
+    OperationType _type;
+    uint64_t _rows_touched;
+    uint64_t _bytes_read;
+    uint64_t _bytes_written;
+  };
+
+  /// The contents of a row in the IMPU table.
+  struct ImpuRecord
+  {
+    ImpuRecord();
+
+    std::string public_id;
+    RegistrationState reg_state;
+    int32_t reg_state_ttl;
+    std::string xml;
+    int32_t xml_ttl;
+    std::vector<std::string> impis;
+    ChargingAddresses charging_addrs;
+  };
+
+  /// The contents of a row in the IMPI table.
+  struct ImpiRecord
+  {
+    std::string private_id;
+    DigestAuthVector auth_vector;
+    std::vector<std::string> public_ids;
+  };
+
+  /// A range of Cassandra tokens, from start_token (exclusive) to end_token
+  /// (inclusive).
+  struct TokenRange
+  {
+    std::string start_token;
+    std::string end_token;
+  };
+
+  /// Split the whole token ring into contiguous ranges of roughly equal size,
+  /// so that a table can be scanned by several operations in parallel.  This
+  /// assumes the keyspace uses the Murmur3Partitioner.
+  ///
+  /// @param num_ranges - The number of ranges to split the ring into.
+  static std::vector<TokenRange> split_token_ring(int num_ranges);
+
   //
   // Operations
   //
 
   /// @class PutRegData write the registration data for some number of public IDs.
-  class PutRegData : public CassandraStore::Operation
+  class PutRegData : public CacheOperation
   {
   public:
     /// Constructors. Stores off the public IDs that we're changing, the
@@ -87,6 +316,11 @@ public:
     /// @returns - A reference to this PutRegData object.
     virtual PutRegData& with_xml(const std::string& xml);
 
+    /// @param xml - The subscription XML, which is shared with the caller
+    ///              rather than copied.
+    /// @returns - A reference to this PutRegData object.
+    virtual PutRegData& with_xml(const SharedPayload& xml);
+
     /// @param reg_state - The new registration state.
     /// @returns - A reference to this PutRegData object.
     virtual PutRegData& with_reg_state(const RegistrationState reg_state);
@@ -109,6 +343,10 @@ public:
     std::map<std::string, std::string> _columns;
     std::vector<CassandraStore::RowColumns> _to_put;
 
+    // The subscription XML, which is written separately from the other
+    // columns so that it's only copied into the mutations.
+    SharedPayload _xml;
+
     bool perform(CassandraStore::Client* client, SAS::TrailId trail);
   };
 
@@ -130,7 +368,7 @@ public:
                           ttl);
   }
 
-  class PutAssociatedPrivateID : public CassandraStore::Operation
+  class PutAssociatedPrivateID : public CacheOperation
   {
   public:
     /// Give a set of public IDs (representing an implicit registration set) an associated private ID.
@@ -161,7 +399,7 @@ public:
     return new PutAssociatedPrivateID(impus, impi, timestamp, ttl);
   }
 
-  class PutAssociatedPublicID : public CassandraStore::Operation
+  class PutAssociatedPublicID : public CacheOperation
   {
   public:
     /// Give a private_id an associated public ID.
@@ -191,7 +429,7 @@ public:
     return new PutAssociatedPublicID(private_id, assoc_public_id, timestamp, ttl);
   }
 
-  class PutAuthVector : public CassandraStore::Operation
+  class PutAuthVector : public CacheOperation
   {
   public:
     /// Set the authorization vector used for a private ID.
@@ -224,7 +462,7 @@ public:
     return new PutAuthVector(private_id, auth_vector, timestamp, ttl);
   }
 
-  class GetRegData : public CassandraStore::Operation
+  class GetRegData : public CacheOperation
   {
   public:
     /// Get the IMS subscription XML for a public identity.
@@ -240,6 +478,12 @@ public:
     /// @param ttl the column's time-to-live.
     virtual void get_xml(std::string& xml, int32_t& ttl);
 
+    /// Access the result of the request, without copying the XML document.
+    ///
+    /// @param xml the IMS subscription XML document.
+    /// @param ttl the column's time-to-live.
+    virtual void get_shared_xml(SharedPayload& xml, int32_t& ttl);
+
     /// Access the result of the request.
     ///
     /// @param reg_state the registration state value.
@@ -270,7 +514,7 @@ public:
     std::string _public_id;
 
     // Result.
-    std::string _xml;
+    SharedPayload _xml;
     RegistrationState _reg_state;
     int32_t _xml_ttl;
     int32_t _reg_state_ttl;
@@ -285,6 +529,39 @@ public:
     return new GetRegData(public_id);
   }
 
+  /// Get the registration data for several public identities with a single
+  /// multiget, rather than one read per identity.
+  class GetRegDataBatch : public CacheOperation
+  {
+  public:
+    /// Get the registration data for a list of public identities.
+    ///
+    /// @param public_ids the public identities.  Duplicates are read once.
+    GetRegDataBatch(const std::vector<std::string>& public_ids);
+    virtual ~GetRegDataBatch();
+
+    /// Access the result of the request.
+    ///
+    /// @param results a map from each requested public identity to its
+    ///                registration data.  Identities with nothing stored
+    ///                are NOT_REGISTERED with empty XML, as for GetRegData.
+    virtual void get_result(std::map<std::string, GetRegData::Result>& results);
+
+  protected:
+    // Request parameters.
+    std::vector<std::string> _public_ids;
+
+    // Result.
+    std::map<std::string, GetRegData::Result> _results;
+
+    bool perform(CassandraStore::Client* client, SAS::TrailId trail);
+  };
+
+  virtual GetRegDataBatch* create_GetRegDataBatch(const std::vector<std::string>& public_ids)
+  {
+    return new GetRegDataBatch(public_ids);
+  }
+
   /// Get all the public IDs that are associated with one or more
   /// private IDs.
 
@@ -292,7 +569,7 @@ public:
   // database operation that stores associations between IMPIs and
   // primary public IDs for use in handling RTRs, see GetAssociatedPrimaryPublicIDs.
 
-  class GetAssociatedPublicIDs : public CassandraStore::Operation
+  class GetAssociatedPublicIDs : public CacheOperation
   {
   public:
     /// Get the public Ids that are associated with a single private ID.
@@ -340,7 +617,7 @@ public:
   /// when we have a HSS) not the "impi" table (storing the SIP digest
   /// HA1 and all the public IDs associated with this IMPI, and only
   /// used when subscribers are locally provisioned).
-  class GetAssociatedPrimaryPublicIDs : public CassandraStore::Operation
+  class GetAssociatedPrimaryPublicIDs : public CacheOperation
   {
   public:
     /// Get the primary public Ids that are associated with a single private ID.
@@ -377,7 +654,7 @@ public:
     return new GetAssociatedPrimaryPublicIDs(private_ids);
   }
 
-  class GetAuthVector : public CassandraStore::Operation
+  class GetAuthVector : public CacheOperation
   {
   public:
     /// Get the auth vector of a private ID.
@@ -422,7 +699,7 @@ public:
     return new GetAuthVector(private_id, public_id);
   }
 
-  class DeletePublicIDs : public CassandraStore::Operation
+  class DeletePublicIDs : public CacheOperation
   {
   public:
     /// Delete several public IDs from the cache, and also dissociate
@@ -472,7 +749,7 @@ public:
     return new DeletePublicIDs(public_id, impis, timestamp);
   }
 
-  class DeletePrivateIDs : public CassandraStore::Operation
+  class DeletePrivateIDs : public CacheOperation
   {
   public:
     /// Delete a single private ID from the cache.
@@ -515,7 +792,7 @@ public:
   /// may specify a private ID and require the S-CSCF to clear all data
   /// and bindings associated with it.
 
-  class DeleteIMPIMapping : public CassandraStore::Operation
+  class DeleteIMPIMapping : public CacheOperation
   {
   public:
     /// Delete a mapping from private IDs to the IMPUs they have authenticated.
@@ -551,7 +828,7 @@ public:
 
   /// The main use-case is for Registration-Termination-Requests.
 
-  class DissociateImplicitRegistrationSetFromImpi : public CassandraStore::Operation
+  class DissociateImplicitRegistrationSetFromImpi : public CacheOperation
   {
   public:
     /// Delete a mapping from private IDs to the IMPUs they have authenticated.
@@ -587,6 +864,130 @@ public:
   {
     return new DissociateImplicitRegistrationSetFromImpi(impus, impis, timestamp);
   }
+
+  /// The default number of rows read from Cassandra by each page of a scan.
+  static const int32_t DEFAULT_SCAN_PAGE_SIZE = 100;
+
+  /// @class ScanOperation is the base class for operations that read every
+  /// row in a range of a table.  The range is read a page at a time, and each
+  /// row is decoded and passed to a callback before the next page is read, so
+  /// memory use is bounded by the page size however large the table is.
+  ///
+  /// Pages are read at consistency level ONE, and the scan does not retry,
+  /// so that a scan puts as little load as possible on Cassandra.  If a scan
+  /// fails it can be resumed from the last row it delivered by passing that
+  /// row's key to a new operation.
+  class ScanOperation : public CacheOperation
+  {
+  public:
+    virtual ~ScanOperation();
+
+    /// @return the number of rows passed to the callback.
+    inline uint64_t rows_scanned() const { return _rows_scanned; }
+
+    /// @return the key of the last row read, or an empty string if no rows
+    /// have been read.
+    inline const std::string& last_key() const { return _last_key; }
+
+    /// @return whether the callback stopped the scan before the end of the
+    /// range.
+    inline bool stopped() const { return _stopped; }
+
+  protected:
+    ScanOperation(OperationType type,
+                  const std::string& table,
+                  const TokenRange& range,
+                  const std::string& resume_key,
+                  int32_t page_size);
+
+    /// Decode a row and pass it to the callback.
+    ///
+    /// @param key - The row key.
+    /// @param columns - The columns in the row.  Values may be moved out of
+    ///                  them.
+    /// @param now - The time of the scan (used to calculate TTLs).
+    /// @return false to stop the scan.
+    virtual bool process_row(const std::string& key,
+                             std::vector<org::apache::cassandra::ColumnOrSuperColumn>& columns,
+                             int64_t now) = 0;
+
+    bool perform(CassandraStore::Client* client, SAS::TrailId trail);
+
+    std::string _table;
+    TokenRange _range;
+    int32_t _page_size;
+    std::string _last_key;
+    uint64_t _rows_scanned;
+    bool _stopped;
+  };
+
+  /// @class ScanImpus reads every public ID in a range of the IMPU table.
+  class ScanImpus : public ScanOperation
+  {
+  public:
+    /// Called for each public ID.  Returns false to stop the scan.
+    typedef std::function<bool(const ImpuRecord&)> Callback;
+
+    /// @param range - The token range to scan.
+    /// @param callback - Called for each row in the range.
+    /// @param resume_key - If not empty, the scan starts after this key
+    ///                     (which must be in the range).
+    /// @param page_size - The number of rows to read in each page.
+    ScanImpus(const TokenRange& range,
+              const Callback& callback,
+              const std::string& resume_key = "",
+              int32_t page_size = DEFAULT_SCAN_PAGE_SIZE);
+    virtual ~ScanImpus();
+
+  protected:
+    Callback _callback;
+
+    bool process_row(const std::string& key,
+                     std::vector<org::apache::cassandra::ColumnOrSuperColumn>& columns,
+                     int64_t now);
+  };
+
+  virtual ScanImpus* create_ScanImpus(const TokenRange& range,
+                                      const ScanImpus::Callback& callback,
+                                      const std::string& resume_key = "",
+                                      int32_t page_size = DEFAULT_SCAN_PAGE_SIZE)
+  {
+    return new ScanImpus(range, callback, resume_key, page_size);
+  }
+
+  /// @class ScanImpis reads every private ID in a range of the IMPI table.
+  class ScanImpis : public ScanOperation
+  {
+  public:
+    /// Called for each private ID.  Returns false to stop the scan.
+    typedef std::function<bool(const ImpiRecord&)> Callback;
+
+    /// @param range - The token range to scan.
+    /// @param callback - Called for each row in the range.
+    /// @param resume_key - If not empty, the scan starts after this key
+    ///                     (which must be in the range).
+    /// @param page_size - The number of rows to read in each page.
+    ScanImpis(const TokenRange& range,
+              const Callback& callback,
+              const std::string& resume_key = "",
+              int32_t page_size = DEFAULT_SCAN_PAGE_SIZE);
+    virtual ~ScanImpis();
+
+  protected:
+    Callback _callback;
+
+    bool process_row(const std::string& key,
+                     std::vector<org::apache::cassandra::ColumnOrSuperColumn>& columns,
+                     int64_t now);
+  };
+
+  virtual ScanImpis* create_ScanImpis(const TokenRange& range,
+                                      const ScanImpis::Callback& callback,
+                                      const std::string& resume_key = "",
+                                      int32_t page_size = DEFAULT_SCAN_PAGE_SIZE)
+  {
+    return new ScanImpis(range, callback, resume_key, page_size);
+  }
 };
 
 #endif
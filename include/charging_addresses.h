@@ -40,6 +40,122 @@
 
 #include <string>
 #include <deque>
+#include <initializer_list>
+#include <utility>
+
+/// A subscriber's primary and (optional) secondary addresses for one type of
+/// charging function.  This has the same interface as the parts of
+/// std::deque<std::string> that we use, but stores the addresses inline, as
+/// there can never be more than two.  This avoids allocating a deque block
+/// every time the charging addresses are read or copied.
+class ChargingFunctions
+{
+public:
+  typedef std::string value_type;
+  typedef std::string* iterator;
+  typedef const std::string* const_iterator;
+  typedef size_t size_type;
+
+  /// The maximum number of addresses (primary and secondary).
+  static const size_t MAX_SIZE = 2;
+
+  inline ChargingFunctions() : _size(0) {}
+
+  /// Construct from a list of addresses, in priority order.  Any addresses
+  /// beyond MAX_SIZE are ignored.
+  ChargingFunctions(std::initializer_list<std::string> functions) : _size(0)
+  {
+    for (std::initializer_list<std::string>::const_iterator it = functions.begin();
+         it != functions.end();
+         ++it)
+    {
+      push_back(*it);
+    }
+  }
+
+  /// Construct from a deque of addresses, in priority order.  Any addresses
+  /// beyond MAX_SIZE are ignored.
+  ChargingFunctions(const std::deque<std::string>& functions) : _size(0)
+  {
+    for (std::deque<std::string>::const_iterator it = functions.begin();
+         it != functions.end();
+         ++it)
+    {
+      push_back(*it);
+    }
+  }
+
+  inline size_t size() const { return _size; }
+  inline bool empty() const { return (_size == 0); }
+
+  inline std::string& operator[](size_t index) { return _functions[index]; }
+  inline const std::string& operator[](size_t index) const { return _functions[index]; }
+
+  inline iterator begin() { return _functions; }
+  inline iterator end() { return _functions + _size; }
+  inline const_iterator begin() const { return _functions; }
+  inline const_iterator end() const { return _functions + _size; }
+
+  /// Add a lower priority address.  Ignored if there are already MAX_SIZE.
+  inline void push_back(std::string function)
+  {
+    if (_size < MAX_SIZE)
+    {
+      _functions[_size++] = std::move(function);
+    }
+  }
+
+  /// Add a higher priority address.  If there are already MAX_SIZE, the
+  /// lowest priority one is dropped.
+  inline void push_front(std::string function)
+  {
+    for (size_t ii = (_size < MAX_SIZE) ? _size : (MAX_SIZE - 1); ii > 0; --ii)
+    {
+      _functions[ii] = std::move(_functions[ii - 1]);
+    }
+    _functions[0] = std::move(function);
+    if (_size < MAX_SIZE)
+    {
+      ++_size;
+    }
+  }
+
+  inline void clear()
+  {
+    for (size_t ii = 0; ii < _size; ++ii)
+    {
+      _functions[ii].clear();
+    }
+    _size = 0;
+  }
+
+  bool operator==(const ChargingFunctions& other) const
+  {
+    if (_size != other._size)
+    {
+      return false;
+    }
+
+    for (size_t ii = 0; ii < _size; ++ii)
+    {
+      if (_functions[ii] != other._functions[ii])
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  inline bool operator!=(const ChargingFunctions& other) const
+  {
+    return !(*this == other);
+  }
+
+private:
+  std::string _functions[MAX_SIZE];
+  size_t _size;
+};
 
 /// An object containing a subscriber's charging addresses.
 class ChargingAddresses
@@ -49,22 +165,21 @@ public:
   inline ChargingAddresses() {}
 
   /// Constructor which takes CCFs and ECFs.
-  inline ChargingAddresses(std::deque<std::string> ccfs,
-                           std::deque<std::string> ecfs) : ccfs(ccfs), ecfs(ecfs) {}
-
+  inline ChargingAddresses(ChargingFunctions ccfs,
+                           ChargingFunctions ecfs) :
+    ccfs(std::move(ccfs)), ecfs(std::move(ecfs)) {}
 
-  /// Double ended queues of collect charging function addresses and event
-  /// charging function addresses. These are stored in priority order, and
-  /// they are stored in the format given by the provisioning server
-  /// (normally the HSS).
-  std::deque<std::string> ccfs;
-  std::deque<std::string> ecfs;
+  /// Collect charging function addresses and event charging function
+  /// addresses. These are stored in priority order, and they are stored in
+  /// the format given by the provisioning server (normally the HSS).
+  ChargingFunctions ccfs;
+  ChargingFunctions ecfs;
 
   /// Helper function to determine whether we have any charging addresses.
   inline bool empty() const { return (ccfs.empty()) && (ecfs.empty()); }
 
   /// Convert the charging functions into a string to display in logs
-  std::string log_string()
+  std::string log_string() const
   {
     std::string log_str;
 
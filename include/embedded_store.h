@@ -0,0 +1,313 @@
+/**
+ * @file embedded_store.h In-process store for the cache, persisted
+ *   through an append-only log and snapshots.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef EMBEDDED_STORE_H__
+#define EMBEDDED_STORE_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "cassandra_store.h"
+
+/// @class EmbeddedStore
+///
+/// Implements the subset of the Cassandra Thrift API used by the cache
+/// against in-process hash tables, so that small deployments without an HSS
+/// (where homestead's store is the master copy of the subscriber data) can
+/// serve every request from memory.
+///
+/// Column timestamps and TTLs are honoured as in Cassandra.  Each row is kept
+/// as a vector of columns sorted by name, which is much more compact than the
+/// Thrift structures for the handful of columns a cache row has.
+///
+/// Deleting a column or row leaves a tombstone recording the deletion's
+/// timestamp, so that a write with an older timestamp that arrives later
+/// (for example from a background cache write) doesn't bring the data back.
+/// As in Cassandra, tombstones are discarded TOMBSTONE_GC_GRACE_S after the
+/// deletion's timestamp (which, as for every cache write, is in
+/// microseconds).
+///
+/// If a directory is configured, every batch of changes is appended to a log
+/// before it is applied.  A snapshot of the whole store is written (and the
+/// log truncated) when the log grows past a configurable size, and also
+/// periodically if there have been any changes.  Snapshots are written on a
+/// background thread.  A new log is started first, and the tables are then
+/// encoded under the read lock, so reads carry on while a snapshot is
+/// written.  On start-up the snapshot is memory-mapped and loaded, the logs
+/// are replayed over it, and any columns that have expired in the meantime
+/// are discarded.  Log records are checksummed, so a record torn by a crash
+/// is detected and discarded.
+///
+/// When the log is synced to disk depends on the sync policy.
+/// - SYNC_COMMIT: a change isn't acknowledged until the log has been synced.
+///   Changes made concurrently share a single sync (group commit), so the
+///   cost of syncing is spread over every change waiting for it.  No
+///   acknowledged change is lost if the host fails.
+/// - SYNC_NONE: the log is written on every change but only synced when the
+///   store is closed or snapshotted.  Data survives homestead restarting, but
+///   the last few changes may be lost if the host fails.
+///
+/// As in Cassandra, range scans return rows in token order, where a row's
+/// token is a 64-bit hash of its key, and can be bounded by tokens or keys.
+///
+/// The store is thread-safe.  Reads share a lock, and writes are exclusive.
+/// Writes also wait while a snapshot encodes the tables.
+class EmbeddedStore : public CassandraStore::Client
+{
+public:
+  /// When the log is synced to disk (see above).
+  enum SyncPolicy
+  {
+    SYNC_NONE,
+    SYNC_COMMIT
+  };
+
+  /// Constructor.
+  ///
+  /// @param dir                - Directory for the snapshot and log.  If
+  ///                             empty the store is not persisted.
+  /// @param snapshot_log_bytes - The size the log can reach before a
+  ///                             snapshot is taken.
+  /// @param snapshot_interval_s - How often to take a snapshot if there have
+  ///                             been changes (0 for only when the log
+  ///                             reaches snapshot_log_bytes).
+  /// @param sync_policy        - When the log is synced to disk.
+  EmbeddedStore(const std::string& dir = "",
+                uint64_t snapshot_log_bytes = DEFAULT_SNAPSHOT_LOG_BYTES,
+                int snapshot_interval_s = 0,
+                SyncPolicy sync_policy = SYNC_COMMIT);
+  virtual ~EmbeddedStore();
+
+  /// Load any existing snapshot and log, and open the log for writing.  Must
+  /// be called before the store is used if it is persisted.
+  ///
+  /// @return false if the files could not be read or created.
+  bool open();
+
+  /// Call open() on a background thread, so that other start-up work can
+  /// carry on while the store loads.  The store must not be used until
+  /// wait_opened() has returned.
+  void open_async();
+
+  /// Wait for a call to open_async() to complete.
+  ///
+  /// @return the result of open().
+  bool wait_opened();
+
+  /// Write a snapshot of the store and truncate the log.  This blocks
+  /// writes (but not reads) while the tables are encoded.
+  ///
+  /// @return false if the snapshot could not be written.
+  bool snapshot();
+
+  /// @return the number of non-empty rows in a table.
+  size_t row_count(const std::string& table);
+
+  /// @return the number of bytes written to the log since the last snapshot.
+  uint64_t log_bytes();
+
+  // CassandraStore::Client methods.
+  void set_keyspace(const std::string& keyspace);
+
+  void batch_mutate(
+    const std::map<std::string, std::map<std::string, std::vector<org::apache::cassandra::Mutation> > >& mutation_map,
+    const org::apache::cassandra::ConsistencyLevel::type consistency_level);
+
+  void get_slice(std::vector<org::apache::cassandra::ColumnOrSuperColumn>& _return,
+                 const std::string& key,
+                 const org::apache::cassandra::ColumnParent& column_parent,
+                 const org::apache::cassandra::SlicePredicate& predicate,
+                 const org::apache::cassandra::ConsistencyLevel::type consistency_level);
+
+  void multiget_slice(std::map<std::string, std::vector<org::apache::cassandra::ColumnOrSuperColumn> >& _return,
+                      const std::vector<std::string>& keys,
+                      const org::apache::cassandra::ColumnParent& column_parent,
+                      const org::apache::cassandra::SlicePredicate& predicate,
+                      const org::apache::cassandra::ConsistencyLevel::type consistency_level);
+
+  void remove(const std::string& key,
+              const org::apache::cassandra::ColumnPath& column_path,
+              const int64_t timestamp,
+              const org::apache::cassandra::ConsistencyLevel::type consistency_level);
+
+  void get_range_slices(std::vector<org::apache::cassandra::KeySlice>& _return,
+                        const org::apache::cassandra::ColumnParent& column_parent,
+                        const org::apache::cassandra::SlicePredicate& predicate,
+                        const org::apache::cassandra::KeyRange& range,
+                        const org::apache::cassandra::ConsistencyLevel::type consistency_level);
+
+  static const uint64_t DEFAULT_SNAPSHOT_LOG_BYTES = 64 * 1024 * 1024;
+
+  // How long tombstones are kept, as in Cassandra's default gc_grace_seconds.
+  static const int64_t TOMBSTONE_GC_GRACE_S = 10 * 24 * 60 * 60;
+
+private:
+  struct StoredColumn
+  {
+    std::string name;
+    std::string value;
+    int64_t timestamp;
+    int64_t expiry; // Absolute expiry time in seconds, or 0 for none.
+    bool deleted;   // Set if this is a tombstone.
+  };
+  typedef std::vector<StoredColumn> Row;
+  typedef std::unordered_map<std::string, Row> Table;
+
+  // The types of change in a log record.
+  enum ChangeType
+  {
+    PUT_COLUMN = 1,
+    DELETE_COLUMN = 2,
+    DELETE_ROW = 3
+  };
+
+  // Encode a change onto a log record.
+  static void encode_put(std::string& record,
+                         const std::string& table,
+                         const std::string& key,
+                         const StoredColumn& column);
+  static void encode_delete(std::string& record,
+                            ChangeType type,
+                            const std::string& table,
+                            const std::string& key,
+                            const std::string& name,
+                            int64_t timestamp);
+
+  // Apply the changes in a log record to the tables.  Must be called with
+  // the write lock held.
+  //
+  // @return false if the record is malformed.
+  bool apply(const char* record, size_t len);
+
+  // Write a record to the log (if the store is persisted) and apply it.  Must
+  // be called with the write lock held.
+  //
+  // @return the record's sequence number in the log (to pass to
+  //         wait_for_sync()), or 0 if it wasn't logged.
+  uint64_t commit(const std::string& record);
+
+  // Wait until the log has been synced up to the given record (if the sync
+  // policy requires it).  Must be called without the write lock held.
+  void wait_for_sync(uint64_t seq);
+
+  // Apply deletions to a row.
+  static void delete_column(Row& row, const std::string& name, int64_t timestamp, time_t now);
+  static void delete_row(Row& row, int64_t timestamp, time_t now);
+
+  // Load a snapshot or log file, applying each record in turn.
+  //
+  // @param valid_bytes - Set to the length of the file up to the end of the
+  //                      last good record.
+  // @return false if the file exists but could not be read.
+  bool load(const std::string& path, uint64_t& valid_bytes);
+
+  // Write a snapshot and remove the log it replaces.  Must be called without
+  // the store lock held.
+  bool write_snapshot();
+
+  // Start a new log, keeping the current one until a snapshot has been
+  // written.  Must be called with the write lock held.
+  bool rotate_log();
+
+  // Ask the snapshot thread to write a snapshot.
+  void request_snapshot();
+
+  // Open the log, truncating it to the given length.
+  bool open_log(uint64_t length);
+
+  // Load the snapshot and logs.  Must be called with the write lock held.
+  bool load_all();
+
+  // Body of the thread that takes periodic and requested snapshots.
+  void snapshot_loop();
+
+  // Row helpers.
+  static Row::iterator find_column(Row& row, const std::string& name);
+  static bool live(const StoredColumn& column, time_t now);
+  static bool visible(const StoredColumn& column, time_t now);
+  static int64_t tombstone_expiry(int64_t timestamp);
+  static int64_t token(const std::string& key);
+  static void slice_row(std::vector<org::apache::cassandra::ColumnOrSuperColumn>& _return,
+                        Row& row,
+                        const org::apache::cassandra::SlicePredicate& predicate,
+                        time_t now);
+  static void to_thrift(org::apache::cassandra::ColumnOrSuperColumn& cosc,
+                        const StoredColumn& column,
+                        time_t now);
+
+  pthread_rwlock_t _lock;
+  std::map<std::string, Table> _tables;
+
+  std::string _dir;
+  uint64_t _snapshot_log_bytes;
+  int _log_fd;
+  uint64_t _log_bytes;
+  uint64_t _next_snapshot_log_bytes;
+
+  std::thread _loader;
+  bool _opened;
+
+  // Group commit.  _written_seq counts the records written to the log (under
+  // the write lock), and _synced_seq those known to be on disk (under
+  // _sync_lock).  One thread at a time syncs the log.
+  SyncPolicy _sync_policy;
+  uint64_t _written_seq;
+  std::mutex _sync_lock;
+  std::condition_variable _sync_cond;
+  bool _syncing;
+  uint64_t _synced_seq;
+
+  // The snapshot thread waits on _snapshot_cond for a request or for the
+  // snapshot interval.  _snapshot_write_lock ensures only one snapshot is
+  // written at a time.
+  int _snapshot_interval_s;
+  std::thread _snapshot_thread;
+  std::mutex _snapshot_lock;
+  std::condition_variable _snapshot_cond;
+  bool _snapshot_requested;
+  bool _terminating;
+  std::mutex _snapshot_write_lock;
+};
+
+#endif
@@ -37,6 +37,8 @@
 #ifndef HANDLERS_H__
 #define HANDLERS_H__
 
+#include <atomic>
+#include <set>
 #include <boost/bind.hpp>
 
 #include "cx.h"
@@ -48,6 +50,15 @@
 #include "sproutconnection.h"
 #include "health_checker.h"
 #include "snmp_cx_counter_table.h"
+#include "utils.h"
+#include "heavy_hitters.h"
+#include "negative_cache.h"
+#include "answer_cache.h"
+#include "response_compressor.h"
+#include "assoc_impu_writer.h"
+#include "reg_data_refresher.h"
+#include "thread_placement.h"
+#include "shared_payload.h"
 
 // Result-Code AVP constants
 const int32_t DIAMETER_SUCCESS = 2001;
@@ -89,16 +100,34 @@ const std::string JSON_CRYPTKEY = "cryptkey";
 const std::string JSON_INTEGRITYKEY = "integritykey";
 const std::string JSON_RC = "result-code";
 const std::string JSON_SCSCF = "scscf";
+const std::string JSON_PUBLIC_IDS = "public-ids";
+const std::string JSON_PUBLIC_ID = "public-id";
+const std::string JSON_REG_DATA = "reg-data";
 
 // HTTP query string field names
 const std::string AUTH_FIELD_NAME = "resync-auth";
 
+// HTTP header names, and status codes not defined by the HTTP stack.
+const std::string HEADER_ETAG = "ETag";
+const std::string HEADER_IF_NONE_MATCH = "If-None-Match";
+const std::string CONTENT_TYPE_JSON = "application/json";
+#ifndef HTTP_NOT_MODIFIED
+#define HTTP_NOT_MODIFIED 304
+#endif
+
 class HssCacheTask : public HttpStackUtils::Task
 {
 public:
   HssCacheTask(HttpStack::Request& req, SAS::TrailId trail) :
     HttpStackUtils::Task(req, trail)
-  {};
+  {
+    _in_flight++;
+  };
+
+  virtual ~HssCacheTask()
+  {
+    _in_flight--;
+  };
 
   static void configure_diameter(Diameter::Stack* diameter_stack,
                                  const std::string& dest_realm,
@@ -108,6 +137,62 @@ public:
   static void configure_cache(Cache* cache);
   static void configure_health_checker(HealthChecker* hc);
   static void configure_stats(StatisticsManager* stats_manager);
+  static void configure_hot_subscribers(HotSubscribers* hot_subscribers);
+  static void configure_negative_cache(NegativeCache* negative_cache);
+  static void configure_location_info_cache(AnswerCache* location_info_cache);
+  static void configure_registration_status_cache(AnswerCache* registration_status_cache);
+  static void configure_response_compressor(ResponseCompressor* response_compressor);
+  static void configure_assoc_impu_writer(AssocImpuWriter* assoc_impu_writer);
+  static void configure_reg_data_refresher(RegDataRefresher* reg_data_refresher);
+
+  // Record a request from a subscriber in the hot subscriber stats (if
+  // configured).  Returns false if the subscriber is over the rate limit and
+  // the request should be rejected.
+  static bool admit_subscriber(HotSubscribers::Endpoint endpoint,
+                               const std::string& id);
+
+  // Check whether the HSS has recently reported the identities on a request
+  // as unknown (if negative caching is configured).
+  static bool is_user_unknown(NegativeCache::Command command,
+                              const std::string& id,
+                              const std::string& other_id = "");
+
+  // Record that the HSS reported the identities on a request as unknown (if
+  // negative caching is configured).
+  static void record_user_unknown(NegativeCache::Command command,
+                                  const std::string& id,
+                                  const std::string& other_id = "");
+
+  // Forget any negative cache entries for an identity, because the HSS has
+  // told us about it.
+  static void forget_user_unknown(const std::string& id);
+
+  // Forget any cached location info for a set of public IDs, because their
+  // S-CSCF assignment may have changed.
+  static void forget_location_info(const std::vector<std::string>& impus);
+
+  // Forget any cached registration status for a set of private IDs, because
+  // their registrations have been terminated.
+  static void forget_registration_status(const std::vector<std::string>& impis);
+
+  // Stop accepting requests, ahead of shutting down.  Requests that arrive
+  // while draining are rejected with a 503 (by DrainingHandler), so that the
+  // client retries them elsewhere.
+  static void start_draining();
+  static void stop_draining();
+  static bool is_draining();
+
+  // Wait for the requests in progress to finish, including any work a task
+  // does after sending its reply (such as a refresh-ahead re-registration).
+  // Associated public ID writes handed to the AssocImpuWriter aren't tasks,
+  // so aren't waited for here.  Returns false if some requests are still in
+  // progress after the timeout.
+  static bool drain(unsigned long timeout_ms);
+
+  // Record the time spent in one stage of processing a request (if stats are
+  // configured).
+  static void record_stage_latency(StatisticsManager::Stage stage,
+                                   unsigned long latency_us);
 
   inline Cache* cache() const
   {
@@ -116,6 +201,29 @@ public:
 
   void on_diameter_timeout();
 
+  // Send the HTTP reply, recording the time taken in the reply stage stats.
+  void send_http_reply(int status_code);
+
+  // Add a registration data or IMS subscription document to the HTTP reply,
+  // compressed if the client accepts it (and compression is configured).  If
+  // an identity and document version are given, the compressed body may be
+  // cached against them.  If an entity tag is given, it's added to the reply
+  // with a suffix for the content encoding.  Other replies (e.g. digests and
+  // AVs) are small and are added directly with add_content.
+  void add_reply_content(const std::string& body,
+                         const std::string& id = "",
+                         const std::string& version = "",
+                         const std::string& etag = "");
+
+  // Add the Vary header to a reply whose body depends on the request's
+  // Accept-Encoding header, i.e. if compression is configured.
+  void add_vary_header();
+
+  // Whether add_reply_content needs the document's version for this body,
+  // i.e. whether the compressed body will be cached.  Computing the version
+  // means hashing the whole document, so it's only done if it's needed.
+  bool reply_needs_version(const std::string& body);
+
   // Stats the HSS cache handlers can update.
   enum StatsFlags
   {
@@ -155,6 +263,7 @@ public:
 
     void on_timeout()
     {
+      ThreadPlacement::place_current_thread(ThreadPlacement::DIAMETER);
       update_latency_stats();
       // No result-code returned on timeout, so use 0.
       _cx_results_tbl->increment(SNMP::DiameterAppId::TIMEOUT, 0);
@@ -167,6 +276,7 @@ public:
 
     void on_response(Diameter::Message& rsp)
     {
+      ThreadPlacement::place_current_thread(ThreadPlacement::DIAMETER);
       update_latency_stats();
 
       // If we got an overload response (result code of 3004) record a penalty
@@ -205,6 +315,8 @@ public:
           {
             stats->update_H_hss_subscription_latency_us(latency);
           }
+
+          stats->update_stage_latency_us(StatisticsManager::STAGE_HSS, latency);
         }
       }
     }
@@ -218,30 +330,53 @@ public:
     typedef void(H::*failure_clbk_t)(CassandraStore::Operation*,
                                      CassandraStore::ResultCode,
                                      std::string&);
-    CacheTransaction() :
-      CassandraStore::Transaction(0),
+    // The stage and the type of the cache operation must always be given,
+    // so that each operation's latency is recorded against the right stage
+    // and operation type.  The operation must be one created by the Cache.
+    CacheTransaction(StatisticsManager::Stage stage,
+                     Cache::OperationType type,
+                     SAS::TrailId trail = 0) :
+      CassandraStore::Transaction(trail),
       _handler(NULL),
       _success_clbk(NULL),
-      _failure_clbk(NULL)
-    {};
+      _failure_clbk(NULL),
+      _stage(stage),
+      _type(type)
+    {
+      _queue_stopwatch.start();
+    };
 
     CacheTransaction(H* handler,
                      success_clbk_t success_clbk,
-                     failure_clbk_t failure_clbk) :
+                     failure_clbk_t failure_clbk,
+                     StatisticsManager::Stage stage,
+                     Cache::OperationType type) :
       CassandraStore::Transaction((handler != NULL) ? handler->trail() : 0),
       _handler(handler),
       _success_clbk(success_clbk),
-      _failure_clbk(failure_clbk)
-    {};
+      _failure_clbk(failure_clbk),
+      _stage(stage),
+      _type(type)
+    {
+      _queue_stopwatch.start();
+    };
 
   protected:
     H* _handler;
     success_clbk_t _success_clbk;
     failure_clbk_t _failure_clbk;
 
+    // The stage this cache operation is part of, the type of the operation,
+    // and a stopwatch started when the operation was queued (so we can work
+    // out how long it spent waiting for a cache thread).
+    StatisticsManager::Stage _stage;
+    Cache::OperationType _type;
+    Utils::StopWatch _queue_stopwatch;
+
     void on_success(CassandraStore::Operation* op)
     {
-      update_latency_stats();
+      ThreadPlacement::place_current_thread(ThreadPlacement::CACHE);
+      update_latency_stats(op);
 
       if ((_handler != NULL) && (_success_clbk != NULL))
       {
@@ -251,7 +386,8 @@ public:
 
     void on_failure(CassandraStore::Operation* op)
     {
-      update_latency_stats();
+      ThreadPlacement::place_current_thread(ThreadPlacement::CACHE);
+      update_latency_stats(op);
 
       if ((_handler != NULL) && (_failure_clbk != NULL))
       {
@@ -264,7 +400,7 @@ public:
     }
 
   private:
-    void update_latency_stats()
+    void update_latency_stats(CassandraStore::Operation* op)
     {
       StatisticsManager* stats = HssCacheTask::_stats_manager;
 
@@ -272,6 +408,28 @@ public:
       if ((stats != NULL) && get_duration(latency))
       {
         stats->update_H_cache_latency_us(latency);
+        stats->update_stage_latency_us(_stage, latency);
+
+        // Any time between the operation being queued and it completing that
+        // wasn't spent executing it was spent waiting for a cache thread.
+        unsigned long queue_wait = 0;
+        unsigned long total = 0;
+        if (_queue_stopwatch.read(total) && (total > latency))
+        {
+          queue_wait = total - latency;
+          stats->update_stage_latency_us(StatisticsManager::STAGE_CACHE_QUEUE_WAIT,
+                                         queue_wait);
+        }
+
+        // Also break the stats down by the type of cache operation.
+        Cache::CacheOperation* cache_op = (Cache::CacheOperation*)op;
+        stats->update_cache_op_stats(_type,
+                                     cache_op->get_result_code(),
+                                     latency,
+                                     queue_wait,
+                                     cache_op->rows_touched(),
+                                     cache_op->bytes_read(),
+                                     cache_op->bytes_written());
       }
     }
   };
@@ -285,6 +443,32 @@ protected:
   static Cache* _cache;
   static HealthChecker* _health_checker;
   static StatisticsManager* _stats_manager;
+  static HotSubscribers* _hot_subscribers;
+  static NegativeCache* _negative_cache;
+  static AnswerCache* _location_info_cache;
+  static AnswerCache* _registration_status_cache;
+  static ResponseCompressor* _response_compressor;
+  static AssocImpuWriter* _assoc_impu_writer;
+  static RegDataRefresher* _reg_data_refresher;
+
+private:
+  static std::atomic<bool> _draining;
+  static std::atomic<int> _in_flight;
+};
+
+// Wraps the handler for an HSS cache URL, rejecting requests with a 503 while
+// homestead is draining before shutdown.  Also places the HTTP threads that
+// run the handler (see ThreadPlacement).
+class DrainingHandler : public HttpStack::HandlerInterface
+{
+public:
+  DrainingHandler(HttpStack::HandlerInterface* handler) : _handler(handler) {}
+  virtual ~DrainingHandler() {}
+
+  void process_request(HttpStack::Request& req, SAS::TrailId trail);
+
+private:
+  HttpStack::HandlerInterface* _handler;
 };
 
 class ImpiTask : public HssCacheTask
@@ -320,6 +504,7 @@ public:
   void run();
   virtual ~ImpiTask();
   virtual bool parse_request() = 0;
+  virtual HotSubscribers::Endpoint hot_subscriber_endpoint() const = 0;
   void query_cache_av();
   void on_get_av_success(CassandraStore::Operation* op);
   void on_get_av_failure(CassandraStore::Operation* op, CassandraStore::ResultCode error, std::string& text);
@@ -355,6 +540,10 @@ public:
   {}
 
   bool parse_request();
+  HotSubscribers::Endpoint hot_subscriber_endpoint() const
+  {
+    return HotSubscribers::IMPI_DIGEST;
+  }
   void send_reply(const DigestAuthVector& av);
   void send_reply(const AKAAuthVector& av);
 };
@@ -370,6 +559,10 @@ public:
   {}
 
   bool parse_request();
+  HotSubscribers::Endpoint hot_subscriber_endpoint() const
+  {
+    return HotSubscribers::IMPI_AV;
+  }
   void send_reply(const DigestAuthVector& av);
   void send_reply(const AKAAuthVector& av);
 };
@@ -462,9 +655,12 @@ public:
   };
 
   ImpuRegDataTask(HttpStack::Request& req, const Config* cfg, SAS::TrailId trail) :
-    HssCacheTask(req, trail), _cfg(cfg), _impi(), _impu(), _http_rc(HTTP_OK)
+    HssCacheTask(req, trail), _cfg(cfg), _impi(), _impu(),
+    _xml(empty_payload()), _http_rc(HTTP_OK),
+    _refresher(NULL), _refresh_retries(0),
+    _refreshed(false)
   {}
-  virtual ~ImpuRegDataTask() {};
+  virtual ~ImpuRegDataTask();
   virtual void run();
   void on_get_reg_data_success(CassandraStore::Operation* op);
   void on_get_reg_data_failure(CassandraStore::Operation* op,
@@ -472,6 +668,7 @@ public:
                                std::string& text);
   void send_server_assignment_request(Cx::ServerAssignmentType type);
   void on_sar_response(Diameter::Message& rsp);
+  void on_sar_timeout();
   void on_put_reg_data_success(CassandraStore::Operation* op);
   void on_put_reg_data_failure(CassandraStore::Operation* op, CassandraStore::ResultCode error, std::string& text);
   void on_del_impu_success(CassandraStore::Operation* op);
@@ -481,6 +678,12 @@ public:
   typedef HssCacheTask::CacheTransaction<ImpuRegDataTask> CacheTransaction;
   typedef HssCacheTask::DiameterTransaction<ImpuRegDataTask> DiameterTransaction;
 
+  // Build the entity tag for a ClearwaterRegData document from the data it
+  // is rendered from, so it can be checked without rendering the document.
+  static std::string reg_data_etag(RegistrationState state,
+                                   const std::string& xml,
+                                   const ChargingAddresses& charging_addrs);
+
 protected:
 
   // Represents the possible types of request that can be made in the
@@ -494,25 +697,48 @@ protected:
   };
 
   virtual void send_reply();
+  std::string current_etag(bool json);
   void put_in_cache();
+  bool refresh_ahead(int ttl);
+  bool retry_refresh();
   bool is_deregistration_request(RequestType type);
   bool is_auth_failure_request(RequestType type);
   Cx::ServerAssignmentType sar_type_for_request(RequestType type);
   RequestType request_type_from_body(std::string body);
   std::string server_name_from_body(std::string body);
   std::vector<std::string> get_associated_private_ids();
+  const std::vector<std::string>& xml_public_ids();
+  const std::string& xml_private_id();
+  void parse_xml_ids();
 
   const Config* _cfg;
   std::string _impi;
   std::string _impu;
   std::string _type_param;
   RequestType _type;
-  std::string _xml;
+
+  // The IMS subscription.  This is shared with the cache operation or SAS
+  // events that also hold it, so is never modified - only replaced.
+  SharedPayload _xml;
+
+  // The IDs in the IMS subscription, parsed from _parsed_xml.  These are
+  // reparsed only when _xml is replaced.
+  SharedPayload _parsed_xml;
+  std::vector<std::string> _xml_public_ids;
+  std::string _xml_private_id;
+
   RegistrationState _original_state;
   RegistrationState _new_state;
   ChargingAddresses _charging_addrs;
   long _http_rc;
   std::string _provided_server_name;
+
+  // Set if this request has already been answered from the cache, and is now
+  // telling the HSS about the re-registration in the background.  The task
+  // must not reply again.
+  RegDataRefresher* _refresher;
+  int _refresh_retries;
+  bool _refreshed;
 };
 
 class ImpuIMSSubscriptionTask : public ImpuRegDataTask
@@ -529,6 +755,44 @@ private:
   void send_reply();
 };
 
+// Reads the registration data for several public IDs with a single cache
+// read, for URLs of the form "/impu/batch/reg-data".  This is read-only, like
+// a GET of "/impu/<public ID>/reg-data", so never contacts the HSS.
+class ImpuRegDataBatchTask : public HssCacheTask
+{
+public:
+  struct Config
+  {
+    Config(size_t _max_batch_size = 100) :
+      max_batch_size(_max_batch_size) {}
+
+    size_t max_batch_size;
+  };
+
+  ImpuRegDataBatchTask(HttpStack::Request& req, const Config* cfg, SAS::TrailId trail) :
+    HssCacheTask(req, trail), _cfg(cfg), _impus(), _rejected_impus()
+  {}
+  virtual ~ImpuRegDataBatchTask() {};
+  virtual void run();
+  void on_get_reg_data_success(CassandraStore::Operation* op);
+  void on_get_reg_data_failure(CassandraStore::Operation* op,
+                               CassandraStore::ResultCode error,
+                               std::string& text);
+
+  typedef HssCacheTask::CacheTransaction<ImpuRegDataBatchTask> CacheTransaction;
+
+private:
+  bool public_ids_from_body(const std::string& body);
+
+  const Config* _cfg;
+
+  // The public IDs on the request, in the order they were requested.
+  std::vector<std::string> _impus;
+
+  // Public IDs that were over the hot subscriber limits, so weren't read.
+  std::set<std::string> _rejected_impus;
+};
+
 class RegistrationTerminationTask : public Diameter::Task
 {
 public:
@@ -0,0 +1,225 @@
+/**
+ * @file heavy_hitters.h Streaming detection of the most frequent keys.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef HEAVY_HITTERS_H__
+#define HEAVY_HITTERS_H__
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/// @class HeavyHitters
+///
+/// Tracks the most frequent keys seen in a fixed time window, using a
+/// count-min sketch to estimate the count of every key and a small table of
+/// candidate heavy hitters.
+///
+/// Recording a key increments one counter in each row of the sketch.  Each
+/// thread also keeps its own table of candidate keys.  If the key is already
+/// in the table, or its estimated count is no more than the lightest
+/// candidate's, recording it takes no locks.  The table is only locked to add
+/// a key, which the thread does when that key overtakes the lightest
+/// candidate.  The tables hold keys but not counts.  When the heavy hitters
+/// are reported, the tables are merged and each key's count is read from
+/// the sketch.
+///
+/// When a window ends the merged candidates are saved off (so they can be
+/// reported) and the sketch is cleared.
+class HeavyHitters
+{
+public:
+  struct Entry
+  {
+    std::string key;
+    uint64_t count;
+  };
+
+  HeavyHitters(size_t capacity = DEFAULT_CAPACITY,
+               unsigned long window_ms = DEFAULT_WINDOW_MS);
+  virtual ~HeavyHitters();
+
+  /// Record one occurrence of a key.
+  ///
+  /// @param key - The key.
+  /// @return the estimated number of times the key has been seen in the
+  ///         current window, including this one.
+  uint64_t record(const std::string& key);
+
+  /// @return the estimated number of times the key has been seen in the
+  ///         current window.  This may overestimate, but never underestimates.
+  uint64_t estimate(const std::string& key) const;
+
+  /// @return the amount by which estimate() may overestimate the count of a
+  ///         key in the current window (with a probability of less than 2%
+  ///         that it overestimates by more).  This is proportional to the
+  ///         number of keys recorded in the window.
+  uint64_t error_bound() const;
+
+  /// @return the heaviest keys in the last complete window (or in the current
+  ///         window if none has completed yet), heaviest first.
+  std::vector<Entry> top();
+
+  /// @return the length of the window in milliseconds.
+  inline unsigned long window_ms() const { return _window_ms; }
+
+  static const size_t DEFAULT_CAPACITY = 10;
+  static const unsigned long DEFAULT_WINDOW_MS = 10000;
+
+  // The dimensions of the count-min sketch.  With these values the estimated
+  // count of a key exceeds its true count by more than 0.1% of the requests in
+  // the window with a probability of less than 2%.
+  static const size_t SKETCH_DEPTH = 4;
+  static const size_t SKETCH_WIDTH = 2048;
+
+private:
+  // A candidate heavy hitter, with the hash of its key so that checking
+  // whether a key is a candidate rarely needs to compare strings.
+  struct Candidate
+  {
+    uint64_t hash;
+    std::string key;
+  };
+
+  // The candidate heavy hitters seen by one thread in one window.  Only the
+  // owning thread changes the table, and it holds the lock while doing so,
+  // so it can read the table without the lock.  The lock is only contended
+  // when the tables are merged.
+  struct ThreadCandidates
+  {
+    std::mutex lock;
+    uint64_t window;
+    uint64_t threshold;
+    std::vector<Candidate> candidates;
+  };
+
+  uint64_t hash(const std::string& key, size_t indices[SKETCH_DEPTH]) const;
+  uint64_t estimate(const size_t indices[SKETCH_DEPTH]) const;
+  ThreadCandidates* thread_candidates();
+  bool is_candidate(const ThreadCandidates* tc,
+                    uint64_t key_hash,
+                    const std::string& key) const;
+  void update_candidates(ThreadCandidates* tc,
+                         uint64_t window,
+                         uint64_t key_hash,
+                         const std::string& key,
+                         uint64_t count);
+  void maybe_end_window();
+  std::vector<Entry> merge_candidates(uint64_t window);
+
+  // Disallow copying.
+  HeavyHitters(const HeavyHitters&);
+  void operator=(const HeavyHitters&);
+
+  size_t _capacity;
+  unsigned long _window_ms;
+
+  // Indexes this object's entry in each thread's list of candidate tables.
+  uint64_t _id;
+
+  std::atomic<uint32_t> _sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+  std::atomic<uint64_t> _window_start_ms;
+
+  // Counts windows, so that threads can tell when their candidate tables
+  // belong to a window that has ended.
+  std::atomic<uint64_t> _window;
+
+  // Protects the list of per-thread candidate tables and the results of the
+  // last window.
+  std::mutex _lock;
+  std::vector<ThreadCandidates*> _threads;
+  std::vector<Entry> _last_window;
+  uint64_t _last_window_end_ms;
+};
+
+/// @class HotSubscribers
+///
+/// Tracks the subscribers generating the most requests to each HTTP endpoint,
+/// and optionally limits the rate of requests from any single subscriber.
+class HotSubscribers
+{
+public:
+  enum Endpoint
+  {
+    IMPI_DIGEST = 0,
+    IMPI_AV,
+    IMPI_REG_STATUS,
+    IMPU_LOC_INFO,
+    IMPU_REG_DATA,
+    NUM_ENDPOINTS
+  };
+
+  /// @return a short name for an endpoint, for use in reports.
+  static const char* endpoint_name(Endpoint endpoint);
+
+  /// Constructor.
+  ///
+  /// @param rate_limit - The maximum number of requests per second allowed
+  ///                     from a single subscriber to a single endpoint
+  ///                     (averaged over the window), or 0 for no limit.
+  /// @param capacity - The number of subscribers to report per endpoint.
+  /// @param window_ms - The length of the measurement window.
+  HotSubscribers(unsigned int rate_limit = 0,
+                 size_t capacity = HeavyHitters::DEFAULT_CAPACITY,
+                 unsigned long window_ms = HeavyHitters::DEFAULT_WINDOW_MS);
+  virtual ~HotSubscribers();
+
+  /// Record a request from a subscriber.
+  ///
+  /// @param endpoint - The endpoint the request was for.
+  /// @param id - The subscriber's public or private ID.
+  /// @return false if the subscriber has exceeded the rate limit and the
+  ///         request should be rejected, true otherwise.
+  bool record(Endpoint endpoint, const std::string& id);
+
+  /// @return the subscribers making the most requests to an endpoint.
+  std::vector<HeavyHitters::Entry> top(Endpoint endpoint);
+
+  /// @return the length of the measurement window in milliseconds.
+  inline unsigned long window_ms() const { return _window_ms; }
+
+private:
+  // Disallow copying.
+  HotSubscribers(const HotSubscribers&);
+  void operator=(const HotSubscribers&);
+
+  unsigned long _window_ms;
+  uint64_t _max_per_window;
+  HeavyHitters* _hitters[NUM_ENDPOINTS];
+};
+
+#endif
@@ -0,0 +1,145 @@
+/**
+ * @file latency_histogram.h A low-overhead, fixed-precision latency histogram.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef LATENCY_HISTOGRAM_H__
+#define LATENCY_HISTOGRAM_H__
+
+#include <atomic>
+#include <stdint.h>
+
+/// @class LatencyHistogram
+///
+/// Records latency samples (in microseconds) into a fixed set of log-linear
+/// buckets, in the style of an HDR histogram.  Values below 64us are recorded
+/// exactly, and larger values are recorded to within about 3%.
+///
+/// Recording a sample is a single relaxed atomic increment, so a histogram
+/// can be shared by all threads without locking.  Percentiles are calculated
+/// from a (possibly slightly inconsistent) snapshot of the buckets.
+class LatencyHistogram
+{
+public:
+  LatencyHistogram();
+  virtual ~LatencyHistogram() {}
+
+  /// Record a single sample.  Samples larger than MAX_VALUE are recorded as
+  /// MAX_VALUE.
+  void record(uint64_t value_us);
+
+  /// @return the number of samples recorded.
+  uint64_t count() const;
+
+  /// @return the largest sample recorded (0 if no samples have been recorded).
+  uint64_t max() const;
+
+  /// Calculate a percentile of the recorded samples.
+  ///
+  /// @param percentile - The percentile to calculate (e.g. 99.9).
+  /// @return the value at the requested percentile, which is the highest
+  ///         value that falls in the same bucket (capped at the largest
+  ///         sample recorded).  Returns 0 if no samples have been recorded.
+  uint64_t value_at_percentile(double percentile) const;
+
+  /// Clear all the recorded samples.
+  void reset();
+
+  /// The largest value the histogram can distinguish.
+  static const uint64_t MAX_VALUE = 0xFFFFFFFF;
+
+  /// Helpers for converting between values and bucket indexes.  Public for
+  /// UT.
+  static int bucket_index(uint64_t value);
+  static uint64_t bucket_highest_value(int index);
+
+private:
+  /// Each power of two range is split into SUB_BUCKETS / 2 linear buckets,
+  /// except for values below SUB_BUCKETS which each have their own bucket.
+  static const int SUB_BUCKET_BITS = 6;
+  static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  static const int HALF_SUB_BUCKETS = SUB_BUCKETS / 2;
+  static const int NUM_BUCKETS = SUB_BUCKETS +
+                                 ((32 - SUB_BUCKET_BITS) * HALF_SUB_BUCKETS);
+
+  std::atomic<uint64_t> _buckets[NUM_BUCKETS];
+  std::atomic<uint64_t> _count;
+  std::atomic<uint64_t> _max;
+};
+
+/// @class PeriodicLatencyHistogram
+///
+/// Records latency samples into a histogram that is cleared at the start of
+/// each fixed-length period, so that percentiles reflect recent behaviour
+/// rather than the whole life of the process.  The histogram for the last
+/// complete period is kept for reporting.
+///
+/// The histograms are switched over by whichever thread first notices that a
+/// period has ended, so a few samples recorded right on a period boundary
+/// may be lost.
+class PeriodicLatencyHistogram
+{
+public:
+  PeriodicLatencyHistogram(uint64_t period_ms = DEFAULT_PERIOD_MS);
+  virtual ~PeriodicLatencyHistogram() {}
+
+  /// Record a single sample in the current period.
+  void record(uint64_t value_us);
+
+  /// @return the samples recorded so far in the current period.
+  const LatencyHistogram& current() const;
+
+  /// @return the samples recorded in the last complete period.
+  const LatencyHistogram& previous() const;
+
+  inline uint64_t period_ms() const { return _period_ms; }
+
+  /// The default period matches the five minute period of the SNMP event
+  /// accumulator tables.
+  static const uint64_t DEFAULT_PERIOD_MS = 300000;
+
+private:
+  // Move on to the current period, if it has changed since the last sample.
+  void rotate() const;
+
+  const uint64_t _period_ms;
+  const uint64_t _start_ms;
+
+  // The number of the current period (counted from _start_ms), and the
+  // histograms for even and odd numbered periods.
+  mutable std::atomic<uint64_t> _period;
+  mutable LatencyHistogram _histograms[2];
+};
+
+#endif
@@ -0,0 +1,139 @@
+/**
+ * @file negative_cache.h Cache of identities the HSS reports as unknown.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef NEGATIVE_CACHE_H__
+#define NEGATIVE_CACHE_H__
+
+#include <atomic>
+#include <string>
+#include <stdint.h>
+
+#include "answer_cache.h"
+
+/// @class NegativeCache
+///
+/// Remembers, for a short time, the identities that the HSS has reported as
+/// unknown (DIAMETER_ERROR_USER_UNKNOWN), so that repeated requests for them
+/// (for example from scanners or misconfigured devices) can be rejected
+/// without querying the HSS again.
+///
+/// Entries are keyed by the Diameter command and the identities on the
+/// request, so an unknown public ID sent with a valid private ID doesn't
+/// block requests for the private ID on its own.  They are held in an
+/// AnswerCache, with an empty body.
+class NegativeCache
+{
+public:
+  enum Command
+  {
+    MAR = 0,
+    SAR,
+    UAR,
+    LIR,
+    NUM_COMMANDS
+  };
+
+  /// @return a short name for a command, for use in reports.
+  static const char* command_name(Command command);
+
+  struct Stats
+  {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+  };
+
+  /// Constructor.
+  ///
+  /// @param capacity - The maximum number of entries.
+  /// @param ttl_ms - How long an entry is remembered for.
+  NegativeCache(size_t capacity = DEFAULT_CAPACITY,
+                unsigned long ttl_ms = DEFAULT_TTL_MS);
+  virtual ~NegativeCache();
+
+  /// Check whether the HSS has recently reported the identities as unknown.
+  /// Counts a hit or a miss against the command.
+  ///
+  /// @param command - The command that would be sent to the HSS.
+  /// @param id - The identity on the request.
+  /// @param other_id - The other identity on the request, if any.
+  bool contains(Command command,
+                const std::string& id,
+                const std::string& other_id = "");
+
+  /// Record that the HSS reported the identities as unknown.
+  void add(Command command,
+           const std::string& id,
+           const std::string& other_id = "");
+
+  /// Forget every entry involving an identity, because it has been
+  /// (re)provisioned or the HSS has told us about it.
+  void invalidate(const std::string& id);
+
+  /// Forget every entry.
+  void clear();
+
+  /// @return the number of entries.
+  size_t size();
+
+  /// @return the hit, miss and insert counts for a command.
+  Stats stats(Command command) const;
+
+  /// @return the number of entries removed by invalidate() and clear().
+  inline uint64_t invalidations() const { return _entries.invalidations(); }
+
+  /// @return the number of entries evicted because the cache was full.
+  inline uint64_t evictions() const { return _entries.evictions(); }
+
+  /// @return how long entries are remembered for, in milliseconds.
+  inline unsigned long ttl_ms() const { return _entries.ttl_ms(); }
+
+  static const size_t DEFAULT_CAPACITY = 10000;
+  static const unsigned long DEFAULT_TTL_MS = 30000;
+
+private:
+  // Disallow copying.
+  NegativeCache(const NegativeCache&);
+  void operator=(const NegativeCache&);
+
+  AnswerCache _entries;
+
+  std::atomic<uint64_t> _hits[NUM_COMMANDS];
+  std::atomic<uint64_t> _misses[NUM_COMMANDS];
+  std::atomic<uint64_t> _inserts[NUM_COMMANDS];
+};
+
+#endif
@@ -0,0 +1,152 @@
+/**
+ * @file reg_data_refresher.h Refresh-ahead of registration data.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef REG_DATA_REFRESHER_H__
+#define REG_DATA_REFRESHER_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <string>
+#include <stdint.h>
+
+/// @class RegDataRefresher
+///
+/// Tracks re-registrations that have been answered from the cache while the
+/// HSS is told about them in the background ("refresh-ahead"), so Sprout's
+/// REGISTER doesn't wait for the Server-Assignment round trip and the cache
+/// rewrite.
+///
+/// The refresher bounds the number of refreshes in progress, and makes sure
+/// only one refresh is in progress for each public ID.  Records that are too
+/// close to expiring aren't refreshed ahead - the caller must tell the HSS
+/// before replying, as before.
+class RegDataRefresher
+{
+public:
+  /// How a re-registration that needs the HSS to be told about it should be
+  /// handled.
+  enum Admission
+  {
+    /// Tell the HSS before replying.
+    INLINE,
+
+    /// Reply from the cache, then tell the HSS and refresh the cache.  The
+    /// caller must call complete() once the refresh has finished.
+    REFRESH,
+
+    /// Reply from the cache - the HSS is already being told about this
+    /// public ID.
+    IN_PROGRESS
+  };
+
+  /// Constructor.
+  ///
+  /// @param min_remaining_ttl - Records with less than this many seconds
+  ///                            left before they expire are refreshed inline.
+  /// @param max_refreshes     - The maximum number of refreshes in progress
+  ///                            at once.
+  /// @param max_retries       - The number of times to retry a
+  ///                            Server-Assignment request that times out or
+  ///                            can't be delivered.
+  RegDataRefresher(int min_remaining_ttl,
+                   size_t max_refreshes = DEFAULT_MAX_REFRESHES,
+                   int max_retries = DEFAULT_MAX_RETRIES);
+
+  /// Destructor.  Waits for refreshes in progress to complete.
+  virtual ~RegDataRefresher();
+
+  /// Decide how to handle a re-registration for a public ID.
+  ///
+  /// @param impu          - The public ID being re-registered.
+  /// @param remaining_ttl - How long the cached record has left to live.
+  Admission admit(const std::string& impu, int remaining_ttl);
+
+  /// Called when a refresh admitted by admit() has finished.
+  ///
+  /// @param success - Whether the HSS was told and the cache refreshed.
+  void complete(const std::string& impu, bool success);
+
+  /// Called when a refresh retries its Server-Assignment request.
+  inline void record_retry() { _retried++; }
+
+  /// Wait for refreshes in progress to complete.
+  ///
+  /// @param timeout_ms - How long to wait.
+  /// @return true if every refresh completed.
+  bool flush(unsigned long timeout_ms = DEFAULT_FLUSH_TIMEOUT_MS);
+
+  /// @return the number of refreshes in progress.
+  size_t in_progress();
+
+  inline int max_retries() const { return _max_retries; }
+
+  inline uint64_t started() const { return _started; }
+  inline uint64_t coalesced() const { return _coalesced; }
+  inline uint64_t overflowed() const { return _overflowed; }
+  inline uint64_t retried() const { return _retried; }
+  inline uint64_t succeeded() const { return _succeeded; }
+  inline uint64_t failed() const { return _failed; }
+
+  static const size_t DEFAULT_MAX_REFRESHES = 100;
+  static const int DEFAULT_MAX_RETRIES = 2;
+  static const unsigned long DEFAULT_FLUSH_TIMEOUT_MS = 5000;
+
+private:
+  // Disallow copying.
+  RegDataRefresher(const RegDataRefresher&);
+  void operator=(const RegDataRefresher&);
+
+  int _min_remaining_ttl;
+  size_t _max_refreshes;
+  int _max_retries;
+
+  std::mutex _lock;
+  std::condition_variable _cond;
+
+  // The public IDs being refreshed.
+  std::set<std::string> _refreshing;
+
+  std::atomic<uint64_t> _started;
+  std::atomic<uint64_t> _coalesced;
+  std::atomic<uint64_t> _overflowed;
+  std::atomic<uint64_t> _retried;
+  std::atomic<uint64_t> _succeeded;
+  std::atomic<uint64_t> _failed;
+};
+
+#endif
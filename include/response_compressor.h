@@ -0,0 +1,125 @@
+/**
+ * @file response_compressor.h Negotiated compression of HTTP response bodies.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef RESPONSE_COMPRESSOR_H__
+#define RESPONSE_COMPRESSOR_H__
+
+#include <atomic>
+#include <string>
+#include <stdint.h>
+
+#include "answer_cache.h"
+
+/// @class ResponseCompressor
+///
+/// Compresses HTTP response bodies with whichever of gzip or deflate the
+/// client accepts.  Small bodies aren't worth compressing, so only bodies of
+/// at least the threshold size are compressed.
+///
+/// Each thread reuses its own zlib streams rather than allocating new ones
+/// for every response.  Compressed bodies can also be cached against the
+/// version of the document they were built from, so a busy subscriber's
+/// profile is only compressed once per version.
+class ResponseCompressor
+{
+public:
+  enum Encoding
+  {
+    IDENTITY = 0,
+    GZIP,
+    DEFLATE
+  };
+
+  /// Constructor.
+  ///
+  /// @param threshold - The smallest body that is compressed, in bytes.
+  /// @param cache_size - The maximum number of compressed bodies to cache, or
+  ///                     0 to not cache them.
+  ResponseCompressor(size_t threshold = DEFAULT_THRESHOLD,
+                     size_t cache_size = 0);
+  virtual ~ResponseCompressor();
+
+  /// Pick the encoding to use from an Accept-Encoding header.  gzip is
+  /// preferred to deflate if the client accepts both.
+  static Encoding choose_encoding(const std::string& accept_encoding);
+
+  /// @return the Content-Encoding name for an encoding.
+  static const char* encoding_name(Encoding encoding);
+
+  /// Compress a response body.
+  ///
+  /// @param body - The body to compress.
+  /// @param encoding - The encoding to use.
+  /// @param id - The identity the body is for, or empty if the compressed
+  ///             body shouldn't be cached.
+  /// @param version - The version of the document the body was built from
+  ///                  (e.g. its entity tag).
+  /// @param compressed - (out) The compressed body.
+  /// @return true if the body was compressed, false if it should be sent
+  ///         uncompressed.
+  bool compress(const std::string& body,
+                Encoding encoding,
+                const std::string& id,
+                const std::string& version,
+                std::string& compressed);
+
+  /// @return true if compress would cache a body of this size and encoding,
+  ///         in which case it needs the document's version.
+  bool will_cache(size_t body_size, Encoding encoding) const;
+
+  inline uint64_t compressions() const { return _compressions; }
+  inline uint64_t cache_hits() const { return (_cache != NULL) ? _cache->hits() : 0; }
+
+  static const size_t DEFAULT_THRESHOLD = 2048;
+  static const unsigned long CACHE_TTL_MS = 30000;
+
+private:
+  // Compress a body with zlib.  Returns false if zlib fails.
+  static bool deflate_body(const std::string& body,
+                           Encoding encoding,
+                           std::string& compressed);
+
+  // Disallow copying.
+  ResponseCompressor(const ResponseCompressor&);
+  void operator=(const ResponseCompressor&);
+
+  size_t _threshold;
+  AnswerCache* _cache;
+
+  std::atomic<uint64_t> _compressions;
+};
+
+#endif
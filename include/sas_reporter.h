@@ -0,0 +1,199 @@
+/**
+ * @file sas_reporter.h Builds and reports SAS events with large
+ * compressed parameters on a background thread.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef SAS_REPORTER_H__
+#define SAS_REPORTER_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#include "sas.h"
+#include "shared_payload.h"
+
+/// Remembers the compressed form of the last few shared SAS parameters, so
+/// that an IMS subscription logged on several events of a request is only
+/// compressed once.  Parameters are matched by pointer, and the cache keeps a
+/// reference to each one, so a match is always the same string.
+///
+/// Not thread-safe - each SasReporter has one for its own thread.
+class SasCompressionCache
+{
+public:
+  SasCompressionCache();
+
+  /// @return the compressed form of param.
+  const std::string& compress(const SharedPayload& param,
+                              const SAS::Profile* profile);
+
+  /// @return the number of parameters that didn't need compressing again.
+  inline uint64_t hits() const { return _hits; }
+
+  static const size_t NUM_ENTRIES = 16;
+
+private:
+  struct Entry
+  {
+    SharedPayload param;
+    const SAS::Profile* profile;
+    std::string compressed;
+  };
+
+  Entry _entries[NUM_ENTRIES];
+  size_t _next;
+  std::atomic<uint64_t> _hits;
+};
+
+/// A SAS event whose parameters are recorded when it is created, but which is
+/// only built - including compressing any compressed parameters - when it is
+/// reported.  If a SasReporter is configured, this happens on the reporter's
+/// background thread, so that compressing large IMS subscriptions doesn't add
+/// to the latency of the request.
+///
+/// The event is timestamped when it is created, not when it is built, so it
+/// keeps its place in the trail relative to the request's other events
+/// however long it waits on the queue (or if it's built inline because the
+/// queue is full).
+class DeferredSasEvent
+{
+public:
+  DeferredSasEvent(SAS::TrailId trail, uint32_t event_id, uint32_t instance_id);
+
+  DeferredSasEvent& add_static_param(uint32_t param);
+  DeferredSasEvent& add_var_param(std::string param);
+  DeferredSasEvent& add_compressed_param(std::string param,
+                                         const SAS::Profile* profile);
+
+  /// Add a compressed parameter that is shared with the rest of the request
+  /// rather than copied.
+  DeferredSasEvent& add_compressed_param(const SharedPayload& param,
+                                         const SAS::Profile* profile);
+
+  /// Report the event, on the configured SasReporter's thread if there is one
+  /// (and its queue isn't full) or on this thread if not.  The event's
+  /// parameters are moved out, so it must not be reported twice.
+  void report();
+
+  /// Build the SAS event and report it on this thread.  Shared compressed
+  /// parameters are looked up in the cache, if one is supplied.
+  void build_and_report(SasCompressionCache* cache = NULL) const;
+
+private:
+  enum ParamType
+  {
+    STATIC_PARAM,
+    VAR_PARAM,
+    COMPRESSED_PARAM
+  };
+
+  struct Param
+  {
+    ParamType type;
+    uint32_t value;
+    std::string str;
+    SharedPayload payload;
+    const SAS::Profile* profile;
+  };
+
+  SAS::TrailId _trail;
+  SAS::Timestamp _timestamp;
+  uint32_t _event_id;
+  uint32_t _instance_id;
+  std::vector<Param> _params;
+};
+
+/// Reports DeferredSasEvents on a background thread.  The queue of events is
+/// bounded; if it's full, events are reported on the calling thread instead,
+/// so no events are lost.
+class SasReporter
+{
+public:
+  SasReporter(size_t max_queue_len = DEFAULT_MAX_QUEUE_LEN);
+
+  /// Destructor.  Reports any queued events before returning.
+  virtual ~SasReporter();
+
+  /// Queue an event to be reported.
+  ///
+  /// @return false if the queue is full, in which case the caller should
+  ///         report the event itself.
+  bool queue(DeferredSasEvent& event);
+
+  /// @return the number of events reported on the background thread.
+  inline uint64_t reported() const { return _reported; }
+
+  /// @return the number of events rejected because the queue was full.
+  inline uint64_t rejected() const { return _rejected; }
+
+  /// @return the number of shared parameters that had already been compressed
+  ///         for an earlier event.
+  inline uint64_t compressions_reused() const { return _compression_cache.hits(); }
+
+  /// Configure the reporter used by DeferredSasEvent::report() (or NULL to
+  /// report events on the calling thread).
+  static void configure(SasReporter* reporter);
+  static SasReporter* instance();
+
+  static const size_t DEFAULT_MAX_QUEUE_LEN = 1000;
+
+private:
+  void run();
+
+  // Disallow copying.
+  SasReporter(const SasReporter&);
+  void operator=(const SasReporter&);
+
+  size_t _max_queue_len;
+  std::mutex _lock;
+  std::condition_variable _cond;
+  std::deque<DeferredSasEvent> _queue;
+  bool _terminating;
+  SasCompressionCache _compression_cache;
+  std::thread _thread;
+
+  std::atomic<uint64_t> _reported;
+  std::atomic<uint64_t> _rejected;
+
+  static std::atomic<SasReporter*> _instance;
+};
+
+#endif
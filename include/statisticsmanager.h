@@ -41,6 +41,8 @@
 #include "snmp_counter_table.h"
 #include "snmp_event_accumulator_table.h"
 #include "httpstack.h"
+#include "latency_histogram.h"
+#include "cache.h"
 
 #define COUNTER_INCR_METHOD(NAME) \
   virtual void incr_##NAME() { (NAME)->increment(); }
@@ -54,6 +56,65 @@ public:
   StatisticsManager();
   virtual ~StatisticsManager();
 
+  // The stages of request processing that have their own latency stats.
+  enum Stage
+  {
+    STAGE_CACHE_QUEUE_WAIT = 0,
+    STAGE_CACHE_READ,
+    STAGE_HSS,
+    STAGE_CACHE_WRITE,
+    STAGE_XML_RENDER,
+    STAGE_REPLY,
+    NUM_STAGES
+  };
+
+  /// @return a short name for the stage, for use in reports.
+  static const char* stage_name(Stage stage);
+
+  /// Record the time spent in one stage of processing a request.
+  virtual void update_stage_latency_us(Stage stage, unsigned long sample);
+
+  /// @return the histograms of latencies recorded for the stage in the
+  /// current and previous stats periods.
+  const PeriodicLatencyHistogram& stage_histogram(Stage stage) const
+  {
+    return _stage_histograms[stage];
+  }
+
+  /// Result codes are counted in a fixed size array for each cache operation
+  /// type.  Any result code that doesn't fit is counted in the last entry.
+  static const int MAX_CACHE_RESULT_CODES = 8;
+
+  /// @return a short name for a cache result code, for use in reports.
+  static const char* cache_result_name(int rc);
+
+  /// Record the cost and outcome of a completed cache operation.
+  ///
+  /// @param type - The type of the operation.
+  /// @param rc - The result of the operation.
+  /// @param latency_us - How long the operation took to execute.
+  /// @param queue_wait_us - How long the operation waited for a cache thread.
+  /// @param rows - The number of rows the operation read or modified.
+  /// @param bytes_read - The number of bytes read from Cassandra.
+  /// @param bytes_written - The number of bytes written to Cassandra.
+  virtual void update_cache_op_stats(Cache::OperationType type,
+                                     CassandraStore::ResultCode rc,
+                                     unsigned long latency_us,
+                                     unsigned long queue_wait_us,
+                                     uint64_t rows,
+                                     uint64_t bytes_read,
+                                     uint64_t bytes_written);
+
+  /// @return the histogram of latencies recorded for a cache operation type.
+  const LatencyHistogram& cache_op_histogram(Cache::OperationType type) const
+  {
+    return _cache_ops[type].latency_histogram;
+  }
+
+  /// @return the number of operations of a type that completed with the
+  /// given result code.
+  uint64_t cache_op_result_count(Cache::OperationType type, int rc) const;
+
   ACCUMULATOR_UPDATE_METHOD(H_latency_us);
   ACCUMULATOR_UPDATE_METHOD(H_hss_latency_us);
   ACCUMULATOR_UPDATE_METHOD(H_hss_digest_latency_us);
@@ -80,6 +141,23 @@ private:
 
   SNMP::CounterTable* H_incoming_requests;
   SNMP::CounterTable* H_rejected_overload;
+
+  SNMP::EventAccumulatorTable* _stage_latency_tables[NUM_STAGES];
+  PeriodicLatencyHistogram _stage_histograms[NUM_STAGES];
+
+  // The statistics kept for each type of cache operation.
+  struct CacheOpStats
+  {
+    SNMP::EventAccumulatorTable* latency_us;
+    SNMP::EventAccumulatorTable* queue_wait_us;
+    SNMP::EventAccumulatorTable* rows;
+    SNMP::EventAccumulatorTable* bytes_read;
+    SNMP::EventAccumulatorTable* bytes_written;
+    SNMP::CounterTable* failures;
+    LatencyHistogram latency_histogram;
+    std::atomic<uint64_t> results[MAX_CACHE_RESULT_CODES];
+  };
+  CacheOpStats _cache_ops[Cache::NUM_OPERATION_TYPES];
 };
 
 #endif
@@ -0,0 +1,142 @@
+/**
+ * @file thread_placement.h CPU and NUMA placement of homestead's threads.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef THREAD_PLACEMENT_H__
+#define THREAD_PLACEMENT_H__
+
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+
+/// @class ThreadPlacement
+///
+/// Confines each group of homestead's threads (HTTP, cache and Diameter) to a
+/// set of CPUs, and optionally makes them allocate memory from a particular
+/// NUMA node.
+///
+/// The threads in each group are created by the HTTP stack, the cache and
+/// freeDiameter, so they can't be placed when they're created.  Instead each
+/// thread places itself the first time it runs homestead code, by calling
+/// place_current_thread().  Anything the thread allocates after that (such as
+/// its thread-local pools) comes from its group's NUMA node.
+class ThreadPlacement
+{
+public:
+  enum Group
+  {
+    HTTP,
+    CACHE,
+    DIAMETER,
+    NUM_GROUPS
+  };
+
+  /// The host's NUMA topology - the CPUs on each node, keyed by node number.
+  typedef std::map<int, std::vector<int> > Topology;
+
+  ThreadPlacement();
+  virtual ~ThreadPlacement() {}
+
+  /// Set the CPUs a group of threads runs on, and the NUMA node they allocate
+  /// memory from (or -1 to leave that to the kernel).
+  void set_group(Group group, const std::vector<int>& cpus, int node);
+
+  /// Set the placement from a specification of the form
+  /// "<group>:<target>[;<group>:<target>...]", where each group is "http",
+  /// "cache" or "diameter" and each target is either a NUMA node ("node1") or
+  /// a list of CPUs ("0-3,8-11").  Groups that aren't listed are left to the
+  /// kernel.
+  ///
+  /// @return false if the specification is invalid.
+  bool parse(const std::string& spec, const Topology& topology);
+
+  /// Derive a placement from the host topology.  On a host with a single NUMA
+  /// node, placement is left to the kernel.  Otherwise every group runs on
+  /// the first node with enough CPUs for the HTTP and cache threads, so
+  /// requests stay on one node as they pass between threads.  If no node is
+  /// big enough, the cache threads run on the second node.
+  void derive(const Topology& topology, int http_threads, int cache_threads);
+
+  /// Apply the placement for a group to the calling thread.
+  void place(Group group) const;
+
+  /// @return a description of the placement, for logging.
+  std::string to_string() const;
+
+  /// Read the host topology from sysfs.  If it isn't available the host is
+  /// treated as a single node containing every online CPU.
+  static Topology read_topology(const std::string& sysfs_dir = DEFAULT_SYSFS_DIR);
+
+  /// Parse a list of CPUs of the form "0-3,8,10-11".
+  ///
+  /// @return false if the list is invalid.
+  static bool parse_cpu_list(const std::string& str, std::vector<int>& cpus);
+
+  /// Configure the placement applied by place_current_thread() (or NULL to
+  /// leave threads where they are).
+  static void configure(ThreadPlacement* placement);
+  static ThreadPlacement* instance();
+
+  /// Place the calling thread in a group, unless it has already been placed.
+  static inline void place_current_thread(Group group)
+  {
+    if (!_thread_placed)
+    {
+      ThreadPlacement* placement = _instance;
+      if (placement != NULL)
+      {
+        _thread_placed = true;
+        placement->place(group);
+      }
+    }
+  }
+
+  static const std::string DEFAULT_SYSFS_DIR;
+
+private:
+  struct Placement
+  {
+    std::vector<int> cpus;
+    int node;
+  };
+
+  Placement _groups[NUM_GROUPS];
+
+  static std::atomic<ThreadPlacement*> _instance;
+  static thread_local bool _thread_placed;
+};
+
+#endif
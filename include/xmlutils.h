@@ -46,10 +46,17 @@ namespace XmlUtils
 {
   std::vector<std::string> get_public_ids(const std::string& user_data);
   std::string get_private_id(const std::string& user_data);
+  void get_ids(const std::string& user_data,
+               std::vector<std::string>& public_ids,
+               std::string& private_id);
   int build_ClearwaterRegData_xml(RegistrationState state,
-                                  std::string user_data,
+                                  const std::string& user_data,
                                   const ChargingAddresses& charging_addrs,
                                   std::string& xml_str);
+  int build_ClearwaterRegData_json(RegistrationState state,
+                                   const std::string& user_data,
+                                   const ChargingAddresses& charging_addrs,
+                                   std::string& json_str);
 }
 
 #endif
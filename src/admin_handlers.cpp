@@ -0,0 +1,328 @@
+/**
+ * @file admin_handlers.cpp Implementation of the administrative HTTP
+ * handlers.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "admin_handlers.h"
+
+#include "log.h"
+
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
+
+// JSON field names.
+const std::string JSON_COUNT = "count";
+const std::string JSON_P50 = "p50";
+const std::string JSON_P99 = "p99";
+const std::string JSON_P999 = "p999";
+const std::string JSON_MAX = "max";
+const std::string JSON_RESULTS = "results";
+const std::string JSON_PERIOD_MS = "period_ms";
+const std::string JSON_PREVIOUS = "previous";
+const std::string JSON_WINDOW_MS = "window_ms";
+const std::string JSON_ID = "id";
+const std::string JSON_RATE = "rate";
+const std::string JSON_TTL_MS = "ttl_ms";
+const std::string JSON_SIZE = "size";
+const std::string JSON_EVICTIONS = "evictions";
+const std::string JSON_INVALIDATIONS = "invalidations";
+const std::string JSON_HITS = "hits";
+const std::string JSON_MISSES = "misses";
+const std::string JSON_INSERTS = "inserts";
+const std::string JSON_PENDING = "pending";
+const std::string JSON_WRITTEN = "written";
+const std::string JSON_COALESCED = "coalesced";
+const std::string JSON_OVERFLOWED = "overflowed";
+const std::string JSON_FAILED = "failed";
+
+// Write the percentiles of a latency histogram as members of the current
+// JSON object.
+static void write_histogram(rapidjson::Writer<rapidjson::StringBuffer>& writer,
+                            const LatencyHistogram& histogram)
+{
+  writer.String(JSON_COUNT.c_str());
+  writer.Uint64(histogram.count());
+  writer.String(JSON_P50.c_str());
+  writer.Uint64(histogram.value_at_percentile(50.0));
+  writer.String(JSON_P99.c_str());
+  writer.Uint64(histogram.value_at_percentile(99.0));
+  writer.String(JSON_P999.c_str());
+  writer.Uint64(histogram.value_at_percentile(99.9));
+  writer.String(JSON_MAX.c_str());
+  writer.Uint64(histogram.max());
+}
+
+void StageLatencyHandler::process_request(HttpStack::Request& req,
+                                          SAS::TrailId trail)
+{
+  if (req.method() != htp_method_GET)
+  {
+    req.send_reply(HTTP_BADMETHOD, trail);
+    return;
+  }
+
+  req.add_content(build_report());
+  req.add_header("Content-Type", "application/json");
+  req.send_reply(HTTP_OK, trail);
+}
+
+std::string StageLatencyHandler::build_report()
+{
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  writer.String(JSON_PERIOD_MS.c_str());
+  writer.Uint64(_stats->stage_histogram(StatisticsManager::STAGE_HSS).period_ms());
+
+  for (int ii = 0; ii < StatisticsManager::NUM_STAGES; ++ii)
+  {
+    StatisticsManager::Stage stage = (StatisticsManager::Stage)ii;
+    const PeriodicLatencyHistogram& histogram = _stats->stage_histogram(stage);
+
+    // Report the current period so far, and the last complete period.
+    writer.String(StatisticsManager::stage_name(stage));
+    writer.StartObject();
+    write_histogram(writer, histogram.current());
+    writer.String(JSON_PREVIOUS.c_str());
+    writer.StartObject();
+    write_histogram(writer, histogram.previous());
+    writer.EndObject();
+    writer.EndObject();
+  }
+  writer.EndObject();
+
+  return sb.GetString();
+}
+
+void CacheOperationStatsHandler::process_request(HttpStack::Request& req,
+                                                 SAS::TrailId trail)
+{
+  if (req.method() != htp_method_GET)
+  {
+    req.send_reply(HTTP_BADMETHOD, trail);
+    return;
+  }
+
+  req.add_content(build_report());
+  req.add_header("Content-Type", "application/json");
+  req.send_reply(HTTP_OK, trail);
+}
+
+std::string CacheOperationStatsHandler::build_report()
+{
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  for (int ii = 0; ii < Cache::NUM_OPERATION_TYPES; ++ii)
+  {
+    Cache::OperationType type = (Cache::OperationType)ii;
+
+    writer.String(Cache::operation_name(type));
+    writer.StartObject();
+    write_histogram(writer, _stats->cache_op_histogram(type));
+
+    // Only report the result codes that have been seen.
+    writer.String(JSON_RESULTS.c_str());
+    writer.StartObject();
+    for (int rc = 0; rc < StatisticsManager::MAX_CACHE_RESULT_CODES; ++rc)
+    {
+      uint64_t count = _stats->cache_op_result_count(type, rc);
+      if (count > 0)
+      {
+        writer.String(StatisticsManager::cache_result_name(rc));
+        writer.Uint64(count);
+      }
+    }
+    writer.EndObject();
+
+    writer.EndObject();
+  }
+  writer.EndObject();
+
+  return sb.GetString();
+}
+
+void HotSubscribersHandler::process_request(HttpStack::Request& req,
+                                            SAS::TrailId trail)
+{
+  if (req.method() != htp_method_GET)
+  {
+    req.send_reply(HTTP_BADMETHOD, trail);
+    return;
+  }
+
+  req.add_content(build_report());
+  req.add_header("Content-Type", "application/json");
+  req.send_reply(HTTP_OK, trail);
+}
+
+std::string HotSubscribersHandler::build_report()
+{
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+  double window_secs = _hot_subscribers->window_ms() / 1000.0;
+
+  writer.StartObject();
+  writer.String(JSON_WINDOW_MS.c_str());
+  writer.Uint64(_hot_subscribers->window_ms());
+
+  for (int ii = 0; ii < HotSubscribers::NUM_ENDPOINTS; ++ii)
+  {
+    HotSubscribers::Endpoint endpoint = (HotSubscribers::Endpoint)ii;
+    std::vector<HeavyHitters::Entry> top = _hot_subscribers->top(endpoint);
+
+    writer.String(HotSubscribers::endpoint_name(endpoint));
+    writer.StartArray();
+    for (std::vector<HeavyHitters::Entry>::const_iterator it = top.begin();
+         it != top.end();
+         ++it)
+    {
+      writer.StartObject();
+      writer.String(JSON_ID.c_str());
+      writer.String(it->key.c_str());
+      writer.String(JSON_COUNT.c_str());
+      writer.Uint64(it->count);
+      writer.String(JSON_RATE.c_str());
+      writer.Double(it->count / window_secs);
+      writer.EndObject();
+    }
+    writer.EndArray();
+  }
+  writer.EndObject();
+
+  return sb.GetString();
+}
+
+void NegativeCacheHandler::process_request(HttpStack::Request& req,
+                                           SAS::TrailId trail)
+{
+  if (req.method() == htp_method_DELETE)
+  {
+    std::string id = req.param("id");
+    if (id.empty())
+    {
+      TRC_INFO("Clearing the negative cache");
+      _negative_cache->clear();
+    }
+    else
+    {
+      TRC_INFO("Removing %s from the negative cache", id.c_str());
+      _negative_cache->invalidate(id);
+    }
+    req.send_reply(HTTP_OK, trail);
+    return;
+  }
+  else if (req.method() != htp_method_GET)
+  {
+    req.send_reply(HTTP_BADMETHOD, trail);
+    return;
+  }
+
+  req.add_content(build_report());
+  req.add_header("Content-Type", "application/json");
+  req.send_reply(HTTP_OK, trail);
+}
+
+std::string NegativeCacheHandler::build_report()
+{
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  writer.String(JSON_TTL_MS.c_str());
+  writer.Uint64(_negative_cache->ttl_ms());
+  writer.String(JSON_SIZE.c_str());
+  writer.Uint64(_negative_cache->size());
+  writer.String(JSON_EVICTIONS.c_str());
+  writer.Uint64(_negative_cache->evictions());
+  writer.String(JSON_INVALIDATIONS.c_str());
+  writer.Uint64(_negative_cache->invalidations());
+
+  for (int ii = 0; ii < NegativeCache::NUM_COMMANDS; ++ii)
+  {
+    NegativeCache::Command command = (NegativeCache::Command)ii;
+    NegativeCache::Stats stats = _negative_cache->stats(command);
+
+    writer.String(NegativeCache::command_name(command));
+    writer.StartObject();
+    writer.String(JSON_HITS.c_str());
+    writer.Uint64(stats.hits);
+    writer.String(JSON_MISSES.c_str());
+    writer.Uint64(stats.misses);
+    writer.String(JSON_INSERTS.c_str());
+    writer.Uint64(stats.inserts);
+    writer.EndObject();
+  }
+  writer.EndObject();
+
+  return sb.GetString();
+}
+
+void WriteBehindStatsHandler::process_request(HttpStack::Request& req,
+                                              SAS::TrailId trail)
+{
+  if (req.method() != htp_method_GET)
+  {
+    req.send_reply(HTTP_BADMETHOD, trail);
+    return;
+  }
+
+  req.add_content(build_report());
+  req.add_header("Content-Type", "application/json");
+  req.send_reply(HTTP_OK, trail);
+}
+
+std::string WriteBehindStatsHandler::build_report()
+{
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  writer.String(JSON_PENDING.c_str());
+  writer.Uint64(_writer->pending());
+  writer.String(JSON_WRITTEN.c_str());
+  writer.Uint64(_writer->written());
+  writer.String(JSON_COALESCED.c_str());
+  writer.Uint64(_writer->coalesced());
+  writer.String(JSON_OVERFLOWED.c_str());
+  writer.Uint64(_writer->overflowed());
+  writer.String(JSON_FAILED.c_str());
+  writer.Uint64(_writer->failed());
+  writer.EndObject();
+
+  return sb.GetString();
+}
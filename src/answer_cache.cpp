@@ -0,0 +1,253 @@
+/**
+ * @file answer_cache.cpp Short-lived cache of the HSS's answers.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <vector>
+
+#include "answer_cache.h"
+#include "monotonic_clock.h"
+#include "log.h"
+
+const size_t AnswerCache::DEFAULT_CAPACITY;
+const unsigned long AnswerCache::DEFAULT_TTL_MS;
+
+AnswerCache::AnswerCache(size_t capacity, unsigned long ttl_ms) :
+  _capacity((capacity > 0) ? capacity : 1),
+  _ttl_ms(ttl_ms),
+  _lock(),
+  _entries(),
+  _index(),
+  _hits(0),
+  _misses(0),
+  _invalidations(0),
+  _evictions(0)
+{
+}
+
+AnswerCache::~AnswerCache()
+{
+}
+
+std::string AnswerCache::make_params(const std::string& param1,
+                                     const std::string& param2,
+                                     const std::string& param3)
+{
+  // Query parameters can't contain NUL characters, so use them as separators.
+  std::string params(param1);
+  params.reserve(param1.size() + param2.size() + param3.size() + 2);
+  params.push_back('\0');
+  params.append(param2);
+  params.push_back('\0');
+  params.append(param3);
+  return params;
+}
+
+bool AnswerCache::get(const std::string& id,
+                      const std::string& params,
+                      std::string& body)
+{
+  bool found = false;
+
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    expire(now_ms());
+
+    std::unordered_map<std::string, Variants>::iterator it = _index.find(id);
+    if (it != _index.end())
+    {
+      for (Variants::iterator jt = it->second.begin();
+           jt != it->second.end();
+           ++jt)
+      {
+        // Skip entries that are only tied to this identity.
+        if ((jt->first == params) && (jt->second->id == id))
+        {
+          body = jt->second->body;
+          found = true;
+          break;
+        }
+      }
+    }
+  }
+
+  if (found)
+  {
+    _hits++;
+    TRC_DEBUG("Found cached answer for %s", id.c_str());
+  }
+  else
+  {
+    _misses++;
+  }
+
+  return found;
+}
+
+void AnswerCache::put(const std::string& id,
+                      const std::string& params,
+                      const std::string& body,
+                      const std::string& other_id)
+{
+  uint64_t now = now_ms();
+
+  std::lock_guard<std::mutex> lock(_lock);
+  expire(now);
+
+  // Remove any existing entry, so the new one goes to the back of the list
+  // with a new expiry time.
+  std::unordered_map<std::string, Variants>::iterator it = _index.find(id);
+  if (it != _index.end())
+  {
+    for (Variants::iterator jt = it->second.begin();
+         jt != it->second.end();
+         ++jt)
+    {
+      if ((jt->first == params) && (jt->second->id == id))
+      {
+        remove(jt->second);
+        break;
+      }
+    }
+  }
+
+  if (_entries.size() >= _capacity)
+  {
+    remove(_entries.begin());
+    _evictions++;
+  }
+
+  Entry entry;
+  entry.id = id;
+  entry.other_id = (other_id != id) ? other_id : "";
+  entry.params = params;
+  entry.body = body;
+  entry.expiry_ms = now + _ttl_ms;
+  _entries.push_back(entry);
+
+  EntryIt added = --_entries.end();
+  _index[id].push_back(std::make_pair(params, added));
+  if (!added->other_id.empty())
+  {
+    _index[added->other_id].push_back(std::make_pair(params, added));
+  }
+
+  TRC_DEBUG("Cached answer for %s", id.c_str());
+}
+
+void AnswerCache::invalidate(const std::string& id)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+
+  std::unordered_map<std::string, Variants>::iterator it = _index.find(id);
+  if (it != _index.end())
+  {
+    TRC_DEBUG("Removing cached answers for %s", id.c_str());
+
+    // Removing an entry updates (and may erase) the variants, so take a copy
+    // of the entries first.
+    std::vector<EntryIt> entries;
+    for (Variants::iterator jt = it->second.begin();
+         jt != it->second.end();
+         ++jt)
+    {
+      entries.push_back(jt->second);
+    }
+
+    for (std::vector<EntryIt>::iterator jt = entries.begin();
+         jt != entries.end();
+         ++jt)
+    {
+      remove(*jt);
+      _invalidations++;
+    }
+  }
+}
+
+void AnswerCache::clear()
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  _invalidations += _entries.size();
+  _entries.clear();
+  _index.clear();
+}
+
+size_t AnswerCache::size()
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  expire(now_ms());
+  return _entries.size();
+}
+
+void AnswerCache::remove(EntryIt entry)
+{
+  unindex(entry->id, entry);
+  if (!entry->other_id.empty())
+  {
+    unindex(entry->other_id, entry);
+  }
+
+  _entries.erase(entry);
+}
+
+void AnswerCache::unindex(const std::string& id, EntryIt entry)
+{
+  std::unordered_map<std::string, Variants>::iterator it = _index.find(id);
+  if (it != _index.end())
+  {
+    for (Variants::iterator jt = it->second.begin();
+         jt != it->second.end();
+         ++jt)
+    {
+      if (jt->second == entry)
+      {
+        it->second.erase(jt);
+        break;
+      }
+    }
+
+    if (it->second.empty())
+    {
+      _index.erase(it);
+    }
+  }
+}
+
+void AnswerCache::expire(uint64_t now)
+{
+  while ((!_entries.empty()) && (_entries.front().expiry_ms <= now))
+  {
+    remove(_entries.begin());
+  }
+}
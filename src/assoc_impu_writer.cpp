@@ -0,0 +1,237 @@
+/**
+ * @file assoc_impu_writer.cpp Write-behind of associated public IDs.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <chrono>
+
+#include "assoc_impu_writer.h"
+#include "handlers.h"
+#include "homesteadsasevent.h"
+#include "log.h"
+
+const size_t AssocImpuWriter::DEFAULT_MAX_PENDING;
+const unsigned long AssocImpuWriter::DEFAULT_FLUSH_TIMEOUT_MS;
+
+class AssocImpuWriter::Transaction :
+  public HssCacheTask::CacheTransaction<AssocImpuWriter>
+{
+public:
+  Transaction(AssocImpuWriter* writer, const std::string& key, SAS::TrailId trail);
+
+protected:
+  void on_success(CassandraStore::Operation* op);
+  void on_failure(CassandraStore::Operation* op);
+
+private:
+  AssocImpuWriter* _writer;
+  std::string _key;
+  SAS::TrailId _trail;
+};
+
+AssocImpuWriter::AssocImpuWriter(Cache* cache, size_t max_pending) :
+  _cache(cache),
+  _max_pending(max_pending),
+  _lock(),
+  _cond(),
+  _pending(),
+  _written(0),
+  _coalesced(0),
+  _overflowed(0),
+  _failed(0)
+{
+}
+
+AssocImpuWriter::~AssocImpuWriter()
+{
+  flush();
+  TRC_INFO("Associated public ID writes: %lu written, %lu coalesced, %lu overflowed, %lu failed",
+           (unsigned long)_written, (unsigned long)_coalesced,
+           (unsigned long)_overflowed, (unsigned long)_failed);
+}
+
+bool AssocImpuWriter::write(const std::string& impi,
+                            const std::string& impu,
+                            int32_t ttl,
+                            SAS::TrailId trail)
+{
+  // Private and public IDs can't contain NUL characters, so use one as a
+  // separator.
+  std::string key = impi + '\0' + impu;
+  Write write;
+
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    std::map<std::string, Write>::iterator it = _pending.find(key);
+
+    if (it != _pending.end())
+    {
+      // This association is already being written.  Write it again when that
+      // completes, to refresh the TTL.
+      TRC_DEBUG("Coalescing write of public ID %s for private ID %s",
+                impu.c_str(), impi.c_str());
+      it->second.ttl = ttl;
+      it->second.trail = trail;
+      it->second.rewrite = true;
+      _coalesced++;
+      return true;
+    }
+
+    if (_pending.size() >= _max_pending)
+    {
+      TRC_DEBUG("Too many associated public ID writes outstanding (%d)",
+                _pending.size());
+      _overflowed++;
+      return false;
+    }
+
+    write.impi = impi;
+    write.impu = impu;
+    write.ttl = ttl;
+    write.trail = trail;
+    write.rewrite = false;
+    _pending[key] = write;
+  }
+
+  issue(key, write);
+  return true;
+}
+
+bool AssocImpuWriter::flush(unsigned long timeout_ms)
+{
+  std::unique_lock<std::mutex> lock(_lock);
+  bool flushed = _cond.wait_for(lock,
+                                std::chrono::milliseconds(timeout_ms),
+                                [this]{ return _pending.empty(); });
+
+  if (!flushed)
+  {
+    TRC_WARNING("%d associated public ID writes still outstanding after %lums",
+                _pending.size(), timeout_ms);
+  }
+
+  return flushed;
+}
+
+size_t AssocImpuWriter::pending()
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  return _pending.size();
+}
+
+void AssocImpuWriter::issue(const std::string& key, const Write& write)
+{
+  CassandraStore::Operation* put_public_id =
+    _cache->create_PutAssociatedPublicID(write.impi,
+                                         write.impu,
+                                         Cache::generate_timestamp(),
+                                         write.ttl);
+  CassandraStore::Transaction* tsx = new Transaction(this, key, write.trail);
+  _cache->do_async(put_public_id, tsx);
+}
+
+void AssocImpuWriter::complete(const std::string& key, bool success)
+{
+  Write rewrite;
+
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+
+    if (success)
+    {
+      _written++;
+    }
+    else
+    {
+      _failed++;
+    }
+
+    std::map<std::string, Write>::iterator it = _pending.find(key);
+    if (it == _pending.end())
+    {
+      return; // LCOV_EXCL_LINE - every write is pending until it completes.
+    }
+
+    if (!it->second.rewrite)
+    {
+      _pending.erase(it);
+
+      if (_pending.empty())
+      {
+        _cond.notify_all();
+      }
+      return;
+    }
+
+    it->second.rewrite = false;
+    rewrite = it->second;
+  }
+
+  issue(key, rewrite);
+}
+
+AssocImpuWriter::Transaction::Transaction(AssocImpuWriter* writer,
+                                          const std::string& key,
+                                          SAS::TrailId trail) :
+  HssCacheTask::CacheTransaction<AssocImpuWriter>(StatisticsManager::STAGE_CACHE_WRITE,
+                                                  Cache::OP_PUT_ASSOCIATED_PUBLIC_ID,
+                                                  trail),
+  _writer(writer),
+  _key(key),
+  _trail(trail)
+{
+}
+
+void AssocImpuWriter::Transaction::on_success(CassandraStore::Operation* op)
+{
+  // Record the stats and place the thread as for any other cache write.
+  HssCacheTask::CacheTransaction<AssocImpuWriter>::on_success(op);
+
+  SAS::Event event(_trail, SASEvent::CACHE_PUT_ASSOC_IMPU_SUCCESS, 0);
+  SAS::report_event(event);
+  _writer->complete(_key, true);
+}
+
+void AssocImpuWriter::Transaction::on_failure(CassandraStore::Operation* op)
+{
+  HssCacheTask::CacheTransaction<AssocImpuWriter>::on_failure(op);
+
+  TRC_WARNING("Failed to write associated public ID: %s",
+              op->get_error_text().c_str());
+  SAS::Event event(_trail, SASEvent::CACHE_PUT_ASSOC_IMPU_FAIL, 0);
+  event.add_static_param(op->get_result_code());
+  event.add_var_param(op->get_error_text());
+  SAS::report_event(event);
+  _writer->complete(_key, false);
+}
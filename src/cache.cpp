@@ -34,7 +34,9 @@
  * as those licenses appear in the file LICENSE-OPENSSL.
  */
 
+#include <algorithm>
 #include <boost/format.hpp>
+#include <limits>
 
 #include "cache.h"
 
@@ -76,10 +78,376 @@ Cache Cache::DEFAULT_INSTANCE;
 // Cache methods
 //
 
-Cache::Cache() : CassandraStore::Store(KEYSPACE) {}
+Cache::Cache() : CassandraStore::Store(KEYSPACE), _embedded_store(NULL) {}
 
 Cache::~Cache() {}
 
+void Cache::configure_embedded_store(CassandraStore::Client* store)
+{
+  _embedded_store = store;
+}
+
+CassandraStore::Client* Cache::get_client()
+{
+  return (_embedded_store != NULL) ? _embedded_store :
+                                     CassandraStore::Store::get_client();
+}
+
+void Cache::release_client()
+{
+  if (_embedded_store == NULL)
+  {
+    CassandraStore::Store::release_client();
+  }
+}
+
+const size_t Cache::DEFAULT_MAX_BATCH_SIZE;
+const int32_t Cache::DEFAULT_SCAN_PAGE_SIZE;
+
+
+//
+// MutationBatch methods.
+//
+
+Cache::MutationBatch::
+MutationBatch(const int64_t timestamp, const size_t max_batch_size) :
+  _timestamp(timestamp),
+  _max_batch_size((max_batch_size > 0) ? max_batch_size : 1),
+  _mutations(),
+  _bytes(0)
+{}
+
+Cache::MutationBatch::
+~MutationBatch()
+{}
+
+void Cache::MutationBatch::put_columns(const std::string& table,
+                                       const std::string& key,
+                                       const std::map<std::string, std::string>& columns,
+                                       const int32_t ttl)
+{
+  for (std::map<std::string, std::string>::const_iterator col = columns.begin();
+       col != columns.end();
+       ++col)
+  {
+    put_column(table, key, col->first, col->second, ttl);
+  }
+}
+
+void Cache::MutationBatch::put_column(const std::string& table,
+                                      const std::string& key,
+                                      const std::string& name,
+                                      const std::string& value,
+                                      const int32_t ttl)
+{
+  // Build the mutation in place, so the value (which may be a large IMS
+  // subscription) is only copied once.
+  _mutations.push_back(KeyedMutation());
+  KeyedMutation& km = _mutations.back();
+  km.table = table;
+  km.key = key;
+
+  Column* column = &km.mutation.column_or_supercolumn.column;
+  column->__set_name(name);
+  column->__set_value(value);
+  column->__set_timestamp(_timestamp);
+
+  // A TTL of 0 means the column never expires.
+  if (ttl > 0)
+  {
+    column->__set_ttl(ttl);
+  }
+
+  km.mutation.column_or_supercolumn.__isset.column = true;
+  km.mutation.__isset.column_or_supercolumn = true;
+  _bytes += key.size() + name.size() + value.size();
+}
+
+void Cache::MutationBatch::put_columns(const std::vector<CassandraStore::RowColumns>& rows,
+                                       const int32_t ttl)
+{
+  for (std::vector<CassandraStore::RowColumns>::const_iterator row = rows.begin();
+       row != rows.end();
+       ++row)
+  {
+    put_columns(row->cf, row->key, row->columns, ttl);
+  }
+}
+
+void Cache::MutationBatch::delete_row(const std::string& table,
+                                      const std::string& key)
+{
+  // A deletion with no predicate removes the whole row.
+  KeyedMutation km;
+  km.table = table;
+  km.key = key;
+  km.mutation.deletion.__set_timestamp(_timestamp);
+  km.mutation.__isset.deletion = true;
+  _mutations.push_back(km);
+  _bytes += key.size();
+}
+
+void Cache::MutationBatch::delete_columns(const std::string& table,
+                                          const std::string& key,
+                                          const std::map<std::string, std::string>& columns)
+{
+  if (columns.empty())
+  {
+    delete_row(table, key);
+    return;
+  }
+
+  std::vector<std::string> column_names;
+  _bytes += key.size();
+  for (std::map<std::string, std::string>::const_iterator col = columns.begin();
+       col != columns.end();
+       ++col)
+  {
+    column_names.push_back(col->first);
+    _bytes += col->first.size();
+  }
+
+  KeyedMutation km;
+  km.table = table;
+  km.key = key;
+
+  SlicePredicate what;
+  what.__set_column_names(column_names);
+  km.mutation.deletion.__set_predicate(what);
+  km.mutation.deletion.__set_timestamp(_timestamp);
+  km.mutation.__isset.deletion = true;
+  _mutations.push_back(km);
+}
+
+void Cache::MutationBatch::delete_columns(const std::vector<CassandraStore::RowColumns>& rows)
+{
+  for (std::vector<CassandraStore::RowColumns>::const_iterator row = rows.begin();
+       row != rows.end();
+       ++row)
+  {
+    delete_columns(row->cf, row->key, row->columns);
+  }
+}
+
+void Cache::MutationBatch::add_mutation(const std::string& table,
+                                        const std::string& key,
+                                        const Mutation& mutation)
+{
+  KeyedMutation km;
+  km.table = table;
+  km.key = key;
+  km.mutation = mutation;
+  _mutations.push_back(km);
+
+  _bytes += key.size();
+  if (mutation.__isset.column_or_supercolumn)
+  {
+    const Column& column = mutation.column_or_supercolumn.column;
+    _bytes += column.name.size() + column.value.size();
+  }
+  else if (mutation.deletion.__isset.predicate)
+  {
+    const std::vector<std::string>& names = mutation.deletion.predicate.column_names;
+    for (std::vector<std::string>::const_iterator name = names.begin();
+         name != names.end();
+         ++name)
+    {
+      _bytes += name->size();
+    }
+  }
+}
+
+size_t Cache::MutationBatch::rows() const
+{
+  std::set<std::pair<std::string, std::string> > rows;
+
+  for (std::vector<KeyedMutation>::const_iterator it = _mutations.begin();
+       it != _mutations.end();
+       ++it)
+  {
+    rows.insert(std::make_pair(it->table, it->key));
+  }
+
+  return rows.size();
+}
+
+void Cache::MutationBatch::execute(CassandraStore::Client* client)
+{
+  // Group the mutations by row, keeping the rows in the order they were first
+  // modified, so that a row's mutations are never split between batches.
+  typedef std::pair<std::string, std::string> RowId;
+  std::vector<RowId> row_order;
+  std::map<RowId, std::vector<Mutation> > rows;
+
+  for (std::vector<KeyedMutation>::const_iterator it = _mutations.begin();
+       it != _mutations.end();
+       ++it)
+  {
+    RowId row(it->key, it->table);
+    std::vector<Mutation>& row_mutations = rows[row];
+    if (row_mutations.empty())
+    {
+      row_order.push_back(row);
+    }
+    row_mutations.push_back(it->mutation);
+  }
+
+  // Pack whole rows into batches of at most the maximum size.  A row with
+  // more mutations than that is sent in a batch on its own.
+  std::map<std::string, std::map<std::string, std::vector<Mutation> > > mutmap;
+  size_t in_batch = 0;
+
+  for (std::vector<RowId>::const_iterator row = row_order.begin();
+       row != row_order.end();
+       ++row)
+  {
+    std::vector<Mutation>& row_mutations = rows[*row];
+
+    if ((in_batch > 0) && (in_batch + row_mutations.size() > _max_batch_size))
+    {
+      TRC_DEBUG("Sending batch of %d mutations", in_batch);
+      client->batch_mutate(mutmap, ConsistencyLevel::ONE);
+      mutmap.clear();
+      in_batch = 0;
+    }
+
+    in_batch += row_mutations.size();
+    mutmap[row->first][row->second].swap(row_mutations);
+  }
+
+  if (in_batch > 0)
+  {
+    TRC_DEBUG("Sending batch of %d mutations", in_batch);
+    client->batch_mutate(mutmap, ConsistencyLevel::ONE);
+  }
+}
+
+
+//
+// Scan helpers.
+//
+
+Cache::ImpuRecord::ImpuRecord() :
+  public_id(),
+  reg_state(RegistrationState::NOT_REGISTERED),
+  reg_state_ttl(0),
+  xml(),
+  xml_ttl(0),
+  impis(),
+  charging_addrs()
+{}
+
+std::vector<Cache::TokenRange> Cache::split_token_ring(int num_ranges)
+{
+  // Murmur3Partitioner tokens are signed 64-bit integers.  Work in unsigned
+  // offsets from the minimum token to avoid overflow.
+  const int64_t min_token = std::numeric_limits<int64_t>::min();
+  const int64_t max_token = std::numeric_limits<int64_t>::max();
+  num_ranges = std::max(num_ranges, 1);
+  uint64_t step = std::numeric_limits<uint64_t>::max() / num_ranges;
+
+  std::vector<TokenRange> ranges(num_ranges);
+  for (int ii = 0; ii < num_ranges; ++ii)
+  {
+    int64_t start = (int64_t)((uint64_t)min_token + step * ii);
+    int64_t end = (ii == num_ranges - 1) ?
+                  max_token : (int64_t)((uint64_t)min_token + step * (ii + 1));
+    ranges[ii].start_token = std::to_string(start);
+    ranges[ii].end_token = std::to_string(end);
+  }
+
+  return ranges;
+}
+
+
+//
+// CacheOperation methods.
+//
+
+const char* Cache::operation_name(OperationType type)
+{
+  switch (type)
+  {
+  case OP_PUT_REG_DATA:
+    return "put_reg_data";
+  case OP_PUT_ASSOCIATED_PRIVATE_ID:
+    return "put_assoc_private_id";
+  case OP_PUT_ASSOCIATED_PUBLIC_ID:
+    return "put_assoc_public_id";
+  case OP_PUT_AUTH_VECTOR:
+    return "put_auth_vector";
+  case OP_GET_REG_DATA:
+    return "get_reg_data";
+  case OP_GET_ASSOCIATED_PUBLIC_IDS:
+    return "get_assoc_public_ids";
+  case OP_GET_ASSOCIATED_PRIMARY_PUBLIC_IDS:
+    return "get_assoc_primary_public_ids";
+  case OP_GET_AUTH_VECTOR:
+    return "get_auth_vector";
+  case OP_DELETE_PUBLIC_IDS:
+    return "delete_public_ids";
+  case OP_DELETE_PRIVATE_IDS:
+    return "delete_private_ids";
+  case OP_DELETE_IMPI_MAPPING:
+    return "delete_impi_mapping";
+  case OP_DISSOCIATE_IRS_FROM_IMPI:
+    return "dissociate_irs_from_impi";
+  case OP_SCAN_IMPUS:
+    return "scan_impus";
+  case OP_SCAN_IMPIS:
+    return "scan_impis";
+  case OP_GET_REG_DATA_BATCH:
+    return "get_reg_data_batch";
+  default:
+    return "unknown"; // LCOV_EXCL_LINE
+  }
+}
+
+Cache::CacheOperation::
+CacheOperation(OperationType type) :
+  CassandraStore::Operation(),
+  _type(type),
+  _rows_touched(0),
+  _bytes_read(0),
+  _bytes_written(0)
+{}
+
+Cache::CacheOperation::
+~CacheOperation()
+{}
+
+void Cache::CacheOperation::record_read(const std::vector<ColumnOrSuperColumn>& columns)
+{
+  if (!columns.empty())
+  {
+    _rows_touched++;
+  }
+
+  for (std::vector<ColumnOrSuperColumn>::const_iterator it = columns.begin();
+       it != columns.end();
+       ++it)
+  {
+    _bytes_read += it->column.name.size() + it->column.value.size();
+  }
+}
+
+void Cache::CacheOperation::record_read(
+  const std::map<std::string, std::vector<ColumnOrSuperColumn> >& rows)
+{
+  for (std::map<std::string, std::vector<ColumnOrSuperColumn> >::const_iterator row = rows.begin();
+       row != rows.end();
+       ++row)
+  {
+    record_read(row->second);
+  }
+}
+
+void Cache::CacheOperation::record_write(const MutationBatch& batch)
+{
+  _rows_touched += batch.rows();
+  _bytes_written += batch.bytes();
+}
+
 
 //
 // PutRegData methods.
@@ -89,7 +457,7 @@ Cache::PutRegData::
 PutRegData(const std::string& public_id,
            const int64_t timestamp,
            const int32_t ttl):
-  CassandraStore::Operation(),
+  CacheOperation(OP_PUT_REG_DATA),
   _public_ids(1, public_id),
   _timestamp(timestamp),
   _ttl(ttl)
@@ -99,7 +467,7 @@ Cache::PutRegData::
 PutRegData(const std::vector<std::string>& public_ids,
            const int64_t timestamp,
            const int32_t ttl):
-  CassandraStore::Operation(),
+  CacheOperation(OP_PUT_REG_DATA),
   _public_ids(public_ids),
   _timestamp(timestamp),
   _ttl(ttl)
@@ -111,7 +479,13 @@ Cache::PutRegData::
 
 Cache::PutRegData& Cache::PutRegData::with_xml(const std::string& xml)
 {
-  _columns[IMS_SUB_XML_COLUMN_NAME] = xml;
+  std::string copy = xml;
+  return with_xml(make_shared_payload(copy));
+}
+
+Cache::PutRegData& Cache::PutRegData::with_xml(const SharedPayload& xml)
+{
+  _xml = xml;
   return *this;
 }
 
@@ -190,14 +564,23 @@ Cache::PutRegData& Cache::PutRegData::with_charging_addrs(const ChargingAddresse
 bool Cache::PutRegData::perform(CassandraStore::Client* client,
                                 SAS::TrailId trail)
 {
+  MutationBatch batch(_timestamp);
+
   for (std::vector<std::string>::iterator row = _public_ids.begin();
        row != _public_ids.end();
        row++)
   {
-    _to_put.push_back(CassandraStore::RowColumns(IMPU, *row, _columns));
+    batch.put_columns(IMPU, *row, _columns, _ttl);
+
+    if (_xml != NULL)
+    {
+      batch.put_column(IMPU, *row, IMS_SUB_XML_COLUMN_NAME, *_xml, _ttl);
+    }
   }
 
-  client->put_columns(_to_put, _timestamp, _ttl);
+  batch.put_columns(_to_put, _ttl);
+  record_write(batch);
+  batch.execute(client);
 
   return true;
 }
@@ -211,7 +594,7 @@ PutAssociatedPrivateID(const std::vector<std::string>& impus,
                        const std::string& impi,
                        const int64_t timestamp,
                        const int32_t ttl) :
-  CassandraStore::Operation(),
+  CacheOperation(OP_PUT_ASSOCIATED_PRIVATE_ID),
   _impus(impus),
   _impi(impi),
   _timestamp(timestamp),
@@ -227,23 +610,24 @@ Cache::PutAssociatedPrivateID::
 bool Cache::PutAssociatedPrivateID::perform(CassandraStore::Client* client,
                                             SAS::TrailId trail)
 {
-  std::vector<CassandraStore::RowColumns> to_put;
+  MutationBatch batch(_timestamp);
   std::map<std::string, std::string> impu_columns;
   std::map<std::string, std::string> impi_columns;
   impu_columns[IMPI_COLUMN_PREFIX + _impi] = "";
 
   std::string default_public_id = _impus.front();
   impi_columns[IMPI_MAPPING_PREFIX + default_public_id] = "";
-  to_put.push_back(CassandraStore::RowColumns(IMPI_MAPPING, _impi, impi_columns));
+  batch.put_columns(IMPI_MAPPING, _impi, impi_columns, _ttl);
 
   for (std::vector<std::string>::iterator row = _impus.begin();
        row != _impus.end();
        row++)
   {
-    to_put.push_back(CassandraStore::RowColumns(IMPU, *row, impu_columns));
+    batch.put_columns(IMPU, *row, impu_columns, _ttl);
   }
 
-  client->put_columns(to_put, _timestamp, _ttl);
+  record_write(batch);
+  batch.execute(client);
 
   return true;
 }
@@ -258,7 +642,7 @@ PutAssociatedPublicID(const std::string& private_id,
                       const std::string& assoc_public_id,
                       const int64_t timestamp,
                       const int32_t ttl) :
-  CassandraStore::Operation(),
+  CacheOperation(OP_PUT_ASSOCIATED_PUBLIC_ID),
   _private_id(private_id),
   _assoc_public_id(assoc_public_id),
   _timestamp(timestamp),
@@ -277,9 +661,10 @@ bool Cache::PutAssociatedPublicID::perform(CassandraStore::Client* client,
   std::map<std::string, std::string> columns;
   columns[ASSOC_PUBLIC_ID_COLUMN_PREFIX + _assoc_public_id] = "";
 
-  std::vector<std::string> keys(1, _private_id);
-
-  client->put_columns(IMPI, keys, columns, _timestamp, _ttl);
+  MutationBatch batch(_timestamp);
+  batch.put_columns(IMPI, _private_id, columns, _ttl);
+  record_write(batch);
+  batch.execute(client);
   return true;
 }
 
@@ -292,7 +677,7 @@ PutAuthVector(const std::string& private_id,
               const DigestAuthVector& auth_vector,
               const int64_t timestamp,
               const int32_t ttl) :
-  CassandraStore::Operation(),
+  CacheOperation(OP_PUT_AUTH_VECTOR),
   _private_ids(1, private_id),
   _auth_vector(auth_vector),
   _timestamp(timestamp),
@@ -313,20 +698,123 @@ bool Cache::PutAuthVector::perform(CassandraStore::Client* client,
   columns[DIGEST_REALM_COLUMN_NAME]    = _auth_vector.realm;
   columns[DIGEST_QOP_COLUMN_NAME]      = _auth_vector.qop;
 
-  client->put_columns(IMPI, _private_ids, columns, _timestamp, _ttl);
+  MutationBatch batch(_timestamp);
+  for (std::vector<std::string>::const_iterator it = _private_ids.begin();
+       it != _private_ids.end();
+       ++it)
+  {
+    batch.put_columns(IMPI, *it, columns, _ttl);
+  }
+  record_write(batch);
+  batch.execute(client);
   return true;
 }
 
 
+/// Decode the columns of a row in the IMPU table.  The IMS subscription
+/// document can be several kilobytes, so is moved out of the columns rather
+/// than copied.
+static void decode_impu_columns(std::vector<ColumnOrSuperColumn>& columns,
+                                int64_t now,
+                                Cache::ImpuRecord& record)
+{
+  for (std::vector<ColumnOrSuperColumn>::iterator it = columns.begin();
+       it != columns.end();
+       ++it)
+  {
+    if (it->column.name == IMS_SUB_XML_COLUMN_NAME)
+    {
+      record.xml.swap(it->column.value);
+
+      // Cassandra timestamps are in microseconds (see
+      // generate_timestamp) but TTLs are in seconds, so divide the
+      // timestamps by a million.
+      if (it->column.ttl > 0)
+      {
+        record.xml_ttl = ((it->column.timestamp/1000000) + it->column.ttl) - (now / 1000000);
+      };
+      TRC_DEBUG("Retrieved XML column with TTL %d and value %s", record.xml_ttl, record.xml.c_str());
+    }
+    else if (it->column.name == REG_STATE_COLUMN_NAME)
+    {
+      if (it->column.ttl > 0)
+      {
+        record.reg_state_ttl = ((it->column.timestamp/1000000) + it->column.ttl) - (now / 1000000);
+      };
+      if (it->column.value == CassandraStore::BOOLEAN_TRUE)
+      {
+        record.reg_state = RegistrationState::REGISTERED;
+        TRC_DEBUG("Retrieved is_registered column with value True and TTL %d",
+                  record.reg_state_ttl);
+      }
+      else if (it->column.value == CassandraStore::BOOLEAN_FALSE)
+      {
+        record.reg_state = RegistrationState::UNREGISTERED;
+        TRC_DEBUG("Retrieved is_registered column with value False and TTL %d",
+                  record.reg_state_ttl);
+      }
+      else if ((it->column.value == ""))
+      {
+        TRC_DEBUG("Retrieved is_registered column with empty value and TTL %d",
+                  record.reg_state_ttl);
+      }
+      else
+      {
+        TRC_WARNING("Registration state column has invalid value %d %s",
+                    it->column.value.c_str()[0],
+                    it->column.value.c_str());
+      };
+    }
+    else if (it->column.name.find(IMPI_COLUMN_PREFIX) == 0)
+    {
+      std::string impi = it->column.name.substr(IMPI_COLUMN_PREFIX.length());
+      record.impis.push_back(impi);
+    }
+    else if ((it->column.name == PRIMARY_CCF_COLUMN_NAME) && (it->column.value != ""))
+    {
+      record.charging_addrs.ccfs.push_front(it->column.value);
+      TRC_DEBUG("Retrived primary_ccf column with value %s",
+                it->column.value.c_str());
+    }
+    else if ((it->column.name == SECONDARY_CCF_COLUMN_NAME) && (it->column.value != ""))
+    {
+      record.charging_addrs.ccfs.push_back(it->column.value);
+      TRC_DEBUG("Retrived secondary_ccf column with value %s",
+                it->column.value.c_str());
+    }
+    else if ((it->column.name == PRIMARY_ECF_COLUMN_NAME) && (it->column.value != ""))
+    {
+      record.charging_addrs.ecfs.push_front(it->column.value);
+      TRC_DEBUG("Retrived primary_ecf column with value %s",
+                it->column.value.c_str());
+    }
+    else if ((it->column.name == SECONDARY_ECF_COLUMN_NAME) && (it->column.value != ""))
+    {
+      record.charging_addrs.ecfs.push_back(it->column.value);
+      TRC_DEBUG("Retrived secondary_ecf column with value %s",
+                it->column.value.c_str());
+    }
+  }
+
+  // If we're storing user data for this subscriber (i.e. there is
+  // XML), then by definition they cannot be in NOT_REGISTERED state
+  // - they must be in UNREGISTERED state.
+  if ((record.reg_state == RegistrationState::NOT_REGISTERED) && !record.xml.empty())
+  {
+    TRC_DEBUG("Found stored XML for subscriber, treating as UNREGISTERED state");
+    record.reg_state = RegistrationState::UNREGISTERED;
+  }
+}
+
 //
 // GetRegData methods
 //
 
 Cache::GetRegData::
 GetRegData(const std::string& public_id) :
-  CassandraStore::Operation(),
+  CacheOperation(OP_GET_REG_DATA),
   _public_id(public_id),
-  _xml(),
+  _xml(empty_payload()),
   _reg_state(RegistrationState::NOT_REGISTERED),
   _xml_ttl(0),
   _reg_state_ttl(0),
@@ -350,92 +838,17 @@ bool Cache::GetRegData::perform(CassandraStore::Client* client,
   try
   {
     client->ha_get_all_columns(IMPU, _public_id, results, trail);
+    record_read(results);
 
-    for(std::vector<ColumnOrSuperColumn>::iterator it = results.begin(); it != results.end(); ++it)
-    {
-      if (it->column.name == IMS_SUB_XML_COLUMN_NAME)
-      {
-        _xml = it->column.value;
-
-        // Cassandra timestamps are in microseconds (see
-        // generate_timestamp) but TTLs are in seconds, so divide the
-        // timestamps by a million.
-        if (it->column.ttl > 0)
-        {
-          _xml_ttl = ((it->column.timestamp/1000000) + it->column.ttl) - (now / 1000000);
-        };
-        TRC_DEBUG("Retrieved XML column with TTL %d and value %s", _xml_ttl, _xml.c_str());
-      }
-      else if (it->column.name == REG_STATE_COLUMN_NAME)
-      {
-        if (it->column.ttl > 0)
-        {
-          _reg_state_ttl = ((it->column.timestamp/1000000) + it->column.ttl) - (now / 1000000);
-        };
-        if (it->column.value == CassandraStore::BOOLEAN_TRUE)
-        {
-          _reg_state = RegistrationState::REGISTERED;
-          TRC_DEBUG("Retrieved is_registered column with value True and TTL %d",
-                    _reg_state_ttl);
-        }
-        else if (it->column.value == CassandraStore::BOOLEAN_FALSE)
-        {
-          _reg_state = RegistrationState::UNREGISTERED;
-          TRC_DEBUG("Retrieved is_registered column with value False and TTL %d",
-                    _reg_state_ttl);
-        }
-        else if ((it->column.value == ""))
-        {
-          TRC_DEBUG("Retrieved is_registered column with empty value and TTL %d",
-                    _reg_state_ttl);
-        }
-        else
-        {
-          TRC_WARNING("Registration state column has invalid value %d %s",
-                      it->column.value.c_str()[0],
-                      it->column.value.c_str());
-        };
-      }
-      else if (it->column.name.find(IMPI_COLUMN_PREFIX) == 0)
-      {
-        std::string impi = it->column.name.substr(IMPI_COLUMN_PREFIX.length());
-        _impis.push_back(impi);
-      }
-      else if ((it->column.name == PRIMARY_CCF_COLUMN_NAME) && (it->column.value != ""))
-      {
-        _charging_addrs.ccfs.push_front(it->column.value);
-        TRC_DEBUG("Retrived primary_ccf column with value %s",
-                  it->column.value.c_str());
-      }
-      else if ((it->column.name == SECONDARY_CCF_COLUMN_NAME) && (it->column.value != ""))
-      {
-        _charging_addrs.ccfs.push_back(it->column.value);
-        TRC_DEBUG("Retrived secondary_ccf column with value %s",
-                  it->column.value.c_str());
-      }
-      else if ((it->column.name == PRIMARY_ECF_COLUMN_NAME) && (it->column.value != ""))
-      {
-        _charging_addrs.ecfs.push_front(it->column.value);
-        TRC_DEBUG("Retrived primary_ecf column with value %s",
-                  it->column.value.c_str());
-      }
-      else if ((it->column.name == SECONDARY_ECF_COLUMN_NAME) && (it->column.value != ""))
-      {
-        _charging_addrs.ecfs.push_back(it->column.value);
-        TRC_DEBUG("Retrived secondary_ecf column with value %s",
-                  it->column.value.c_str());
-      }
-    }
-
-    // If we're storing user data for this subscriber (i.e. there is
-    // XML), then by definition they cannot be in NOT_REGISTERED state
-    // - they must be in UNREGISTERED state.
-    if ((_reg_state == RegistrationState::NOT_REGISTERED) && !_xml.empty())
-    {
-      TRC_DEBUG("Found stored XML for subscriber, treating as UNREGISTERED state");
-      _reg_state = RegistrationState::UNREGISTERED;
-    }
+    ImpuRecord record;
+    decode_impu_columns(results, now, record);
 
+    _xml = make_shared_payload(record.xml);
+    _xml_ttl = record.xml_ttl;
+    _reg_state = record.reg_state;
+    _reg_state_ttl = record.reg_state_ttl;
+    _impis.swap(record.impis);
+    _charging_addrs = std::move(record.charging_addrs);
   }
   catch(CassandraStore::RowNotFoundException& rnfe)
   {
@@ -449,6 +862,12 @@ bool Cache::GetRegData::perform(CassandraStore::Client* client,
 }
 
 void Cache::GetRegData::get_xml(std::string& xml, int32_t& ttl)
+{
+  xml = *_xml;
+  ttl = _xml_ttl;
+}
+
+void Cache::GetRegData::get_shared_xml(SharedPayload& xml, int32_t& ttl)
 {
   xml = _xml;
   ttl = _xml_ttl;
@@ -498,13 +917,112 @@ void Cache::GetRegData::get_result(Cache::GetRegData::Result& result)
 }
 
 
+//
+// GetRegDataBatch methods
+//
+
+Cache::GetRegDataBatch::
+GetRegDataBatch(const std::vector<std::string>& public_ids) :
+  CacheOperation(OP_GET_REG_DATA_BATCH),
+  _public_ids(public_ids),
+  _results()
+{
+  std::sort(_public_ids.begin(), _public_ids.end());
+  _public_ids.erase(std::unique(_public_ids.begin(), _public_ids.end()),
+                    _public_ids.end());
+}
+
+
+Cache::GetRegDataBatch::
+~GetRegDataBatch()
+{}
+
+
+bool Cache::GetRegDataBatch::perform(CassandraStore::Client* client,
+                                     SAS::TrailId trail)
+{
+  int64_t now = generate_timestamp();
+  TRC_DEBUG("Issuing multiget for %d public IDs", _public_ids.size());
+
+  ColumnParent parent;
+  parent.column_family = IMPU;
+
+  // Read every column in each row.
+  SliceRange slice_range;
+  slice_range.start = "";
+  slice_range.finish = "";
+  slice_range.count = std::numeric_limits<int32_t>::max();
+  SlicePredicate predicate;
+  predicate.__set_slice_range(slice_range);
+
+  // Read at the same consistency levels as the single-row HA gets - try TWO
+  // first and fall back to ONE if not enough replicas are available.
+  std::map<std::string, std::vector<ColumnOrSuperColumn> > rows;
+
+  try
+  {
+    client->multiget_slice(rows, _public_ids, parent, predicate, ConsistencyLevel::TWO);
+  }
+  catch(UnavailableException& ue)
+  {
+    TRC_DEBUG("Failed TWO multiget for %d public IDs - retry at ONE",
+              _public_ids.size());
+    client->multiget_slice(rows, _public_ids, parent, predicate, ConsistencyLevel::ONE);
+  }
+  catch(TimedOutException& te)
+  {
+    TRC_DEBUG("Failed TWO multiget for %d public IDs - retry at ONE",
+              _public_ids.size());
+    client->multiget_slice(rows, _public_ids, parent, predicate, ConsistencyLevel::ONE);
+  }
+
+  record_read(rows);
+
+  for (std::vector<std::string>::const_iterator public_id = _public_ids.begin();
+       public_id != _public_ids.end();
+       ++public_id)
+  {
+    // The row's columns are moved into the result, so a public ID that was
+    // asked for twice must only be decoded once.
+    if (_results.find(*public_id) != _results.end())
+    {
+      continue;
+    }
+
+    ImpuRecord record;
+    std::map<std::string, std::vector<ColumnOrSuperColumn> >::iterator row =
+      rows.find(*public_id);
+
+    // Rows that don't exist are left in the default state (NOT_REGISTERED
+    // and empty XML), as for GetRegData.
+    if (row != rows.end())
+    {
+      decode_impu_columns(row->second, now, record);
+    }
+
+    GetRegData::Result& result = _results[*public_id];
+    result.xml.swap(record.xml);
+    result.state = record.reg_state;
+    result.impis.swap(record.impis);
+    result.charging_addrs = std::move(record.charging_addrs);
+  }
+
+  return true;
+}
+
+void Cache::GetRegDataBatch::get_result(std::map<std::string, GetRegData::Result>& results)
+{
+  results = _results;
+}
+
+
 //
 // GetAssociatedPublicIDs methods
 //
 
 Cache::GetAssociatedPublicIDs::
 GetAssociatedPublicIDs(const std::string& private_id) :
-  CassandraStore::Operation(),
+  CacheOperation(OP_GET_ASSOCIATED_PUBLIC_IDS),
   _private_ids(1, private_id),
   _public_ids()
 {}
@@ -512,7 +1030,7 @@ GetAssociatedPublicIDs(const std::string& private_id) :
 
 Cache::GetAssociatedPublicIDs::
 GetAssociatedPublicIDs(const std::vector<std::string>& private_ids) :
-  CassandraStore::Operation(),
+  CacheOperation(OP_GET_ASSOCIATED_PUBLIC_IDS),
   _private_ids(private_ids),
   _public_ids()
 {}
@@ -539,6 +1057,7 @@ bool Cache::GetAssociatedPublicIDs::perform(CassandraStore::Client* client,
                                             ASSOC_PUBLIC_ID_COLUMN_PREFIX,
                                             columns,
                                             trail);
+    record_read(columns);
   }
   catch(CassandraStore::RowNotFoundException& rnfe)
   {
@@ -579,14 +1098,14 @@ void Cache::GetAssociatedPublicIDs::get_result(std::vector<std::string>& ids)
 
 Cache::GetAssociatedPrimaryPublicIDs::
 GetAssociatedPrimaryPublicIDs(const std::string& private_id) :
-  CassandraStore::Operation(),
+  CacheOperation(OP_GET_ASSOCIATED_PRIMARY_PUBLIC_IDS),
   _private_ids(1, private_id),
   _public_ids()
 {}
 
 Cache::GetAssociatedPrimaryPublicIDs::
 GetAssociatedPrimaryPublicIDs(const std::vector<std::string>& private_ids) :
-  CassandraStore::Operation(),
+  CacheOperation(OP_GET_ASSOCIATED_PRIMARY_PUBLIC_IDS),
   _private_ids(private_ids),
   _public_ids()
 {}
@@ -606,6 +1125,7 @@ bool Cache::GetAssociatedPrimaryPublicIDs::perform(CassandraStore::Client* clien
                                             IMPI_MAPPING_PREFIX,
                                             columns,
                                             trail);
+    record_read(columns);
   }
   catch(CassandraStore::RowNotFoundException& rnfe)
   {
@@ -642,7 +1162,7 @@ void Cache::GetAssociatedPrimaryPublicIDs::get_result(std::vector<std::string>&
 
 Cache::GetAuthVector::
 GetAuthVector(const std::string& private_id) :
-  CassandraStore::Operation(),
+  CacheOperation(OP_GET_AUTH_VECTOR),
   _private_id(private_id),
   _public_id(""),
   _auth_vector()
@@ -652,7 +1172,7 @@ GetAuthVector(const std::string& private_id) :
 Cache::GetAuthVector::
 GetAuthVector(const std::string& private_id,
               const std::string& public_id) :
-  CassandraStore::Operation(),
+  CacheOperation(OP_GET_AUTH_VECTOR),
   _private_id(private_id),
   _public_id(public_id),
   _auth_vector()
@@ -692,6 +1212,7 @@ bool Cache::GetAuthVector::perform(CassandraStore::Client* client,
   TRC_DEBUG("Issuing cache query");
   std::vector<ColumnOrSuperColumn> results;
   client->ha_get_columns(IMPI, _private_id, requested_columns, results, trail);
+  record_read(results);
 
   for (std::vector<ColumnOrSuperColumn>::const_iterator it = results.begin();
        it != results.end();
@@ -755,7 +1276,7 @@ Cache::DeletePublicIDs::
 DeletePublicIDs(const std::string& public_id,
                 const std::vector<std::string>& impis,
                 int64_t timestamp) :
-  CassandraStore::Operation(),
+  CacheOperation(OP_DELETE_PUBLIC_IDS),
   _public_ids(1, public_id),
   _impis(impis),
   _timestamp(timestamp)
@@ -765,7 +1286,7 @@ Cache::DeletePublicIDs::
 DeletePublicIDs(const std::vector<std::string>& public_ids,
                 const std::vector<std::string>& impis,
                 int64_t timestamp) :
-  CassandraStore::Operation(),
+  CacheOperation(OP_DELETE_PUBLIC_IDS),
   _public_ids(public_ids),
   _impis(impis),
   _timestamp(timestamp)
@@ -779,14 +1300,13 @@ Cache::DeletePublicIDs::
 bool Cache::DeletePublicIDs::perform(CassandraStore::Client* client,
                                      SAS::TrailId trail)
 {
-  std::vector<CassandraStore::RowColumns> to_delete;
+  MutationBatch batch(_timestamp);
 
   for (std::vector<std::string>::const_iterator it = _public_ids.begin();
        it != _public_ids.end();
        ++it)
   {
-    // Don't specify columns as we're deleting the whole row
-    to_delete.push_back(CassandraStore::RowColumns(IMPU, *it));
+    batch.delete_row(IMPU, *it);
   }
 
   std::string primary_public_id = _public_ids.front();
@@ -799,11 +1319,12 @@ bool Cache::DeletePublicIDs::perform(CassandraStore::Client* client,
   {
     // Delete the column for this primary public ID from the IMPI
     // mapping table
-    to_delete.push_back(CassandraStore::RowColumns(IMPI_MAPPING, *it, impi_columns_to_delete));
+    batch.delete_columns(IMPI_MAPPING, *it, impi_columns_to_delete);
   }
 
   // Perform the batch deletion we've built up
-  client->delete_columns(to_delete, _timestamp);
+  record_write(batch);
+  batch.execute(client);
 
   return true;
 }
@@ -814,7 +1335,7 @@ bool Cache::DeletePublicIDs::perform(CassandraStore::Client* client,
 
 Cache::DeletePrivateIDs::
 DeletePrivateIDs(const std::string& private_id, int64_t timestamp) :
-  CassandraStore::Operation(),
+  CacheOperation(OP_DELETE_PRIVATE_IDS),
   _private_ids(1, private_id),
   _timestamp(timestamp)
 {}
@@ -822,7 +1343,7 @@ DeletePrivateIDs(const std::string& private_id, int64_t timestamp) :
 
 Cache::DeletePrivateIDs::
 DeletePrivateIDs(const std::vector<std::string>& private_ids, int64_t timestamp) :
-  CassandraStore::Operation(),
+  CacheOperation(OP_DELETE_PRIVATE_IDS),
   _private_ids(private_ids),
   _timestamp(timestamp)
 {}
@@ -836,13 +1357,17 @@ Cache::DeletePrivateIDs::
 bool Cache::DeletePrivateIDs::perform(CassandraStore::Client* client,
                                       SAS::TrailId trail)
 {
+  MutationBatch batch(_timestamp);
+
   for (std::vector<std::string>::const_iterator it = _private_ids.begin();
        it != _private_ids.end();
        ++it)
   {
-    client->delete_row(IMPI, *it, _timestamp);
+    batch.delete_row(IMPI, *it);
   }
 
+  record_write(batch);
+  batch.execute(client);
   return true;
 }
 
@@ -852,7 +1377,7 @@ bool Cache::DeletePrivateIDs::perform(CassandraStore::Client* client,
 
 Cache::DeleteIMPIMapping::
 DeleteIMPIMapping(const std::vector<std::string>& private_ids, int64_t timestamp) :
-  CassandraStore::Operation(),
+  CacheOperation(OP_DELETE_IMPI_MAPPING),
   _private_ids(private_ids),
   _timestamp(timestamp)
 {}
@@ -860,17 +1385,17 @@ DeleteIMPIMapping(const std::vector<std::string>& private_ids, int64_t timestamp
 bool Cache::DeleteIMPIMapping::perform(CassandraStore::Client* client,
                                        SAS::TrailId trail)
 {
-  std::vector<CassandraStore::RowColumns> to_delete;
+  MutationBatch batch(_timestamp);
 
   for (std::vector<std::string>::const_iterator it = _private_ids.begin();
        it != _private_ids.end();
        ++it)
   {
-    // Don't specify columns as we're deleting the whole row
-    to_delete.push_back(CassandraStore::RowColumns(IMPI_MAPPING, *it));
+    batch.delete_row(IMPI_MAPPING, *it);
   }
 
-  client->delete_columns(to_delete, _timestamp);
+  record_write(batch);
+  batch.execute(client);
   return true;
 }
 
@@ -882,7 +1407,7 @@ Cache::DissociateImplicitRegistrationSetFromImpi::
 DissociateImplicitRegistrationSetFromImpi(const std::vector<std::string>& impus,
                                           const std::string& impi,
                                           int64_t timestamp) :
-  CassandraStore::Operation(),
+  CacheOperation(OP_DISSOCIATE_IRS_FROM_IMPI),
   _impus(impus),
   _timestamp(timestamp)
 {
@@ -893,7 +1418,7 @@ Cache::DissociateImplicitRegistrationSetFromImpi::
 DissociateImplicitRegistrationSetFromImpi(const std::vector<std::string>& impus,
                                           const std::vector<std::string>& impis,
                                           int64_t timestamp) :
-  CassandraStore::Operation(),
+  CacheOperation(OP_DISSOCIATE_IRS_FROM_IMPI),
   _impus(impus),
   _impis(impis),
   _timestamp(timestamp)
@@ -932,6 +1457,7 @@ bool Cache::DissociateImplicitRegistrationSetFromImpi::perform(CassandraStore::C
                                      IMPI_COLUMN_PREFIX,
                                      columns,
                                      trail);
+  record_read(columns);
   TRC_DEBUG("%d IMPIs are associated with this IRS", columns.size());
 
   std::set<std::string> associated_impis_set;
@@ -991,7 +1517,195 @@ bool Cache::DissociateImplicitRegistrationSetFromImpi::perform(CassandraStore::C
   }
 
   // Perform the batch deletion we've built up
-  client->delete_columns(to_delete, _timestamp);
+  MutationBatch batch(_timestamp);
+  batch.delete_columns(to_delete);
+  record_write(batch);
+  batch.execute(client);
+
+  return true;
+}
+
+
+//
+// ScanOperation methods
+//
+
+Cache::ScanOperation::
+ScanOperation(OperationType type,
+              const std::string& table,
+              const TokenRange& range,
+              const std::string& resume_key,
+              int32_t page_size) :
+  CacheOperation(type),
+  _table(table),
+  _range(range),
+  _page_size(std::max(page_size, 1)),
+  _last_key(resume_key),
+  _rows_scanned(0),
+  _stopped(false)
+{}
+
+Cache::ScanOperation::
+~ScanOperation()
+{}
+
+bool Cache::ScanOperation::perform(CassandraStore::Client* client,
+                                   SAS::TrailId trail)
+{
+  int64_t now = generate_timestamp();
+  TRC_DEBUG("Scanning %s from token %s (key %s) to token %s",
+            _table.c_str(),
+            _range.start_token.c_str(),
+            _last_key.c_str(),
+            _range.end_token.c_str());
+
+  ColumnParent parent;
+  parent.column_family = _table;
+
+  // Read every column in each row.
+  SliceRange slice_range;
+  slice_range.start = "";
+  slice_range.finish = "";
+  slice_range.count = std::numeric_limits<int32_t>::max();
+  SlicePredicate predicate;
+  predicate.__set_slice_range(slice_range);
+
+  while (true)
+  {
+    KeyRange key_range;
+    key_range.__set_end_token(_range.end_token);
+
+    if (_last_key.empty())
+    {
+      key_range.__set_start_token(_range.start_token);
+      key_range.__set_count(_page_size);
+    }
+    else
+    {
+      // Carry on from the last row read.  The start key is inclusive, so read
+      // one extra row to make up for it.
+      key_range.__set_start_key(_last_key);
+      key_range.__set_count(_page_size + 1);
+    }
+
+    std::vector<KeySlice> page;
+    client->get_range_slices(page, parent, predicate, key_range, ConsistencyLevel::ONE);
+
+    for (std::vector<KeySlice>::iterator row = page.begin();
+         row != page.end();
+         ++row)
+    {
+      if (row->key == _last_key)
+      {
+        continue;
+      }
+
+      _last_key = row->key;
+
+      // Deleted rows are returned with no columns until Cassandra compacts
+      // them away.
+      if (row->columns.empty())
+      {
+        continue;
+      }
+
+      record_read(row->columns);
+      _rows_scanned++;
+
+      if (!process_row(row->key, row->columns, now))
+      {
+        TRC_DEBUG("Scan of %s stopped at key %s", _table.c_str(), _last_key.c_str());
+        _stopped = true;
+        return true;
+      }
+    }
+
+    if (page.size() < (size_t)key_range.count)
+    {
+      break;
+    }
+  }
 
+  TRC_DEBUG("Scanned %lu rows of %s", _rows_scanned, _table.c_str());
   return true;
 }
+
+
+//
+// ScanImpus methods
+//
+
+Cache::ScanImpus::
+ScanImpus(const TokenRange& range,
+          const Callback& callback,
+          const std::string& resume_key,
+          int32_t page_size) :
+  ScanOperation(OP_SCAN_IMPUS, IMPU, range, resume_key, page_size),
+  _callback(callback)
+{}
+
+Cache::ScanImpus::
+~ScanImpus()
+{}
+
+bool Cache::ScanImpus::process_row(const std::string& key,
+                                   std::vector<ColumnOrSuperColumn>& columns,
+                                   int64_t now)
+{
+  ImpuRecord record;
+  record.public_id = key;
+  decode_impu_columns(columns, now, record);
+  return _callback(record);
+}
+
+
+//
+// ScanImpis methods
+//
+
+Cache::ScanImpis::
+ScanImpis(const TokenRange& range,
+          const Callback& callback,
+          const std::string& resume_key,
+          int32_t page_size) :
+  ScanOperation(OP_SCAN_IMPIS, IMPI, range, resume_key, page_size),
+  _callback(callback)
+{}
+
+Cache::ScanImpis::
+~ScanImpis()
+{}
+
+bool Cache::ScanImpis::process_row(const std::string& key,
+                                   std::vector<ColumnOrSuperColumn>& columns,
+                                   int64_t now)
+{
+  ImpiRecord record;
+  record.private_id = key;
+
+  for (std::vector<ColumnOrSuperColumn>::const_iterator it = columns.begin();
+       it != columns.end();
+       ++it)
+  {
+    const Column* col = &it->column;
+
+    if (col->name == DIGEST_HA1_COLUMN_NAME)
+    {
+      record.auth_vector.ha1 = col->value;
+    }
+    else if (col->name == DIGEST_REALM_COLUMN_NAME)
+    {
+      record.auth_vector.realm = col->value;
+    }
+    else if (col->name == DIGEST_QOP_COLUMN_NAME)
+    {
+      record.auth_vector.qop = col->value;
+    }
+    else if (col->name.find(ASSOC_PUBLIC_ID_COLUMN_PREFIX) == 0)
+    {
+      record.public_ids.push_back(col->name.substr(ASSOC_PUBLIC_ID_COLUMN_PREFIX.length()));
+    }
+  }
+
+  return _callback(record);
+}
@@ -714,7 +714,7 @@ ServerAssignmentAnswer::ServerAssignmentAnswer(const Dictionary* dict,
       charging_information.add(Diameter::AVP(dict->PRIMARY_EVENT_CHARGING_FUNCTION_NAME).
                                val_str(charging_addrs.ecfs[0]));
     }
-    if (charging_addrs.ccfs.size() > 1)
+    if (charging_addrs.ecfs.size() > 1)
     {
       TRC_DEBUG("Adding Secondary-Event-Charging-Function-Name %s", charging_addrs.ecfs[1].c_str());
       charging_information.add(Diameter::AVP(dict->SECONDARY_EVENT_CHARGING_FUNCTION_NAME).
@@ -952,7 +952,7 @@ PushProfileRequest::PushProfileRequest(const Dictionary* dict,
       charging_information.add(Diameter::AVP(dict->PRIMARY_EVENT_CHARGING_FUNCTION_NAME).
                                val_str(charging_addrs.ecfs[0]));
     }
-    if (charging_addrs.ccfs.size() > 1)
+    if (charging_addrs.ecfs.size() > 1)
     {
       TRC_DEBUG("Adding Secondary-Event-Charging-Function-Name %s", charging_addrs.ecfs[1].c_str());
       charging_information.add(Diameter::AVP(dict->SECONDARY_EVENT_CHARGING_FUNCTION_NAME).
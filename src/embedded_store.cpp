@@ -0,0 +1,1298 @@
+/**
+ * @file embedded_store.cpp In-process store for the cache, persisted
+ *   through an append-only log and snapshots.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <algorithm>
+#include <limits>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "embedded_store.h"
+#include "log.h"
+
+using namespace org::apache::cassandra;
+
+const uint64_t EmbeddedStore::DEFAULT_SNAPSHOT_LOG_BYTES;
+const int64_t EmbeddedStore::TOMBSTONE_GC_GRACE_S;
+
+// Every snapshot and log file starts with this string, followed by a
+// sequence of records.  Each record is a 4 byte length and a 4 byte CRC32 of
+// the payload (both in host byte order), followed by the payload.
+static const std::string FILE_MAGIC = "HSEMBED1";
+
+// Snapshots are written as a sequence of records of about this size.
+static const size_t SNAPSHOT_RECORD_BYTES = 1024 * 1024;
+
+static const std::string SNAPSHOT_FILE = "snapshot";
+static const std::string LOG_FILE = "log";
+
+// While a snapshot is being written, the log it replaces is kept under this
+// name.  If the snapshot fails, it is replayed between the old snapshot and
+// the new log.
+static const std::string OLD_LOG_FILE = "log.old";
+
+// Helpers for holding the read/write lock for the duration of a scope.
+class ReadLock
+{
+public:
+  ReadLock(pthread_rwlock_t* lock) : _lock(lock) { pthread_rwlock_rdlock(_lock); }
+  ~ReadLock() { pthread_rwlock_unlock(_lock); }
+private:
+  pthread_rwlock_t* _lock;
+};
+
+class WriteLock
+{
+public:
+  WriteLock(pthread_rwlock_t* lock) : _lock(lock) { pthread_rwlock_wrlock(_lock); }
+  ~WriteLock() { pthread_rwlock_unlock(_lock); }
+private:
+  pthread_rwlock_t* _lock;
+};
+
+//
+// Encoding and decoding of log records.
+//
+
+static void encode_int(std::string& buf, const void* value, size_t len)
+{
+  buf.append((const char*)value, len);
+}
+
+static void encode_str(std::string& buf, const std::string& str)
+{
+  uint32_t len = str.length();
+  encode_int(buf, &len, sizeof(len));
+  buf.append(str);
+}
+
+/// Reads the fields of a log record in turn.  Reading past the end of the
+/// record clears the ok flag rather than failing immediately, so the caller
+/// can check once after reading a whole change.
+class RecordReader
+{
+public:
+  RecordReader(const char* data, size_t len) : _data(data), _len(len), _pos(0), _ok(true) {}
+
+  bool done() const { return _pos >= _len; }
+  bool ok() const { return _ok; }
+
+  template <class T> T read_int()
+  {
+    T value = 0;
+    if (_pos + sizeof(T) <= _len)
+    {
+      memcpy(&value, _data + _pos, sizeof(T));
+      _pos += sizeof(T);
+    }
+    else
+    {
+      _ok = false;
+      _pos = _len;
+    }
+    return value;
+  }
+
+  std::string read_str()
+  {
+    uint32_t len = read_int<uint32_t>();
+    if (_ok && (_pos + len <= _len))
+    {
+      std::string str(_data + _pos, len);
+      _pos += len;
+      return str;
+    }
+    _ok = false;
+    _pos = _len;
+    return std::string();
+  }
+
+private:
+  const char* _data;
+  size_t _len;
+  size_t _pos;
+  bool _ok;
+};
+
+static bool write_all(int fd, const char* data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t written = write(fd, data, len);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue; // LCOV_EXCL_LINE
+      }
+      return false;
+    }
+    data += written;
+    len -= written;
+  }
+  return true;
+}
+
+// Write a record (with its length and checksum) to a file.
+static bool write_record(int fd, const std::string& record)
+{
+  uint32_t len = record.length();
+  uint32_t crc = crc32(0, (const Bytef*)record.data(), record.length());
+
+  std::string buf;
+  buf.reserve(sizeof(len) + sizeof(crc) + record.length());
+  encode_int(buf, &len, sizeof(len));
+  encode_int(buf, &crc, sizeof(crc));
+  buf.append(record);
+
+  return write_all(fd, buf.data(), buf.length());
+}
+
+//
+// EmbeddedStore methods.
+//
+
+EmbeddedStore::EmbeddedStore(const std::string& dir,
+                             uint64_t snapshot_log_bytes,
+                             int snapshot_interval_s,
+                             SyncPolicy sync_policy) :
+  _tables(),
+  _dir(dir),
+  _snapshot_log_bytes(snapshot_log_bytes),
+  _log_fd(-1),
+  _log_bytes(0),
+  _next_snapshot_log_bytes(snapshot_log_bytes),
+  _opened(false),
+  _sync_policy(sync_policy),
+  _written_seq(0),
+  _syncing(false),
+  _synced_seq(0),
+  _snapshot_interval_s(snapshot_interval_s),
+  _snapshot_requested(false),
+  _terminating(false)
+{
+  pthread_rwlock_init(&_lock, NULL);
+}
+
+EmbeddedStore::~EmbeddedStore()
+{
+  if (_loader.joinable())
+  {
+    _loader.join();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_snapshot_lock);
+    _terminating = true;
+  }
+  _snapshot_cond.notify_all();
+
+  if (_snapshot_thread.joinable())
+  {
+    _snapshot_thread.join();
+  }
+
+  if (_log_fd >= 0)
+  {
+    fdatasync(_log_fd);
+    close(_log_fd);
+    _log_fd = -1;
+  }
+
+  pthread_rwlock_destroy(&_lock);
+}
+
+bool EmbeddedStore::open()
+{
+  if (_dir.empty())
+  {
+    return true;
+  }
+
+  bool ok;
+  {
+    WriteLock lock(&_lock);
+    ok = load_all();
+  }
+
+  // If the log is already large, or a snapshot was interrupted, compact the
+  // log now rather than waiting for more writes.
+  if (ok &&
+      ((log_bytes() >= _snapshot_log_bytes) ||
+       (access((_dir + "/" + OLD_LOG_FILE).c_str(), F_OK) == 0)))
+  {
+    ok = write_snapshot();
+  }
+
+  if (ok)
+  {
+    _snapshot_thread = std::thread(&EmbeddedStore::snapshot_loop, this);
+  }
+
+  return ok;
+}
+
+void EmbeddedStore::open_async()
+{
+  _loader = std::thread([this]() { _opened = open(); });
+}
+
+bool EmbeddedStore::wait_opened()
+{
+  if (_loader.joinable())
+  {
+    _loader.join();
+  }
+
+  return _opened;
+}
+
+bool EmbeddedStore::load_all()
+{
+  uint64_t valid_bytes = 0;
+
+  if (!load(_dir + "/" + SNAPSHOT_FILE, valid_bytes) ||
+      !load(_dir + "/" + OLD_LOG_FILE, valid_bytes) ||
+      !load(_dir + "/" + LOG_FILE, valid_bytes) ||
+      !open_log(valid_bytes))
+  {
+    return false;
+  }
+
+  size_t rows = 0;
+  for (std::map<std::string, Table>::const_iterator table = _tables.begin();
+       table != _tables.end();
+       ++table)
+  {
+    rows += table->second.size();
+  }
+  TRC_STATUS("Loaded %ld rows into embedded store from %s", rows, _dir.c_str());
+  return true;
+}
+
+void EmbeddedStore::request_snapshot()
+{
+  {
+    std::lock_guard<std::mutex> lock(_snapshot_lock);
+    _snapshot_requested = true;
+  }
+  _snapshot_cond.notify_one();
+}
+
+void EmbeddedStore::snapshot_loop()
+{
+  std::unique_lock<std::mutex> lock(_snapshot_lock);
+
+  while (true)
+  {
+    if ((!_snapshot_requested) && (!_terminating))
+    {
+      if (_snapshot_interval_s > 0)
+      {
+        _snapshot_cond.wait_for(lock, std::chrono::seconds(_snapshot_interval_s));
+      }
+      else
+      {
+        _snapshot_cond.wait(lock);
+      }
+    }
+
+    // A requested snapshot is still written if the store is terminating, as
+    // the log has grown past the threshold.
+    bool requested = _snapshot_requested;
+    _snapshot_requested = false;
+
+    if ((!requested) && (_terminating))
+    {
+      break;
+    }
+
+    // Don't hold our lock while writing the snapshot, as writes take it (with
+    // the store lock held) to request snapshots.  Periodic snapshots are only
+    // written if something has changed since the last one.
+    lock.unlock();
+
+    if (requested || ((_snapshot_interval_s > 0) && (log_bytes() > 0)))
+    {
+      write_snapshot();
+    }
+
+    lock.lock();
+  }
+}
+
+bool EmbeddedStore::snapshot()
+{
+  if (_dir.empty())
+  {
+    return true;
+  }
+
+  return write_snapshot();
+}
+
+size_t EmbeddedStore::row_count(const std::string& table)
+{
+  time_t now = time(NULL);
+  ReadLock lock(&_lock);
+
+  std::map<std::string, Table>::const_iterator it = _tables.find(table);
+  if (it == _tables.end())
+  {
+    return 0;
+  }
+
+  // Rows that only hold tombstones don't count.
+  size_t rows = 0;
+  for (Table::const_iterator row = it->second.begin();
+       row != it->second.end();
+       ++row)
+  {
+    if (std::any_of(row->second.begin(),
+                    row->second.end(),
+                    [now](const StoredColumn& c) { return visible(c, now); }))
+    {
+      rows++;
+    }
+  }
+
+  return rows;
+}
+
+uint64_t EmbeddedStore::log_bytes()
+{
+  ReadLock lock(&_lock);
+  return _log_bytes;
+}
+
+void EmbeddedStore::set_keyspace(const std::string& keyspace)
+{
+  // There is only one keyspace.
+}
+
+void EmbeddedStore::batch_mutate(
+  const std::map<std::string, std::map<std::string, std::vector<Mutation> > >& mutation_map,
+  const ConsistencyLevel::type consistency_level)
+{
+  time_t now = time(NULL);
+  std::string record;
+
+  // The mutation map is keyed by row key, then by table.
+  for (std::map<std::string, std::map<std::string, std::vector<Mutation> > >::const_iterator key_it = mutation_map.begin();
+       key_it != mutation_map.end();
+       ++key_it)
+  {
+    for (std::map<std::string, std::vector<Mutation> >::const_iterator table_it = key_it->second.begin();
+         table_it != key_it->second.end();
+         ++table_it)
+    {
+      for (std::vector<Mutation>::const_iterator mut = table_it->second.begin();
+           mut != table_it->second.end();
+           ++mut)
+      {
+        if (mut->__isset.column_or_supercolumn)
+        {
+          const Column& thrift_column = mut->column_or_supercolumn.column;
+          StoredColumn column;
+          column.name = thrift_column.name;
+          column.value = thrift_column.value;
+          column.timestamp = thrift_column.timestamp;
+          column.expiry = (thrift_column.__isset.ttl && (thrift_column.ttl > 0)) ?
+                            now + thrift_column.ttl : 0;
+          column.deleted = false;
+          encode_put(record, table_it->first, key_it->first, column);
+        }
+        else if (mut->__isset.deletion &&
+                 mut->deletion.__isset.predicate &&
+                 mut->deletion.predicate.__isset.column_names)
+        {
+          for (std::vector<std::string>::const_iterator name = mut->deletion.predicate.column_names.begin();
+               name != mut->deletion.predicate.column_names.end();
+               ++name)
+          {
+            encode_delete(record,
+                          DELETE_COLUMN,
+                          table_it->first,
+                          key_it->first,
+                          *name,
+                          mut->deletion.timestamp);
+          }
+        }
+        else if (mut->__isset.deletion)
+        {
+          encode_delete(record,
+                        DELETE_ROW,
+                        table_it->first,
+                        key_it->first,
+                        "",
+                        mut->deletion.timestamp);
+        }
+      }
+    }
+  }
+
+  uint64_t seq;
+  {
+    WriteLock lock(&_lock);
+    seq = commit(record);
+  }
+  wait_for_sync(seq);
+}
+
+void EmbeddedStore::get_slice(std::vector<ColumnOrSuperColumn>& _return,
+                              const std::string& key,
+                              const ColumnParent& column_parent,
+                              const SlicePredicate& predicate,
+                              const ConsistencyLevel::type consistency_level)
+{
+  time_t now = time(NULL);
+  ReadLock lock(&_lock);
+
+  std::map<std::string, Table>::iterator table = _tables.find(column_parent.column_family);
+  if (table != _tables.end())
+  {
+    Table::iterator row = table->second.find(key);
+    if (row != table->second.end())
+    {
+      slice_row(_return, row->second, predicate, now);
+    }
+  }
+}
+
+void EmbeddedStore::multiget_slice(std::map<std::string, std::vector<ColumnOrSuperColumn> >& _return,
+                                   const std::vector<std::string>& keys,
+                                   const ColumnParent& column_parent,
+                                   const SlicePredicate& predicate,
+                                   const ConsistencyLevel::type consistency_level)
+{
+  time_t now = time(NULL);
+  ReadLock lock(&_lock);
+
+  std::map<std::string, Table>::iterator table = _tables.find(column_parent.column_family);
+  if (table == _tables.end())
+  {
+    return;
+  }
+
+  for (std::vector<std::string>::const_iterator key = keys.begin();
+       key != keys.end();
+       ++key)
+  {
+    Table::iterator row = table->second.find(*key);
+
+    if (row != table->second.end())
+    {
+      std::vector<ColumnOrSuperColumn> columns;
+      slice_row(columns, row->second, predicate, now);
+
+      if (!columns.empty())
+      {
+        _return[*key].swap(columns);
+      }
+    }
+  }
+}
+
+void EmbeddedStore::remove(const std::string& key,
+                           const ColumnPath& column_path,
+                           const int64_t timestamp,
+                           const ConsistencyLevel::type consistency_level)
+{
+  std::string record;
+
+  if (column_path.__isset.column)
+  {
+    encode_delete(record, DELETE_COLUMN, column_path.column_family, key, column_path.column, timestamp);
+  }
+  else
+  {
+    encode_delete(record, DELETE_ROW, column_path.column_family, key, "", timestamp);
+  }
+
+  uint64_t seq;
+  {
+    WriteLock lock(&_lock);
+    seq = commit(record);
+  }
+  wait_for_sync(seq);
+}
+
+void EmbeddedStore::get_range_slices(std::vector<KeySlice>& _return,
+                                     const ColumnParent& column_parent,
+                                     const SlicePredicate& predicate,
+                                     const KeyRange& range,
+                                     const ConsistencyLevel::type consistency_level)
+{
+  time_t now = time(NULL);
+  ReadLock lock(&_lock);
+
+  std::map<std::string, Table>::iterator table = _tables.find(column_parent.column_family);
+  if (table == _tables.end())
+  {
+    return;
+  }
+
+  // Work out the bounds of the range.  A start token is exclusive, and a
+  // start key (used to carry on from the last row of a previous page) is
+  // inclusive.  End tokens and keys are both inclusive.
+  typedef std::pair<int64_t, std::string> Position;
+  const int64_t min_token = std::numeric_limits<int64_t>::min();
+  const int64_t max_token = std::numeric_limits<int64_t>::max();
+  Position start(min_token, "");
+  Position end(max_token, "");
+  bool start_exclusive = false;
+  bool unbounded_end = true;
+
+  if (range.__isset.start_token)
+  {
+    start.first = std::stoll(range.start_token);
+    start_exclusive = (start.first != min_token);
+  }
+  else if (!range.start_key.empty())
+  {
+    start = Position(token(range.start_key), range.start_key);
+  }
+
+  if (range.__isset.end_token)
+  {
+    end.first = std::stoll(range.end_token);
+    unbounded_end = (end.first == max_token);
+  }
+  else if (!range.end_key.empty())
+  {
+    end = Position(token(range.end_key), range.end_key);
+    unbounded_end = false;
+  }
+
+  // The tables are hashed, so find the keys in the range and sort them.
+  // This is linear in the size of the table, but range scans are only used
+  // for bulk operations.
+  std::vector<std::pair<Position, Table::iterator> > rows;
+  for (Table::iterator row = table->second.begin();
+       row != table->second.end();
+       ++row)
+  {
+    Position pos(token(row->first), row->first);
+
+    if ((start_exclusive ? (pos.first > start.first) : (pos >= start)) &&
+        (unbounded_end ||
+         (range.__isset.end_token ? (pos.first <= end.first) : (pos <= end))))
+    {
+      rows.push_back(std::make_pair(pos, row));
+    }
+  }
+
+  std::sort(rows.begin(),
+            rows.end(),
+            [](const std::pair<Position, Table::iterator>& a,
+               const std::pair<Position, Table::iterator>& b) { return a.first < b.first; });
+
+  for (std::vector<std::pair<Position, Table::iterator> >::const_iterator row = rows.begin();
+       (row != rows.end()) && (_return.size() < (size_t)range.count);
+       ++row)
+  {
+    KeySlice slice;
+    slice.key = row->second->first;
+    slice_row(slice.columns, row->second->second, predicate, now);
+
+    if (!slice.columns.empty())
+    {
+      _return.push_back(slice);
+    }
+  }
+}
+
+void EmbeddedStore::encode_put(std::string& record,
+                               const std::string& table,
+                               const std::string& key,
+                               const StoredColumn& column)
+{
+  uint8_t type = PUT_COLUMN;
+  encode_int(record, &type, sizeof(type));
+  encode_str(record, table);
+  encode_str(record, key);
+  encode_str(record, column.name);
+  encode_int(record, &column.timestamp, sizeof(column.timestamp));
+  encode_str(record, column.value);
+  encode_int(record, &column.expiry, sizeof(column.expiry));
+}
+
+void EmbeddedStore::encode_delete(std::string& record,
+                                  ChangeType type,
+                                  const std::string& table,
+                                  const std::string& key,
+                                  const std::string& name,
+                                  int64_t timestamp)
+{
+  uint8_t type_byte = type;
+  encode_int(record, &type_byte, sizeof(type_byte));
+  encode_str(record, table);
+  encode_str(record, key);
+  encode_str(record, name);
+  encode_int(record, &timestamp, sizeof(timestamp));
+}
+
+bool EmbeddedStore::apply(const char* record, size_t len)
+{
+  time_t now = time(NULL);
+  RecordReader reader(record, len);
+
+  while (!reader.done())
+  {
+    uint8_t type = reader.read_int<uint8_t>();
+    std::string table_name = reader.read_str();
+    std::string key = reader.read_str();
+    StoredColumn column;
+    column.name = reader.read_str();
+    column.timestamp = reader.read_int<int64_t>();
+    column.expiry = 0;
+    column.deleted = false;
+
+    if (type == PUT_COLUMN)
+    {
+      column.value = reader.read_str();
+      column.expiry = reader.read_int<int64_t>();
+    }
+
+    if (!reader.ok())
+    {
+      return false;
+    }
+
+    Table& table = _tables[table_name];
+
+    if (type == PUT_COLUMN)
+    {
+      Row& row = table[key];
+
+      // Drop any expired columns while we're changing the row anyway.
+      row.erase(std::remove_if(row.begin(),
+                               row.end(),
+                               [now](const StoredColumn& c) { return !live(c, now); }),
+                row.end());
+
+      Row::iterator existing = find_column(row, column.name);
+      bool found = ((existing != row.end()) && (existing->name == column.name));
+
+      // As in Cassandra, a deletion wins over a write with the same
+      // timestamp.  The row's tombstone (if any) is always its first column.
+      bool row_deleted = ((!row.empty()) &&
+                          (row.front().name.empty()) &&
+                          (row.front().timestamp >= column.timestamp));
+      bool column_deleted = (found &&
+                             existing->deleted &&
+                             (existing->timestamp >= column.timestamp));
+
+      if (row_deleted || column_deleted)
+      {
+        // The column was deleted after this write was made.
+      }
+      else if (!live(column, now))
+      {
+        // The column expired before it was loaded.  It still replaces any
+        // older value, so the column is now absent.
+        delete_column(row, column.name, column.timestamp, now);
+      }
+      else if (!found)
+      {
+        row.insert(existing, column);
+      }
+      else if (existing->timestamp <= column.timestamp)
+      {
+        // As in Cassandra, the write with the latest timestamp wins.
+        existing->value.swap(column.value);
+        existing->timestamp = column.timestamp;
+        existing->expiry = column.expiry;
+        existing->deleted = false;
+      }
+
+      if (row.empty())
+      {
+        table.erase(key);
+      }
+    }
+    else if ((type == DELETE_COLUMN) || (type == DELETE_ROW))
+    {
+      // Deleting a row that doesn't exist still leaves a tombstone, in case
+      // an older write for it arrives later.
+      Row& row = table[key];
+
+      if (type == DELETE_COLUMN)
+      {
+        delete_column(row, column.name, column.timestamp, now);
+      }
+      else
+      {
+        delete_row(row, column.timestamp, now);
+      }
+
+      if (row.empty())
+      {
+        table.erase(key);
+      }
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void EmbeddedStore::delete_column(Row& row,
+                                  const std::string& name,
+                                  int64_t timestamp,
+                                  time_t now)
+{
+  Row::iterator existing = find_column(row, name);
+  bool found = ((existing != row.end()) && (existing->name == name));
+
+  if (found && (existing->timestamp > timestamp))
+  {
+    // The column was written (or deleted) after this deletion.
+    return;
+  }
+
+  StoredColumn tombstone;
+  tombstone.name = name;
+  tombstone.timestamp = timestamp;
+  tombstone.expiry = tombstone_expiry(timestamp);
+  tombstone.deleted = true;
+
+  if (!live(tombstone, now))
+  {
+    // The tombstone would already have been discarded.
+    if (found)
+    {
+      row.erase(existing);
+    }
+  }
+  else if (found)
+  {
+    *existing = tombstone;
+  }
+  else
+  {
+    row.insert(existing, tombstone);
+  }
+}
+
+void EmbeddedStore::delete_row(Row& row, int64_t timestamp, time_t now)
+{
+  // Remove everything older than the deletion, including older tombstones.
+  row.erase(std::remove_if(row.begin(),
+                           row.end(),
+                           [timestamp](const StoredColumn& c) { return c.timestamp <= timestamp; }),
+            row.end());
+
+  if ((!row.empty()) && (row.front().name.empty()))
+  {
+    // The row has been deleted again since.
+    return;
+  }
+
+  // The row's tombstone is stored as a column with an empty name, which
+  // Cassandra doesn't allow for real columns, so it sorts first.
+  StoredColumn tombstone;
+  tombstone.timestamp = timestamp;
+  tombstone.expiry = tombstone_expiry(timestamp);
+  tombstone.deleted = true;
+
+  if (live(tombstone, now))
+  {
+    row.insert(row.begin(), tombstone);
+  }
+}
+
+uint64_t EmbeddedStore::commit(const std::string& record)
+{
+  uint64_t seq = 0;
+
+  if (record.empty())
+  {
+    return seq;
+  }
+
+  if (_log_fd >= 0)
+  {
+    if (!write_record(_log_fd, record))
+    {
+      // Don't leave a partial record in the log, as it would stop any later
+      // records being replayed.
+      TRC_ERROR("Failed to write to embedded store log: %s", strerror(errno));
+      if (ftruncate(_log_fd, FILE_MAGIC.length() + _log_bytes) != 0)
+      {
+        TRC_ERROR("Failed to truncate embedded store log: %s", strerror(errno)); // LCOV_EXCL_LINE
+      }
+      throw UnavailableException();
+    }
+
+    _log_bytes += sizeof(uint32_t) * 2 + record.length();
+    seq = ++_written_seq;
+  }
+
+  if (!apply(record.data(), record.length()))
+  {
+    TRC_ERROR("Failed to apply malformed embedded store record"); // LCOV_EXCL_LINE
+  }
+
+  if ((_log_fd >= 0) && (_log_bytes >= _next_snapshot_log_bytes))
+  {
+    // Leave the snapshot to the snapshot thread rather than holding up this
+    // write.  Don't ask again until the log has grown by the threshold again
+    // (starting a new log resets this).
+    _next_snapshot_log_bytes = _log_bytes + _snapshot_log_bytes;
+    request_snapshot();
+  }
+
+  return seq;
+}
+
+void EmbeddedStore::wait_for_sync(uint64_t seq)
+{
+  if ((_sync_policy != SYNC_COMMIT) || (seq == 0))
+  {
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(_sync_lock);
+
+  while (_synced_seq < seq)
+  {
+    if (_syncing)
+    {
+      // Another thread is syncing the log.  Its sync may not cover our
+      // record, so check again when it has finished.
+      _sync_cond.wait(lock);
+      continue;
+    }
+
+    // Sync everything written so far, on behalf of every thread waiting.
+    // Hold the read lock so that a snapshot can't replace the log under us.
+    _syncing = true;
+    lock.unlock();
+
+    uint64_t target;
+    bool ok;
+    {
+      ReadLock store_lock(&_lock);
+      target = _written_seq;
+      ok = ((_log_fd < 0) || (fdatasync(_log_fd) == 0));
+    }
+
+    lock.lock();
+    _syncing = false;
+    if (ok)
+    {
+      _synced_seq = std::max(_synced_seq, target);
+    }
+    _sync_cond.notify_all();
+
+    if (!ok)
+    {
+      TRC_ERROR("Failed to sync embedded store log: %s", strerror(errno));
+      throw UnavailableException();
+    }
+  }
+}
+
+bool EmbeddedStore::load(const std::string& path, uint64_t& valid_bytes)
+{
+  valid_bytes = 0;
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    if (errno == ENOENT)
+    {
+      return true;
+    }
+    TRC_ERROR("Failed to open %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    TRC_ERROR("Failed to stat %s: %s", path.c_str(), strerror(errno)); // LCOV_EXCL_LINE
+    close(fd); // LCOV_EXCL_LINE
+    return false; // LCOV_EXCL_LINE
+  }
+
+  size_t size = st.st_size;
+  if (size == 0)
+  {
+    close(fd);
+    return true;
+  }
+
+  // Map the file rather than reading it, so loading a large snapshot doesn't
+  // need a second copy of it in memory.
+  void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED)
+  {
+    TRC_ERROR("Failed to map %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  madvise(map, size, MADV_SEQUENTIAL);
+  const char* contents = (const char*)map;
+
+  if ((size < FILE_MAGIC.length()) ||
+      (memcmp(contents, FILE_MAGIC.data(), FILE_MAGIC.length()) != 0))
+  {
+    TRC_ERROR("%s is not an embedded store file", path.c_str());
+    munmap(map, size);
+    return false;
+  }
+
+  size_t pos = FILE_MAGIC.length();
+  int records = 0;
+
+  while (pos + sizeof(uint32_t) * 2 <= size)
+  {
+    uint32_t record_len;
+    uint32_t crc;
+    memcpy(&record_len, contents + pos, sizeof(record_len));
+    memcpy(&crc, contents + pos + sizeof(record_len), sizeof(crc));
+    size_t start = pos + sizeof(record_len) + sizeof(crc);
+
+    if ((start + record_len > size) ||
+        (crc32(0, (const Bytef*)contents + start, record_len) != crc))
+    {
+      break;
+    }
+
+    if (!apply(contents + start, record_len))
+    {
+      break; // LCOV_EXCL_LINE
+    }
+
+    pos = start + record_len;
+    records++;
+  }
+
+  munmap(map, size);
+
+  if (pos != size)
+  {
+    TRC_WARNING("Discarding %ld bytes of incomplete or corrupt data at the end of %s",
+                size - pos,
+                path.c_str());
+  }
+
+  TRC_DEBUG("Loaded %d records from %s", records, path.c_str());
+  valid_bytes = pos;
+  return true;
+}
+
+bool EmbeddedStore::rotate_log()
+{
+  std::string path = _dir + "/" + LOG_FILE;
+  std::string old_path = _dir + "/" + OLD_LOG_FILE;
+
+  if (access(old_path.c_str(), F_OK) == 0)
+  {
+    // An earlier snapshot failed, and the old log holds changes that aren't
+    // in the current snapshot.  Keep it, and carry on using the current log.
+    // Everything in both logs will be in the new snapshot.
+    return true;
+  }
+
+  // Records in the log may have been acknowledged on the understanding that
+  // they will be synced by the next thread to sync the log, which will now be
+  // syncing the new log.
+  if ((_sync_policy == SYNC_COMMIT) && (fdatasync(_log_fd) != 0))
+  {
+    TRC_ERROR("Failed to sync embedded store log: %s", strerror(errno));
+    return false;
+  }
+
+  if (rename(path.c_str(), old_path.c_str()) != 0)
+  {
+    TRC_ERROR("Failed to rename %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  return open_log(0);
+}
+
+bool EmbeddedStore::write_snapshot()
+{
+  std::lock_guard<std::mutex> snapshot_lock(_snapshot_write_lock);
+
+  std::string path = _dir + "/" + SNAPSHOT_FILE;
+  std::string tmp_path = path + ".tmp";
+
+  // Start a new log for the changes made from now on.  This is the only part
+  // of taking a snapshot that stops reads.
+  {
+    WriteLock lock(&_lock);
+    if ((_log_fd < 0) || (!rotate_log()))
+    {
+      return false;
+    }
+  }
+
+  int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    TRC_ERROR("Failed to create %s: %s", tmp_path.c_str(), strerror(errno));
+    return false;
+  }
+
+  time_t now = time(NULL);
+  bool ok = write_all(fd, FILE_MAGIC.data(), FILE_MAGIC.length());
+  std::string record;
+
+  // Only writes wait for the tables to be encoded.  The snapshot may include
+  // some changes that are also in the new log, but replaying those over it
+  // is harmless.
+  {
+    ReadLock lock(&_lock);
+
+    for (std::map<std::string, Table>::const_iterator table = _tables.begin();
+         ok && (table != _tables.end());
+         ++table)
+    {
+      for (Table::const_iterator row = table->second.begin();
+           ok && (row != table->second.end());
+           ++row)
+      {
+        for (Row::const_iterator column = row->second.begin();
+             column != row->second.end();
+             ++column)
+        {
+          if (!live(*column, now))
+          {
+            continue;
+          }
+
+          if (!column->deleted)
+          {
+            encode_put(record, table->first, row->first, *column);
+          }
+          else
+          {
+            encode_delete(record,
+                          column->name.empty() ? DELETE_ROW : DELETE_COLUMN,
+                          table->first,
+                          row->first,
+                          column->name,
+                          column->timestamp);
+          }
+        }
+
+        if (record.length() >= SNAPSHOT_RECORD_BYTES)
+        {
+          ok = write_record(fd, record);
+          record.clear();
+        }
+      }
+    }
+  }
+
+  if (ok && !record.empty())
+  {
+    ok = write_record(fd, record);
+  }
+
+  ok = ok && (fdatasync(fd) == 0);
+  close(fd);
+
+  if (!ok || (rename(tmp_path.c_str(), path.c_str()) != 0))
+  {
+    TRC_ERROR("Failed to write embedded store snapshot %s: %s", path.c_str(), strerror(errno));
+    unlink(tmp_path.c_str());
+    return false;
+  }
+
+  TRC_INFO("Wrote embedded store snapshot %s", path.c_str());
+
+  // The snapshot contains everything in the old log.  If we fail before
+  // removing it, it is replayed over the snapshot on the next start-up,
+  // which is harmless.
+  unlink((_dir + "/" + OLD_LOG_FILE).c_str());
+  return true;
+}
+
+bool EmbeddedStore::open_log(uint64_t length)
+{
+  std::string path = _dir + "/" + LOG_FILE;
+
+  if (_log_fd >= 0)
+  {
+    close(_log_fd);
+    _log_fd = -1;
+  }
+
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0)
+  {
+    TRC_ERROR("Failed to open %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  // Truncate any torn record at the end of the log, or the whole log if it
+  // is being restarted.
+  if (length < FILE_MAGIC.length())
+  {
+    length = 0;
+  }
+
+  if ((ftruncate(fd, length) != 0) ||
+      ((length == 0) && !write_all(fd, FILE_MAGIC.data(), FILE_MAGIC.length())))
+  {
+    TRC_ERROR("Failed to initialize %s: %s", path.c_str(), strerror(errno));
+    close(fd);
+    return false;
+  }
+
+  _log_fd = fd;
+  _log_bytes = (length > 0) ? length - FILE_MAGIC.length() : 0;
+  _next_snapshot_log_bytes = _snapshot_log_bytes;
+  return true;
+}
+
+EmbeddedStore::Row::iterator EmbeddedStore::find_column(Row& row, const std::string& name)
+{
+  return std::lower_bound(row.begin(),
+                          row.end(),
+                          name,
+                          [](const StoredColumn& c, const std::string& n) { return c.name < n; });
+}
+
+int64_t EmbeddedStore::token(const std::string& key)
+{
+  // FNV-1a, which is stable across runs (unlike std::hash) so that a scan
+  // can be resumed from a key.  The minimum token is reserved for the start
+  // of the ring, as in Cassandra.
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t ii = 0; ii < key.size(); ++ii)
+  {
+    hash ^= (uint8_t)key[ii];
+    hash *= 1099511628211ULL;
+  }
+
+  int64_t result = (int64_t)hash;
+  return (result == std::numeric_limits<int64_t>::min()) ?
+         std::numeric_limits<int64_t>::max() : result;
+}
+
+bool EmbeddedStore::live(const StoredColumn& column, time_t now)
+{
+  return (column.expiry == 0) || (column.expiry > now);
+}
+
+bool EmbeddedStore::visible(const StoredColumn& column, time_t now)
+{
+  return (!column.deleted) && live(column, now);
+}
+
+int64_t EmbeddedStore::tombstone_expiry(int64_t timestamp)
+{
+  return (timestamp / 1000000) + TOMBSTONE_GC_GRACE_S;
+}
+
+void EmbeddedStore::to_thrift(ColumnOrSuperColumn& cosc,
+                              const StoredColumn& column,
+                              time_t now)
+{
+  cosc.__isset.column = true;
+  cosc.column.__set_name(column.name);
+  cosc.column.__set_value(column.value);
+  cosc.column.__set_timestamp(column.timestamp);
+
+  if (column.expiry != 0)
+  {
+    cosc.column.__set_ttl(column.expiry - now);
+  }
+}
+
+void EmbeddedStore::slice_row(std::vector<ColumnOrSuperColumn>& _return,
+                              Row& row,
+                              const SlicePredicate& predicate,
+                              time_t now)
+{
+  if (predicate.__isset.column_names)
+  {
+    for (std::vector<std::string>::const_iterator name = predicate.column_names.begin();
+         name != predicate.column_names.end();
+         ++name)
+    {
+      Row::iterator column = find_column(row, *name);
+
+      if ((column != row.end()) && (column->name == *name) && visible(*column, now))
+      {
+        _return.push_back(ColumnOrSuperColumn());
+        to_thrift(_return.back(), *column, now);
+      }
+    }
+  }
+  else
+  {
+    // A slice range.  An empty start or finish means the range is unbounded
+    // at that end.
+    const SliceRange& range = predicate.slice_range;
+    Row::iterator column = range.start.empty() ? row.begin() :
+                                                 find_column(row, range.start);
+
+    for (;
+         (column != row.end()) && (_return.size() < (size_t)range.count);
+         ++column)
+    {
+      if (!range.finish.empty() && (column->name > range.finish))
+      {
+        break;
+      }
+
+      if (visible(*column, now))
+      {
+        _return.push_back(ColumnOrSuperColumn());
+        to_thrift(_return.back(), *column, now);
+      }
+    }
+  }
+}
@@ -34,11 +34,14 @@
  * as those licenses appear in the file LICENSE-OPENSSL.
  */
 
+#include <unistd.h>
+
 #include "handlers.h"
 #include "xmlutils.h"
 #include "servercapabilities.h"
 #include "homesteadsasevent.h"
 #include "snmp_cx_counter_table.h"
+#include "sas_reporter.h"
 
 #include "log.h"
 
@@ -57,7 +60,19 @@ std::string HssCacheTask::_configured_server_name;
 Cx::Dictionary* HssCacheTask::_dict;
 Cache* HssCacheTask::_cache = NULL;
 StatisticsManager* HssCacheTask::_stats_manager = NULL;
+HotSubscribers* HssCacheTask::_hot_subscribers = NULL;
+NegativeCache* HssCacheTask::_negative_cache = NULL;
+AnswerCache* HssCacheTask::_location_info_cache = NULL;
+AnswerCache* HssCacheTask::_registration_status_cache = NULL;
+ResponseCompressor* HssCacheTask::_response_compressor = NULL;
+AssocImpuWriter* HssCacheTask::_assoc_impu_writer = NULL;
+RegDataRefresher* HssCacheTask::_reg_data_refresher = NULL;
 HealthChecker* HssCacheTask::_health_checker = NULL;
+std::atomic<bool> HssCacheTask::_draining(false);
+std::atomic<int> HssCacheTask::_in_flight(0);
+
+// How often to check whether requests have drained during shutdown.
+const static useconds_t DRAIN_POLL_INTERVAL_US = 10000;
 
 const static HssCacheTask::StatsFlags DIGEST_STATS =
   static_cast<HssCacheTask::StatsFlags>(
@@ -108,6 +123,251 @@ void HssCacheTask::configure_stats(StatisticsManager* stats_manager)
   _stats_manager = stats_manager;
 }
 
+void HssCacheTask::configure_hot_subscribers(HotSubscribers* hot_subscribers)
+{
+  _hot_subscribers = hot_subscribers;
+}
+
+bool HssCacheTask::admit_subscriber(HotSubscribers::Endpoint endpoint,
+                                    const std::string& id)
+{
+  return (_hot_subscribers == NULL) || _hot_subscribers->record(endpoint, id);
+}
+
+void HssCacheTask::configure_negative_cache(NegativeCache* negative_cache)
+{
+  _negative_cache = negative_cache;
+}
+
+bool HssCacheTask::is_user_unknown(NegativeCache::Command command,
+                                   const std::string& id,
+                                   const std::string& other_id)
+{
+  if ((_negative_cache != NULL) &&
+      (_negative_cache->contains(command, id, other_id)))
+  {
+    TRC_DEBUG("HSS recently reported %s (%s) as unknown - not sending %s",
+              id.c_str(),
+              other_id.c_str(),
+              NegativeCache::command_name(command));
+    return true;
+  }
+
+  return false;
+}
+
+void HssCacheTask::record_user_unknown(NegativeCache::Command command,
+                                       const std::string& id,
+                                       const std::string& other_id)
+{
+  if (_negative_cache != NULL)
+  {
+    _negative_cache->add(command, id, other_id);
+  }
+}
+
+void HssCacheTask::forget_user_unknown(const std::string& id)
+{
+  if (_negative_cache != NULL)
+  {
+    _negative_cache->invalidate(id);
+  }
+}
+
+void HssCacheTask::configure_location_info_cache(AnswerCache* location_info_cache)
+{
+  _location_info_cache = location_info_cache;
+}
+
+void HssCacheTask::configure_registration_status_cache(AnswerCache* registration_status_cache)
+{
+  _registration_status_cache = registration_status_cache;
+}
+
+void HssCacheTask::configure_response_compressor(ResponseCompressor* response_compressor)
+{
+  _response_compressor = response_compressor;
+}
+
+void HssCacheTask::configure_assoc_impu_writer(AssocImpuWriter* assoc_impu_writer)
+{
+  _assoc_impu_writer = assoc_impu_writer;
+}
+
+void HssCacheTask::configure_reg_data_refresher(RegDataRefresher* reg_data_refresher)
+{
+  _reg_data_refresher = reg_data_refresher;
+}
+
+void HssCacheTask::forget_location_info(const std::vector<std::string>& impus)
+{
+  if (_location_info_cache != NULL)
+  {
+    for (std::vector<std::string>::const_iterator it = impus.begin();
+         it != impus.end();
+         ++it)
+    {
+      _location_info_cache->invalidate(*it);
+    }
+  }
+}
+
+void HssCacheTask::forget_registration_status(const std::vector<std::string>& impis)
+{
+  if (_registration_status_cache != NULL)
+  {
+    for (std::vector<std::string>::const_iterator it = impis.begin();
+         it != impis.end();
+         ++it)
+    {
+      _registration_status_cache->invalidate(*it);
+    }
+  }
+}
+
+void HssCacheTask::record_stage_latency(StatisticsManager::Stage stage,
+                                        unsigned long latency_us)
+{
+  if (_stats_manager != NULL)
+  {
+    _stats_manager->update_stage_latency_us(stage, latency_us);
+  }
+}
+
+void HssCacheTask::send_http_reply(int status_code)
+{
+  Utils::StopWatch stopwatch;
+  stopwatch.start();
+
+  HttpStackUtils::Task::send_http_reply(status_code);
+
+  unsigned long latency_us = 0;
+  if (stopwatch.read(latency_us))
+  {
+    record_stage_latency(StatisticsManager::STAGE_REPLY, latency_us);
+  }
+}
+
+// Add the suffix for a content encoding to an entity tag.  The tag is
+// strong, so each encoding of a document needs a different one.
+static std::string encoded_etag(const std::string& etag,
+                                ResponseCompressor::Encoding encoding)
+{
+  std::string encoded = etag;
+  if ((encoding != ResponseCompressor::IDENTITY) && (!encoded.empty()))
+  {
+    encoded.insert(encoded.size() - 1,
+                   std::string("-") + ResponseCompressor::encoding_name(encoding));
+  }
+  return encoded;
+}
+
+void HssCacheTask::add_reply_content(const std::string& body,
+                                     const std::string& id,
+                                     const std::string& version,
+                                     const std::string& etag)
+{
+  ResponseCompressor::Encoding encoding = ResponseCompressor::IDENTITY;
+  std::string compressed;
+
+  if (_response_compressor != NULL)
+  {
+    encoding =
+      ResponseCompressor::choose_encoding(_req.header("Accept-Encoding"));
+    add_vary_header();
+
+    if (!_response_compressor->compress(body, encoding, id, version, compressed))
+    {
+      encoding = ResponseCompressor::IDENTITY;
+    }
+  }
+
+  if (!etag.empty())
+  {
+    _req.add_header(HEADER_ETAG, encoded_etag(etag, encoding));
+  }
+
+  if (encoding != ResponseCompressor::IDENTITY)
+  {
+    _req.add_header("Content-Encoding",
+                    ResponseCompressor::encoding_name(encoding));
+    _req.add_content(compressed);
+  }
+  else
+  {
+    _req.add_content(body);
+  }
+}
+
+void HssCacheTask::add_vary_header()
+{
+  // The body depends on the Accept-Encoding header, so tell any caches.
+  if (_response_compressor != NULL)
+  {
+    _req.add_header("Vary", "Accept-Encoding");
+  }
+}
+
+bool HssCacheTask::reply_needs_version(const std::string& body)
+{
+  return ((_response_compressor != NULL) &&
+          (_response_compressor->will_cache(
+             body.size(),
+             ResponseCompressor::choose_encoding(_req.header("Accept-Encoding")))));
+}
+
+void HssCacheTask::start_draining()
+{
+  TRC_STATUS("Draining %d requests in progress", (int)_in_flight);
+  _draining = true;
+}
+
+void HssCacheTask::stop_draining()
+{
+  _draining = false;
+}
+
+bool HssCacheTask::is_draining()
+{
+  return _draining;
+}
+
+bool HssCacheTask::drain(unsigned long timeout_ms)
+{
+  Utils::StopWatch stopwatch;
+  stopwatch.start();
+  unsigned long elapsed_us = 0;
+
+  while (_in_flight > 0)
+  {
+    if ((!stopwatch.read(elapsed_us)) || (elapsed_us >= timeout_ms * 1000))
+    {
+      TRC_WARNING("%d requests still in progress after %lums",
+                  (int)_in_flight, timeout_ms);
+      return false;
+    }
+
+    usleep(DRAIN_POLL_INTERVAL_US);
+  }
+
+  TRC_STATUS("Drained requests in progress");
+  return true;
+}
+
+void DrainingHandler::process_request(HttpStack::Request& req, SAS::TrailId trail)
+{
+  ThreadPlacement::place_current_thread(ThreadPlacement::HTTP);
+
+  if (HssCacheTask::is_draining())
+  {
+    TRC_DEBUG("Rejecting request for %s while draining", req.full_path().c_str());
+    req.send_reply(HTTP_SERVER_UNAVAILABLE, trail);
+    return;
+  }
+
+  _handler->process_request(req, trail);
+}
+
 void HssCacheTask::on_diameter_timeout()
 {
   send_http_reply(HTTP_GATEWAY_TIMEOUT);
@@ -116,26 +376,39 @@ void HssCacheTask::on_diameter_timeout()
 
 // Common SAS log function
 
-static void sas_log_get_reg_data_success(Cache::GetRegData* get_reg_data, SAS::TrailId trail)
+static void sas_log_get_reg_data_success(const Cache::GetRegData::Result& result,
+                                         SAS::TrailId trail)
 {
-  std::string xml;
-  int32_t ttl;
+  DeferredSasEvent event(trail, SASEvent::CACHE_GET_REG_DATA_SUCCESS, 0);
+  event.add_compressed_param(result.xml, &SASEvent::PROFILE_SERVICE_PROFILE);
+  event.add_static_param(result.state);
+  event.add_var_param(boost::algorithm::join(result.impis, ", "));
+  event.add_var_param(result.charging_addrs.log_string());
+  event.report();
+}
+
+static void sas_log_get_reg_data_success(Cache::GetRegData* get_reg_data,
+                                         SAS::TrailId trail)
+{
+  // Read the fields individually so that the subscription is shared with
+  // the cache operation rather than copied into a Result.
   RegistrationState state;
-  std::vector<std::string> associated_impis;
+  SharedPayload xml;
+  std::vector<std::string> impis;
   ChargingAddresses charging_addrs;
+  int32_t unused_ttl;
 
-  get_reg_data->get_xml(xml, ttl);
-  get_reg_data->get_registration_state(state, ttl);
-  get_reg_data->get_associated_impis(associated_impis);
+  get_reg_data->get_registration_state(state, unused_ttl);
+  get_reg_data->get_shared_xml(xml, unused_ttl);
+  get_reg_data->get_associated_impis(impis);
   get_reg_data->get_charging_addrs(charging_addrs);
 
-  SAS::Event event(trail, SASEvent::CACHE_GET_REG_DATA_SUCCESS, 0);
+  DeferredSasEvent event(trail, SASEvent::CACHE_GET_REG_DATA_SUCCESS, 0);
   event.add_compressed_param(xml, &SASEvent::PROFILE_SERVICE_PROFILE);
   event.add_static_param(state);
-  std::string associated_impis_str = boost::algorithm::join(associated_impis, ", ");
-  event.add_var_param(associated_impis_str);
+  event.add_var_param(boost::algorithm::join(impis, ", "));
   event.add_var_param(charging_addrs.log_string());
-  SAS::report_event(event);
+  event.report();
 }
 
 // General IMPI handling.
@@ -146,6 +419,13 @@ void ImpiTask::run()
   {
     TRC_DEBUG("Parsed HTTP request: private ID %s, public ID %s, scheme %s, authorization %s",
               _impi.c_str(), _impu.c_str(), _scheme.c_str(), _authorization.c_str());
+    if (!admit_subscriber(hot_subscriber_endpoint(), _impi))
+    {
+      send_http_reply(HTTP_SERVER_UNAVAILABLE);
+      delete this;
+      return;
+    }
+
     if (_cfg->query_cache_av)
     {
       query_cache_av();
@@ -180,7 +460,9 @@ void ImpiTask::query_cache_av()
   CassandraStore::Transaction* tsx =
     new CacheTransaction(this,
                          &ImpiTask::on_get_av_success,
-                         &ImpiTask::on_get_av_failure);
+                         &ImpiTask::on_get_av_failure,
+                         StatisticsManager::STAGE_CACHE_READ,
+                         Cache::OP_GET_AUTH_VECTOR);
   _cache->do_async(get_av, tsx);
 }
 
@@ -262,7 +544,9 @@ void ImpiTask::query_cache_impu()
   CassandraStore::Transaction* tsx =
     new CacheTransaction(this,
                          &ImpiTask::on_get_impu_success,
-                         &ImpiTask::on_get_impu_failure);
+                         &ImpiTask::on_get_impu_failure,
+                         StatisticsManager::STAGE_CACHE_READ,
+                         Cache::OP_GET_ASSOCIATED_PUBLIC_IDS);
   _cache->do_async(get_public_ids, tsx);
 }
 
@@ -320,6 +604,13 @@ void ImpiTask::on_get_impu_failure(CassandraStore::Operation* op, CassandraStore
 
 void ImpiTask::send_mar()
 {
+  if (is_user_unknown(NegativeCache::MAR, _impi, _impu))
+  {
+    send_http_reply(HTTP_NOT_FOUND);
+    delete this;
+    return;
+  }
+
   Cx::MultimediaAuthRequest mar(_dict,
                                 _diameter_stack,
                                 _dest_realm,
@@ -359,16 +650,28 @@ void ImpiTask::on_mar_response(Diameter::Message& rsp)
           event.add_var_param(_impu);
           SAS::report_event(event);
 
-          CassandraStore::Operation* put_public_id =
-            _cache->create_PutAssociatedPublicID(_impi,
-                                                 _impu,
-                                                 Cache::generate_timestamp(),
-                                                 _cfg->impu_cache_ttl);
-          CassandraStore::Transaction* tsx = new CacheTransaction(this,
-                        &ImpiTask::on_put_assoc_impu_success,
-                        &ImpiTask::on_put_assoc_impu_failure);
-          _cache->do_async(put_public_id, tsx);
-          updating_assoc_public_ids = true;
+          if ((_assoc_impu_writer != NULL) &&
+              (_assoc_impu_writer->write(_impi, _impu, _cfg->impu_cache_ttl, trail())))
+          {
+            // The association is written in the background, so there's no
+            // need to wait for it before replying.
+            send_reply(_maa->digest_auth_vector());
+          }
+          else
+          {
+            CassandraStore::Operation* put_public_id =
+              _cache->create_PutAssociatedPublicID(_impi,
+                                                   _impu,
+                                                   Cache::generate_timestamp(),
+                                                   _cfg->impu_cache_ttl);
+            CassandraStore::Transaction* tsx = new CacheTransaction(this,
+                          &ImpiTask::on_put_assoc_impu_success,
+                          &ImpiTask::on_put_assoc_impu_failure,
+                          StatisticsManager::STAGE_CACHE_WRITE,
+                          Cache::OP_PUT_ASSOCIATED_PUBLIC_ID);
+            _cache->do_async(put_public_id, tsx);
+            updating_assoc_public_ids = true;
+          }
         }
         else
         {
@@ -399,6 +702,7 @@ void ImpiTask::on_mar_response(Diameter::Message& rsp)
       TRC_INFO("Multimedia-Auth answer with result code %d - reject", result_code);
       SAS::Event event(this->trail(), SASEvent::NO_AV_HSS, 0);
       SAS::report_event(event);
+      record_user_unknown(NegativeCache::MAR, _impi, _impu);
       send_http_reply(HTTP_NOT_FOUND);
     }
     break;
@@ -590,6 +894,36 @@ void ImpiRegistrationStatusTask::run()
     TRC_DEBUG("Parsed HTTP request: private ID %s, public ID %s, visited network %s, authorization type %s",
               _impi.c_str(), _impu.c_str(), _visited_network.c_str(), _authorization_type.c_str());
 
+    if (!admit_subscriber(HotSubscribers::IMPI_REG_STATUS, _impi))
+    {
+      send_http_reply(HTTP_SERVER_UNAVAILABLE);
+      delete this;
+      return;
+    }
+
+    if (is_user_unknown(NegativeCache::UAR, _impi, _impu))
+    {
+      send_http_reply(HTTP_NOT_FOUND);
+      delete this;
+      return;
+    }
+
+    // De-registrations must always be authorized by the HSS.
+    std::string cached_body;
+    if ((_registration_status_cache != NULL) &&
+        (_authorization_type != "DEREG") &&
+        (_registration_status_cache->get(_impi,
+                                         AnswerCache::make_params(_impu,
+                                                                  _visited_network,
+                                                                  _authorization_type),
+                                         cached_body)))
+    {
+      _req.add_content(cached_body);
+      send_http_reply(HTTP_OK);
+      delete this;
+      return;
+    }
+
     Cx::UserAuthorizationRequest uar(_dict,
                                      _diameter_stack,
                                      _dest_host,
@@ -678,6 +1012,19 @@ void ImpiRegistrationStatusTask::on_uar_response(Diameter::Message& rsp)
       server_capabilities.write_capabilities(&writer);
     }
     writer.EndObject();
+    // Only cache answers for subscribers that are already registered - these
+    // are the periodic re-registrations.  An answer for a first registration
+    // is out of date as soon as the S-CSCF has been assigned.
+    if ((_registration_status_cache != NULL) &&
+        (_authorization_type != "DEREG") &&
+        (experimental_result_code == DIAMETER_SUBSEQUENT_REGISTRATION))
+    {
+      _registration_status_cache->put(_impi,
+                                      AnswerCache::make_params(_impu,
+                                                               _visited_network,
+                                                               _authorization_type),
+                                      sb.GetString());
+    }
     _req.add_content(sb.GetString());
     send_http_reply(HTTP_OK);
     if (_health_checker)
@@ -690,6 +1037,10 @@ void ImpiRegistrationStatusTask::on_uar_response(Diameter::Message& rsp)
   {
     TRC_INFO("User unknown or public/private ID conflict - reject");
     sas_log_hss_failure(result_code, experimental_result_code);
+    if (experimental_result_code == DIAMETER_ERROR_USER_UNKNOWN)
+    {
+      record_user_unknown(NegativeCache::UAR, _impi, _impu);
+    }
     send_http_reply(HTTP_NOT_FOUND);
   }
   else if ((result_code == DIAMETER_AUTHORIZATION_REJECTED) ||
@@ -744,6 +1095,13 @@ void ImpuLocationInfoTask::run()
   std::string path = _req.path();
   _impu = path.substr(prefix.length(), path.find_first_of("/", prefix.length()) - prefix.length());
 
+  if (!admit_subscriber(HotSubscribers::IMPU_LOC_INFO, _impu))
+  {
+    send_http_reply(HTTP_SERVER_UNAVAILABLE);
+    delete this;
+    return;
+  }
+
   if (_cfg->hss_configured)
   {
     _originating = _req.param("originating");
@@ -751,6 +1109,26 @@ void ImpuLocationInfoTask::run()
     TRC_DEBUG("Parsed HTTP request: public ID %s, originating %s, authorization type %s",
               _impu.c_str(), _originating.c_str(), _authorization_type.c_str());
 
+    if (is_user_unknown(NegativeCache::LIR, _impu))
+    {
+      send_http_reply(HTTP_NOT_FOUND);
+      delete this;
+      return;
+    }
+
+    std::string cached_body;
+    if ((_location_info_cache != NULL) &&
+        (_location_info_cache->get(_impu,
+                                   AnswerCache::make_params(_originating,
+                                                            _authorization_type),
+                                   cached_body)))
+    {
+      _req.add_content(cached_body);
+      send_http_reply(HTTP_OK);
+      delete this;
+      return;
+    }
+
     Cx::LocationInfoRequest lir(_dict,
                                 _diameter_stack,
                                 _dest_host,
@@ -825,6 +1203,13 @@ void ImpuLocationInfoTask::on_lir_response(Diameter::Message& rsp)
       server_capabilities.write_capabilities(&writer);
     }
     writer.EndObject();
+    if (_location_info_cache != NULL)
+    {
+      _location_info_cache->put(_impu,
+                                AnswerCache::make_params(_originating,
+                                                         _authorization_type),
+                                sb.GetString());
+    }
     _req.add_content(sb.GetString());
     send_http_reply(HTTP_OK);
   }
@@ -833,6 +1218,10 @@ void ImpuLocationInfoTask::on_lir_response(Diameter::Message& rsp)
   {
     TRC_INFO("User unknown or public/private ID conflict - reject");
     sas_log_hss_failure(result_code, experimental_result_code);
+    if (experimental_result_code == DIAMETER_ERROR_USER_UNKNOWN)
+    {
+      record_user_unknown(NegativeCache::LIR, _impu);
+    }
     send_http_reply(HTTP_NOT_FOUND);
   }
   else if (result_code == DIAMETER_TOO_BUSY)
@@ -880,7 +1269,9 @@ void ImpuLocationInfoTask::query_cache_reg_data()
   CassandraStore::Transaction* tsx =
     new CacheTransaction(this,
                          &ImpuLocationInfoTask::on_get_reg_data_success,
-                         &ImpuLocationInfoTask::on_get_reg_data_failure);
+                         &ImpuLocationInfoTask::on_get_reg_data_failure,
+                         StatisticsManager::STAGE_CACHE_READ,
+                         Cache::OP_GET_REG_DATA);
   _cache->do_async(get_reg_data, tsx);
 }
 
@@ -1079,6 +1470,13 @@ void ImpuRegDataTask::run()
   TRC_DEBUG("Parsed HTTP request: private ID %s, public ID %s, server name %s",
             _impi.c_str(), _impu.c_str(), _provided_server_name.c_str());
 
+  if (!admit_subscriber(HotSubscribers::IMPU_REG_DATA, _impu))
+  {
+    send_http_reply(HTTP_SERVER_UNAVAILABLE);
+    delete this;
+    return;
+  }
+
   htp_method method = _req.method();
 
   // Police preconditions:
@@ -1123,7 +1521,9 @@ void ImpuRegDataTask::run()
   CassandraStore::Transaction* tsx =
     new CacheTransaction(this,
                          &ImpuRegDataTask::on_get_reg_data_success,
-                         &ImpuRegDataTask::on_get_reg_data_failure);
+                         &ImpuRegDataTask::on_get_reg_data_failure,
+                         StatisticsManager::STAGE_CACHE_READ,
+                         Cache::OP_GET_REG_DATA);
   _cache->do_async(get_reg_data, tsx);
 }
 
@@ -1150,14 +1550,14 @@ void ImpuRegDataTask::on_get_reg_data_success(CassandraStore::Operation* op)
 
   std::vector<std::string> associated_impis;
   int32_t ttl = 0;
-  get_reg_data->get_xml(_xml, ttl);
+  get_reg_data->get_shared_xml(_xml, ttl);
   get_reg_data->get_registration_state(_original_state, ttl);
   get_reg_data->get_associated_impis(associated_impis);
   get_reg_data->get_charging_addrs(_charging_addrs);
   bool new_binding = false;
   TRC_DEBUG("TTL for this database record is %d, IMS Subscription XML is %s, registration state is %s, and the charging addresses are %s",
             ttl,
-            _xml.empty() ? "empty" : "not empty",
+            _xml->empty() ? "empty" : "not empty",
             regstate_to_str(_original_state).c_str(),
             _charging_addrs.empty() ? "empty" : _charging_addrs.log_string().c_str());
 
@@ -1179,9 +1579,9 @@ void ImpuRegDataTask::on_get_reg_data_success(CassandraStore::Operation* op)
   // we have a record of this binding.
   if (_impi.empty())
   {
-    _impi = XmlUtils::get_private_id(_xml);
+    _impi = xml_private_id();
   }
-  else if ((!_xml.empty()) &&
+  else if ((!_xml->empty()) &&
            ((associated_impis.empty()) ||
             (std::find(associated_impis.begin(), associated_impis.end(), _impi) == associated_impis.end())))
   {
@@ -1199,13 +1599,15 @@ void ImpuRegDataTask::on_get_reg_data_success(CassandraStore::Operation* op)
       TRC_DEBUG("Associating private identity %s to IRS for %s",
                 _impi.c_str(),
                 _impu.c_str());
-      std::vector<std::string> public_ids = XmlUtils::get_public_ids(_xml);
+      const std::vector<std::string>& public_ids = xml_public_ids();
       CassandraStore::Operation* put_associated_private_id =
         _cache->create_PutAssociatedPrivateID(public_ids,
                                               _impi,
                                               Cache::generate_timestamp(),
                                               _cfg->record_ttl);
-      CassandraStore::Transaction* tsx = new CacheTransaction;
+      CassandraStore::Transaction* tsx =
+        new CacheTransaction(StatisticsManager::STAGE_CACHE_WRITE,
+                             Cache::OP_PUT_ASSOCIATED_PRIVATE_ID);
 
       // TODO: Technically, we should be blocking our response until this PUT
       // has completed (in case the client relies on it having been done by the
@@ -1237,8 +1639,17 @@ void ImpuRegDataTask::on_get_reg_data_success(CassandraStore::Operation* op)
         //
         // Alternatively we need to notify the HSS if the HTTP request does not
         // allow cached responses.
+        //
+        // If the record isn't close to expiring we can answer from the cache
+        // and tell the HSS in the background, unless the request does not
+        // allow cached responses.
         if (record_age >= _cfg->hss_reregistration_time)
         {
+          if ((!cache_not_allowed) && (refresh_ahead(ttl)))
+          {
+            return;
+          }
+
           TRC_DEBUG("Sending re-registration to HSS as %d seconds have passed",
                     record_age, _cfg->hss_reregistration_time);
           send_server_assignment_request(Cx::ServerAssignmentType::RE_REGISTRATION);
@@ -1437,9 +1848,122 @@ void ImpuRegDataTask::on_get_reg_data_success(CassandraStore::Operation* op)
   }
 }
 
+// Fold a string into a 64-bit FNV-1a hash.  This is used rather than
+// std::hash so that every Homestead node generates the same entity tags.
+static uint64_t fnv1a_hash(uint64_t hash, const std::string& str)
+{
+  for (std::string::const_iterator it = str.begin(); it != str.end(); ++it)
+  {
+    hash ^= (unsigned char)*it;
+    hash *= 1099511628211ULL;
+  }
+
+  // Separate this string from the next one, so that moving characters
+  // between fields changes the hash.
+  hash ^= 0xff;
+  hash *= 1099511628211ULL;
+  return hash;
+}
+
+std::string ImpuRegDataTask::reg_data_etag(RegistrationState state,
+                                           const std::string& xml,
+                                           const ChargingAddresses& charging_addrs)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  hash = fnv1a_hash(hash, regstate_to_str(state));
+  hash = fnv1a_hash(hash, xml);
+
+  for (ChargingFunctions::const_iterator ccf = charging_addrs.ccfs.begin();
+       ccf != charging_addrs.ccfs.end();
+       ++ccf)
+  {
+    hash = fnv1a_hash(hash, *ccf);
+  }
+
+  hash = fnv1a_hash(hash, "");
+
+  for (ChargingFunctions::const_iterator ecf = charging_addrs.ecfs.begin();
+       ecf != charging_addrs.ecfs.end();
+       ++ecf)
+  {
+    hash = fnv1a_hash(hash, *ecf);
+  }
+
+  char etag[20];
+  snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)hash);
+  return etag;
+}
+
+std::string ImpuRegDataTask::current_etag(bool json)
+{
+  // The XML and JSON forms of the document need different entity tags.
+  std::string etag = reg_data_etag(_new_state, *_xml, _charging_addrs);
+  if (json)
+  {
+    etag.insert(etag.size() - 1, "-json");
+  }
+  return etag;
+}
+
+// Check whether an If-None-Match header value lists an entity tag, in any
+// content encoding.  If so, matched_etag is set to the listed tag.  Weak
+// comparison is used, as allowed for If-None-Match by RFC 7232.
+static bool etag_matches(const std::string& if_none_match,
+                         const std::string& etag,
+                         std::string& matched_etag)
+{
+  std::vector<std::string> tags;
+  Utils::split_string(if_none_match, ',', tags, 0, true);
+
+  for (std::vector<std::string>::iterator tag = tags.begin();
+       tag != tags.end();
+       ++tag)
+  {
+    if (tag->compare(0, 2, "W/") == 0)
+    {
+      tag->erase(0, 2);
+    }
+
+    if (*tag == "*")
+    {
+      matched_etag = etag;
+      return true;
+    }
+
+    if ((*tag == etag) ||
+        (*tag == encoded_etag(etag, ResponseCompressor::GZIP)) ||
+        (*tag == encoded_etag(etag, ResponseCompressor::DEFLATE)))
+    {
+      matched_etag = *tag;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Check whether an Accept header asks for JSON.  Sprout only sends
+// application/json if it wants it, so there's no need to weigh it against
+// other media types.
+static bool accepts_json(const std::string& accept)
+{
+  size_t pos = accept.find(CONTENT_TYPE_JSON);
+
+  if (pos == std::string::npos)
+  {
+    return false;
+  }
+
+  // Honour an explicit refusal, i.e. "application/json;q=0".
+  size_t end = accept.find(',', pos);
+  std::string range = accept.substr(pos, (end == std::string::npos) ? end : end - pos);
+  size_t q = range.find("q=");
+  return ((q == std::string::npos) || (atof(range.c_str() + q + 2) > 0));
+}
+
 void ImpuRegDataTask::send_reply()
 {
-  std::string xml_str;
+  std::string reg_data_str;
   int rc;
 
   // Check whether we have a saved failure return code
@@ -1449,20 +1973,78 @@ void ImpuRegDataTask::send_reply()
   }
   else
   {
-    rc = XmlUtils::build_ClearwaterRegData_xml(_new_state,
-                                               _xml,
-                                               _charging_addrs,
-                                               xml_str);
+    // Sprout can ask for the compact JSON form of the document instead of
+    // the XML one.
+    bool json = accepts_json(_req.header("Accept"));
+
+    // The entity tag means hashing the whole document, so it's only worked
+    // out for conditional requests, or if the compressed body is cached
+    // against it (below).
+    std::string etag;
+    std::string if_none_match = _req.header(HEADER_IF_NONE_MATCH);
+
+    if ((_req.method() == htp_method_GET) && (!if_none_match.empty()))
+    {
+      etag = current_etag(json);
+
+      // If Sprout already has this version of the document, in whatever
+      // encoding, there's no need to render or send it again.  The 304
+      // carries the tag Sprout has, and the same Vary header as a 200.
+      std::string matched_etag;
+      if (etag_matches(if_none_match, etag, matched_etag))
+      {
+        TRC_DEBUG("Registration data unchanged (ETag %s) - sending 304",
+                  matched_etag.c_str());
+        _req.add_header(HEADER_ETAG, matched_etag);
+        add_vary_header();
+        send_http_reply(HTTP_NOT_MODIFIED);
+        return;
+      }
+    }
+
+    Utils::StopWatch stopwatch;
+    stopwatch.start();
+
+    if (json)
+    {
+      rc = XmlUtils::build_ClearwaterRegData_json(_new_state,
+                                                  *_xml,
+                                                  _charging_addrs,
+                                                  reg_data_str);
+    }
+    else
+    {
+      rc = XmlUtils::build_ClearwaterRegData_xml(_new_state,
+                                                 *_xml,
+                                                 _charging_addrs,
+                                                 reg_data_str);
+    }
+
+    unsigned long render_us = 0;
+    if (stopwatch.read(render_us))
+    {
+      record_stage_latency(StatisticsManager::STAGE_XML_RENDER, render_us);
+    }
 
     if (rc == HTTP_OK)
     {
-      _req.add_content(xml_str);
+      if (json)
+      {
+        _req.add_header("Content-Type", CONTENT_TYPE_JSON);
+      }
+
+      if ((etag.empty()) && (reply_needs_version(reg_data_str)))
+      {
+        etag = current_etag(json);
+      }
+
+      add_reply_content(reg_data_str, _impu, etag, etag);
     }
     else
     {
-      SAS::Event event(this->trail(), SASEvent::REG_DATA_HSS_INVALID, 0);
+      DeferredSasEvent event(this->trail(), SASEvent::REG_DATA_HSS_INVALID, 0);
       event.add_compressed_param(_xml, &SASEvent::PROFILE_SERVICE_PROFILE);
-      SAS::report_event(event);
+      event.report();
     }
   }
 
@@ -1503,6 +2085,18 @@ void ImpuRegDataTask::on_get_reg_data_failure(CassandraStore::Operation* op,
 
 void ImpuRegDataTask::send_server_assignment_request(Cx::ServerAssignmentType type)
 {
+  // Only requests that would assign a new subscriber to us are answered from
+  // the negative cache - the HSS must still be told about deregistrations.
+  if (((type == Cx::ServerAssignmentType::REGISTRATION) ||
+       (type == Cx::ServerAssignmentType::UNREGISTERED_USER)) &&
+      (is_user_unknown(NegativeCache::SAR, _impu, _impi)))
+  {
+    _http_rc = HTTP_NOT_FOUND;
+    send_reply();
+    delete this;
+    return;
+  }
+
   Cx::ServerAssignmentRequest sar(_dict,
                                   _diameter_stack,
                                   _dest_host,
@@ -1517,10 +2111,85 @@ void ImpuRegDataTask::send_server_assignment_request(Cx::ServerAssignmentType ty
                             this,
                             SUBSCRIPTION_STATS,
                             &ImpuRegDataTask::on_sar_response,
-                            sar_results_tbl);
+                            sar_results_tbl,
+                            &ImpuRegDataTask::on_sar_timeout);
   sar.send(tsx, _cfg->diameter_timeout_ms);
 }
 
+void ImpuRegDataTask::on_sar_timeout()
+{
+  if (_refresher == NULL)
+  {
+    on_diameter_timeout();
+  }
+  else if (!retry_refresh())
+  {
+    // The reply has already been sent, so there's nothing more to do.  The
+    // next re-registration will try the HSS again.
+    TRC_WARNING("Timed out refreshing registration data for %s", _impu.c_str());
+    delete this;
+  }
+}
+
+ImpuRegDataTask::~ImpuRegDataTask()
+{
+  if (_refresher != NULL)
+  {
+    _refresher->complete(_impu, _refreshed);
+  }
+}
+
+// Answer a re-registration that needs the HSS to be told about it from the
+// cache, and tell the HSS in the background (if configured, and the record
+// isn't close to expiring).  Returns false if the caller must tell the HSS
+// before replying.
+bool ImpuRegDataTask::refresh_ahead(int ttl)
+{
+  if (_reg_data_refresher == NULL)
+  {
+    return false;
+  }
+
+  RegDataRefresher::Admission admission = _reg_data_refresher->admit(_impu, ttl);
+
+  if (admission == RegDataRefresher::INLINE)
+  {
+    return false;
+  }
+
+  send_reply();
+
+  if (admission == RegDataRefresher::IN_PROGRESS)
+  {
+    // Another request is already refreshing this subscriber.
+    delete this;
+  }
+  else
+  {
+    TRC_DEBUG("Sending re-registration to HSS in the background");
+    _refresher = _reg_data_refresher;
+    send_server_assignment_request(Cx::ServerAssignmentType::RE_REGISTRATION);
+  }
+
+  return true;
+}
+
+// Resend the Server-Assignment request for a background refresh.  Returns
+// false if it has been retried too many times already.
+bool ImpuRegDataTask::retry_refresh()
+{
+  if (_refresh_retries >= _refresher->max_retries())
+  {
+    return false;
+  }
+
+  _refresh_retries++;
+  _refresher->record_retry();
+  TRC_DEBUG("Retrying re-registration to HSS (attempt %d)", _refresh_retries + 1);
+  send_server_assignment_request(Cx::ServerAssignmentType::RE_REGISTRATION);
+  return true;
+}
+
 std::vector<std::string> ImpuRegDataTask::get_associated_private_ids()
 {
   std::vector<std::string> private_ids;
@@ -1529,7 +2198,7 @@ std::vector<std::string> ImpuRegDataTask::get_associated_private_ids()
     TRC_DEBUG("Associated private ID %s", _impi.c_str());
     private_ids.push_back(_impi);
   }
-  std::string xml_impi = XmlUtils::get_private_id(_xml);
+  const std::string& xml_impi = xml_private_id();
   if ((!xml_impi.empty()) && (xml_impi != _impi))
   {
     TRC_DEBUG("Associated private ID %s", xml_impi.c_str());
@@ -1538,6 +2207,31 @@ std::vector<std::string> ImpuRegDataTask::get_associated_private_ids()
   return private_ids;
 }
 
+// Get the public IDs in the IMS subscription.
+const std::vector<std::string>& ImpuRegDataTask::xml_public_ids()
+{
+  parse_xml_ids();
+  return _xml_public_ids;
+}
+
+// Get the private ID embedded in the IMS subscription.
+const std::string& ImpuRegDataTask::xml_private_id()
+{
+  parse_xml_ids();
+  return _xml_private_id;
+}
+
+// Parse the IDs out of the IMS subscription, unless they've already been
+// parsed out of this version of it.
+void ImpuRegDataTask::parse_xml_ids()
+{
+  if (_parsed_xml != _xml)
+  {
+    XmlUtils::get_ids(*_xml, _xml_public_ids, _xml_private_id);
+    _parsed_xml = _xml;
+  }
+}
+
 void ImpuRegDataTask::put_in_cache()
 {
   int ttl;
@@ -1553,11 +2247,11 @@ void ImpuRegDataTask::put_in_cache()
   }
 
   TRC_DEBUG("Attempting to cache IMS subscription for public IDs");
-  std::vector<std::string> public_ids = XmlUtils::get_public_ids(_xml);
+  const std::vector<std::string>& public_ids = xml_public_ids();
   if (!public_ids.empty())
   {
     TRC_DEBUG("Got public IDs to cache against - doing it");
-    for (std::vector<std::string>::iterator i = public_ids.begin();
+    for (std::vector<std::string>::const_iterator i = public_ids.begin();
          i != public_ids.end();
          i++)
     {
@@ -1571,7 +2265,7 @@ void ImpuRegDataTask::put_in_cache()
     {
       bool found_sip_uri = false;
 
-      for (std::vector<std::string>::iterator it = public_ids.begin();
+      for (std::vector<std::string>::const_iterator it = public_ids.begin();
            (it != public_ids.end()) && (!found_sip_uri);
            ++it)
       {
@@ -1585,9 +2279,9 @@ void ImpuRegDataTask::put_in_cache()
       {
         // LCOV_EXCL_START - This is essentially tested in the PPR UTs
         TRC_ERROR("No SIP URI in Implicit Registration Set");
-        SAS::Event event(this->trail(), SASEvent::NO_SIP_URI_IN_IRS, 0);
+        DeferredSasEvent event(this->trail(), SASEvent::NO_SIP_URI_IN_IRS, 0);
         event.add_compressed_param(_xml, &SASEvent::PROFILE_SERVICE_PROFILE);
-        SAS::report_event(event);
+        event.report();
         // LCOV_EXCL_STOP
       }
     }
@@ -1598,15 +2292,13 @@ void ImpuRegDataTask::put_in_cache()
       associated_private_ids = get_associated_private_ids();
     }
 
-    SAS::Event event(this->trail(), SASEvent::CACHE_PUT_REG_DATA, 0);
-    std::string public_ids_str = boost::algorithm::join(public_ids, ", ");
-    event.add_var_param(public_ids_str);
+    DeferredSasEvent event(this->trail(), SASEvent::CACHE_PUT_REG_DATA, 0);
+    event.add_var_param(boost::algorithm::join(public_ids, ", "));
     event.add_compressed_param(_xml, &SASEvent::PROFILE_SERVICE_PROFILE);
     event.add_static_param(_new_state);
-    std::string associated_private_ids_str = boost::algorithm::join(associated_private_ids, ", ");
-    event.add_var_param(associated_private_ids_str);
+    event.add_var_param(boost::algorithm::join(associated_private_ids, ", "));
     event.add_var_param(_charging_addrs.log_string());
-    SAS::report_event(event);
+    event.report();
 
     Cache::PutRegData* put_reg_data = _cache->create_PutRegData(public_ids,
                                                                 Cache::generate_timestamp(),
@@ -1642,14 +2334,20 @@ void ImpuRegDataTask::put_in_cache()
 
     CassandraStore::Transaction* tsx = new CacheTransaction(this,
                                     &ImpuRegDataTask::on_put_reg_data_success,
-                                    &ImpuRegDataTask::on_put_reg_data_failure);
+                                    &ImpuRegDataTask::on_put_reg_data_failure,
+                                    StatisticsManager::STAGE_CACHE_WRITE,
+                                    Cache::OP_PUT_REG_DATA);
     CassandraStore::Operation*& op = (CassandraStore::Operation*&)put_reg_data;
     _cache->do_async(op, tsx);
   }
   else
   {
-    // No need to wait for a cache write.  Just reply inline.
-    send_reply();
+    // No need to wait for a cache write.  Just reply inline (unless we've
+    // already replied).
+    if (_refresher == NULL)
+    {
+      send_reply();
+    }
     delete this;
   }
 }
@@ -1659,7 +2357,14 @@ void ImpuRegDataTask::on_put_reg_data_success(CassandraStore::Operation* op)
   SAS::Event event(this->trail(), SASEvent::CACHE_PUT_REG_DATA_SUCCESS, 0);
   SAS::report_event(event);
 
-  send_reply();
+  if (_refresher == NULL)
+  {
+    send_reply();
+  }
+  else
+  {
+    _refreshed = true;
+  }
 
   delete this;
 }
@@ -1671,8 +2376,13 @@ void ImpuRegDataTask::on_put_reg_data_failure(CassandraStore::Operation* op, Cas
   event.add_var_param(text);
   SAS::report_event(event);
 
-  // Failed to cache Reg Data.  Return an error in the hope that the client might try again
-  send_http_reply(HTTP_SERVER_ERROR);
+  // Failed to cache Reg Data.  Return an error in the hope that the client
+  // might try again (unless we've already replied, in which case the next
+  // re-registration will try again).
+  if (_refresher == NULL)
+  {
+    send_http_reply(HTTP_SERVER_ERROR);
+  }
 
   delete this;
 }
@@ -1686,13 +2396,27 @@ void ImpuRegDataTask::on_sar_response(Diameter::Message& rsp)
   sar_results_tbl->increment(SNMP::DiameterAppId::BASE, result_code);
   TRC_DEBUG("Received Server-Assignment answer with result code %d and experimental result code %d", result_code, experimental_result_code);
 
+  // If we're refreshing in the background and the HSS couldn't be reached,
+  // try again - nobody is waiting for the answer.
+  if ((_refresher != NULL) &&
+      ((result_code == DIAMETER_UNABLE_TO_DELIVER) ||
+       (result_code == DIAMETER_TOO_BUSY)) &&
+      (retry_refresh()))
+  {
+    return;
+  }
+
   switch (result_code)
   {
     case 2001:
+    {
       // Get the charging addresses and user data.
+      std::string user_data;
       saa.charging_addrs(_charging_addrs);
-      saa.user_data(_xml);
+      saa.user_data(user_data);
+      _xml = make_shared_payload(user_data);
       break;
+    }
     case DIAMETER_UNABLE_TO_DELIVER:
       // LCOV_EXCL_START - nothing interesting to UT.
       // This may mean we don't have any Diameter connections. Another Homestead
@@ -1709,9 +2433,20 @@ void ImpuRegDataTask::on_sar_response(Diameter::Message& rsp)
       event.add_static_param(experimental_result_code);
       SAS::report_event(event);
       _http_rc = (result_code == 5001) ? HTTP_NOT_FOUND : HTTP_SERVER_ERROR;
+      if (result_code == 5001)
+      {
+        record_user_unknown(NegativeCache::SAR, _impu, _impi);
+      }
       break;
   }
 
+  // The S-CSCF assigned to this subscriber may have changed, so any cached
+  // location info for the registration set is out of date.
+  std::vector<std::string> assigned_public_ids = xml_public_ids();
+  assigned_public_ids.push_back(_impu);
+  forget_location_info(assigned_public_ids);
+  forget_registration_status(get_associated_private_ids());
+
   // Update the cache if required.
   bool pending_cache_op = false;
   if ((result_code == 2001) &&
@@ -1737,11 +2472,11 @@ void ImpuRegDataTask::on_sar_response(Diameter::Message& rsp)
     // don't want to delete the data (since the new Homestead node will receive
     // the request, not find the subscriber registered in Cassandra and reject
     // the request without trying to notify the HSS).
-    std::vector<std::string> public_ids = XmlUtils::get_public_ids(_xml);
+    const std::vector<std::string>& public_ids = xml_public_ids();
     if (!public_ids.empty())
     {
       TRC_DEBUG("Got public IDs to delete from cache - doing it");
-      for (std::vector<std::string>::iterator i = public_ids.begin();
+      for (std::vector<std::string>::const_iterator i = public_ids.begin();
            i != public_ids.end();
            i++)
       {
@@ -1761,16 +2496,22 @@ void ImpuRegDataTask::on_sar_response(Diameter::Message& rsp)
                                        Cache::generate_timestamp());
       CassandraStore::Transaction* tsx = new CacheTransaction(this,
                                       &ImpuRegDataTask::on_del_impu_success,
-                                      &ImpuRegDataTask::on_del_impu_failure);
+                                      &ImpuRegDataTask::on_del_impu_failure,
+                                      StatisticsManager::STAGE_CACHE_WRITE,
+                                      Cache::OP_DELETE_PUBLIC_IDS);
       _cache->do_async(delete_public_id, tsx);
       pending_cache_op = true;
     }
   }
 
-  // If we're not pending a cache operation, send a reply and delete the task.
+  // If we're not pending a cache operation, send a reply (unless we've
+  // already replied) and delete the task.
   if (!pending_cache_op)
   {
-    send_reply();
+    if (_refresher == NULL)
+    {
+      send_reply();
+    }
     delete this;
   }
   return;
@@ -1841,16 +2582,24 @@ void ImpuIMSSubscriptionTask::run()
   CassandraStore::Transaction* tsx =
     new CacheTransaction(this,
                          &ImpuRegDataTask::on_get_reg_data_success,
-                         &ImpuRegDataTask::on_get_reg_data_failure);
+                         &ImpuRegDataTask::on_get_reg_data_failure,
+                         StatisticsManager::STAGE_CACHE_READ,
+                         Cache::OP_GET_REG_DATA);
   _cache->do_async(get_reg_data, tsx);
 }
 
 void ImpuIMSSubscriptionTask::send_reply()
 {
-  if (_xml != "")
+  if (!_xml->empty())
   {
     TRC_DEBUG("Building 200 OK response to send");
-    _req.add_content(_xml);
+    std::string version;
+    if (reply_needs_version(*_xml))
+    {
+      version = "ims-subscription:" + reg_data_etag(_new_state, *_xml, _charging_addrs);
+    }
+
+    add_reply_content(*_xml, _impu, version);
     send_http_reply(HTTP_OK);
   }
   else
@@ -1860,6 +2609,207 @@ void ImpuIMSSubscriptionTask::send_reply()
   }
 }
 
+//
+// Batched IMPU registration data handling for URLs of the form
+// "/impu/batch/reg-data".
+//
+
+void ImpuRegDataBatchTask::run()
+{
+  if (_req.method() != htp_method_POST)
+  {
+    send_http_reply(HTTP_BADMETHOD);
+    delete this;
+    return;
+  }
+
+  if (!public_ids_from_body(_req.get_rx_body()))
+  {
+    send_http_reply(HTTP_BAD_REQUEST);
+    delete this;
+    return;
+  }
+
+  // Police each public ID against the hot subscriber limits separately, so
+  // that one busy subscriber doesn't fail the whole batch.
+  std::vector<std::string> admitted_impus;
+
+  for (std::vector<std::string>::const_iterator impu = _impus.begin();
+       impu != _impus.end();
+       ++impu)
+  {
+    if (admit_subscriber(HotSubscribers::IMPU_REG_DATA, *impu))
+    {
+      SAS::Event event(this->trail(), SASEvent::CACHE_GET_REG_DATA, 0);
+      event.add_var_param(*impu);
+      SAS::report_event(event);
+      admitted_impus.push_back(*impu);
+    }
+    else
+    {
+      _rejected_impus.insert(*impu);
+    }
+  }
+
+  if (admitted_impus.empty())
+  {
+    send_http_reply(HTTP_SERVER_UNAVAILABLE);
+    delete this;
+    return;
+  }
+
+  TRC_DEBUG("Try to find IMS Subscription information for %d public IDs in the cache",
+            admitted_impus.size());
+  CassandraStore::Operation* get_reg_data = _cache->create_GetRegDataBatch(admitted_impus);
+  CassandraStore::Transaction* tsx =
+    new CacheTransaction(this,
+                         &ImpuRegDataBatchTask::on_get_reg_data_success,
+                         &ImpuRegDataBatchTask::on_get_reg_data_failure,
+                         StatisticsManager::STAGE_CACHE_READ,
+                         Cache::OP_GET_REG_DATA_BATCH);
+  _cache->do_async(get_reg_data, tsx);
+}
+
+// Parse a body of the form {"public-ids": ["<public ID>", ...]}.  Returns
+// false if the body is invalid, empty or has too many public IDs.
+bool ImpuRegDataBatchTask::public_ids_from_body(const std::string& body)
+{
+  rapidjson::Document document;
+  document.Parse<0>(body.c_str());
+
+  if (!document.IsObject() ||
+      !document.HasMember(JSON_PUBLIC_IDS.c_str()) ||
+      !document[JSON_PUBLIC_IDS.c_str()].IsArray())
+  {
+    TRC_ERROR("Did not receive valid JSON with a '%s' array", JSON_PUBLIC_IDS.c_str());
+    return false;
+  }
+
+  const rapidjson::Value& public_ids = document[JSON_PUBLIC_IDS.c_str()];
+
+  if ((public_ids.Size() == 0) || (public_ids.Size() > _cfg->max_batch_size))
+  {
+    TRC_ERROR("Batch request has %d public IDs (must be between 1 and %d)",
+              public_ids.Size(), _cfg->max_batch_size);
+    return false;
+  }
+
+  for (rapidjson::SizeType ii = 0; ii < public_ids.Size(); ii++)
+  {
+    if (!public_ids[ii].IsString() || (public_ids[ii].GetStringLength() == 0))
+    {
+      TRC_ERROR("Batch request has an invalid public ID");
+      _impus.clear();
+      return false;
+    }
+
+    _impus.push_back(public_ids[ii].GetString());
+  }
+
+  return true;
+}
+
+void ImpuRegDataBatchTask::on_get_reg_data_success(CassandraStore::Operation* op)
+{
+  TRC_DEBUG("Got IMS subscriptions from cache");
+  std::map<std::string, Cache::GetRegData::Result> results;
+  ((Cache::GetRegDataBatch*)op)->get_result(results);
+
+  Utils::StopWatch stopwatch;
+  stopwatch.start();
+
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  {
+    writer.String(JSON_REG_DATA.c_str());
+    writer.StartArray();
+
+    for (std::vector<std::string>::const_iterator impu = _impus.begin();
+         impu != _impus.end();
+         ++impu)
+    {
+      // Each public ID gets the result code and ClearwaterRegData document
+      // that a GET of /impu/<public ID>/reg-data would have returned.
+      std::string xml_str;
+      int rc;
+
+      if (_rejected_impus.find(*impu) != _rejected_impus.end())
+      {
+        rc = HTTP_SERVER_UNAVAILABLE;
+      }
+      else
+      {
+        const Cache::GetRegData::Result& result = results[*impu];
+        sas_log_get_reg_data_success(result, trail());
+
+        rc = XmlUtils::build_ClearwaterRegData_xml(result.state,
+                                                   result.xml,
+                                                   result.charging_addrs,
+                                                   xml_str);
+        if (rc != HTTP_OK)
+        {
+          DeferredSasEvent event(this->trail(), SASEvent::REG_DATA_HSS_INVALID, 0);
+          event.add_compressed_param(result.xml, &SASEvent::PROFILE_SERVICE_PROFILE);
+          event.report();
+        }
+      }
+
+      writer.StartObject();
+      {
+        writer.String(JSON_PUBLIC_ID.c_str());
+        writer.String(impu->c_str());
+        writer.String(JSON_RC.c_str());
+        writer.Int(rc);
+
+        if (rc == HTTP_OK)
+        {
+          writer.String(JSON_REG_DATA.c_str());
+          writer.String(xml_str.c_str());
+        }
+      }
+      writer.EndObject();
+    }
+
+    writer.EndArray();
+  }
+  writer.EndObject();
+
+  unsigned long render_us = 0;
+  if (stopwatch.read(render_us))
+  {
+    record_stage_latency(StatisticsManager::STAGE_XML_RENDER, render_us);
+  }
+
+  add_reply_content(sb.GetString());
+  send_http_reply(HTTP_OK);
+  delete this;
+}
+
+void ImpuRegDataBatchTask::on_get_reg_data_failure(CassandraStore::Operation* op,
+                                                   CassandraStore::ResultCode error,
+                                                   std::string& text)
+{
+  TRC_DEBUG("Batched IMS subscription cache query failed: %u, %s", error, text.c_str());
+  SAS::Event event(this->trail(), SASEvent::NO_REG_DATA_CACHE, 0);
+  SAS::report_event(event);
+
+  if (error == CassandraStore::CONNECTION_ERROR)
+  {
+    // As for single reads, let Sprout retry against another Homestead.
+    TRC_DEBUG("Cache query failed: unable to connect to local Cassandra");
+    send_http_reply(HTTP_SERVER_UNAVAILABLE);
+  }
+  else
+  {
+    TRC_DEBUG("Cache query failed with rc %d", error);
+    send_http_reply(HTTP_GATEWAY_TIMEOUT);
+  }
+
+  delete this;
+}
+
 void RegistrationTerminationTask::run()
 {
   // Save off the deregistration reason and all private and public
@@ -1882,6 +2832,25 @@ void RegistrationTerminationTask::run()
   TRC_INFO("Received Registration-Termination request with dereg reason %d",
            _deregistration_reason);
 
+  HssCacheTask::forget_location_info(_rtr.impus());
+  HssCacheTask::forget_registration_status(_impis);
+
+  // The HSS has told us about these subscribers, so they're no longer
+  // unknown.
+  std::vector<std::string> rtr_impus = _rtr.impus();
+  for (std::vector<std::string>::const_iterator it = _impis.begin();
+       it != _impis.end();
+       ++it)
+  {
+    HssCacheTask::forget_user_unknown(*it);
+  }
+  for (std::vector<std::string>::const_iterator it = rtr_impus.begin();
+       it != rtr_impus.end();
+       ++it)
+  {
+    HssCacheTask::forget_user_unknown(*it);
+  }
+
   SAS::Event rtr_received(trail(), SASEvent::RTR_RECEIVED, 0);
   rtr_received.add_var_param(impi);
   rtr_received.add_static_param(associated_identities.size());
@@ -1903,7 +2872,9 @@ void RegistrationTerminationTask::run()
     CassandraStore::Transaction* tsx =
       new CacheTransaction(this,
                            &RegistrationTerminationTask::get_assoc_primary_public_ids_success,
-                           &RegistrationTerminationTask::get_assoc_primary_public_ids_failure);
+                           &RegistrationTerminationTask::get_assoc_primary_public_ids_failure,
+                           StatisticsManager::STAGE_CACHE_READ,
+                           Cache::OP_GET_ASSOCIATED_PRIMARY_PUBLIC_IDS);
     _cfg->cache->do_async(get_associated_impus, tsx);
   }
   else if ((!_impus.empty()) && ((_deregistration_reason == PERMANENT_TERMINATION) ||
@@ -1985,7 +2956,9 @@ void RegistrationTerminationTask::get_registration_sets()
     CassandraStore::Transaction* tsx =
       new CacheTransaction(this,
                            &RegistrationTerminationTask::get_registration_set_success,
-                           &RegistrationTerminationTask::get_registration_set_failure);
+                           &RegistrationTerminationTask::get_registration_set_failure,
+                           StatisticsManager::STAGE_CACHE_READ,
+                           Cache::OP_GET_REG_DATA);
     _cfg->cache->do_async(get_reg_data, tsx);
   }
   else if (_registration_sets.empty())
@@ -2022,6 +2995,7 @@ void RegistrationTerminationTask::get_registration_set_success(CassandraStore::O
   std::vector<std::string> public_ids = XmlUtils::get_public_ids(ims_sub);
   if (!public_ids.empty())
   {
+    HssCacheTask::forget_location_info(public_ids);
     _registration_sets.push_back(public_ids);
   }
 
@@ -2163,7 +3137,9 @@ void RegistrationTerminationTask::dissociate_implicit_registration_sets()
     SAS::report_event(event);
     CassandraStore::Operation* dissociate_reg_set =
       _cfg->cache->create_DissociateImplicitRegistrationSetFromImpi(*i, _impis, Cache::generate_timestamp());
-    CassandraStore::Transaction* tsx = new CacheTransaction;
+    CassandraStore::Transaction* tsx =
+      new CacheTransaction(StatisticsManager::STAGE_CACHE_WRITE,
+                           Cache::OP_DISSOCIATE_IRS_FROM_IMPI);
 
     // Note that this is an asynchronous operation and we are not attempting to
     // wait for completion.  This is deliberate: Registration Termination is not
@@ -2186,7 +3162,9 @@ void RegistrationTerminationTask::delete_impi_mappings()
   SAS::report_event(event);
   CassandraStore::Operation* delete_impis =
     _cfg->cache->create_DeleteIMPIMapping(_impis, Cache::generate_timestamp());
-  CassandraStore::Transaction* tsx = new CacheTransaction;
+  CassandraStore::Transaction* tsx =
+    new CacheTransaction(StatisticsManager::STAGE_CACHE_WRITE,
+                         Cache::OP_DELETE_IMPI_MAPPING);
 
   // Note that this is an asynchronous operation and we are not attempting to
   // wait for completion.  This is deliberate: Registration Termination is not
@@ -2218,7 +3196,15 @@ void RegistrationTerminationTask::send_rta(const std::string result_code)
 
   // Send the RTA back to the HSS.
   TRC_INFO("Ready to send RTA");
+  Utils::StopWatch stopwatch;
+  stopwatch.start();
   rta.send(trail());
+
+  unsigned long latency_us = 0;
+  if (stopwatch.read(latency_us))
+  {
+    HssCacheTask::record_stage_latency(StatisticsManager::STAGE_REPLY, latency_us);
+  }
 }
 
 void PushProfileTask::run()
@@ -2231,6 +3217,20 @@ void PushProfileTask::run()
   _ims_sub_present = _ppr.user_data(_ims_subscription);
   _charging_addrs_present = _ppr.charging_addrs(_charging_addrs);
 
+  // The HSS has told us about this subscriber, so it's no longer unknown.
+  HssCacheTask::forget_user_unknown(_ppr.impi());
+  if (_ims_sub_present)
+  {
+    std::vector<std::string> public_ids =
+      XmlUtils::get_public_ids(_ims_subscription);
+    for (std::vector<std::string>::const_iterator it = public_ids.begin();
+         it != public_ids.end();
+         ++it)
+    {
+      HssCacheTask::forget_user_unknown(*it);
+    }
+  }
+
   // If we have charging addresses but no IMS subscription, we need
   // to lookup which public IDs need updating based on the private ID
   // specified in the PPR.
@@ -2246,7 +3246,9 @@ void PushProfileTask::run()
     CassandraStore::Transaction* tsx =
       new CacheTransaction(this,
                            &PushProfileTask::on_get_impus_success,
-                           &PushProfileTask::on_get_impus_failure);
+                           &PushProfileTask::on_get_impus_failure,
+                           StatisticsManager::STAGE_CACHE_READ,
+                           Cache::OP_GET_ASSOCIATED_PUBLIC_IDS);
     _cfg->cache->do_async(get_public_ids, tsx);
   }
   else
@@ -2322,20 +3324,21 @@ void PushProfileTask::update_reg_data()
       if (!found_sip_uri)
       {
         TRC_ERROR("No SIP URI in Implicit Registration Set");
-        SAS::Event event(this->trail(), SASEvent::NO_SIP_URI_IN_IRS, 0);
+        DeferredSasEvent event(this->trail(), SASEvent::NO_SIP_URI_IN_IRS, 0);
         event.add_compressed_param(_ims_subscription, &SASEvent::PROFILE_SERVICE_PROFILE);
-        SAS::report_event(event);
+        event.report();
       }
     }
 
+    HssCacheTask::forget_location_info(_impus);
+
     Cache::PutRegData* put_reg_data =
       _cfg->cache->create_PutRegData(_impus,
                                      Cache::generate_timestamp(),
                                      _cfg->record_ttl);
-    SAS::Event event(this->trail(), SASEvent::CACHE_PUT_REG_DATA, 0);
+    DeferredSasEvent event(this->trail(), SASEvent::CACHE_PUT_REG_DATA, 0);
 
-    std::string impus_str = boost::algorithm::join(_impus, ", ");
-    event.add_var_param(impus_str);
+    event.add_var_param(boost::algorithm::join(_impus, ", "));
 
     if (_ims_sub_present)
     {
@@ -2365,11 +3368,13 @@ void PushProfileTask::update_reg_data()
     CassandraStore::Transaction* tsx =
       new CacheTransaction(this,
                            &PushProfileTask::update_reg_data_success,
-                           &PushProfileTask::update_reg_data_failure);
+                           &PushProfileTask::update_reg_data_failure,
+                           StatisticsManager::STAGE_CACHE_WRITE,
+                           Cache::OP_PUT_REG_DATA);
     CassandraStore::Operation*& op = (CassandraStore::Operation*&)put_reg_data;
     _cfg->cache->do_async(op, tsx);
 
-    SAS::report_event(event);
+    event.report();
 
   }
   else
@@ -2413,8 +3418,16 @@ void PushProfileTask::send_ppa(const std::string result_code)
 
   // Send the PPA back to the HSS.
   TRC_INFO("Ready to send PPA");
+  Utils::StopWatch stopwatch;
+  stopwatch.start();
   ppa.send(trail());
 
+  unsigned long latency_us = 0;
+  if (stopwatch.read(latency_us))
+  {
+    HssCacheTask::record_stage_latency(StatisticsManager::STAGE_REPLY, latency_us);
+  }
+
   delete this;
 }
 
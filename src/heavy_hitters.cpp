@@ -0,0 +1,455 @@
+/**
+ * @file heavy_hitters.cpp Streaming detection of the most frequent keys.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <algorithm>
+#include <functional>
+#include <set>
+
+#include "heavy_hitters.h"
+#include "monotonic_clock.h"
+#include "log.h"
+
+const size_t HeavyHitters::DEFAULT_CAPACITY;
+const unsigned long HeavyHitters::DEFAULT_WINDOW_MS;
+const size_t HeavyHitters::SKETCH_DEPTH;
+const size_t HeavyHitters::SKETCH_WIDTH;
+
+// Sort entries heaviest first, breaking ties by key so the order is stable.
+static bool heavier(const HeavyHitters::Entry& a, const HeavyHitters::Entry& b)
+{
+  return (a.count != b.count) ? (a.count > b.count) : (a.key < b.key);
+}
+
+// Used to give each HeavyHitters object a unique ID.
+static std::atomic<uint64_t> next_id(1);
+
+HeavyHitters::HeavyHitters(size_t capacity, unsigned long window_ms) :
+  _capacity((capacity > 0) ? capacity : 1),
+  _window_ms((window_ms > 0) ? window_ms : 1),
+  _id(next_id++),
+  _window_start_ms(now_ms()),
+  _window(0),
+  _lock(),
+  _threads(),
+  _last_window(),
+  _last_window_end_ms(0)
+{
+  for (size_t ii = 0; ii < SKETCH_DEPTH; ++ii)
+  {
+    for (size_t jj = 0; jj < SKETCH_WIDTH; ++jj)
+    {
+      _sketch[ii][jj] = 0;
+    }
+  }
+}
+
+HeavyHitters::~HeavyHitters()
+{
+  for (std::vector<ThreadCandidates*>::iterator it = _threads.begin();
+       it != _threads.end();
+       ++it)
+  {
+    delete *it;
+  }
+}
+
+uint64_t HeavyHitters::hash(const std::string& key,
+                            size_t indices[SKETCH_DEPTH]) const
+{
+  // Derive a hash for each row of the sketch from two halves of a single
+  // hash of the key (Kirsch-Mitzenmacher).
+  uint64_t h = std::hash<std::string>()(key);
+  uint32_t h1 = (uint32_t)h;
+  uint32_t h2 = (uint32_t)(h >> 32) | 1;
+
+  for (size_t ii = 0; ii < SKETCH_DEPTH; ++ii)
+  {
+    indices[ii] = (h1 + ii * h2) % SKETCH_WIDTH;
+  }
+
+  return h;
+}
+
+uint64_t HeavyHitters::record(const std::string& key)
+{
+  maybe_end_window();
+  uint64_t window = _window.load(std::memory_order_relaxed);
+
+  size_t indices[SKETCH_DEPTH];
+  uint64_t h = hash(key, indices);
+
+  uint64_t count = UINT64_MAX;
+  for (size_t ii = 0; ii < SKETCH_DEPTH; ++ii)
+  {
+    uint64_t value =
+      _sketch[ii][indices[ii]].fetch_add(1, std::memory_order_relaxed) + 1;
+    count = std::min(count, value);
+  }
+
+  // Only this thread changes its candidate table, so it can check the table
+  // without locking it.  Estimates only grow during a window, so the lightest
+  // candidate is still at least as heavy as the threshold.
+  ThreadCandidates* tc = thread_candidates();
+  if ((tc->window != window) ||
+      ((count > tc->threshold) && (!is_candidate(tc, h, key))))
+  {
+    update_candidates(tc, window, h, key, count);
+  }
+
+  return count;
+}
+
+uint64_t HeavyHitters::estimate(const std::string& key) const
+{
+  size_t indices[SKETCH_DEPTH];
+  hash(key, indices);
+  return estimate(indices);
+}
+
+uint64_t HeavyHitters::estimate(const size_t indices[SKETCH_DEPTH]) const
+{
+  uint64_t count = UINT64_MAX;
+  for (size_t ii = 0; ii < SKETCH_DEPTH; ++ii)
+  {
+    count = std::min(count,
+                     (uint64_t)_sketch[ii][indices[ii]].load(std::memory_order_relaxed));
+  }
+
+  return count;
+}
+
+uint64_t HeavyHitters::error_bound() const
+{
+  // Each row of the sketch counts every key recorded in the window.
+  uint64_t total = 0;
+  for (size_t jj = 0; jj < SKETCH_WIDTH; ++jj)
+  {
+    total += _sketch[0][jj].load(std::memory_order_relaxed);
+  }
+
+  // A count-min sketch overestimates by more than e / width of the total
+  // with a probability of e ^ -depth.  Round e up to 3.
+  return (total * 3) / SKETCH_WIDTH;
+}
+
+std::vector<HeavyHitters::Entry> HeavyHitters::top()
+{
+  maybe_end_window();
+
+  std::lock_guard<std::mutex> lock(_lock);
+  return (_last_window_end_ms != 0) ?
+           _last_window :
+           merge_candidates(_window.load(std::memory_order_relaxed));
+}
+
+HeavyHitters::ThreadCandidates* HeavyHitters::thread_candidates()
+{
+  // Each thread's candidate tables, indexed by the ID of the HeavyHitters
+  // object they belong to.  The tables themselves are owned by that object.
+  static thread_local std::vector<ThreadCandidates*> tables;
+
+  if ((_id < tables.size()) && (tables[_id] != NULL))
+  {
+    return tables[_id];
+  }
+
+  ThreadCandidates* tc = new ThreadCandidates();
+  tc->window = _window.load(std::memory_order_relaxed);
+  tc->threshold = 0;
+
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    _threads.push_back(tc);
+  }
+
+  if (_id >= tables.size())
+  {
+    tables.resize(_id + 1, NULL);
+  }
+  tables[_id] = tc;
+  return tc;
+}
+
+bool HeavyHitters::is_candidate(const ThreadCandidates* tc,
+                                uint64_t key_hash,
+                                const std::string& key) const
+{
+  for (std::vector<Candidate>::const_iterator it = tc->candidates.begin();
+       it != tc->candidates.end();
+       ++it)
+  {
+    if ((it->hash == key_hash) && (it->key == key))
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void HeavyHitters::update_candidates(ThreadCandidates* tc,
+                                     uint64_t window,
+                                     uint64_t key_hash,
+                                     const std::string& key,
+                                     uint64_t count)
+{
+  std::lock_guard<std::mutex> lock(tc->lock);
+
+  if (tc->window != window)
+  {
+    // The table's window has ended, so start again.
+    tc->candidates.clear();
+    tc->threshold = 0;
+    tc->window = window;
+  }
+  else if (is_candidate(tc, key_hash, key))
+  {
+    return;
+  }
+
+  std::vector<Candidate>& candidates = tc->candidates;
+
+  if (candidates.size() < _capacity)
+  {
+    Candidate candidate;
+    candidate.hash = key_hash;
+    candidate.key = key;
+    candidates.push_back(candidate);
+
+    if (candidates.size() < _capacity)
+    {
+      return;
+    }
+  }
+
+  // The table is full, so work out the current estimates of the candidates.
+  // This only happens when a key that isn't a candidate overtakes the
+  // threshold, so is rare once the heavy hitters have been found.
+  std::vector<Candidate>::iterator lightest = candidates.end();
+  uint64_t lightest_count = UINT64_MAX;
+  uint64_t second_count = UINT64_MAX;
+
+  for (std::vector<Candidate>::iterator it = candidates.begin();
+       it != candidates.end();
+       ++it)
+  {
+    size_t indices[SKETCH_DEPTH];
+    hash(it->key, indices);
+    uint64_t estimated = estimate(indices);
+
+    if (estimated < lightest_count)
+    {
+      second_count = lightest_count;
+      lightest_count = estimated;
+      lightest = it;
+    }
+    else if (estimated < second_count)
+    {
+      second_count = estimated;
+    }
+  }
+
+  if ((lightest->key != key) && (count > lightest_count))
+  {
+    // Replace the lightest candidate with this key.  The threshold is then
+    // the lighter of this key and the previous second lightest.
+    lightest->hash = key_hash;
+    lightest->key = key;
+    tc->threshold = std::min(count, second_count);
+  }
+  else
+  {
+    tc->threshold = lightest_count;
+  }
+}
+
+void HeavyHitters::maybe_end_window()
+{
+  uint64_t now = now_ms();
+  uint64_t start = _window_start_ms.load(std::memory_order_relaxed);
+
+  if ((now - start < _window_ms) ||
+      !_window_start_ms.compare_exchange_strong(start, now))
+  {
+    // Either the window hasn't ended, or another thread is ending it.
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(_lock);
+
+  // Only save the results if the window that's just ended was the one before
+  // this, otherwise there has been a window with no traffic.
+  if (now - start < 2 * _window_ms)
+  {
+    _last_window = merge_candidates(_window.load(std::memory_order_relaxed));
+  }
+  else
+  {
+    _last_window.clear();
+  }
+  _last_window_end_ms = now;
+
+  // Each thread clears its own candidate table the next time it records a
+  // key.
+  _window++;
+
+  // Samples recorded by other threads while the sketch is being cleared may
+  // be lost or counted in the new window, but that doesn't matter for a
+  // statistical summary.
+  for (size_t ii = 0; ii < SKETCH_DEPTH; ++ii)
+  {
+    for (size_t jj = 0; jj < SKETCH_WIDTH; ++jj)
+    {
+      _sketch[ii][jj].store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+// Merge the threads' candidate tables for a window, and return the heaviest
+// candidates.  Must be called with _lock held.
+std::vector<HeavyHitters::Entry> HeavyHitters::merge_candidates(uint64_t window)
+{
+  std::set<std::string> merged;
+
+  for (std::vector<ThreadCandidates*>::iterator tc = _threads.begin();
+       tc != _threads.end();
+       ++tc)
+  {
+    std::lock_guard<std::mutex> lock((*tc)->lock);
+    if ((*tc)->window != window)
+    {
+      continue;
+    }
+
+    for (std::vector<Candidate>::const_iterator it = (*tc)->candidates.begin();
+         it != (*tc)->candidates.end();
+         ++it)
+    {
+      merged.insert(it->key);
+    }
+  }
+
+  // Every thread's samples are in the shared sketch, so it gives the count
+  // for each key across all threads.
+  std::vector<Entry> entries;
+  for (std::set<std::string>::const_iterator it = merged.begin();
+       it != merged.end();
+       ++it)
+  {
+    Entry entry;
+    entry.key = *it;
+    entry.count = estimate(*it);
+    entries.push_back(entry);
+  }
+
+  std::sort(entries.begin(), entries.end(), heavier);
+  if (entries.size() > _capacity)
+  {
+    entries.resize(_capacity);
+  }
+  return entries;
+}
+
+const char* HotSubscribers::endpoint_name(Endpoint endpoint)
+{
+  switch (endpoint)
+  {
+  case IMPI_DIGEST:
+    return "impi_digest";
+  case IMPI_AV:
+    return "impi_av";
+  case IMPI_REG_STATUS:
+    return "impi_registration_status";
+  case IMPU_LOC_INFO:
+    return "impu_location";
+  case IMPU_REG_DATA:
+    return "impu_reg_data";
+  default:
+    return "unknown"; // LCOV_EXCL_LINE
+  }
+}
+
+HotSubscribers::HotSubscribers(unsigned int rate_limit,
+                               size_t capacity,
+                               unsigned long window_ms) :
+  _window_ms(window_ms),
+  _max_per_window(((uint64_t)rate_limit * window_ms) / 1000)
+{
+  if ((rate_limit > 0) && (_max_per_window == 0))
+  {
+    // Always allow at least one request per window.
+    _max_per_window = 1;
+  }
+
+  for (int ii = 0; ii < NUM_ENDPOINTS; ++ii)
+  {
+    _hitters[ii] = new HeavyHitters(capacity, window_ms);
+  }
+}
+
+HotSubscribers::~HotSubscribers()
+{
+  for (int ii = 0; ii < NUM_ENDPOINTS; ++ii)
+  {
+    delete _hitters[ii]; _hitters[ii] = NULL;
+  }
+}
+
+bool HotSubscribers::record(Endpoint endpoint, const std::string& id)
+{
+  uint64_t count = _hitters[endpoint]->record(id);
+
+  if ((_max_per_window > 0) && (count > _max_per_window))
+  {
+    // The estimate can include requests from other subscribers that share
+    // its counters in the sketch, so only reject the request if the
+    // subscriber is over the limit even allowing for that.
+    uint64_t error = _hitters[endpoint]->error_bound();
+    if (count - std::min(count, error) > _max_per_window)
+    {
+      TRC_INFO("Subscriber %s has made at least %lu %s requests this window - rejecting",
+               id.c_str(), count - error, endpoint_name(endpoint));
+      return false;
+    }
+  }
+
+  return true;
+}
+
+std::vector<HeavyHitters::Entry> HotSubscribers::top(Endpoint endpoint)
+{
+  return _hitters[endpoint]->top();
+}
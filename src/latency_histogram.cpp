@@ -0,0 +1,215 @@
+/**
+ * @file latency_histogram.cpp Implementation of the low-overhead latency histogram.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "latency_histogram.h"
+#include "monotonic_clock.h"
+
+const uint64_t LatencyHistogram::MAX_VALUE;
+const uint64_t PeriodicLatencyHistogram::DEFAULT_PERIOD_MS;
+
+LatencyHistogram::LatencyHistogram()
+{
+  reset();
+}
+
+int LatencyHistogram::bucket_index(uint64_t value)
+{
+  if (value > MAX_VALUE)
+  {
+    value = MAX_VALUE;
+  }
+
+  if (value < (uint64_t)SUB_BUCKETS)
+  {
+    return (int)value;
+  }
+
+  // Work out how far the value needs to be shifted so that it lies in the
+  // top half of the sub-bucket range, then index within that half.
+  int msb = 63 - __builtin_clzll(value);
+  int shift = msb - SUB_BUCKET_BITS + 1;
+  return SUB_BUCKETS +
+         ((shift - 1) * HALF_SUB_BUCKETS) +
+         (int)((value >> shift) - HALF_SUB_BUCKETS);
+}
+
+uint64_t LatencyHistogram::bucket_highest_value(int index)
+{
+  if (index < SUB_BUCKETS)
+  {
+    return (uint64_t)index;
+  }
+
+  int shift = ((index - SUB_BUCKETS) / HALF_SUB_BUCKETS) + 1;
+  uint64_t sub = ((index - SUB_BUCKETS) % HALF_SUB_BUCKETS) + HALF_SUB_BUCKETS;
+  return ((sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t value_us)
+{
+  if (value_us > MAX_VALUE)
+  {
+    value_us = MAX_VALUE;
+  }
+
+  _buckets[bucket_index(value_us)].fetch_add(1, std::memory_order_relaxed);
+  _count.fetch_add(1, std::memory_order_relaxed);
+
+  uint64_t current_max = _max.load(std::memory_order_relaxed);
+  while ((value_us > current_max) &&
+         (!_max.compare_exchange_weak(current_max,
+                                      value_us,
+                                      std::memory_order_relaxed)))
+  {
+    // current_max has been updated by compare_exchange_weak - try again.
+  }
+}
+
+uint64_t LatencyHistogram::count() const
+{
+  return _count.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::max() const
+{
+  return _max.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::value_at_percentile(double percentile) const
+{
+  // Take a snapshot of the buckets, so the total matches what we walk over
+  // even if other threads are recording samples at the same time.
+  uint64_t snapshot[NUM_BUCKETS];
+  uint64_t total = 0;
+
+  for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    snapshot[ii] = _buckets[ii].load(std::memory_order_relaxed);
+    total += snapshot[ii];
+  }
+
+  if (total == 0)
+  {
+    return 0;
+  }
+
+  if (percentile > 100.0)
+  {
+    percentile = 100.0;
+  }
+
+  // Find the first bucket at which the cumulative count reaches the
+  // requested fraction of the samples (always at least one sample).
+  uint64_t target = (uint64_t)((percentile / 100.0) * total + 0.5);
+  if (target == 0)
+  {
+    target = 1;
+  }
+
+  uint64_t cumulative = 0;
+  uint64_t highest = max();
+
+  for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    cumulative += snapshot[ii];
+
+    if (cumulative >= target)
+    {
+      uint64_t value = bucket_highest_value(ii);
+      return (value < highest) ? value : highest;
+    }
+  }
+
+  return highest; // LCOV_EXCL_LINE - the loop always finds the target.
+}
+
+void LatencyHistogram::reset()
+{
+  for (int ii = 0; ii < NUM_BUCKETS; ++ii)
+  {
+    _buckets[ii].store(0, std::memory_order_relaxed);
+  }
+
+  _count.store(0, std::memory_order_relaxed);
+  _max.store(0, std::memory_order_relaxed);
+}
+
+PeriodicLatencyHistogram::PeriodicLatencyHistogram(uint64_t period_ms) :
+  _period_ms(period_ms),
+  _start_ms(now_ms()),
+  _period(0)
+{
+}
+
+void PeriodicLatencyHistogram::record(uint64_t value_us)
+{
+  rotate();
+  _histograms[_period.load(std::memory_order_relaxed) % 2].record(value_us);
+}
+
+const LatencyHistogram& PeriodicLatencyHistogram::current() const
+{
+  rotate();
+  return _histograms[_period.load(std::memory_order_relaxed) % 2];
+}
+
+const LatencyHistogram& PeriodicLatencyHistogram::previous() const
+{
+  rotate();
+  return _histograms[(_period.load(std::memory_order_relaxed) + 1) % 2];
+}
+
+void PeriodicLatencyHistogram::rotate() const
+{
+  uint64_t period = (now_ms() - _start_ms) / _period_ms;
+  uint64_t old_period = _period.load(std::memory_order_relaxed);
+
+  if ((period > old_period) &&
+      (_period.compare_exchange_strong(old_period,
+                                       period,
+                                       std::memory_order_relaxed)))
+  {
+    // The histogram for the new period still holds the samples from two
+    // periods ago.  If more than one period has passed with no samples, the
+    // other histogram is stale too.
+    _histograms[period % 2].reset();
+
+    if (period > old_period + 1)
+    {
+      _histograms[(period + 1) % 2].reset();
+    }
+  }
+}
@@ -46,8 +46,11 @@
 #include "diameterstack.h"
 #include "httpstack.h"
 #include "handlers.h"
+#include "admin_handlers.h"
+#include "sas_reporter.h"
 #include "logger.h"
 #include "cache.h"
+#include "embedded_store.h"
 #include "saslogger.h"
 #include "sas.h"
 #include "sasevent.h"
@@ -107,6 +110,23 @@ struct options
   std::string pidfile;
   bool daemon;
   bool sas_signaling_if;
+  int hot_subscriber_limit;
+  std::string embedded_store;
+  int embedded_store_snapshot_interval;
+  EmbeddedStore::SyncPolicy embedded_store_sync;
+  int negative_cache_ttl;
+  int negative_cache_size;
+  int location_cache_ttl;
+  int location_cache_size;
+  int registration_status_cache_ttl;
+  int registration_status_cache_size;
+  int sas_queue_length;
+  int http_compression_threshold;
+  int http_compression_cache_size;
+  int impu_cache_write_behind;
+  int reg_data_refresh_ahead;
+  int shutdown_drain_timeout_ms;
+  std::string thread_placement;
 };
 
 // Enum for option types not assigned short-forms
@@ -130,7 +150,24 @@ enum OptionTypes
   SAS_USE_SIGNALING_IF,
   PIDFILE,
   DAEMON,
-  REG_MAX_EXPIRES
+  REG_MAX_EXPIRES,
+  HOT_SUBSCRIBER_LIMIT,
+  EMBEDDED_STORE,
+  EMBEDDED_STORE_SNAPSHOT_INTERVAL,
+  EMBEDDED_STORE_SYNC,
+  NEGATIVE_CACHE_TTL,
+  NEGATIVE_CACHE_SIZE,
+  LOCATION_CACHE_TTL,
+  LOCATION_CACHE_SIZE,
+  REGISTRATION_STATUS_CACHE_TTL,
+  REGISTRATION_STATUS_CACHE_SIZE,
+  SAS_QUEUE_LENGTH,
+  HTTP_COMPRESSION_THRESHOLD,
+  HTTP_COMPRESSION_CACHE_SIZE,
+  IMPU_CACHE_WRITE_BEHIND,
+  REG_DATA_REFRESH_AHEAD,
+  SHUTDOWN_DRAIN_TIMEOUT_MS,
+  THREAD_PLACEMENT
 };
 
 const static struct option long_opt[] =
@@ -171,6 +208,23 @@ const static struct option long_opt[] =
   {"pidfile",                     required_argument, NULL, PIDFILE},
   {"daemon",                      no_argument,       NULL, DAEMON},
   {"sas-use-signaling-interface", no_argument,       NULL, SAS_USE_SIGNALING_IF},
+  {"hot-subscriber-limit",        required_argument, NULL, HOT_SUBSCRIBER_LIMIT},
+  {"embedded-store",              required_argument, NULL, EMBEDDED_STORE},
+  {"embedded-store-snapshot-interval", required_argument, NULL, EMBEDDED_STORE_SNAPSHOT_INTERVAL},
+  {"embedded-store-sync",         required_argument, NULL, EMBEDDED_STORE_SYNC},
+  {"negative-cache-ttl",          required_argument, NULL, NEGATIVE_CACHE_TTL},
+  {"negative-cache-size",         required_argument, NULL, NEGATIVE_CACHE_SIZE},
+  {"location-cache-ttl",          required_argument, NULL, LOCATION_CACHE_TTL},
+  {"location-cache-size",         required_argument, NULL, LOCATION_CACHE_SIZE},
+  {"registration-status-cache-ttl", required_argument, NULL, REGISTRATION_STATUS_CACHE_TTL},
+  {"registration-status-cache-size", required_argument, NULL, REGISTRATION_STATUS_CACHE_SIZE},
+  {"sas-queue-length",            required_argument, NULL, SAS_QUEUE_LENGTH},
+  {"http-compression-threshold",  required_argument, NULL, HTTP_COMPRESSION_THRESHOLD},
+  {"http-compression-cache-size", required_argument, NULL, HTTP_COMPRESSION_CACHE_SIZE},
+  {"impu-cache-write-behind",     required_argument, NULL, IMPU_CACHE_WRITE_BEHIND},
+  {"reg-data-refresh-ahead",      required_argument, NULL, REG_DATA_REFRESH_AHEAD},
+  {"shutdown-drain-timeout",      required_argument, NULL, SHUTDOWN_DRAIN_TIMEOUT_MS},
+  {"thread-placement",            required_argument, NULL, THREAD_PLACEMENT},
   {NULL,                          0,                 NULL, 0},
 };
 
@@ -231,6 +285,65 @@ void usage(void)
        "                            The amount of time to blacklist an HTTP peer when it is unresponsive.\n"
        "     --diameter-blacklist-duration <secs>\n"
        "                            The amount of time to blacklist a Diameter peer when it is unresponsive.\n"
+       "     --hot-subscriber-limit N\n"
+       "                            Maximum rate of requests per second from a single subscriber to a\n"
+       "                            single endpoint before requests are rejected (default: 0, no limit)\n"
+       "     --embedded-store <directory>\n"
+       "                            Store subscriber data in memory, persisted to the specified directory,\n"
+       "                            rather than in Cassandra.  Intended for deployments without an HSS\n"
+       "     --embedded-store-snapshot-interval <secs>\n"
+       "                            How often to snapshot the embedded store if it has changed (default: 300)\n"
+       "     --embedded-store-sync <commit|none>\n"
+       "                            When to sync the embedded store's log to disk: before acknowledging each\n"
+       "                            change, sharing syncs between concurrent changes (commit), or only on\n"
+       "                            snapshots and shutdown, so changes may be lost if the host fails (none)\n"
+       "                            (default: commit)\n"
+       "     --negative-cache-ttl <secs>\n"
+       "                            How long to remember that the HSS reported a subscriber as unknown,\n"
+       "                            rejecting requests for it without querying the HSS (default: 0, disabled)\n"
+       "     --negative-cache-size N\n"
+       "                            Maximum number of unknown subscribers to remember (default: 10000)\n"
+       "     --location-cache-ttl <millisecs>\n"
+       "                            How long to cache the HSS's answers to location queries, until the\n"
+       "                            subscriber is reassigned (default: 0, disabled)\n"
+       "     --location-cache-size N\n"
+       "                            Maximum number of location query answers to cache (default: 10000)\n"
+       "     --registration-status-cache-ttl <millisecs>\n"
+       "                            How long to cache the HSS's answers to registration status queries for\n"
+       "                            registered subscribers.  Should be well below the re-registration\n"
+       "                            interval (default: 0, disabled)\n"
+       "     --registration-status-cache-size N\n"
+       "                            Maximum number of registration status answers to cache (default: 10000)\n"
+       "     --sas-queue-length N\n"
+       "                            Maximum number of SAS events with IMS subscriptions to queue for\n"
+       "                            compression on a background thread (default: 1000, 0 to compress\n"
+       "                            them on the request thread)\n"
+       "     --http-compression-threshold N\n"
+       "                            Smallest registration data response, in bytes, to compress if the\n"
+       "                            client accepts gzip or deflate (default: 2048, 0 to disable)\n"
+       "     --http-compression-cache-size N\n"
+       "                            Maximum number of compressed registration data responses to cache\n"
+       "                            (default: 10000, 0 to disable)\n"
+       "     --impu-cache-write-behind N\n"
+       "                            Reply to digest requests without waiting for the IMPU cache write,\n"
+       "                            with up to N writes outstanding in the background (default: 0,\n"
+       "                            disabled)\n"
+       "     --reg-data-refresh-ahead N\n"
+       "                            Answer re-registrations that are due to be sent to the HSS from\n"
+       "                            the cache, and send them to the HSS in the background, with up\n"
+       "                            to N in progress at once (default: 0, disabled)\n"
+       "     --shutdown-drain-timeout <milliseconds>\n"
+       "                            On termination, reject new requests with a 503 and wait up to\n"
+       "                            this long for requests in progress to finish before stopping.\n"
+       "                            Must be shorter than the init script's stop timeout (30s)\n"
+       "                            (default: 0, requests in progress are dropped)\n"
+       "     --thread-placement <placement>\n"
+       "                            Confine HTTP, cache and Diameter threads to CPUs, and allocate\n"
+       "                            their memory from the local NUMA node. Either 'auto' to derive\n"
+       "                            a placement from the host topology, or a list of the form\n"
+       "                            'http:<target>;cache:<target>;diameter:<target>', where each\n"
+       "                            target is a NUMA node (e.g. 'node1') or a list of CPUs\n"
+       "                            (e.g. '0-3,8-11') (default: placement is left to the kernel)\n"
        " -F, --log-file <directory>\n"
        "                            Log to file in specified directory\n"
        " -L, --log-level N          Set log level to N (default: 4)\n"
@@ -469,6 +582,103 @@ int init_options(int argc, char**argv, struct options& options)
       options.sas_signaling_if = true;
       break;
 
+    case HOT_SUBSCRIBER_LIMIT:
+      TRC_INFO("Hot subscriber limit: %s", optarg);
+      options.hot_subscriber_limit = atoi(optarg);
+      break;
+
+    case EMBEDDED_STORE:
+      TRC_INFO("Embedded store directory: %s", optarg);
+      options.embedded_store = std::string(optarg);
+      break;
+
+    case EMBEDDED_STORE_SNAPSHOT_INTERVAL:
+      TRC_INFO("Embedded store snapshot interval: %s", optarg);
+      options.embedded_store_snapshot_interval = atoi(optarg);
+      break;
+
+    case EMBEDDED_STORE_SYNC:
+      TRC_INFO("Embedded store sync policy: %s", optarg);
+      if (std::string(optarg) == "commit")
+      {
+        options.embedded_store_sync = EmbeddedStore::SYNC_COMMIT;
+      }
+      else if (std::string(optarg) == "none")
+      {
+        options.embedded_store_sync = EmbeddedStore::SYNC_NONE;
+      }
+      else
+      {
+        TRC_ERROR("Invalid --embedded-store-sync option %s", optarg);
+        return -1;
+      }
+      break;
+
+    case NEGATIVE_CACHE_TTL:
+      TRC_INFO("Negative cache TTL: %s", optarg);
+      options.negative_cache_ttl = atoi(optarg);
+      break;
+
+    case NEGATIVE_CACHE_SIZE:
+      TRC_INFO("Negative cache size: %s", optarg);
+      options.negative_cache_size = atoi(optarg);
+      break;
+
+    case LOCATION_CACHE_TTL:
+      TRC_INFO("Location cache TTL: %s", optarg);
+      options.location_cache_ttl = atoi(optarg);
+      break;
+
+    case LOCATION_CACHE_SIZE:
+      TRC_INFO("Location cache size: %s", optarg);
+      options.location_cache_size = atoi(optarg);
+      break;
+
+    case REGISTRATION_STATUS_CACHE_TTL:
+      TRC_INFO("Registration status cache TTL: %s", optarg);
+      options.registration_status_cache_ttl = atoi(optarg);
+      break;
+
+    case REGISTRATION_STATUS_CACHE_SIZE:
+      TRC_INFO("Registration status cache size: %s", optarg);
+      options.registration_status_cache_size = atoi(optarg);
+      break;
+
+    case SAS_QUEUE_LENGTH:
+      TRC_INFO("SAS queue length: %s", optarg);
+      options.sas_queue_length = atoi(optarg);
+      break;
+
+    case HTTP_COMPRESSION_THRESHOLD:
+      TRC_INFO("HTTP compression threshold: %s", optarg);
+      options.http_compression_threshold = atoi(optarg);
+      break;
+
+    case HTTP_COMPRESSION_CACHE_SIZE:
+      TRC_INFO("HTTP compression cache size: %s", optarg);
+      options.http_compression_cache_size = atoi(optarg);
+      break;
+
+    case IMPU_CACHE_WRITE_BEHIND:
+      TRC_INFO("IMPU cache write-behind: %s", optarg);
+      options.impu_cache_write_behind = atoi(optarg);
+      break;
+
+    case REG_DATA_REFRESH_AHEAD:
+      TRC_INFO("Registration data refresh-ahead: %s", optarg);
+      options.reg_data_refresh_ahead = atoi(optarg);
+      break;
+
+    case SHUTDOWN_DRAIN_TIMEOUT_MS:
+      TRC_INFO("Shutdown drain timeout: %s", optarg);
+      options.shutdown_drain_timeout_ms = atoi(optarg);
+      break;
+
+    case THREAD_PLACEMENT:
+      TRC_INFO("Thread placement: %s", optarg);
+      options.thread_placement = std::string(optarg);
+      break;
+
     case DAEMON:
     case 'F':
     case 'L':
@@ -568,6 +778,23 @@ int main(int argc, char**argv)
   options.pidfile = "";
   options.daemon = false;
   options.sas_signaling_if = false;
+  options.hot_subscriber_limit = 0;
+  options.embedded_store = "";
+  options.embedded_store_snapshot_interval = 300;
+  options.embedded_store_sync = EmbeddedStore::SYNC_COMMIT;
+  options.negative_cache_ttl = 0;
+  options.negative_cache_size = NegativeCache::DEFAULT_CAPACITY;
+  options.location_cache_ttl = 0;
+  options.location_cache_size = AnswerCache::DEFAULT_CAPACITY;
+  options.registration_status_cache_ttl = 0;
+  options.registration_status_cache_size = AnswerCache::DEFAULT_CAPACITY;
+  options.sas_queue_length = SasReporter::DEFAULT_MAX_QUEUE_LEN;
+  options.http_compression_threshold = ResponseCompressor::DEFAULT_THRESHOLD;
+  options.http_compression_cache_size = AnswerCache::DEFAULT_CAPACITY;
+  options.impu_cache_write_behind = 0;
+  options.reg_data_refresh_ahead = 0;
+  options.shutdown_drain_timeout_ms = 0;
+  options.thread_placement = "";
 
   // Initialise ENT logging before making "Started" log
   PDLogStatic::init(argv[0]);
@@ -642,6 +869,14 @@ int main(int argc, char**argv)
             options.sas_signaling_if ? create_connection_in_signaling_namespace
                                      : create_connection_in_management_namespace);
 
+  // Compress the IMS subscriptions in SAS events off the request threads.
+  SasReporter* sas_reporter = NULL;
+  if (options.sas_queue_length > 0)
+  {
+    sas_reporter = new SasReporter(options.sas_queue_length);
+    SasReporter::configure(sas_reporter);
+  }
+
   // Set up the statistics (Homestead specific and Diameter)
   snmp_setup("homestead");
   StatisticsManager* stats_manager = new StatisticsManager();
@@ -706,6 +941,33 @@ int main(int argc, char**argv)
                                                  af,
                                                  options.http_blacklist_duration);
 
+  // Work out where to run the HTTP, cache and Diameter threads.  The threads
+  // place themselves when they first handle a request.
+  ThreadPlacement* thread_placement = NULL;
+  if (!options.thread_placement.empty())
+  {
+    ThreadPlacement::Topology topology = ThreadPlacement::read_topology();
+    thread_placement = new ThreadPlacement();
+
+    if (options.thread_placement == "auto")
+    {
+      thread_placement->derive(topology,
+                               options.http_threads,
+                               options.cache_threads);
+    }
+    else if (!thread_placement->parse(options.thread_placement, topology))
+    {
+      TRC_WARNING("Thread placement option was invalid - placement is left to the kernel");
+      delete thread_placement; thread_placement = NULL;
+    }
+
+    if (thread_placement != NULL)
+    {
+      TRC_STATUS("Thread placement: %s", thread_placement->to_string().c_str());
+      ThreadPlacement::configure(thread_placement);
+    }
+  }
+
   Cache* cache = Cache::get_instance();
   cache->configure_connection(options.cassandra,
                               9160,
@@ -714,10 +976,28 @@ int main(int argc, char**argv)
                            options.cache_threads,
                            0);
 
-  // Test the connection to Cassandra before starting the store.
-  CassandraStore::ResultCode rc = cache->connection_test();
+  EmbeddedStore* embedded_store = NULL;
+  CassandraStore::ResultCode rc = CassandraStore::OK;
 
-  if (rc == CassandraStore::OK)
+  if (!options.embedded_store.empty())
+  {
+    // Use the embedded store instead of Cassandra.  It is loaded in the
+    // background while the rest of start-up carries on, and we wait for it
+    // before starting the cache or handling any requests.
+    embedded_store = new EmbeddedStore(options.embedded_store,
+                                       EmbeddedStore::DEFAULT_SNAPSHOT_LOG_BYTES,
+                                       std::max(options.embedded_store_snapshot_interval, 0),
+                                       options.embedded_store_sync);
+    embedded_store->open_async();
+    cache->configure_embedded_store(embedded_store);
+  }
+  else
+  {
+    // Test the connection to Cassandra before starting the store.
+    rc = cache->connection_test();
+  }
+
+  if ((rc == CassandraStore::OK) && (embedded_store == NULL))
   {
     // Cassandra connection is good, so start the store.
     rc = cache->start();
@@ -780,6 +1060,29 @@ int main(int argc, char**argv)
     diameter_stack->register_handler(dict->CX, dict->REGISTRATION_TERMINATION_REQUEST, rtr_task);
     diameter_stack->register_handler(dict->CX, dict->PUSH_PROFILE_REQUEST, ppr_task);
     diameter_stack->register_fallback_handler(dict->CX);
+
+    if (embedded_store != NULL)
+    {
+      if (!embedded_store->wait_opened())
+      {
+        TRC_ERROR("Failed to load the embedded store from %s",
+                  options.embedded_store.c_str());
+        TRC_STATUS("Homestead is shutting down");
+        exit(2);
+      }
+
+      // Only start the cache once the store has loaded, so that no cache
+      // operation can see it half-loaded.
+      rc = cache->start();
+      if (rc != CassandraStore::OK)
+      {
+        CL_HOMESTEAD_CASSANDRA_CACHE_INIT_FAIL.log(rc);
+        TRC_ERROR("Failed to initialize the Cassandra cache with error code %d.", rc);
+        TRC_STATUS("Homestead is shutting down");
+        exit(2);
+      }
+    }
+
     diameter_stack->start();
   }
   catch (Diameter::Stack::Exception& e)
@@ -800,11 +1103,74 @@ int main(int argc, char**argv)
   HssCacheTask::configure_health_checker(hc);
   HssCacheTask::configure_stats(stats_manager);
 
+  HotSubscribers* hot_subscribers =
+    new HotSubscribers(std::max(options.hot_subscriber_limit, 0));
+  HssCacheTask::configure_hot_subscribers(hot_subscribers);
+
+  AssocImpuWriter* assoc_impu_writer = NULL;
+  if ((options.impu_cache_ttl != 0) && (options.impu_cache_write_behind > 0))
+  {
+    assoc_impu_writer = new AssocImpuWriter(cache, options.impu_cache_write_behind);
+    HssCacheTask::configure_assoc_impu_writer(assoc_impu_writer);
+  }
+
   // We should only query the cache for AV information if there is no HSS.  If there is an HSS, we
   // should always hit it.  If there is not, the AV information must have been provisioned in the
   // "cache" (which becomes persistent).
   bool hss_configured = !(options.dest_realm.empty() && (options.dest_host.empty() || options.dest_host == "0.0.0.0"));
 
+  // Only remember unknown subscribers if there is an HSS to protect.
+  NegativeCache* negative_cache = NULL;
+  if ((hss_configured) && (options.negative_cache_ttl > 0))
+  {
+    negative_cache =
+      new NegativeCache(std::max(options.negative_cache_size, 1),
+                        options.negative_cache_ttl * 1000);
+    HssCacheTask::configure_negative_cache(negative_cache);
+  }
+
+  // Only refresh re-registrations in the background if there is an HSS to
+  // tell about them.  Records with less than half of the time between the
+  // HSS re-registration time and their expiry left are refreshed inline, so
+  // a background refresh has plenty of time to complete.
+  RegDataRefresher* reg_data_refresher = NULL;
+  if ((hss_configured) && (options.reg_data_refresh_ahead > 0))
+  {
+    reg_data_refresher =
+      new RegDataRefresher((record_ttl - options.hss_reregistration_time) / 2,
+                           options.reg_data_refresh_ahead);
+    HssCacheTask::configure_reg_data_refresher(reg_data_refresher);
+  }
+
+  // Location queries are answered from the Cassandra cache if there's no HSS,
+  // so only cache the HSS's answers if there is one.
+  AnswerCache* location_info_cache = NULL;
+  if ((hss_configured) && (options.location_cache_ttl > 0))
+  {
+    location_info_cache =
+      new AnswerCache(std::max(options.location_cache_size, 1),
+                      options.location_cache_ttl);
+    HssCacheTask::configure_location_info_cache(location_info_cache);
+  }
+
+  AnswerCache* registration_status_cache = NULL;
+  if ((hss_configured) && (options.registration_status_cache_ttl > 0))
+  {
+    registration_status_cache =
+      new AnswerCache(std::max(options.registration_status_cache_size, 1),
+                      options.registration_status_cache_ttl);
+    HssCacheTask::configure_registration_status_cache(registration_status_cache);
+  }
+
+  ResponseCompressor* response_compressor = NULL;
+  if (options.http_compression_threshold > 0)
+  {
+    response_compressor =
+      new ResponseCompressor(options.http_compression_threshold,
+                             std::max(options.http_compression_cache_size, 0));
+    HssCacheTask::configure_response_compressor(response_compressor);
+  }
+
   ImpiTask::Config impi_handler_config(hss_configured,
                                        options.impu_cache_ttl,
                                        options.scheme_unknown,
@@ -822,15 +1188,32 @@ int main(int argc, char**argv)
   ImpuIMSSubscriptionTask::Config impu_handler_config_old(hss_configured,
                                                           options.hss_reregistration_time,
                                                           options.diameter_timeout_ms);
+  ImpuRegDataBatchTask::Config impu_batch_handler_config;
 
   HttpStackUtils::PingHandler ping_handler;
+  StageLatencyHandler stage_latency_handler(stats_manager);
+  CacheOperationStatsHandler cache_stats_handler(stats_manager);
+  HotSubscribersHandler hot_subscribers_handler(hot_subscribers);
+  NegativeCacheHandler negative_cache_handler(negative_cache);
+  WriteBehindStatsHandler write_behind_stats_handler(assoc_impu_writer);
   HttpStackUtils::SpawningHandler<ImpiDigestTask, ImpiTask::Config> impi_digest_handler(&impi_handler_config);
   HttpStackUtils::SpawningHandler<ImpiAvTask, ImpiTask::Config> impi_av_handler(&impi_handler_config);
   HttpStackUtils::SpawningHandler<ImpiRegistrationStatusTask, ImpiRegistrationStatusTask::Config> impi_reg_status_handler(&registration_status_handler_config);
   HttpStackUtils::SpawningHandler<ImpuLocationInfoTask, ImpuLocationInfoTask::Config> impu_loc_info_handler(&location_info_handler_config);
   HttpStackUtils::SpawningHandler<ImpuRegDataTask, ImpuRegDataTask::Config> impu_reg_data_handler(&impu_handler_config);
+  HttpStackUtils::SpawningHandler<ImpuRegDataBatchTask, ImpuRegDataBatchTask::Config> impu_reg_data_batch_handler(&impu_batch_handler_config);
   HttpStackUtils::SpawningHandler<ImpuIMSSubscriptionTask, ImpuIMSSubscriptionTask::Config> impu_ims_sub_handler(&impu_handler_config_old);
 
+  // Wrap the HSS cache handlers so they reject requests while draining on
+  // shutdown.
+  DrainingHandler impi_digest_draining_handler(&impi_digest_handler);
+  DrainingHandler impi_av_draining_handler(&impi_av_handler);
+  DrainingHandler impi_reg_status_draining_handler(&impi_reg_status_handler);
+  DrainingHandler impu_loc_info_draining_handler(&impu_loc_info_handler);
+  DrainingHandler impu_reg_data_draining_handler(&impu_reg_data_handler);
+  DrainingHandler impu_reg_data_batch_draining_handler(&impu_reg_data_batch_handler);
+  DrainingHandler impu_ims_sub_draining_handler(&impu_ims_sub_handler);
+
   try
   {
     http_stack->initialize();
@@ -843,18 +1226,38 @@ int main(int argc, char**argv)
                           stats_manager);
     http_stack->register_handler("^/ping$",
                                     &ping_handler);
+    http_stack->register_handler("^/stats/latency$",
+                                    &stage_latency_handler);
+    http_stack->register_handler("^/stats/cache$",
+                                    &cache_stats_handler);
+    http_stack->register_handler("^/stats/hot-subscribers$",
+                                    &hot_subscribers_handler);
+    if (negative_cache != NULL)
+    {
+      http_stack->register_handler("^/negative-cache$",
+                                      &negative_cache_handler);
+    }
+    if (assoc_impu_writer != NULL)
+    {
+      http_stack->register_handler("^/stats/write-behind$",
+                                      &write_behind_stats_handler);
+    }
     http_stack->register_handler("^/impi/[^/]*/digest$",
-                                    &impi_digest_handler);
+                                    &impi_digest_draining_handler);
     http_stack->register_handler("^/impi/[^/]*/av",
-                                    &impi_av_handler);
+                                    &impi_av_draining_handler);
     http_stack->register_handler("^/impi/[^/]*/registration-status$",
-                                    &impi_reg_status_handler);
+                                    &impi_reg_status_draining_handler);
     http_stack->register_handler("^/impu/[^/]*/location$",
-                                    &impu_loc_info_handler);
+                                    &impu_loc_info_draining_handler);
+    // The batch URL also matches the single public ID URL, so must be
+    // registered first.
+    http_stack->register_handler("^/impu/batch/reg-data$",
+                                    &impu_reg_data_batch_draining_handler);
     http_stack->register_handler("^/impu/[^/]*/reg-data$",
-                                    &impu_reg_data_handler);
+                                    &impu_reg_data_draining_handler);
     http_stack->register_handler("^/impu/",
-                                    &impu_ims_sub_handler);
+                                    &impu_ims_sub_draining_handler);
     http_stack->start();
   }
   catch (HttpStack::Exception& e)
@@ -898,6 +1301,16 @@ int main(int argc, char**argv)
   TRC_STATUS("Termination signal received - terminating");
   CL_HOMESTEAD_ENDED.log();
 
+  if (options.shutdown_drain_timeout_ms > 0)
+  {
+    // Stop accepting requests, and let those in progress finish (including
+    // refresh-ahead re-registrations) before stopping the HTTP stack, so
+    // they aren't dropped.  Write-behind writes are flushed below, once the
+    // HTTP stack has stopped.
+    HssCacheTask::start_draining();
+    HssCacheTask::drain(options.shutdown_drain_timeout_ms);
+  }
+
   try
   {
     http_stack->stop();
@@ -909,8 +1322,26 @@ int main(int argc, char**argv)
     TRC_ERROR("Failed to stop HttpStack stack - function %s, rc %d", e._func, e._rc);
   }
 
+  // Stop queueing associated public ID writes, and let the queued ones
+  // complete before stopping the cache.
+  HssCacheTask::configure_assoc_impu_writer(NULL);
+  if (assoc_impu_writer != NULL)
+  {
+    assoc_impu_writer->flush();
+  }
+
+  // Likewise let background re-registrations complete before stopping the
+  // cache and the Diameter stack.
+  HssCacheTask::configure_reg_data_refresher(NULL);
+  if (reg_data_refresher != NULL)
+  {
+    reg_data_refresher->flush();
+  }
+
   cache->stop();
   cache->wait_stopped();
+  delete assoc_impu_writer; assoc_impu_writer = NULL;
+  delete embedded_store; embedded_store = NULL;
 
   if (hss_configured)
   {
@@ -935,12 +1366,20 @@ int main(int argc, char**argv)
   delete rtr_config; rtr_config = NULL;
   delete ppr_task; ppr_task = NULL;
   delete rtr_task; rtr_task = NULL;
+  delete reg_data_refresher; reg_data_refresher = NULL;
 
   delete sprout_conn; sprout_conn = NULL;
 
   delete realm_counter; realm_counter = NULL;
   delete host_counter; host_counter = NULL;
   delete stats_manager; stats_manager = NULL;
+  delete hot_subscribers; hot_subscribers = NULL;
+  delete negative_cache; negative_cache = NULL;
+  delete location_info_cache; location_info_cache = NULL;
+  delete registration_status_cache; registration_status_cache = NULL;
+  delete response_compressor; response_compressor = NULL;
+  ThreadPlacement::configure(NULL);
+  delete thread_placement; thread_placement = NULL;
   delete mar_results_table; mar_results_table = NULL;
   delete sar_results_table; sar_results_table = NULL;
   delete uar_results_table; uar_results_table = NULL;
@@ -954,6 +1393,10 @@ int main(int argc, char**argv)
 
   delete load_monitor; load_monitor = NULL;
 
+  // Report any queued SAS events before shutting down SAS.
+  SasReporter::configure(NULL);
+  delete sas_reporter; sas_reporter = NULL;
+
   SAS::term();
 
   // Delete Homestead's alarm objects
@@ -0,0 +1,136 @@
+/**
+ * @file negative_cache.cpp Cache of identities the HSS reports as unknown.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "negative_cache.h"
+#include "log.h"
+
+const size_t NegativeCache::DEFAULT_CAPACITY;
+const unsigned long NegativeCache::DEFAULT_TTL_MS;
+
+const char* NegativeCache::command_name(Command command)
+{
+  switch (command)
+  {
+  case MAR:
+    return "mar";
+  case SAR:
+    return "sar";
+  case UAR:
+    return "uar";
+  case LIR:
+    return "lir";
+  default:
+    return "unknown"; // LCOV_EXCL_LINE
+  }
+}
+
+NegativeCache::NegativeCache(size_t capacity, unsigned long ttl_ms) :
+  _entries(capacity, ttl_ms)
+{
+  for (int ii = 0; ii < NUM_COMMANDS; ++ii)
+  {
+    _hits[ii] = 0;
+    _misses[ii] = 0;
+    _inserts[ii] = 0;
+  }
+}
+
+NegativeCache::~NegativeCache()
+{
+}
+
+bool NegativeCache::contains(Command command,
+                             const std::string& id,
+                             const std::string& other_id)
+{
+  std::string unused_body;
+  bool found = _entries.get(id,
+                            AnswerCache::make_params(command_name(command), other_id),
+                            unused_body);
+
+  if (found)
+  {
+    _hits[command]++;
+    TRC_DEBUG("%s %s %s is in the negative cache",
+              command_name(command), id.c_str(), other_id.c_str());
+  }
+  else
+  {
+    _misses[command]++;
+  }
+
+  return found;
+}
+
+void NegativeCache::add(Command command,
+                        const std::string& id,
+                        const std::string& other_id)
+{
+  // Tie the entry to the other identity too, so that invalidating either
+  // identity forgets it.
+  _entries.put(id,
+               AnswerCache::make_params(command_name(command), other_id),
+               "",
+               other_id);
+  _inserts[command]++;
+
+  TRC_DEBUG("Added %s %s %s to the negative cache",
+            command_name(command), id.c_str(), other_id.c_str());
+}
+
+void NegativeCache::invalidate(const std::string& id)
+{
+  _entries.invalidate(id);
+}
+
+void NegativeCache::clear()
+{
+  _entries.clear();
+}
+
+size_t NegativeCache::size()
+{
+  return _entries.size();
+}
+
+NegativeCache::Stats NegativeCache::stats(Command command) const
+{
+  Stats stats;
+  stats.hits = _hits[command];
+  stats.misses = _misses[command];
+  stats.inserts = _inserts[command];
+  return stats;
+}
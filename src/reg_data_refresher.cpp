@@ -0,0 +1,147 @@
+/**
+ * @file reg_data_refresher.cpp Refresh-ahead of registration data.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <chrono>
+
+#include "reg_data_refresher.h"
+#include "log.h"
+
+const size_t RegDataRefresher::DEFAULT_MAX_REFRESHES;
+const int RegDataRefresher::DEFAULT_MAX_RETRIES;
+const unsigned long RegDataRefresher::DEFAULT_FLUSH_TIMEOUT_MS;
+
+RegDataRefresher::RegDataRefresher(int min_remaining_ttl,
+                                   size_t max_refreshes,
+                                   int max_retries) :
+  _min_remaining_ttl(min_remaining_ttl),
+  _max_refreshes(max_refreshes),
+  _max_retries(max_retries),
+  _lock(),
+  _cond(),
+  _refreshing(),
+  _started(0),
+  _coalesced(0),
+  _overflowed(0),
+  _retried(0),
+  _succeeded(0),
+  _failed(0)
+{
+}
+
+RegDataRefresher::~RegDataRefresher()
+{
+  flush();
+  TRC_INFO("Registration data refreshes: %lu started, %lu coalesced, %lu overflowed, %lu retried, %lu succeeded, %lu failed",
+           (unsigned long)_started, (unsigned long)_coalesced,
+           (unsigned long)_overflowed, (unsigned long)_retried,
+           (unsigned long)_succeeded, (unsigned long)_failed);
+}
+
+RegDataRefresher::Admission RegDataRefresher::admit(const std::string& impu,
+                                                    int remaining_ttl)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+
+  if (_refreshing.find(impu) != _refreshing.end())
+  {
+    // The HSS is already being told about this public ID, and the cache will
+    // be refreshed when it answers.  This check comes first so that a burst
+    // of re-registrations near expiry sends only one request to the HSS.
+    TRC_DEBUG("Refresh of %s already in progress", impu.c_str());
+    _coalesced++;
+    return IN_PROGRESS;
+  }
+
+  if (remaining_ttl < _min_remaining_ttl)
+  {
+    // The record could expire before a background refresh completes, so the
+    // HSS must be told before replying.
+    TRC_DEBUG("Record for %s expires in %d seconds - refreshing inline",
+              impu.c_str(), remaining_ttl);
+    return INLINE;
+  }
+
+  if (_refreshing.size() >= _max_refreshes)
+  {
+    TRC_DEBUG("Too many registration data refreshes in progress (%d)",
+              _refreshing.size());
+    _overflowed++;
+    return INLINE;
+  }
+
+  TRC_DEBUG("Refreshing %s in the background", impu.c_str());
+  _refreshing.insert(impu);
+  _started++;
+  return REFRESH;
+}
+
+void RegDataRefresher::complete(const std::string& impu, bool success)
+{
+  if (success)
+  {
+    _succeeded++;
+  }
+  else
+  {
+    _failed++;
+  }
+
+  std::lock_guard<std::mutex> lock(_lock);
+  _refreshing.erase(impu);
+  _cond.notify_all();
+}
+
+bool RegDataRefresher::flush(unsigned long timeout_ms)
+{
+  std::unique_lock<std::mutex> lock(_lock);
+  bool flushed = _cond.wait_for(lock,
+                                std::chrono::milliseconds(timeout_ms),
+                                [this]{ return _refreshing.empty(); });
+
+  if (!flushed)
+  {
+    TRC_WARNING("%d registration data refreshes still in progress after %lums",
+                _refreshing.size(), timeout_ms);
+  }
+
+  return flushed;
+}
+
+size_t RegDataRefresher::in_progress()
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  return _refreshing.size();
+}
@@ -0,0 +1,285 @@
+/**
+ * @file response_compressor.cpp Negotiated compression of HTTP response bodies.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "response_compressor.h"
+#include "log.h"
+
+const size_t ResponseCompressor::DEFAULT_THRESHOLD;
+const unsigned long ResponseCompressor::CACHE_TTL_MS;
+
+// zlib window bits for each encoding.  Adding 16 to the maximum window size
+// makes zlib write a gzip header and trailer rather than a zlib one.
+static const int DEFLATE_WINDOW_BITS = 15;
+static const int GZIP_WINDOW_BITS = 15 + 16;
+
+/// A zlib stream owned by a single thread.  Streams are reset rather than
+/// reallocated between responses, which saves zlib's ~256KB of state being
+/// allocated and freed every time.
+class ThreadCompressor
+{
+public:
+  ThreadCompressor(int window_bits) : _initialized(false)
+  {
+    memset(&_stream, 0, sizeof(_stream));
+    _initialized = (deflateInit2(&_stream,
+                                 Z_DEFAULT_COMPRESSION,
+                                 Z_DEFLATED,
+                                 window_bits,
+                                 8,
+                                 Z_DEFAULT_STRATEGY) == Z_OK);
+  }
+
+  ~ThreadCompressor()
+  {
+    if (_initialized)
+    {
+      deflateEnd(&_stream);
+    }
+  }
+
+  /// @return the stream, ready to compress a new body, or NULL if zlib
+  /// couldn't be initialized.
+  z_stream* stream()
+  {
+    if ((!_initialized) || (deflateReset(&_stream) != Z_OK))
+    {
+      return NULL;
+    }
+
+    return &_stream;
+  }
+
+private:
+  z_stream _stream;
+  bool _initialized;
+};
+
+// Strip leading and trailing whitespace from a header token.
+static std::string trim(const std::string& str)
+{
+  size_t start = str.find_first_not_of(" \t");
+  if (start == std::string::npos)
+  {
+    return "";
+  }
+
+  size_t end = str.find_last_not_of(" \t");
+  return str.substr(start, end - start + 1);
+}
+
+ResponseCompressor::ResponseCompressor(size_t threshold, size_t cache_size) :
+  _threshold(threshold),
+  _cache((cache_size > 0) ? new AnswerCache(cache_size, CACHE_TTL_MS) : NULL),
+  _compressions(0)
+{
+}
+
+ResponseCompressor::~ResponseCompressor()
+{
+  delete _cache; _cache = NULL;
+}
+
+ResponseCompressor::Encoding ResponseCompressor::choose_encoding(const std::string& accept_encoding)
+{
+  // Whether each coding is acceptable, as set by an explicit entry for it or
+  // by a "*" entry.  An explicit entry takes precedence over "*", whichever
+  // order they appear in (so "*, gzip;q=0" doesn't allow gzip).
+  bool gzip = false;
+  bool gzip_explicit = false;
+  bool deflate = false;
+  bool deflate_explicit = false;
+  bool any = false;
+
+  size_t start = 0;
+
+  while (start <= accept_encoding.size())
+  {
+    size_t end = accept_encoding.find(',', start);
+    if (end == std::string::npos)
+    {
+      end = accept_encoding.size();
+    }
+
+    std::string coding = accept_encoding.substr(start, end - start);
+    start = end + 1;
+
+    // Each coding may have a quality value (e.g. "gzip;q=0.5").  A quality of
+    // zero means the coding is not acceptable.
+    std::string name = coding;
+    bool acceptable = true;
+    size_t semicolon = coding.find(';');
+
+    if (semicolon != std::string::npos)
+    {
+      name = coding.substr(0, semicolon);
+      size_t q = coding.find("q=", semicolon);
+      acceptable = ((q == std::string::npos) ||
+                    (strtod(coding.c_str() + q + 2, NULL) > 0));
+    }
+
+    name = trim(name);
+
+    if ((name == "gzip") || (name == "x-gzip"))
+    {
+      gzip = gzip || acceptable;
+      gzip_explicit = true;
+    }
+    else if (name == "deflate")
+    {
+      deflate = deflate || acceptable;
+      deflate_explicit = true;
+    }
+    else if (name == "*")
+    {
+      any = any || acceptable;
+    }
+  }
+
+  if (!gzip_explicit)
+  {
+    gzip = any;
+  }
+
+  if (!deflate_explicit)
+  {
+    deflate = any;
+  }
+
+  return gzip ? GZIP : (deflate ? DEFLATE : IDENTITY);
+}
+
+const char* ResponseCompressor::encoding_name(Encoding encoding)
+{
+  switch (encoding)
+  {
+  case GZIP:
+    return "gzip";
+  case DEFLATE:
+    return "deflate";
+  default:
+    return "identity";
+  }
+}
+
+bool ResponseCompressor::will_cache(size_t body_size, Encoding encoding) const
+{
+  return ((_cache != NULL) &&
+          (encoding != IDENTITY) &&
+          (body_size >= _threshold));
+}
+
+bool ResponseCompressor::compress(const std::string& body,
+                                  Encoding encoding,
+                                  const std::string& id,
+                                  const std::string& version,
+                                  std::string& compressed)
+{
+  if ((encoding == IDENTITY) || (body.size() < _threshold))
+  {
+    return false;
+  }
+
+  std::string params;
+
+  if ((_cache != NULL) && (!id.empty()))
+  {
+    params = AnswerCache::make_params(version, encoding_name(encoding));
+
+    if (_cache->get(id, params, compressed))
+    {
+      return true;
+    }
+  }
+
+  if (!deflate_body(body, encoding, compressed))
+  {
+    return false;
+  }
+
+  _compressions++;
+  TRC_DEBUG("Compressed %d byte body to %d bytes with %s",
+            (int)body.size(), (int)compressed.size(), encoding_name(encoding));
+
+  if (!params.empty())
+  {
+    _cache->put(id, params, compressed);
+  }
+
+  return true;
+}
+
+bool ResponseCompressor::deflate_body(const std::string& body,
+                                      Encoding encoding,
+                                      std::string& compressed)
+{
+  static thread_local ThreadCompressor gzip_compressor(GZIP_WINDOW_BITS);
+  static thread_local ThreadCompressor deflate_compressor(DEFLATE_WINDOW_BITS);
+
+  z_stream* stream = (encoding == GZIP) ?
+                       gzip_compressor.stream() :
+                       deflate_compressor.stream();
+
+  if (stream == NULL)
+  {
+    TRC_WARNING("Failed to initialize %s compressor", encoding_name(encoding));
+    return false;
+  }
+
+  // Size the output for the worst case, so a single call compresses the
+  // whole body.  The gzip header and trailer are a few bytes bigger than
+  // zlib's, which deflateBound doesn't allow for.
+  compressed.resize(deflateBound(stream, body.size()) + 18);
+
+  stream->next_in = (Bytef*)body.data();
+  stream->avail_in = body.size();
+  stream->next_out = (Bytef*)&compressed[0];
+  stream->avail_out = compressed.size();
+
+  if (deflate(stream, Z_FINISH) != Z_STREAM_END)
+  {
+    TRC_WARNING("Failed to %s compress %d byte body",
+                encoding_name(encoding), (int)body.size());
+    compressed.clear();
+    return false;
+  }
+
+  compressed.resize(stream->total_out);
+  return true;
+}
@@ -0,0 +1,254 @@
+/**
+ * @file sas_reporter.cpp Builds and reports SAS events with large
+ * compressed parameters on a background thread.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "sas_reporter.h"
+#include "log.h"
+
+const size_t SasCompressionCache::NUM_ENTRIES;
+const size_t SasReporter::DEFAULT_MAX_QUEUE_LEN;
+std::atomic<SasReporter*> SasReporter::_instance(NULL);
+
+SasCompressionCache::SasCompressionCache() :
+  _next(0),
+  _hits(0)
+{
+  for (size_t ii = 0; ii < NUM_ENTRIES; ++ii)
+  {
+    _entries[ii].profile = NULL;
+  }
+}
+
+const std::string& SasCompressionCache::compress(const SharedPayload& param,
+                                                 const SAS::Profile* profile)
+{
+  for (size_t ii = 0; ii < NUM_ENTRIES; ++ii)
+  {
+    if ((_entries[ii].param == param) && (_entries[ii].profile == profile))
+    {
+      _hits++;
+      return _entries[ii].compressed;
+    }
+  }
+
+  // Not seen recently, so compress it and replace the oldest entry.
+  Entry& entry = _entries[_next];
+  _next = (_next + 1) % NUM_ENTRIES;
+  entry.param = param;
+  entry.profile = profile;
+  entry.compressed = SAS::Compressor::get()->compress(*param, profile);
+  return entry.compressed;
+}
+
+DeferredSasEvent::DeferredSasEvent(SAS::TrailId trail,
+                                   uint32_t event_id,
+                                   uint32_t instance_id) :
+  _trail(trail),
+  _timestamp(SAS::get_current_timestamp()),
+  _event_id(event_id),
+  _instance_id(instance_id),
+  _params()
+{
+}
+
+DeferredSasEvent& DeferredSasEvent::add_static_param(uint32_t param)
+{
+  Param p;
+  p.type = STATIC_PARAM;
+  p.value = param;
+  p.profile = NULL;
+  _params.push_back(std::move(p));
+  return *this;
+}
+
+DeferredSasEvent& DeferredSasEvent::add_var_param(std::string param)
+{
+  Param p;
+  p.type = VAR_PARAM;
+  p.value = 0;
+  p.str = std::move(param);
+  p.profile = NULL;
+  _params.push_back(std::move(p));
+  return *this;
+}
+
+DeferredSasEvent& DeferredSasEvent::add_compressed_param(std::string param,
+                                                         const SAS::Profile* profile)
+{
+  Param p;
+  p.type = COMPRESSED_PARAM;
+  p.value = 0;
+  p.str = std::move(param);
+  p.profile = profile;
+  _params.push_back(std::move(p));
+  return *this;
+}
+
+DeferredSasEvent& DeferredSasEvent::add_compressed_param(const SharedPayload& param,
+                                                         const SAS::Profile* profile)
+{
+  Param p;
+  p.type = COMPRESSED_PARAM;
+  p.value = 0;
+  p.payload = param;
+  p.profile = profile;
+  _params.push_back(std::move(p));
+  return *this;
+}
+
+void DeferredSasEvent::report()
+{
+  SasReporter* reporter = SasReporter::instance();
+  if ((reporter == NULL) || (!reporter->queue(*this)))
+  {
+    build_and_report();
+  }
+}
+
+void DeferredSasEvent::build_and_report(SasCompressionCache* cache) const
+{
+  SAS::Event event(_trail, _event_id, _instance_id);
+  event.set_timestamp(_timestamp);
+
+  for (std::vector<Param>::const_iterator it = _params.begin();
+       it != _params.end();
+       ++it)
+  {
+    switch (it->type)
+    {
+    case STATIC_PARAM:
+      event.add_static_param(it->value);
+      break;
+
+    case VAR_PARAM:
+      event.add_var_param(it->str);
+      break;
+
+    case COMPRESSED_PARAM:
+      if (it->payload == NULL)
+      {
+        event.add_compressed_param(it->str, it->profile);
+      }
+      else if (cache != NULL)
+      {
+        // A compressed parameter is just a variable parameter holding the
+        // compressed bytes.
+        event.add_var_param(cache->compress(it->payload, it->profile));
+      }
+      else
+      {
+        event.add_compressed_param(*it->payload, it->profile);
+      }
+      break;
+    }
+  }
+
+  SAS::report_event(event);
+}
+
+SasReporter::SasReporter(size_t max_queue_len) :
+  _max_queue_len(max_queue_len),
+  _lock(),
+  _cond(),
+  _queue(),
+  _terminating(false),
+  _compression_cache(),
+  _thread(),
+  _reported(0),
+  _rejected(0)
+{
+  _thread = std::thread(&SasReporter::run, this);
+}
+
+SasReporter::~SasReporter()
+{
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    _terminating = true;
+  }
+  _cond.notify_one();
+  _thread.join();
+}
+
+bool SasReporter::queue(DeferredSasEvent& event)
+{
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    if (_queue.size() >= _max_queue_len)
+    {
+      _rejected++;
+      return false;
+    }
+    _queue.push_back(std::move(event));
+  }
+  _cond.notify_one();
+  return true;
+}
+
+void SasReporter::run()
+{
+  std::unique_lock<std::mutex> lock(_lock);
+
+  while (true)
+  {
+    _cond.wait(lock, [this]{ return _terminating || !_queue.empty(); });
+
+    if (_queue.empty())
+    {
+      // Only reached when terminating, once every event has been reported.
+      break;
+    }
+
+    DeferredSasEvent event = std::move(_queue.front());
+    _queue.pop_front();
+
+    // Build the event (which is the expensive part) without the lock held.
+    lock.unlock();
+    event.build_and_report(&_compression_cache);
+    _reported++;
+    lock.lock();
+  }
+}
+
+void SasReporter::configure(SasReporter* reporter)
+{
+  _instance = reporter;
+}
+
+SasReporter* SasReporter::instance()
+{
+  return _instance;
+}
@@ -36,6 +36,29 @@
 
 #include <statisticsmanager.h>
 
+// The SNMP tables for the per-stage latencies.  These must be in the same order
+// as the StatisticsManager::Stage enum.
+static const struct
+{
+  const char* name;
+  const char* table_name;
+  const char* oid;
+} STAGE_TABLES[StatisticsManager::NUM_STAGES] =
+{
+  {"cache_queue_wait", "H_cache_queue_wait_latency_us", ".1.2.826.0.1.1578918.9.5.16"},
+  {"cache_read",       "H_cache_read_latency_us",       ".1.2.826.0.1.1578918.9.5.17"},
+  {"hss",              "H_hss_stage_latency_us",        ".1.2.826.0.1.1578918.9.5.18"},
+  {"cache_write",      "H_cache_write_latency_us",      ".1.2.826.0.1.1578918.9.5.19"},
+  {"xml_render",       "H_xml_render_latency_us",       ".1.2.826.0.1.1578918.9.5.20"},
+  {"reply",            "H_reply_latency_us",            ".1.2.826.0.1.1578918.9.5.21"},
+};
+
+const int StatisticsManager::MAX_CACHE_RESULT_CODES;
+
+// The per-operation cache tables live under this OID, indexed by operation
+// type (starting at 1) and then by statistic.
+static const std::string CACHE_OP_OID_ROOT = ".1.2.826.0.1.1578918.9.5.22";
+
 StatisticsManager::StatisticsManager()
 {
   H_latency_us = SNMP::EventAccumulatorTable::create("H_latency_us",
@@ -52,6 +75,39 @@ StatisticsManager::StatisticsManager()
                                                    ".1.2.826.0.1.1578918.9.5.6");
   H_rejected_overload = SNMP::CounterTable::create("H_rejected_overload",
                                                    ".1.2.826.0.1.1578918.9.5.7");
+
+  for (int ii = 0; ii < NUM_STAGES; ++ii)
+  {
+    _stage_latency_tables[ii] =
+      SNMP::EventAccumulatorTable::create(STAGE_TABLES[ii].table_name,
+                                          STAGE_TABLES[ii].oid);
+  }
+
+  for (int ii = 0; ii < Cache::NUM_OPERATION_TYPES; ++ii)
+  {
+    std::string name = std::string("H_cache_") +
+                       Cache::operation_name((Cache::OperationType)ii);
+    std::string oid = CACHE_OP_OID_ROOT + "." + std::to_string(ii + 1);
+    CacheOpStats& op = _cache_ops[ii];
+
+    op.latency_us = SNMP::EventAccumulatorTable::create(name + "_latency_us",
+                                                        oid + ".1");
+    op.queue_wait_us = SNMP::EventAccumulatorTable::create(name + "_queue_wait_us",
+                                                           oid + ".2");
+    op.rows = SNMP::EventAccumulatorTable::create(name + "_rows",
+                                                  oid + ".3");
+    op.bytes_read = SNMP::EventAccumulatorTable::create(name + "_bytes_read",
+                                                        oid + ".4");
+    op.bytes_written = SNMP::EventAccumulatorTable::create(name + "_bytes_written",
+                                                           oid + ".5");
+    op.failures = SNMP::CounterTable::create(name + "_failures",
+                                             oid + ".6");
+
+    for (int rc = 0; rc < MAX_CACHE_RESULT_CODES; ++rc)
+    {
+      op.results[rc] = 0;
+    }
+  }
 }
 
 StatisticsManager::~StatisticsManager()
@@ -63,4 +119,101 @@ StatisticsManager::~StatisticsManager()
   delete H_hss_subscription_latency_us; H_hss_subscription_latency_us = NULL;
   delete H_incoming_requests; H_incoming_requests = NULL;
   delete H_rejected_overload; H_rejected_overload = NULL;
+
+  for (int ii = 0; ii < NUM_STAGES; ++ii)
+  {
+    delete _stage_latency_tables[ii]; _stage_latency_tables[ii] = NULL;
+  }
+
+  for (int ii = 0; ii < Cache::NUM_OPERATION_TYPES; ++ii)
+  {
+    CacheOpStats& op = _cache_ops[ii];
+    delete op.latency_us; op.latency_us = NULL;
+    delete op.queue_wait_us; op.queue_wait_us = NULL;
+    delete op.rows; op.rows = NULL;
+    delete op.bytes_read; op.bytes_read = NULL;
+    delete op.bytes_written; op.bytes_written = NULL;
+    delete op.failures; op.failures = NULL;
+  }
+}
+
+const char* StatisticsManager::stage_name(Stage stage)
+{
+  return ((stage >= 0) && (stage < NUM_STAGES)) ? STAGE_TABLES[stage].name :
+                                                  "unknown";
+}
+
+void StatisticsManager::update_stage_latency_us(Stage stage,
+                                                unsigned long sample)
+{
+  if ((stage >= 0) && (stage < NUM_STAGES))
+  {
+    _stage_histograms[stage].record(sample);
+    _stage_latency_tables[stage]->accumulate(sample);
+  }
+}
+
+const char* StatisticsManager::cache_result_name(int rc)
+{
+  switch (rc)
+  {
+  case CassandraStore::OK:
+    return "ok";
+  case CassandraStore::INVALID_REQUEST:
+    return "invalid_request";
+  case CassandraStore::NOT_FOUND:
+    return "not_found";
+  case CassandraStore::CONNECTION_ERROR:
+    return "connection_error";
+  case CassandraStore::RESOURCE_ERROR:
+    return "resource_error";
+  case CassandraStore::UNKNOWN_ERROR:
+    return "unknown_error";
+  default:
+    return "other";
+  }
+}
+
+void StatisticsManager::update_cache_op_stats(Cache::OperationType type,
+                                              CassandraStore::ResultCode rc,
+                                              unsigned long latency_us,
+                                              unsigned long queue_wait_us,
+                                              uint64_t rows,
+                                              uint64_t bytes_read,
+                                              uint64_t bytes_written)
+{
+  if ((type < 0) || (type >= Cache::NUM_OPERATION_TYPES))
+  {
+    return; // LCOV_EXCL_LINE
+  }
+
+  CacheOpStats& op = _cache_ops[type];
+  op.latency_histogram.record(latency_us);
+  op.latency_us->accumulate(latency_us);
+  op.queue_wait_us->accumulate(queue_wait_us);
+  op.rows->accumulate(rows);
+  op.bytes_read->accumulate(bytes_read);
+  op.bytes_written->accumulate(bytes_written);
+
+  // NOT_FOUND is a normal outcome for a cache read, so isn't a failure.
+  if ((rc != CassandraStore::OK) && (rc != CassandraStore::NOT_FOUND))
+  {
+    op.failures->increment();
+  }
+
+  int index = ((rc >= 0) && (rc < MAX_CACHE_RESULT_CODES)) ?
+                rc : (MAX_CACHE_RESULT_CODES - 1);
+  op.results[index].fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t StatisticsManager::cache_op_result_count(Cache::OperationType type,
+                                                  int rc) const
+{
+  if ((type < 0) || (type >= Cache::NUM_OPERATION_TYPES) ||
+      (rc < 0) || (rc >= MAX_CACHE_RESULT_CODES))
+  {
+    return 0;
+  }
+
+  return _cache_ops[type].results[rc].load(std::memory_order_relaxed);
 }
@@ -0,0 +1,374 @@
+/**
+ * @file thread_placement.cpp CPU and NUMA placement of homestead's threads.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include <boost/algorithm/string.hpp>
+
+#include "thread_placement.h"
+#include "log.h"
+
+const std::string ThreadPlacement::DEFAULT_SYSFS_DIR = "/sys/devices/system/node";
+std::atomic<ThreadPlacement*> ThreadPlacement::_instance(NULL);
+thread_local bool ThreadPlacement::_thread_placed = false;
+
+static const char* GROUP_NAMES[ThreadPlacement::NUM_GROUPS] =
+{
+  "http",
+  "cache",
+  "diameter"
+};
+
+static const std::string NODE_PREFIX = "node";
+
+ThreadPlacement::ThreadPlacement()
+{
+  for (int ii = 0; ii < NUM_GROUPS; ii++)
+  {
+    _groups[ii].node = -1;
+  }
+}
+
+void ThreadPlacement::set_group(Group group, const std::vector<int>& cpus, int node)
+{
+  _groups[group].cpus = cpus;
+  _groups[group].node = node;
+}
+
+bool ThreadPlacement::parse(const std::string& spec, const Topology& topology)
+{
+  std::vector<std::string> entries;
+  boost::split(entries, spec, boost::is_any_of(";"));
+
+  for (std::vector<std::string>::const_iterator entry = entries.begin();
+       entry != entries.end();
+       ++entry)
+  {
+    size_t colon = entry->find(':');
+    if (colon == std::string::npos)
+    {
+      TRC_ERROR("Invalid thread placement %s - expected <group>:<target>",
+                entry->c_str());
+      return false;
+    }
+
+    std::string name = entry->substr(0, colon);
+    std::string target = entry->substr(colon + 1);
+
+    int group = 0;
+    while ((group < NUM_GROUPS) && (name != GROUP_NAMES[group]))
+    {
+      group++;
+    }
+
+    if (group == NUM_GROUPS)
+    {
+      TRC_ERROR("Invalid thread group %s in thread placement", name.c_str());
+      return false;
+    }
+
+    std::vector<int> cpus;
+    int node = -1;
+
+    if (target.compare(0, NODE_PREFIX.length(), NODE_PREFIX) == 0)
+    {
+      // All the CPUs on a node, allocating memory from that node.
+      std::string node_str = target.substr(NODE_PREFIX.length());
+      char* end = NULL;
+      node = strtol(node_str.c_str(), &end, 10);
+      Topology::const_iterator it = topology.find(node);
+
+      if ((node_str.empty()) || (*end != '\0') || (it == topology.end()))
+      {
+        TRC_ERROR("Invalid NUMA node %s in thread placement", target.c_str());
+        return false;
+      }
+
+      cpus = it->second;
+    }
+    else if (parse_cpu_list(target, cpus))
+    {
+      // If the CPUs are all on one node, allocate memory from that node.
+      for (Topology::const_iterator it = topology.begin();
+           it != topology.end();
+           ++it)
+      {
+        bool all_on_node = true;
+        for (std::vector<int>::const_iterator cpu = cpus.begin();
+             (cpu != cpus.end()) && (all_on_node);
+             ++cpu)
+        {
+          all_on_node = (std::find(it->second.begin(), it->second.end(), *cpu) !=
+                         it->second.end());
+        }
+
+        if (all_on_node)
+        {
+          node = it->first;
+          break;
+        }
+      }
+    }
+    else
+    {
+      TRC_ERROR("Invalid CPU list %s in thread placement", target.c_str());
+      return false;
+    }
+
+    set_group((Group)group, cpus, node);
+  }
+
+  return true;
+}
+
+void ThreadPlacement::derive(const Topology& topology,
+                             int http_threads,
+                             int cache_threads)
+{
+  if (topology.size() < 2)
+  {
+    TRC_INFO("Single NUMA node - leaving thread placement to the kernel");
+    return;
+  }
+
+  size_t needed = http_threads + cache_threads;
+
+  for (Topology::const_iterator it = topology.begin();
+       it != topology.end();
+       ++it)
+  {
+    if (it->second.size() >= needed)
+    {
+      for (int group = 0; group < NUM_GROUPS; group++)
+      {
+        set_group((Group)group, it->second, it->first);
+      }
+      return;
+    }
+  }
+
+  // No node is big enough for every thread, so move the cache threads to the
+  // second node.
+  Topology::const_iterator first = topology.begin();
+  Topology::const_iterator second = first;
+  ++second;
+  set_group(HTTP, first->second, first->first);
+  set_group(DIAMETER, first->second, first->first);
+  set_group(CACHE, second->second, second->first);
+}
+
+void ThreadPlacement::place(Group group) const
+{
+  const Placement& placement = _groups[group];
+
+  if (!placement.cpus.empty())
+  {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    for (std::vector<int>::const_iterator cpu = placement.cpus.begin();
+         cpu != placement.cpus.end();
+         ++cpu)
+    {
+      CPU_SET(*cpu, &cpuset);
+    }
+
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    if (rc != 0)
+    {
+      TRC_WARNING("Failed to set CPU affinity of %s thread: %d",
+                  GROUP_NAMES[group], rc);
+    }
+  }
+
+  if ((placement.node >= 0) &&
+      (placement.node < (int)(sizeof(unsigned long) * 8)))
+  {
+    // Prefer (rather than require) the node, so allocations still succeed if
+    // it runs out of memory.
+    unsigned long nodemask = 1UL << placement.node;
+    if (syscall(SYS_set_mempolicy,
+                MPOL_PREFERRED,
+                &nodemask,
+                sizeof(nodemask) * 8) != 0)
+    {
+      TRC_WARNING("Failed to set NUMA memory policy of %s thread: %d",
+                  GROUP_NAMES[group], errno);
+    }
+  }
+
+  TRC_DEBUG("Placed %s thread", GROUP_NAMES[group]);
+}
+
+std::string ThreadPlacement::to_string() const
+{
+  std::ostringstream oss;
+
+  for (int group = 0; group < NUM_GROUPS; group++)
+  {
+    const Placement& placement = _groups[group];
+    oss << ((group == 0) ? "" : "; ") << GROUP_NAMES[group] << ": ";
+
+    if (placement.cpus.empty())
+    {
+      oss << "any CPU";
+    }
+    else
+    {
+      oss << placement.cpus.size() << " CPUs";
+    }
+
+    if (placement.node >= 0)
+    {
+      oss << ", node " << placement.node;
+    }
+  }
+
+  return oss.str();
+}
+
+ThreadPlacement::Topology ThreadPlacement::read_topology(const std::string& sysfs_dir)
+{
+  Topology topology;
+  DIR* dir = opendir(sysfs_dir.c_str());
+
+  if (dir != NULL)
+  {
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+      std::string name = entry->d_name;
+      if ((name.compare(0, NODE_PREFIX.length(), NODE_PREFIX) != 0) ||
+          (name.find_first_not_of("0123456789", NODE_PREFIX.length()) != std::string::npos) ||
+          (name.length() == NODE_PREFIX.length()))
+      {
+        continue;
+      }
+
+      std::ifstream cpulist((sysfs_dir + "/" + name + "/cpulist").c_str());
+      std::string line;
+      std::vector<int> cpus;
+
+      if ((std::getline(cpulist, line)) &&
+          (parse_cpu_list(line, cpus)) &&
+          (!cpus.empty()))
+      {
+        topology[atoi(name.c_str() + NODE_PREFIX.length())] = cpus;
+      }
+    }
+
+    closedir(dir);
+  }
+
+  if (topology.empty())
+  {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int cpu = 0; cpu < num_cpus; cpu++)
+    {
+      topology[0].push_back(cpu);
+    }
+  }
+
+  return topology;
+}
+
+bool ThreadPlacement::parse_cpu_list(const std::string& str, std::vector<int>& cpus)
+{
+  std::string trimmed = boost::algorithm::trim_copy(str);
+  if (trimmed.empty())
+  {
+    return true;
+  }
+
+  std::vector<std::string> ranges;
+  boost::split(ranges, trimmed, boost::is_any_of(","));
+
+  for (std::vector<std::string>::const_iterator range = ranges.begin();
+       range != ranges.end();
+       ++range)
+  {
+    char* end = NULL;
+    long first = strtol(range->c_str(), &end, 10);
+    long last = first;
+
+    if ((end == range->c_str()) || (first < 0))
+    {
+      return false;
+    }
+
+    if (*end == '-')
+    {
+      const char* start = end + 1;
+      last = strtol(start, &end, 10);
+      if ((end == start) || (last < first))
+      {
+        return false;
+      }
+    }
+
+    if ((*end != '\0') || (last >= CPU_SETSIZE))
+    {
+      return false;
+    }
+
+    for (long cpu = first; cpu <= last; cpu++)
+    {
+      cpus.push_back(cpu);
+    }
+  }
+
+  return true;
+}
+
+void ThreadPlacement::configure(ThreadPlacement* placement)
+{
+  _instance = placement;
+}
+
+ThreadPlacement* ThreadPlacement::instance()
+{
+  return _instance;
+}
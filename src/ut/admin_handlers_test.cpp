@@ -0,0 +1,298 @@
+/**
+ * @file admin_handlers_test.cpp UT for the administrative HTTP handlers.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+
+#include "mockhttpstack.hpp"
+#include "fakesnmp.hpp"
+#include "admin_handlers.h"
+
+#include "rapidjson/document.h"
+
+using ::testing::_;
+
+const SAS::TrailId FAKE_TRAIL_ID = 0x12345678;
+
+/// Fixture for AdminHandlersTest.
+class AdminHandlersTest : public testing::Test
+{
+public:
+  AdminHandlersTest()
+  {
+    _httpstack = new MockHttpStack();
+    _stats = new StatisticsManager();
+  }
+
+  ~AdminHandlersTest()
+  {
+    delete _stats; _stats = NULL;
+    delete _httpstack; _httpstack = NULL;
+  }
+
+  MockHttpStack* _httpstack;
+  StatisticsManager* _stats;
+};
+
+TEST_F(AdminHandlersTest, StageLatencyReport)
+{
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    _stats->update_stage_latency_us(StatisticsManager::STAGE_HSS, 10);
+  }
+  _stats->update_stage_latency_us(StatisticsManager::STAGE_XML_RENDER, 20);
+
+  StageLatencyHandler handler(_stats);
+  MockHttpStack::Request req(_httpstack, "/stats/latency", "");
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  handler.process_request(req, FAKE_TRAIL_ID);
+
+  rapidjson::Document doc;
+  doc.Parse<0>(req.content().c_str());
+  ASSERT_FALSE(doc.HasParseError());
+
+  // Every stage is reported, even if it has no samples.
+  for (int ii = 0; ii < StatisticsManager::NUM_STAGES; ++ii)
+  {
+    const char* name =
+      StatisticsManager::stage_name((StatisticsManager::Stage)ii);
+    ASSERT_TRUE(doc.HasMember(name));
+  }
+
+  EXPECT_EQ(100u, doc["hss"]["count"].GetUint64());
+  EXPECT_EQ(10u, doc["hss"]["p50"].GetUint64());
+  EXPECT_EQ(10u, doc["hss"]["p999"].GetUint64());
+  EXPECT_EQ(1u, doc["xml_render"]["count"].GetUint64());
+  EXPECT_EQ(20u, doc["xml_render"]["max"].GetUint64());
+  EXPECT_EQ(0u, doc["cache_queue_wait"]["count"].GetUint64());
+  EXPECT_EQ(0u, doc["hss"]["previous"]["count"].GetUint64());
+  EXPECT_EQ(300000u, doc["period_ms"].GetUint64());
+}
+
+TEST_F(AdminHandlersTest, StageLatencyBadMethod)
+{
+  StageLatencyHandler handler(_stats);
+  MockHttpStack::Request req(_httpstack,
+                             "/stats/latency",
+                             "",
+                             "",
+                             "",
+                             htp_method_PUT);
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 405, _));
+  handler.process_request(req, FAKE_TRAIL_ID);
+}
+
+TEST_F(AdminHandlersTest, CacheOperationReport)
+{
+  _stats->update_cache_op_stats(Cache::OP_GET_REG_DATA,
+                                CassandraStore::OK,
+                                100, 5, 1, 200, 0);
+  _stats->update_cache_op_stats(Cache::OP_GET_REG_DATA,
+                                CassandraStore::NOT_FOUND,
+                                50, 5, 0, 0, 0);
+  _stats->update_cache_op_stats(Cache::OP_PUT_REG_DATA,
+                                CassandraStore::CONNECTION_ERROR,
+                                3000, 0, 4, 0, 400);
+
+  CacheOperationStatsHandler handler(_stats);
+  MockHttpStack::Request req(_httpstack, "/stats/cache", "");
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  handler.process_request(req, FAKE_TRAIL_ID);
+
+  rapidjson::Document doc;
+  doc.Parse<0>(req.content().c_str());
+  ASSERT_FALSE(doc.HasParseError());
+
+  // Every operation type is reported, even if it has no samples.
+  for (int ii = 0; ii < Cache::NUM_OPERATION_TYPES; ++ii)
+  {
+    const char* name = Cache::operation_name((Cache::OperationType)ii);
+    ASSERT_TRUE(doc.HasMember(name));
+  }
+
+  EXPECT_EQ(2u, doc["get_reg_data"]["count"].GetUint64());
+  EXPECT_EQ(100u, doc["get_reg_data"]["max"].GetUint64());
+  EXPECT_EQ(1u, doc["get_reg_data"]["results"]["ok"].GetUint64());
+  EXPECT_EQ(1u, doc["get_reg_data"]["results"]["not_found"].GetUint64());
+  EXPECT_EQ(1u, doc["put_reg_data"]["results"]["connection_error"].GetUint64());
+  EXPECT_FALSE(doc["put_reg_data"]["results"].HasMember("ok"));
+  EXPECT_EQ(0u, doc["get_auth_vector"]["count"].GetUint64());
+}
+
+TEST_F(AdminHandlersTest, CacheOperationBadMethod)
+{
+  CacheOperationStatsHandler handler(_stats);
+  MockHttpStack::Request req(_httpstack,
+                             "/stats/cache",
+                             "",
+                             "",
+                             "",
+                             htp_method_POST);
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 405, _));
+  handler.process_request(req, FAKE_TRAIL_ID);
+}
+
+TEST_F(AdminHandlersTest, HotSubscribersReport)
+{
+  HotSubscribers hot_subscribers(0, 2, 10000);
+  for (int ii = 0; ii < 30; ++ii)
+  {
+    hot_subscribers.record(HotSubscribers::IMPI_AV, "kermit@example.com");
+  }
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    hot_subscribers.record(HotSubscribers::IMPI_AV, "gonzo@example.com");
+  }
+
+  HotSubscribersHandler handler(&hot_subscribers);
+  MockHttpStack::Request req(_httpstack, "/stats/hot-subscribers", "");
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  handler.process_request(req, FAKE_TRAIL_ID);
+
+  rapidjson::Document doc;
+  doc.Parse<0>(req.content().c_str());
+  ASSERT_FALSE(doc.HasParseError());
+
+  EXPECT_EQ(10000u, doc["window_ms"].GetUint64());
+
+  const rapidjson::Value& av = doc["impi_av"];
+  ASSERT_TRUE(av.IsArray());
+  ASSERT_EQ(2u, av.Size());
+  EXPECT_EQ(std::string("kermit@example.com"), av[0u]["id"].GetString());
+  EXPECT_EQ(30u, av[0u]["count"].GetUint64());
+  EXPECT_DOUBLE_EQ(3.0, av[0u]["rate"].GetDouble());
+  EXPECT_EQ(std::string("gonzo@example.com"), av[1u]["id"].GetString());
+
+  EXPECT_EQ(0u, doc["impu_reg_data"].Size());
+}
+
+TEST_F(AdminHandlersTest, HotSubscribersBadMethod)
+{
+  HotSubscribers hot_subscribers;
+  HotSubscribersHandler handler(&hot_subscribers);
+  MockHttpStack::Request req(_httpstack,
+                             "/stats/hot-subscribers",
+                             "",
+                             "",
+                             "",
+                             htp_method_DELETE);
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 405, _));
+  handler.process_request(req, FAKE_TRAIL_ID);
+}
+
+TEST_F(AdminHandlersTest, NegativeCacheReport)
+{
+  NegativeCache negative_cache(100, 30000);
+  negative_cache.add(NegativeCache::MAR, "kermit@example.com", "sip:kermit@example.com");
+  negative_cache.contains(NegativeCache::MAR, "kermit@example.com", "sip:kermit@example.com");
+  negative_cache.contains(NegativeCache::LIR, "sip:gonzo@example.com");
+
+  NegativeCacheHandler handler(&negative_cache);
+  MockHttpStack::Request req(_httpstack, "/negative-cache", "");
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  handler.process_request(req, FAKE_TRAIL_ID);
+
+  rapidjson::Document doc;
+  doc.Parse<0>(req.content().c_str());
+  ASSERT_FALSE(doc.HasParseError());
+
+  EXPECT_EQ(30000u, doc["ttl_ms"].GetUint64());
+  EXPECT_EQ(1u, doc["size"].GetUint64());
+  EXPECT_EQ(1u, doc["mar"]["hits"].GetUint64());
+  EXPECT_EQ(1u, doc["mar"]["inserts"].GetUint64());
+  EXPECT_EQ(1u, doc["lir"]["misses"].GetUint64());
+  EXPECT_EQ(0u, doc["sar"]["hits"].GetUint64());
+}
+
+TEST_F(AdminHandlersTest, NegativeCacheDelete)
+{
+  NegativeCache negative_cache;
+  negative_cache.add(NegativeCache::LIR, "sip:kermit@example.com");
+  negative_cache.add(NegativeCache::LIR, "sip:gonzo@example.com");
+  NegativeCacheHandler handler(&negative_cache);
+
+  // Deleting with an ID only forgets that identity.
+  MockHttpStack::Request req(_httpstack,
+                             "/negative-cache",
+                             "",
+                             "?id=sip:kermit@example.com",
+                             "",
+                             htp_method_DELETE);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  handler.process_request(req, FAKE_TRAIL_ID);
+  EXPECT_EQ(1u, negative_cache.size());
+  EXPECT_TRUE(negative_cache.contains(NegativeCache::LIR, "sip:gonzo@example.com"));
+
+  // Deleting without an ID clears the cache.
+  MockHttpStack::Request req2(_httpstack,
+                              "/negative-cache",
+                              "",
+                              "",
+                              "",
+                              htp_method_DELETE);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  handler.process_request(req2, FAKE_TRAIL_ID);
+  EXPECT_EQ(0u, negative_cache.size());
+}
+
+TEST_F(AdminHandlersTest, WriteBehindStatsReport)
+{
+  // With no room for outstanding writes, every write overflows without
+  // touching the cache.
+  AssocImpuWriter assoc_impu_writer(NULL, 0);
+  EXPECT_FALSE(assoc_impu_writer.write("kermit@example.com", "sip:kermit@example.com", 300, FAKE_TRAIL_ID));
+  WriteBehindStatsHandler handler(&assoc_impu_writer);
+  MockHttpStack::Request req(_httpstack, "/stats/write-behind", "");
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  handler.process_request(req, FAKE_TRAIL_ID);
+
+  rapidjson::Document doc;
+  doc.Parse<0>(req.content().c_str());
+  ASSERT_FALSE(doc.HasParseError());
+
+  EXPECT_EQ(0u, doc["pending"].GetUint64());
+  EXPECT_EQ(0u, doc["written"].GetUint64());
+  EXPECT_EQ(1u, doc["overflowed"].GetUint64());
+  EXPECT_EQ(0u, doc["failed"].GetUint64());
+}
@@ -0,0 +1,152 @@
+/**
+ * @file answer_cache_test.cpp UT for AnswerCache.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+#include "test_interposer.hpp"
+
+#include "answer_cache.h"
+
+/// Fixture for AnswerCacheTest.  Time is controlled so that entries
+/// only expire when the test wants them to.
+class AnswerCacheTest : public testing::Test
+{
+public:
+  AnswerCacheTest()
+  {
+    cwtest_completely_control_time();
+  }
+
+  ~AnswerCacheTest()
+  {
+    cwtest_reset_time();
+  }
+};
+
+TEST_F(AnswerCacheTest, PutAndGet)
+{
+  AnswerCache cache(10, 1000);
+  std::string body;
+
+  EXPECT_FALSE(cache.get("sip:kermit@example.com", AnswerCache::make_params("", ""), body));
+  cache.put("sip:kermit@example.com", AnswerCache::make_params("", ""), "{\"result-code\":2001}");
+  ASSERT_TRUE(cache.get("sip:kermit@example.com", AnswerCache::make_params("", ""), body));
+  EXPECT_EQ("{\"result-code\":2001}", body);
+
+  // Queries with different parameters are cached separately.
+  EXPECT_FALSE(cache.get("sip:kermit@example.com", AnswerCache::make_params("true", ""), body));
+  EXPECT_FALSE(cache.get("sip:kermit@example.com", AnswerCache::make_params("", "CAPAB"), body));
+
+  EXPECT_EQ(1u, cache.hits());
+  EXPECT_EQ(3u, cache.misses());
+}
+
+TEST_F(AnswerCacheTest, EntriesExpire)
+{
+  AnswerCache cache(10, 1000);
+  std::string body;
+
+  cache.put("sip:kermit@example.com", AnswerCache::make_params("", ""), "kermit");
+  cwtest_advance_time_ms(500);
+  cache.put("sip:gonzo@example.com", AnswerCache::make_params("", ""), "gonzo");
+  cwtest_advance_time_ms(600);
+
+  EXPECT_FALSE(cache.get("sip:kermit@example.com", AnswerCache::make_params("", ""), body));
+  EXPECT_TRUE(cache.get("sip:gonzo@example.com", AnswerCache::make_params("", ""), body));
+  EXPECT_EQ(1u, cache.size());
+}
+
+TEST_F(AnswerCacheTest, OldestEvictedWhenFull)
+{
+  AnswerCache cache(2, 1000);
+  std::string body;
+
+  cache.put("sip:kermit@example.com", AnswerCache::make_params("", ""), "kermit");
+  cache.put("sip:kermit@example.com", AnswerCache::make_params("true", ""), "kermit-orig");
+  cache.put("sip:gonzo@example.com", AnswerCache::make_params("", ""), "gonzo");
+
+  EXPECT_EQ(2u, cache.size());
+  EXPECT_FALSE(cache.get("sip:kermit@example.com", AnswerCache::make_params("", ""), body));
+  ASSERT_TRUE(cache.get("sip:kermit@example.com", AnswerCache::make_params("true", ""), body));
+  EXPECT_EQ("kermit-orig", body);
+  EXPECT_TRUE(cache.get("sip:gonzo@example.com", AnswerCache::make_params("", ""), body));
+}
+
+TEST_F(AnswerCacheTest, InvalidateRemovesAllQueries)
+{
+  AnswerCache cache(10, 1000);
+  std::string body;
+
+  cache.put("sip:kermit@example.com", AnswerCache::make_params("", ""), "kermit");
+  cache.put("sip:kermit@example.com", AnswerCache::make_params("true", ""), "kermit-orig");
+  cache.put("sip:gonzo@example.com", AnswerCache::make_params("", ""), "gonzo");
+  cache.invalidate("sip:kermit@example.com");
+
+  EXPECT_FALSE(cache.get("sip:kermit@example.com", AnswerCache::make_params("", ""), body));
+  EXPECT_FALSE(cache.get("sip:kermit@example.com", AnswerCache::make_params("true", ""), body));
+  EXPECT_TRUE(cache.get("sip:gonzo@example.com", AnswerCache::make_params("", ""), body));
+  EXPECT_EQ(2u, cache.invalidations());
+
+  // Replacing an entry doesn't leave a stale copy behind.
+  cache.put("sip:gonzo@example.com", AnswerCache::make_params("", ""), "gonzo2");
+  ASSERT_TRUE(cache.get("sip:gonzo@example.com", AnswerCache::make_params("", ""), body));
+  EXPECT_EQ("gonzo2", body);
+  EXPECT_EQ(1u, cache.size());
+}
+
+TEST_F(AnswerCacheTest, InvalidateOtherIdentity)
+{
+  AnswerCache cache(10, 1000);
+  std::string body;
+
+  cache.put("kermit@example.com", AnswerCache::make_params("mar"), "", "sip:kermit@example.com");
+  cache.put("sip:kermit@example.com", AnswerCache::make_params("lir"), "");
+
+  // A response tied to another identity can't be looked up by it.
+  EXPECT_TRUE(cache.get("kermit@example.com", AnswerCache::make_params("mar"), body));
+  EXPECT_FALSE(cache.get("sip:kermit@example.com", AnswerCache::make_params("mar"), body));
+
+  // But it's forgotten when that identity is invalidated.
+  cache.invalidate("sip:kermit@example.com");
+  EXPECT_FALSE(cache.get("kermit@example.com", AnswerCache::make_params("mar"), body));
+  EXPECT_EQ(0u, cache.size());
+  EXPECT_EQ(2u, cache.invalidations());
+
+  cache.put("sip:gonzo@example.com", AnswerCache::make_params("lir"), "");
+  cache.clear();
+  EXPECT_EQ(0u, cache.size());
+  EXPECT_EQ(3u, cache.invalidations());
+}
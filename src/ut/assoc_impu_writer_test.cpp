@@ -0,0 +1,170 @@
+/**
+ * @file assoc_impu_writer_test.cpp UT for AssocImpuWriter.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+
+#include "assoc_impu_writer.h"
+#include "handlers.h"
+#include "mockcache.hpp"
+#include "mockstatisticsmanager.hpp"
+#include "test_interposer.hpp"
+
+using ::testing::NiceMock;
+using ::testing::Return;
+using ::testing::_;
+
+const std::string IMPI = "kermit@example.com";
+const std::string IMPU = "sip:kermit@example.com";
+const std::string IMPU2 = "sip:miss_piggy@example.com";
+
+class AssocImpuWriterTest : public testing::Test
+{
+public:
+  AssocImpuWriterTest() : _cache() {}
+
+  MockCache _cache;
+};
+
+TEST_F(AssocImpuWriterTest, Write)
+{
+  AssocImpuWriter writer(&_cache);
+
+  MockCache::MockPutAssociatedPublicID mock_op;
+  EXPECT_CALL(_cache, create_PutAssociatedPublicID(IMPI, IMPU, _, 300))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(_cache, mock_op);
+  EXPECT_TRUE(writer.write(IMPI, IMPU, 300, 0));
+  EXPECT_EQ(1u, writer.pending());
+  EXPECT_FALSE(writer.flush(0));
+
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  t->on_success(&mock_op);
+
+  EXPECT_EQ(0u, writer.pending());
+  EXPECT_EQ(1u, writer.written());
+  EXPECT_TRUE(writer.flush(0));
+}
+
+// Writes of an association that's already being written are coalesced into a
+// single rewrite once the first write completes.
+TEST_F(AssocImpuWriterTest, Coalesce)
+{
+  AssocImpuWriter writer(&_cache);
+
+  MockCache::MockPutAssociatedPublicID mock_op;
+  EXPECT_CALL(_cache, create_PutAssociatedPublicID(IMPI, IMPU, _, 300))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(_cache, mock_op);
+  EXPECT_TRUE(writer.write(IMPI, IMPU, 300, 0));
+  EXPECT_TRUE(writer.write(IMPI, IMPU, 600, 0));
+  EXPECT_TRUE(writer.write(IMPI, IMPU, 600, 0));
+  EXPECT_EQ(2u, writer.coalesced());
+
+  MockCache::MockPutAssociatedPublicID mock_op2;
+  EXPECT_CALL(_cache, create_PutAssociatedPublicID(IMPI, IMPU, _, 600))
+    .WillOnce(Return(&mock_op2));
+  EXPECT_DO_ASYNC(_cache, mock_op2);
+  mock_op.get_trx()->on_success(&mock_op);
+  EXPECT_EQ(1u, writer.pending());
+
+  mock_op2.get_trx()->on_success(&mock_op2);
+  EXPECT_EQ(0u, writer.pending());
+  EXPECT_EQ(2u, writer.written());
+}
+
+// If too many writes are outstanding, the caller must write the association
+// itself.
+TEST_F(AssocImpuWriterTest, Overflow)
+{
+  AssocImpuWriter writer(&_cache, 1);
+
+  MockCache::MockPutAssociatedPublicID mock_op;
+  EXPECT_CALL(_cache, create_PutAssociatedPublicID(IMPI, IMPU, _, 300))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(_cache, mock_op);
+  EXPECT_TRUE(writer.write(IMPI, IMPU, 300, 0));
+  EXPECT_FALSE(writer.write(IMPI, IMPU2, 300, 0));
+  EXPECT_EQ(1u, writer.overflowed());
+
+  mock_op.get_trx()->on_success(&mock_op);
+}
+
+TEST_F(AssocImpuWriterTest, Failure)
+{
+  AssocImpuWriter writer(&_cache);
+
+  MockCache::MockPutAssociatedPublicID mock_op;
+  EXPECT_CALL(_cache, create_PutAssociatedPublicID(IMPI, IMPU, _, 300))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(_cache, mock_op);
+  EXPECT_TRUE(writer.write(IMPI, IMPU, 300, 0));
+
+  mock_op._cass_status = CassandraStore::CONNECTION_ERROR;
+  mock_op._cass_error_text = "Connection failed";
+  mock_op.get_trx()->on_failure(&mock_op);
+
+  EXPECT_EQ(0u, writer.pending());
+  EXPECT_EQ(0u, writer.written());
+  EXPECT_EQ(1u, writer.failed());
+}
+
+// Writes are counted in the same cache stats as the handlers' own writes.
+TEST_F(AssocImpuWriterTest, WriteUpdatesCacheStats)
+{
+  NiceMock<MockStatisticsManager> stats;
+  HssCacheTask::configure_stats(&stats);
+  AssocImpuWriter writer(&_cache);
+
+  MockCache::MockPutAssociatedPublicID mock_op;
+  EXPECT_CALL(_cache, create_PutAssociatedPublicID(IMPI, IMPU, _, 300))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(_cache, mock_op);
+  EXPECT_TRUE(writer.write(IMPI, IMPU, 300, 0));
+
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  t->start_timer();
+  cwtest_advance_time_ms(12);
+  t->stop_timer();
+
+  EXPECT_CALL(stats, update_H_cache_latency_us(12000));
+  t->on_success(&mock_op);
+  EXPECT_EQ(1u, writer.written());
+
+  HssCacheTask::configure_stats(NULL);
+}
@@ -35,6 +35,7 @@
  */
 #include <semaphore.h>
 #include <time.h>
+#include <string.h>
 
 #include "gtest/gtest.h"
 #include "gmock/gmock.h"
@@ -202,6 +203,143 @@ public:
 };
 
 
+//
+// MATCHERS
+//
+
+typedef std::map<std::string, std::map<std::string, std::vector<cass::Mutation> > > MutMap;
+
+// Matches a batch_mutate map containing exactly the specified deletions.  A
+// RowColumns with no columns is expected to be a whole-row deletion (one with
+// no predicate).
+MATCHER_P(BatchedDeletionMap, expected, "")
+{
+  const MutMap& mutmap = arg;
+  size_t deletions = 0;
+
+  for (std::vector<CassandraStore::RowColumns>::const_iterator row = expected.begin();
+       row != expected.end();
+       ++row)
+  {
+    MutMap::const_iterator key_it = mutmap.find(row->key);
+    if (key_it == mutmap.end())
+    {
+      *result_listener << "no mutations for key " << row->key;
+      return false;
+    }
+
+    std::map<std::string, std::vector<cass::Mutation> >::const_iterator cf_it =
+      key_it->second.find(row->cf);
+    if ((cf_it == key_it->second.end()) || (cf_it->second.size() != 1))
+    {
+      *result_listener << "expected one mutation for " << row->cf << ":" << row->key;
+      return false;
+    }
+
+    const cass::Mutation& mutation = cf_it->second.front();
+    if (!mutation.__isset.deletion)
+    {
+      *result_listener << "mutation for " << row->key << " is not a deletion";
+      return false;
+    }
+
+    if (row->columns.empty())
+    {
+      if (mutation.deletion.__isset.predicate)
+      {
+        *result_listener << "expected whole-row deletion for " << row->key;
+        return false;
+      }
+    }
+    else
+    {
+      std::vector<std::string> expected_names;
+      for (std::map<std::string, std::string>::const_iterator col = row->columns.begin();
+           col != row->columns.end();
+           ++col)
+      {
+        expected_names.push_back(col->first);
+      }
+
+      if (!mutation.deletion.__isset.predicate ||
+          (mutation.deletion.predicate.column_names != expected_names))
+      {
+        *result_listener << "unexpected columns deleted for " << row->key;
+        return false;
+      }
+    }
+
+    deletions++;
+  }
+
+  size_t total = 0;
+  for (MutMap::const_iterator key_it = mutmap.begin();
+       key_it != mutmap.end();
+       ++key_it)
+  {
+    for (std::map<std::string, std::vector<cass::Mutation> >::const_iterator cf_it = key_it->second.begin();
+         cf_it != key_it->second.end();
+         ++cf_it)
+    {
+      total += cf_it->second.size();
+    }
+  }
+
+  if (total != deletions)
+  {
+    *result_listener << "batch contains " << total << " mutations, expected " << deletions;
+    return false;
+  }
+
+  return true;
+}
+
+// Matches a batch_mutate map containing the specified number of mutations.
+MATCHER_P(BatchOfSize, size, "")
+{
+  size_t total = 0;
+  for (MutMap::const_iterator key_it = arg.begin();
+       key_it != arg.end();
+       ++key_it)
+  {
+    for (std::map<std::string, std::vector<cass::Mutation> >::const_iterator cf_it = key_it->second.begin();
+         cf_it != key_it->second.end();
+         ++cf_it)
+    {
+      total += cf_it->second.size();
+    }
+  }
+
+  *result_listener << "batch contains " << total << " mutations";
+  return (total == (size_t)size);
+}
+
+// Matches a KeyRange covering a whole token range.
+MATCHER_P3(TokenKeyRange, start_token, end_token, count, "")
+{
+  return (arg.__isset.start_token && (arg.start_token == start_token) &&
+          arg.__isset.end_token && (arg.end_token == end_token) &&
+          !arg.__isset.start_key && (arg.count == count));
+}
+
+// Matches a KeyRange that carries on from a key.
+MATCHER_P3(ResumedKeyRange, start_key, end_token, count, "")
+{
+  return (arg.__isset.start_key && (arg.start_key == start_key) &&
+          arg.__isset.end_token && (arg.end_token == end_token) &&
+          !arg.__isset.start_token && (arg.count == count));
+}
+
+// Builds a KeySlice for a range scan.
+static cass::KeySlice make_key_slice(const std::string& key,
+                                     const std::map<std::string, std::string>& columns)
+{
+  cass::KeySlice slice;
+  slice.key = key;
+  make_slice(slice.columns, columns);
+  return slice;
+}
+
 //
 // TESTS
 //
@@ -452,6 +590,27 @@ MATCHER_P(OperationHasResult, expected_rc, "")
   return (expected_rc == actual_rc);
 }
 
+// Matches a cache operation that has recorded the expected usage of Cassandra.
+MATCHER_P4(OperationHasUsage, type, rows, bytes_read, bytes_written, "")
+{
+  Cache::CacheOperation* op = dynamic_cast<Cache::CacheOperation*>(arg);
+
+  if (op == NULL)
+  {
+    *result_listener << "not a cache operation";
+    return false;
+  }
+
+  *result_listener << "type " << op->type()
+                   << ", rows " << op->rows_touched()
+                   << ", bytes read " << op->bytes_read()
+                   << ", bytes written " << op->bytes_written();
+  return ((op->type() == type) &&
+          (op->rows_touched() == (uint64_t)rows) &&
+          (op->bytes_read() == (uint64_t)bytes_read) &&
+          (op->bytes_written() == (uint64_t)bytes_written));
+}
+
 TEST_F(CacheRequestTest, PutTransportEx)
 {
   TestTransaction *trx = make_trx();
@@ -639,6 +798,27 @@ TEST_F(CacheRequestTest, PutAssocPrivateIdMainline)
   execute_trx(op, trx);
 }
 
+TEST_F(CacheRequestTest, PutAssocPrivateIdRecordsUsage)
+{
+  TestTransaction *trx = make_trx();
+  CassandraStore::Operation* op =
+    _cache.create_PutAssociatedPrivateID({"kermit", "miss piggy"}, "gonzo", 1000);
+
+  // Three rows are written.  The bytes written are the row keys plus the
+  // column names (the values are empty).
+  size_t bytes = strlen("gonzo") + strlen("associated_primary_impu__kermit") +
+                 strlen("kermit") + strlen("associated_impi__gonzo") +
+                 strlen("miss piggy") + strlen("associated_impi__gonzo");
+
+  EXPECT_CALL(_client, batch_mutate(_, _));
+  EXPECT_CALL(*trx, on_success(OperationHasUsage(Cache::OP_PUT_ASSOCIATED_PRIVATE_ID,
+                                                 3,
+                                                 0,
+                                                 bytes)));
+
+  execute_trx(op, trx);
+}
+
 
 TEST_F(CacheRequestTest, DeletePublicId)
 {
@@ -649,7 +829,7 @@ TEST_F(CacheRequestTest, DeletePublicId)
     _cache.create_DeletePublicIDs("kermit", IMPIS, 1000);
 
   // The "kermit" IMPU row should be deleted entirely
-  EXPECT_CALL(_client, remove("kermit", _, 1000, _));
+  expected.push_back(CassandraStore::RowColumns("impu", "kermit"));
 
   // The "kermit" column should be deleted from the IMPI's row in the
   // IMPI mapping table
@@ -657,7 +837,8 @@ TEST_F(CacheRequestTest, DeletePublicId)
   deleted_impi_columns["associated_primary_impu__kermit"] = "";
   expected.push_back(CassandraStore::RowColumns("impi_mapping", "somebody@example.com", deleted_impi_columns));
 
-  EXPECT_CALL(_client, batch_mutate(DeletionMap(expected), _));
+  // Both deletions are sent in a single batch
+  EXPECT_CALL(_client, batch_mutate(BatchedDeletionMap(expected), _));
   EXPECT_CALL(*trx, on_success(_));
 
   execute_trx(op, trx);
@@ -678,9 +859,9 @@ TEST_F(CacheRequestTest, DeleteMultiPublicIds)
     _cache.create_DeletePublicIDs(ids, IMPIS, 1000);
 
   // The "kermit", "gonzo" and "miss piggy" IMPU rows should be deleted entirely
-  EXPECT_CALL(_client, remove("kermit", _, 1000, _));
-  EXPECT_CALL(_client, remove("gonzo", _, 1000, _));
-  EXPECT_CALL(_client, remove("miss piggy", _, 1000, _));
+  expected.push_back(CassandraStore::RowColumns("impu", "kermit"));
+  expected.push_back(CassandraStore::RowColumns("impu", "gonzo"));
+  expected.push_back(CassandraStore::RowColumns("impu", "miss piggy"));
 
   // Only the "kermit" column should be deleted from the IMPI's row in the
   // IMPI mapping table
@@ -688,7 +869,7 @@ TEST_F(CacheRequestTest, DeleteMultiPublicIds)
   deleted_impi_columns["associated_primary_impu__kermit"] = "";
   expected.push_back(CassandraStore::RowColumns("impi_mapping", "somebody@example.com", deleted_impi_columns));
 
-  EXPECT_CALL(_client, batch_mutate(DeletionMap(expected), _));
+  EXPECT_CALL(_client, batch_mutate(BatchedDeletionMap(expected), _));
   EXPECT_CALL(*trx, on_success(_));
 
   execute_trx(op, trx);
@@ -701,11 +882,12 @@ TEST_F(CacheRequestTest, DeletePrivateId)
   CassandraStore::Operation* op =
     _cache.create_DeletePrivateIDs("kermit", 1000);
 
+  std::vector<CassandraStore::RowColumns> expected;
+  expected.push_back(CassandraStore::RowColumns("impi", "kermit"));
+
   EXPECT_CALL(_client,
-              remove("kermit",
-                     ColumnPathForTable("impi"),
-                     1000,
-                     cass::ConsistencyLevel::ONE));
+              batch_mutate(BatchedDeletionMap(expected),
+                           cass::ConsistencyLevel::ONE));
   EXPECT_CALL(*trx, on_success(_));
 
   execute_trx(op, trx);
@@ -722,9 +904,13 @@ TEST_F(CacheRequestTest, DeleteMultiPrivateIds)
   CassandraStore::Operation* op =
     _cache.create_DeletePrivateIDs(ids, 1000);
 
-  EXPECT_CALL(_client, remove("kermit", ColumnPathForTable("impi"), _, _));
-  EXPECT_CALL(_client, remove("gonzo", ColumnPathForTable("impi"), _, _));
-  EXPECT_CALL(_client, remove("miss piggy", ColumnPathForTable("impi"), _, _));
+  // All three rows are deleted in a single batch
+  std::vector<CassandraStore::RowColumns> expected;
+  expected.push_back(CassandraStore::RowColumns("impi", "kermit"));
+  expected.push_back(CassandraStore::RowColumns("impi", "gonzo"));
+  expected.push_back(CassandraStore::RowColumns("impi", "miss piggy"));
+
+  EXPECT_CALL(_client, batch_mutate(BatchedDeletionMap(expected), _));
   EXPECT_CALL(*trx, on_success(_));
 
   execute_trx(op, trx);
@@ -742,15 +928,63 @@ TEST_F(CacheRequestTest, DeleteIMPIMappings)
     _cache.create_DeleteIMPIMapping(ids, 1000);
 
   std::vector<CassandraStore::RowColumns> expected;
-  EXPECT_CALL(_client, remove("kermit", _, 1000, _));
-  EXPECT_CALL(_client, remove("gonzo", _, 1000, _));
-  EXPECT_CALL(_client, remove("miss piggy", _, 1000, _));
+  expected.push_back(CassandraStore::RowColumns("impi_mapping", "kermit"));
+  expected.push_back(CassandraStore::RowColumns("impi_mapping", "gonzo"));
+  expected.push_back(CassandraStore::RowColumns("impi_mapping", "miss piggy"));
+
+  EXPECT_CALL(_client, batch_mutate(BatchedDeletionMap(expected), _));
   EXPECT_CALL(*trx, on_success(_));
 
   execute_trx(op, trx);
 }
 
+TEST_F(CacheRequestTest, MutationBatchSplitsLargeBatches)
+{
+  Cache::MutationBatch batch(1000, 2);
 
+  batch.delete_row("impi", "kermit");
+  batch.delete_row("impi", "gonzo");
+  batch.delete_row("impi", "miss piggy");
+  batch.delete_row("impi", "fozzie");
+  batch.delete_row("impi", "rowlf");
+  EXPECT_EQ(5u, batch.size());
+
+  // Five mutations with a cap of two are sent as batches of 2, 2 and 1.
+  EXPECT_CALL(_client, batch_mutate(BatchOfSize(2), cass::ConsistencyLevel::ONE))
+    .Times(2);
+  EXPECT_CALL(_client, batch_mutate(BatchOfSize(1), cass::ConsistencyLevel::ONE));
+
+  batch.execute(&_client);
+}
+
+TEST_F(CacheRequestTest, MutationBatchSplitsOnRowBoundaries)
+{
+  Cache::MutationBatch batch(1000, 2);
+  std::map<std::string, std::string> column;
+  column["a"] = "1";
+  std::map<std::string, std::string> columns(column);
+  columns["b"] = "2";
+
+  // Kermit's row has three mutations (more than the cap), added either side
+  // of a change to gonzo's row.
+  batch.put_columns("impu", "kermit", columns);
+  batch.put_columns("impu", "gonzo", column);
+  batch.delete_row("impu", "kermit");
+  batch.delete_row("impu", "fozzie");
+  batch.put_columns("impu", "rowlf", columns);
+  EXPECT_EQ(7u, batch.size());
+
+  // Kermit's row is sent on its own, then gonzo's and fozzie's rows together,
+  // then rowlf's.
+  {
+    testing::InSequence seq;
+    EXPECT_CALL(_client, batch_mutate(BatchOfSize(3), cass::ConsistencyLevel::ONE));
+    EXPECT_CALL(_client, batch_mutate(BatchOfSize(2), cass::ConsistencyLevel::ONE))
+      .Times(2);
+  }
+
+  batch.execute(&_client);
+}
 
 TEST_F(CacheRequestTest, DeletesHaveConsistencyLevelOne)
 {
@@ -758,7 +992,6 @@ TEST_F(CacheRequestTest, DeletesHaveConsistencyLevelOne)
   CassandraStore::Operation* op =
     _cache.create_DeletePublicIDs("kermit", IMPIS, 1000);
 
-  EXPECT_CALL(_client, remove(_, _, _, cass::ConsistencyLevel::ONE));
   EXPECT_CALL(_client, batch_mutate(_, cass::ConsistencyLevel::ONE));
   EXPECT_CALL(*trx, on_success(_));
 
@@ -949,6 +1182,65 @@ TEST_F(CacheRequestTest, GetRegDataNotFound)
   EXPECT_EQ(EMPTY_IMPIS, rec.result.impis);
 }
 
+TEST_F(CacheRequestTest, GetRegDataBatchMainline)
+{
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+  columns["is_registered"] = "\x01";
+  columns["associated_impi__somebody@example.com"] = "";
+
+  std::vector<cass::ColumnOrSuperColumn> inner_slice;
+  make_slice(inner_slice, columns);
+  std::map<std::string, std::vector<cass::ColumnOrSuperColumn> > slice;
+  slice["kermit"] = inner_slice;
+
+  typedef std::map<std::string, Cache::GetRegData::Result> Results;
+  ResultRecorder<Cache::GetRegDataBatch, Results> rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op =
+    _cache.create_GetRegDataBatch({"kermit", "gonzo", "kermit"});
+
+  // Duplicate public IDs are only read once.
+  std::vector<std::string> impus = {"gonzo", "kermit"};
+  EXPECT_CALL(_client, multiget_slice(_,
+                                      impus,
+                                      ColumnPathForTable("impu"),
+                                      AllColumns(),
+                                      cass::ConsistencyLevel::TWO))
+    .WillOnce(SetArgReferee<0>(slice));
+
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  ASSERT_EQ(2u, rec.result.size());
+  EXPECT_EQ(RegistrationState::REGISTERED, rec.result["kermit"].state);
+  EXPECT_EQ("<howdy>", rec.result["kermit"].xml);
+  EXPECT_EQ(IMPIS, rec.result["kermit"].impis);
+  EXPECT_EQ(RegistrationState::NOT_REGISTERED, rec.result["gonzo"].state);
+  EXPECT_EQ("", rec.result["gonzo"].xml);
+}
+
+TEST_F(CacheRequestTest, GetRegDataBatchRetriesAtOne)
+{
+  typedef std::map<std::string, Cache::GetRegData::Result> Results;
+  ResultRecorder<Cache::GetRegDataBatch, Results> rec;
+  RecordingTransaction* trx = make_rec_trx(&rec);
+  CassandraStore::Operation* op = _cache.create_GetRegDataBatch({"kermit"});
+
+  cass::UnavailableException ue;
+  EXPECT_CALL(_client, multiget_slice(_, _, _, _, cass::ConsistencyLevel::TWO))
+    .WillOnce(Throw(ue));
+  EXPECT_CALL(_client, multiget_slice(_, _, _, _, cass::ConsistencyLevel::ONE))
+    .WillOnce(SetArgReferee<0>(empty_slice_multiget));
+
+  EXPECT_CALL(*trx, on_success(_))
+    .WillOnce(Invoke(trx, &RecordingTransaction::record_result));
+  execute_trx(op, trx);
+
+  EXPECT_EQ(RegistrationState::NOT_REGISTERED, rec.result["kermit"].state);
+}
+
 TEST_F(CacheRequestTest, GetAuthVectorAllColsReturned)
 {
   std::vector<std::string> requested_columns;
@@ -985,6 +1277,32 @@ TEST_F(CacheRequestTest, GetAuthVectorAllColsReturned)
 }
 
 
+TEST_F(CacheRequestTest, GetAuthVectorRecordsUsage)
+{
+  std::map<std::string, std::string> columns;
+  columns["digest_ha1"] = "somehash";
+  columns["digest_realm"] = "themuppetshow.com";
+
+  std::vector<cass::ColumnOrSuperColumn> slice;
+  make_slice(slice, columns);
+
+  TestTransaction *trx = make_trx();
+  CassandraStore::Operation* op = _cache.create_GetAuthVector("kermit");
+
+  EXPECT_CALL(_client, get_slice(_, "kermit", ColumnPathForTable("impi"), _, _))
+    .WillOnce(SetArgReferee<0>(slice));
+
+  // One row is read, and the bytes read are the column names and values.
+  size_t bytes = strlen("digest_ha1") + strlen("somehash") +
+                 strlen("digest_realm") + strlen("themuppetshow.com");
+  EXPECT_CALL(*trx, on_success(OperationHasUsage(Cache::OP_GET_AUTH_VECTOR,
+                                                 1,
+                                                 bytes,
+                                                 0)));
+  execute_trx(op, trx);
+}
+
+
 TEST_F(CacheRequestTest, GetAuthVectorNonDefaultableColsReturned)
 {
   std::map<std::string, std::string> columns;
@@ -1465,8 +1783,7 @@ TEST_F(CacheLatencyTest, DeleteRecordsLatency)
   CassandraStore::Operation* op =
     _cache.create_DeletePublicIDs("kermit", IMPIS, 1000);
 
-  EXPECT_CALL(_client, remove(_, _, _, _));
-  EXPECT_CALL(_client, batch_mutate(_, _)).WillRepeatedly(AdvanceTimeMs(13));
+  EXPECT_CALL(_client, batch_mutate(_, _)).WillOnce(AdvanceTimeMs(13));
   EXPECT_CALL(*trx, on_success(_)).WillOnce(CheckLatency(trx, 13));
 
   execute_trx(op, trx);
@@ -1641,6 +1958,10 @@ TEST_F(CacheRequestTest, DissociateImplicitRegistrationSetFromImpiCausingDeletio
 
   expected.push_back(CassandraStore::RowColumns("impi_mapping", "gonzo", impi_columns));
 
+  // Expect full-row removal of both IMPUs in the same batch
+  expected.push_back(CassandraStore::RowColumns("impu", "kermit"));
+  expected.push_back(CassandraStore::RowColumns("impu", "robin"));
+
   // Expect associated IMPI lookup
 
   EXPECT_CALL(_client,
@@ -1651,11 +1972,7 @@ TEST_F(CacheRequestTest, DissociateImplicitRegistrationSetFromImpiCausingDeletio
                         _))
     .WillOnce(SetArgReferee<0>(impu_slice));
 
-  // Expect full-column removal, twice
-  EXPECT_CALL(_client, remove("kermit", _, 1000, _));
-  EXPECT_CALL(_client, remove("robin", _, 1000, _));
-
-  EXPECT_CALL(_client, batch_mutate(DeletionMap(expected), _));
+  EXPECT_CALL(_client, batch_mutate(BatchedDeletionMap(expected), _));
   EXPECT_CALL(*trx, on_success(_));
 
   execute_trx(op, trx);
@@ -1712,4 +2029,130 @@ TEST_F(CacheRequestTest, DissociateImplicitRegistrationSetFromWrongImpi)
   EXPECT_TRUE(log.contains("not all the provided IMPIs are associated with the IMPU"));
 }
 
+TEST_F(CacheRequestTest, SplitTokenRing)
+{
+  std::vector<Cache::TokenRange> ranges = Cache::split_token_ring(4);
+  ASSERT_EQ(4u, ranges.size());
+  EXPECT_EQ("-9223372036854775808", ranges[0].start_token);
+  EXPECT_EQ("9223372036854775807", ranges[3].end_token);
+
+  for (size_t ii = 1; ii < ranges.size(); ++ii)
+  {
+    EXPECT_EQ(ranges[ii - 1].end_token, ranges[ii].start_token);
+  }
+
+  EXPECT_EQ("-4611686018427387905", ranges[0].end_token);
+}
+
+TEST_F(CacheRequestTest, ScanImpusPagesThroughRange)
+{
+  Cache::TokenRange range = {"-100", "100"};
+
+  std::map<std::string, std::string> columns;
+  columns["ims_subscription_xml"] = "<howdy>";
+  columns["is_registered"] = "\x01";
+  columns["primary_ccf"] = "ccf1";
+  columns["associated_impi__somebody@example.com"] = "";
+
+  std::vector<cass::KeySlice> page1;
+  page1.push_back(make_key_slice("kermit", columns));
+  page1.push_back(make_key_slice("gonzo", columns));
+
+  // The second page repeats the last row of the first, and includes a
+  // deleted row with no columns.
+  std::vector<cass::KeySlice> page2;
+  page2.push_back(make_key_slice("gonzo", columns));
+  page2.push_back(make_key_slice("fozzie", {}));
+  page2.push_back(make_key_slice("animal", columns));
+
+  std::vector<Cache::ImpuRecord> records;
+  Cache::ScanImpus* op =
+    _cache.create_ScanImpus(range,
+                            [&records](const Cache::ImpuRecord& record)
+                            {
+                              records.push_back(record);
+                              return true;
+                            },
+                            "",
+                            2);
 
+  {
+    testing::InSequence seq;
+    EXPECT_CALL(_client, get_range_slices(_,
+                                          ColumnPathForTable("impu"),
+                                          AllColumns(),
+                                          TokenKeyRange("-100", "100", 2),
+                                          cass::ConsistencyLevel::ONE))
+      .WillOnce(SetArgReferee<0>(page1));
+    EXPECT_CALL(_client, get_range_slices(_,
+                                          ColumnPathForTable("impu"),
+                                          AllColumns(),
+                                          ResumedKeyRange("gonzo", "100", 3),
+                                          cass::ConsistencyLevel::ONE))
+      .WillOnce(SetArgReferee<0>(page2));
+    EXPECT_CALL(_client, get_range_slices(_,
+                                          _,
+                                          _,
+                                          ResumedKeyRange("animal", "100", 3),
+                                          _))
+      .WillOnce(SetArgReferee<0>(std::vector<cass::KeySlice>()));
+  }
+
+  TestTransaction* trx = make_trx();
+  EXPECT_CALL(*trx, on_success(_));
+  execute_trx(op, trx);
+
+  ASSERT_EQ(3u, records.size());
+  EXPECT_EQ("kermit", records[0].public_id);
+  EXPECT_EQ("gonzo", records[1].public_id);
+  EXPECT_EQ("animal", records[2].public_id);
+  EXPECT_EQ(RegistrationState::REGISTERED, records[2].reg_state);
+  EXPECT_EQ("<howdy>", records[2].xml);
+  EXPECT_EQ(IMPIS, records[2].impis);
+  EXPECT_EQ(CCF, records[2].charging_addrs.ccfs);
+}
+
+TEST_F(CacheRequestTest, ScanImpisStopsWhenCallbackReturnsFalse)
+{
+  Cache::TokenRange range = {"-100", "100"};
+
+  std::map<std::string, std::string> columns;
+  columns["digest_ha1"] = "somehash";
+  columns["digest_realm"] = "themuppetshow.com";
+  columns["digest_qop"] = "auth";
+  columns["public_id_sip:kermit@themuppetshow.com"] = "";
+
+  std::vector<cass::KeySlice> page;
+  page.push_back(make_key_slice("kermit", columns));
+  page.push_back(make_key_slice("gonzo", columns));
+
+  std::vector<Cache::ImpiRecord> records;
+  Cache::ScanImpis* op =
+    _cache.create_ScanImpis(range,
+                            [&records](const Cache::ImpiRecord& record)
+                            {
+                              records.push_back(record);
+                              return false;
+                            },
+                            "gonzo");
+
+  // The scan carries on from the resume key, and stops after the first row
+  // rather than reading another page.
+  EXPECT_CALL(_client, get_range_slices(_,
+                                        ColumnPathForTable("impi"),
+                                        AllColumns(),
+                                        ResumedKeyRange("gonzo", "100", 101),
+                                        _))
+    .WillOnce(SetArgReferee<0>(std::vector<cass::KeySlice>(page.rbegin(), page.rend())));
+
+  TestTransaction* trx = make_trx();
+  EXPECT_CALL(*trx, on_success(_));
+  execute_trx(op, trx);
+
+  ASSERT_EQ(1u, records.size());
+  EXPECT_EQ("kermit", records[0].private_id);
+  EXPECT_EQ("somehash", records[0].auth_vector.ha1);
+  EXPECT_EQ("themuppetshow.com", records[0].auth_vector.realm);
+  EXPECT_EQ("auth", records[0].auth_vector.qop);
+  EXPECT_EQ(std::vector<std::string>({"sip:kermit@themuppetshow.com"}), records[0].public_ids);
+}
@@ -92,3 +92,34 @@ TEST_F(ChargingAddressesTest, Empty)
   charging_addrs.ccfs.clear();
   EXPECT_FALSE(charging_addrs.empty());
 }
+
+TEST_F(ChargingAddressesTest, PushFrontAndBack)
+{
+  // Cache reads can return the secondary address before the primary.
+  ChargingFunctions ccfs;
+  ccfs.push_back("ccf2");
+  ccfs.push_front("ccf1");
+  EXPECT_EQ(std::deque<std::string>({"ccf1", "ccf2"}), ccfs);
+
+  // There are never more than two addresses.
+  ccfs.push_back("ccf3");
+  EXPECT_EQ(2u, ccfs.size());
+  ccfs.push_front("ccf0");
+  EXPECT_EQ(std::deque<std::string>({"ccf0", "ccf1"}), ccfs);
+
+  ccfs.clear();
+  EXPECT_TRUE(ccfs.empty());
+  EXPECT_TRUE(ccfs.begin() == ccfs.end());
+}
+
+TEST_F(ChargingAddressesTest, CopyAndCompare)
+{
+  ChargingAddresses charging_addrs({"ccf1", "ccf2"}, {"ecf"});
+  ChargingAddresses copy = charging_addrs;
+  EXPECT_TRUE(copy.ccfs == charging_addrs.ccfs);
+  EXPECT_TRUE(copy.ecfs == charging_addrs.ecfs);
+
+  copy.ecfs.push_back("ecf2");
+  EXPECT_TRUE(copy.ecfs != charging_addrs.ecfs);
+  EXPECT_FALSE(std::deque<std::string>({"ecf"}) == copy.ecfs);
+}
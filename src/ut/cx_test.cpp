@@ -419,6 +419,21 @@ TEST_F(CxTest, SAATest)
   EXPECT_EQ(ECFS, charging_addrs.ecfs);
 }
 
+TEST_F(CxTest, SAATestOneECF)
+{
+  // Two CCFs but only one ECF - there should be no secondary ECF.
+  ChargingAddresses charging_addrs;
+  Cx::ServerAssignmentAnswer saa(_cx_dict,
+                                 _mock_stack,
+                                 RESULT_CODE_SUCCESS,
+                                 IMS_SUBSCRIPTION,
+                                 ChargingAddresses(CCFS, {"ecf1"}));
+  launder_message(saa);
+  saa.charging_addrs(charging_addrs);
+  EXPECT_EQ(CCFS, charging_addrs.ccfs);
+  EXPECT_EQ(std::deque<std::string>({"ecf1"}), charging_addrs.ecfs);
+}
+
 TEST_F(CxTest, SAATestNoChargingAddresses)
 {
   ChargingAddresses charging_addrs;
@@ -0,0 +1,561 @@
+/**
+ * @file embedded_store_test.cpp UT for EmbeddedStore.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <set>
+#include <thread>
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+#include "test_interposer.hpp"
+
+#include "embedded_store.h"
+
+using namespace org::apache::cassandra;
+
+/// Fixture for EmbeddedStoreTest.  Each test gets a fresh directory for the
+/// store's files, and time is controlled so TTLs can be tested.
+class EmbeddedStoreTest : public testing::Test
+{
+public:
+  EmbeddedStoreTest()
+  {
+    cwtest_completely_control_time();
+
+    char dir[] = "/tmp/embedded_store_test_XXXXXX";
+    _dir = mkdtemp(dir);
+  }
+
+  ~EmbeddedStoreTest()
+  {
+    unlink((_dir + "/log").c_str());
+    unlink((_dir + "/log.old").c_str());
+    unlink((_dir + "/snapshot").c_str());
+    rmdir(_dir.c_str());
+    cwtest_reset_time();
+  }
+
+  static void put(CassandraStore::Client& store,
+                  const std::string& table,
+                  const std::string& key,
+                  const std::string& name,
+                  const std::string& value,
+                  int64_t timestamp,
+                  int32_t ttl = 0)
+  {
+    Mutation mutation;
+    ColumnOrSuperColumn cosc;
+    cosc.column.__set_name(name);
+    cosc.column.__set_value(value);
+    cosc.column.__set_timestamp(timestamp);
+    if (ttl > 0)
+    {
+      cosc.column.__set_ttl(ttl);
+    }
+    cosc.__isset.column = true;
+    mutation.__set_column_or_supercolumn(cosc);
+
+    std::map<std::string, std::map<std::string, std::vector<Mutation> > > mutmap;
+    mutmap[key][table].push_back(mutation);
+    store.batch_mutate(mutmap, ConsistencyLevel::ONE);
+  }
+
+  static void del(CassandraStore::Client& store,
+                  const std::string& table,
+                  const std::string& key,
+                  const std::vector<std::string>& names,
+                  int64_t timestamp)
+  {
+    Mutation mutation;
+    Deletion deletion;
+    deletion.__set_timestamp(timestamp);
+    if (!names.empty())
+    {
+      SlicePredicate predicate;
+      predicate.__set_column_names(names);
+      deletion.__set_predicate(predicate);
+    }
+    mutation.__set_deletion(deletion);
+
+    std::map<std::string, std::map<std::string, std::vector<Mutation> > > mutmap;
+    mutmap[key][table].push_back(mutation);
+    store.batch_mutate(mutmap, ConsistencyLevel::ONE);
+  }
+
+  // Get a single column, returning an empty string if it doesn't exist.
+  static std::string get(CassandraStore::Client& store,
+                         const std::string& table,
+                         const std::string& key,
+                         const std::string& name)
+  {
+    ColumnParent parent;
+    parent.column_family = table;
+    SlicePredicate predicate;
+    predicate.__set_column_names(std::vector<std::string>(1, name));
+
+    std::vector<ColumnOrSuperColumn> columns;
+    store.get_slice(columns, key, parent, predicate, ConsistencyLevel::ONE);
+    return columns.empty() ? "" : columns[0].column.value;
+  }
+
+  std::string _dir;
+};
+
+TEST_F(EmbeddedStoreTest, PutAndGet)
+{
+  EmbeddedStore store;
+  put(store, "impu", "kermit", "xml", "<xml/>", 1);
+  put(store, "impu", "kermit", "is_registered", "1", 1);
+
+  EXPECT_EQ("<xml/>", get(store, "impu", "kermit", "xml"));
+  EXPECT_EQ("1", get(store, "impu", "kermit", "is_registered"));
+  EXPECT_EQ("", get(store, "impu", "kermit", "other"));
+  EXPECT_EQ("", get(store, "impu", "gonzo", "xml"));
+  EXPECT_EQ("", get(store, "impi", "kermit", "xml"));
+  EXPECT_EQ(1u, store.row_count("impu"));
+
+  // A slice range returns the columns in name order.
+  ColumnParent parent;
+  parent.column_family = "impu";
+  SlicePredicate predicate;
+  SliceRange range;
+  range.start = "a";
+  range.finish = "z";
+  predicate.__set_slice_range(range);
+
+  std::vector<ColumnOrSuperColumn> columns;
+  store.get_slice(columns, "kermit", parent, predicate, ConsistencyLevel::ONE);
+  ASSERT_EQ(2u, columns.size());
+  EXPECT_EQ("is_registered", columns[0].column.name);
+  EXPECT_EQ("xml", columns[1].column.name);
+}
+
+TEST_F(EmbeddedStoreTest, LatestTimestampWins)
+{
+  EmbeddedStore store;
+  put(store, "impu", "kermit", "xml", "new", 2);
+  put(store, "impu", "kermit", "xml", "old", 1);
+  EXPECT_EQ("new", get(store, "impu", "kermit", "xml"));
+
+  // Deletions older than the column are ignored too.
+  del(store, "impu", "kermit", {"xml"}, 1);
+  EXPECT_EQ("new", get(store, "impu", "kermit", "xml"));
+}
+
+TEST_F(EmbeddedStoreTest, Deletions)
+{
+  EmbeddedStore store;
+  put(store, "impu", "kermit", "xml", "<xml/>", 1);
+  put(store, "impu", "kermit", "is_registered", "1", 1);
+  put(store, "impu", "gonzo", "xml", "<xml/>", 1);
+
+  del(store, "impu", "kermit", {"is_registered"}, 2);
+  EXPECT_EQ("<xml/>", get(store, "impu", "kermit", "xml"));
+  EXPECT_EQ("", get(store, "impu", "kermit", "is_registered"));
+
+  // Deleting the whole row.
+  del(store, "impu", "kermit", {}, 2);
+  EXPECT_EQ("", get(store, "impu", "kermit", "xml"));
+
+  ColumnPath path;
+  path.column_family = "impu";
+  store.remove("gonzo", path, 2, ConsistencyLevel::ONE);
+  EXPECT_EQ("", get(store, "impu", "gonzo", "xml"));
+
+  EXPECT_EQ(0u, store.row_count("impu"));
+}
+
+// Deletions leave tombstones, so writes with older timestamps that arrive
+// later don't bring the data back.
+TEST_F(EmbeddedStoreTest, TombstonesBlockOlderWrites)
+{
+  EmbeddedStore store;
+  int64_t ts = (int64_t)time(NULL) * 1000000;
+
+  put(store, "impu", "kermit", "xml", "<xml/>", ts);
+  del(store, "impu", "kermit", {"xml"}, ts + 1);
+  put(store, "impu", "kermit", "xml", "<old/>", ts + 1);
+  EXPECT_EQ("", get(store, "impu", "kermit", "xml"));
+  EXPECT_EQ(0u, store.row_count("impu"));
+
+  put(store, "impu", "kermit", "xml", "<new/>", ts + 2);
+  EXPECT_EQ("<new/>", get(store, "impu", "kermit", "xml"));
+
+  // Deleting a row blocks older writes to any of its columns, even if the
+  // row didn't exist when it was deleted.
+  del(store, "impu", "kermit", {}, ts + 3);
+  put(store, "impu", "kermit", "is_registered", "1", ts + 2);
+  del(store, "impu", "gonzo", {}, ts + 3);
+  put(store, "impu", "gonzo", "xml", "<xml/>", ts + 2);
+  EXPECT_EQ("", get(store, "impu", "kermit", "xml"));
+  EXPECT_EQ("", get(store, "impu", "kermit", "is_registered"));
+  EXPECT_EQ("", get(store, "impu", "gonzo", "xml"));
+  EXPECT_EQ(0u, store.row_count("impu"));
+
+  put(store, "impu", "kermit", "xml", "<new/>", ts + 4);
+  EXPECT_EQ("<new/>", get(store, "impu", "kermit", "xml"));
+  EXPECT_EQ(1u, store.row_count("impu"));
+
+  // Tombstones are discarded after the grace period.
+  cwtest_advance_time_ms((EmbeddedStore::TOMBSTONE_GC_GRACE_S + 1) * 1000);
+  put(store, "impu", "gonzo", "xml", "<xml/>", ts + 2);
+  EXPECT_EQ("<xml/>", get(store, "impu", "gonzo", "xml"));
+}
+
+TEST_F(EmbeddedStoreTest, ColumnsExpire)
+{
+  EmbeddedStore store;
+  put(store, "impi", "kermit", "digest_ha1", "ha1", 1, 30);
+
+  ColumnParent parent;
+  parent.column_family = "impi";
+  SlicePredicate predicate;
+  predicate.__set_column_names({"digest_ha1"});
+
+  std::vector<ColumnOrSuperColumn> columns;
+  store.get_slice(columns, "kermit", parent, predicate, ConsistencyLevel::ONE);
+  ASSERT_EQ(1u, columns.size());
+  EXPECT_EQ(30, columns[0].column.ttl);
+
+  cwtest_advance_time_ms(10000);
+  columns.clear();
+  store.get_slice(columns, "kermit", parent, predicate, ConsistencyLevel::ONE);
+  ASSERT_EQ(1u, columns.size());
+  EXPECT_EQ(20, columns[0].column.ttl);
+
+  cwtest_advance_time_ms(20000);
+  EXPECT_EQ("", get(store, "impi", "kermit", "digest_ha1"));
+}
+
+TEST_F(EmbeddedStoreTest, MultigetOmitsMissingRows)
+{
+  EmbeddedStore store;
+  put(store, "impi", "kermit", "public_id_sip:kermit", "", 1);
+  put(store, "impi", "gonzo", "public_id_sip:gonzo", "", 1);
+
+  ColumnParent parent;
+  parent.column_family = "impi";
+  SlicePredicate predicate;
+  SliceRange range;
+  range.start = "public_id_";
+  range.finish = "public_id_\xff";
+  predicate.__set_slice_range(range);
+
+  std::map<std::string, std::vector<ColumnOrSuperColumn> > rows;
+  store.multiget_slice(rows, {"kermit", "gonzo", "fozzie"}, parent, predicate, ConsistencyLevel::ONE);
+  EXPECT_EQ(2u, rows.size());
+  EXPECT_EQ(1u, rows["kermit"].size());
+  EXPECT_EQ(1u, rows["gonzo"].size());
+  EXPECT_EQ(0u, rows.count("fozzie"));
+}
+
+TEST_F(EmbeddedStoreTest, RangeSlicesPageThroughTokenRanges)
+{
+  EmbeddedStore store;
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    put(store, "impu", "key" + std::to_string(ii), "xml", "<xml/>", 1);
+  }
+
+  ColumnParent parent;
+  parent.column_family = "impu";
+  SlicePredicate predicate;
+  predicate.__set_column_names({"xml"});
+
+  // Scan the ring in two halves, three rows at a time, carrying on from the
+  // last key of each page.  Every row is returned exactly once.
+  std::set<std::string> seen;
+  std::vector<std::string> halves = {"-9223372036854775808", "0", "9223372036854775807"};
+
+  for (int half = 0; half < 2; ++half)
+  {
+    std::string last_key;
+    while (true)
+    {
+      KeyRange range;
+      range.__set_end_token(halves[half + 1]);
+      if (last_key.empty())
+      {
+        range.__set_start_token(halves[half]);
+        range.__set_count(3);
+      }
+      else
+      {
+        range.__set_start_key(last_key);
+        range.__set_count(4);
+      }
+
+      std::vector<KeySlice> slices;
+      store.get_range_slices(slices, parent, predicate, range, ConsistencyLevel::ONE);
+      for (std::vector<KeySlice>::const_iterator slice = slices.begin();
+           slice != slices.end();
+           ++slice)
+      {
+        if (slice->key != last_key)
+        {
+          EXPECT_TRUE(seen.insert(slice->key).second);
+          last_key = slice->key;
+        }
+      }
+
+      if (slices.size() < (size_t)range.count)
+      {
+        break;
+      }
+    }
+  }
+
+  EXPECT_EQ(10u, seen.size());
+}
+
+TEST_F(EmbeddedStoreTest, PersistsThroughLog)
+{
+  {
+    EmbeddedStore store(_dir);
+    ASSERT_TRUE(store.open());
+    put(store, "impu", "kermit", "xml", "<xml/>", 1);
+    put(store, "impu", "gonzo", "xml", "<xml/>", 1);
+    del(store, "impu", "gonzo", {}, 2);
+    EXPECT_LT(0u, store.log_bytes());
+  }
+
+  EmbeddedStore store(_dir);
+  ASSERT_TRUE(store.open());
+  EXPECT_EQ("<xml/>", get(store, "impu", "kermit", "xml"));
+  EXPECT_EQ("", get(store, "impu", "gonzo", "xml"));
+}
+
+TEST_F(EmbeddedStoreTest, SnapshotTruncatesLog)
+{
+  {
+    // A tiny threshold, so every write requests a snapshot.  The snapshot
+    // thread writes any requested snapshot before the store is destroyed.
+    EmbeddedStore store(_dir, 1);
+    ASSERT_TRUE(store.open());
+    put(store, "impu", "kermit", "xml", "<xml/>", 1);
+    put(store, "impi", "kermit", "digest_ha1", "ha1", 1);
+  }
+
+  // The log only holds its header, and the old log has been removed.
+  struct stat st;
+  ASSERT_EQ(0, stat((_dir + "/log").c_str(), &st));
+  EXPECT_EQ(8, st.st_size);
+  EXPECT_NE(0, access((_dir + "/log.old").c_str(), F_OK));
+
+  {
+    EmbeddedStore store(_dir);
+    ASSERT_TRUE(store.open());
+    EXPECT_EQ("<xml/>", get(store, "impu", "kermit", "xml"));
+    EXPECT_EQ("ha1", get(store, "impi", "kermit", "digest_ha1"));
+
+    // Later changes go in the log and are replayed over the snapshot.
+    put(store, "impu", "kermit", "xml", "<new/>", 2);
+    EXPECT_LT(0u, store.log_bytes());
+  }
+
+  EmbeddedStore store(_dir);
+  ASSERT_TRUE(store.open());
+  EXPECT_EQ("<new/>", get(store, "impu", "kermit", "xml"));
+}
+
+// If homestead stops while a snapshot is being written, the old log is
+// replayed on start-up and then compacted into a new snapshot.
+TEST_F(EmbeddedStoreTest, InterruptedSnapshotReplayed)
+{
+  {
+    EmbeddedStore store(_dir);
+    ASSERT_TRUE(store.open());
+    put(store, "impu", "kermit", "xml", "<xml/>", 1);
+  }
+
+  ASSERT_EQ(0, rename((_dir + "/log").c_str(), (_dir + "/log.old").c_str()));
+
+  {
+    EmbeddedStore store(_dir);
+    ASSERT_TRUE(store.open());
+    EXPECT_EQ("<xml/>", get(store, "impu", "kermit", "xml"));
+    EXPECT_NE(0, access((_dir + "/log.old").c_str(), F_OK));
+  }
+
+  EmbeddedStore store(_dir);
+  ASSERT_TRUE(store.open());
+  EXPECT_EQ("<xml/>", get(store, "impu", "kermit", "xml"));
+}
+
+TEST_F(EmbeddedStoreTest, TombstonesPersist)
+{
+  int64_t ts = (int64_t)time(NULL) * 1000000;
+
+  {
+    EmbeddedStore store(_dir);
+    ASSERT_TRUE(store.open());
+    put(store, "impu", "kermit", "xml", "<xml/>", ts);
+    del(store, "impu", "kermit", {}, ts + 1);
+    put(store, "impu", "gonzo", "xml", "<xml/>", ts);
+    del(store, "impu", "gonzo", {"xml"}, ts + 1);
+    store.snapshot();
+  }
+
+  EmbeddedStore store(_dir);
+  ASSERT_TRUE(store.open());
+  put(store, "impu", "kermit", "xml", "<old/>", ts);
+  put(store, "impu", "gonzo", "xml", "<old/>", ts);
+  EXPECT_EQ("", get(store, "impu", "kermit", "xml"));
+  EXPECT_EQ("", get(store, "impu", "gonzo", "xml"));
+}
+
+// Concurrent writes are all acknowledged once the log has been synced, and
+// survive the store being reopened.
+TEST_F(EmbeddedStoreTest, GroupCommit)
+{
+  {
+    EmbeddedStore store(_dir,
+                        EmbeddedStore::DEFAULT_SNAPSHOT_LOG_BYTES,
+                        0,
+                        EmbeddedStore::SYNC_COMMIT);
+    ASSERT_TRUE(store.open());
+
+    std::vector<std::thread> threads;
+    for (int ii = 0; ii < 4; ++ii)
+    {
+      threads.push_back(std::thread([&store, ii]()
+      {
+        for (int jj = 0; jj < 10; ++jj)
+        {
+          put(store, "impu", "muppet" + std::to_string(ii * 10 + jj), "xml", "<xml/>", 1);
+        }
+      }));
+    }
+
+    for (std::vector<std::thread>::iterator thread = threads.begin();
+         thread != threads.end();
+         ++thread)
+    {
+      thread->join();
+    }
+  }
+
+  EmbeddedStore store(_dir);
+  ASSERT_TRUE(store.open());
+  EXPECT_EQ(40u, store.row_count("impu"));
+}
+
+TEST_F(EmbeddedStoreTest, ExpiredColumnsDiscardedOnLoad)
+{
+  {
+    EmbeddedStore store(_dir);
+    ASSERT_TRUE(store.open());
+    put(store, "impu", "kermit", "xml", "<xml/>", 1);
+    put(store, "impu", "kermit", "is_registered", "1", 1, 30);
+    put(store, "impu", "gonzo", "is_registered", "1", 1, 30);
+    store.snapshot();
+
+    // An expired write still overwrites an older value.
+    put(store, "impu", "kermit", "xml", "<new/>", 2, 30);
+  }
+
+  cwtest_advance_time_ms(60000);
+
+  EmbeddedStore store(_dir);
+  ASSERT_TRUE(store.open());
+  EXPECT_EQ("", get(store, "impu", "kermit", "xml"));
+  EXPECT_EQ("", get(store, "impu", "kermit", "is_registered"));
+  EXPECT_EQ(0u, store.row_count("impu"));
+}
+
+TEST_F(EmbeddedStoreTest, LoadsInBackground)
+{
+  {
+    EmbeddedStore store(_dir);
+    ASSERT_TRUE(store.open());
+    put(store, "impu", "kermit", "xml", "<xml/>", 1);
+    store.snapshot();
+  }
+
+  EmbeddedStore store(_dir);
+  store.open_async();
+  ASSERT_TRUE(store.wait_opened());
+  EXPECT_EQ("<xml/>", get(store, "impu", "kermit", "xml"));
+}
+
+TEST_F(EmbeddedStoreTest, TornRecordDiscarded)
+{
+  uint64_t first_record_bytes;
+
+  {
+    EmbeddedStore store(_dir);
+    ASSERT_TRUE(store.open());
+    put(store, "impu", "kermit", "xml", "<xml/>", 1);
+    first_record_bytes = store.log_bytes();
+    put(store, "impu", "gonzo", "xml", "<xml/>", 1);
+  }
+
+  // Chop the end off the last record, as if homestead died while writing it.
+  std::string log = _dir + "/log";
+  struct stat st;
+  ASSERT_EQ(0, stat(log.c_str(), &st));
+  ASSERT_EQ(0, truncate(log.c_str(), st.st_size - 3));
+
+  {
+    EmbeddedStore store(_dir);
+    ASSERT_TRUE(store.open());
+    EXPECT_EQ("<xml/>", get(store, "impu", "kermit", "xml"));
+    EXPECT_EQ("", get(store, "impu", "gonzo", "xml"));
+    EXPECT_EQ(first_record_bytes, store.log_bytes());
+
+    // The torn record has been removed, so new records can be replayed.
+    put(store, "impu", "fozzie", "xml", "<xml/>", 1);
+  }
+
+  EmbeddedStore store(_dir);
+  ASSERT_TRUE(store.open());
+  EXPECT_EQ("<xml/>", get(store, "impu", "fozzie", "xml"));
+}
+
+TEST_F(EmbeddedStoreTest, RejectsForeignFiles)
+{
+  std::string log = _dir + "/log";
+  int fd = open(log.c_str(), O_WRONLY | O_CREAT, 0644);
+  ASSERT_EQ(9, write(fd, "not a log", 9));
+  close(fd);
+
+  EmbeddedStore store(_dir);
+  EXPECT_FALSE(store.open());
+}
@@ -73,6 +73,7 @@
 #include "mock_health_checker.hpp"
 #include "fakesnmp.hpp"
 #include "base64.h"
+#include "rapidjson/document.h"
 
 using ::testing::Return;
 using ::testing::ReturnRef;
@@ -1602,6 +1603,62 @@ TEST_F(HandlersTest, DigestHSSNoCacheTTL)
   digest_hss_template(false, false);
 }
 
+// With write-behind configured, the digest is returned without waiting for
+// the associated public ID to be written.
+TEST_F(HandlersTest, DigestHSSWriteBehind)
+{
+  AssocImpuWriter writer(_cache);
+  HssCacheTask::configure_assoc_impu_writer(&writer);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impi/" + IMPI,
+                             "digest",
+                             "?public_id=" + IMPU);
+  ImpiTask::Config cfg(true, 300, SCHEME_UNKNOWN, SCHEME_DIGEST, SCHEME_AKA);
+  ImpiDigestTask* task = new ImpiDigestTask(req, &cfg, FAKE_TRAIL_ID);
+
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  DigestAuthVector digest;
+  digest.ha1 = "ha1";
+  digest.realm = "realm";
+  digest.qop = "qop";
+  AKAAuthVector aka;
+  Cx::MultimediaAuthAnswer maa(_cx_dict,
+                               _mock_stack,
+                               DIAMETER_SUCCESS,
+                               SCHEME_DIGEST,
+                               digest,
+                               aka);
+
+  MockCache::MockPutAssociatedPublicID mock_op;
+  EXPECT_CALL(*_cache, create_PutAssociatedPublicID(IMPI, IMPU,  _, 300))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+
+  // The reply is sent as soon as the MAA arrives.
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  _caught_diam_tsx->on_response(maa);
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+  Mock::VerifyAndClearExpectations(_httpstack);
+  EXPECT_EQ(build_digest_json(digest), req.content());
+  EXPECT_EQ(1u, writer.pending());
+
+  // The write then completes in the background.
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  t->on_success(&mock_op);
+  EXPECT_EQ(0u, writer.pending());
+  EXPECT_EQ(1u, writer.written());
+
+  HssCacheTask::configure_assoc_impu_writer(NULL);
+}
+
 TEST_F(HandlersTest, DigestHSSTimeout)
 {
   // This test tests an Impi Digest task case with an HSS configured.
@@ -2374,6 +2431,113 @@ TEST_F(HandlersTest, IMSSubscriptionHSS_ReregWithSARAlways)
                     310);
 }
 
+// Re-registration when the database record is old enough to trigger a new
+// SAR, with refresh-ahead configured.  The response is sent from the cache,
+// and the SAR (retried after a timeout) and cache write happen afterwards.
+TEST_F(HandlersTest, IMSSubscriptionHSS_ReregRefreshAhead)
+{
+  RegDataRefresher refresher(1800);
+  HssCacheTask::configure_reg_data_refresher(&refresher);
+
+  MockHttpStack::Request req = make_request("reg", true, true);
+  ImpuRegDataTask::Config cfg(true, 3600, 7200);
+  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
+
+  // The record has 3000s left to live, so is 4200s old.
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_op, get_xml(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(DoAll(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION), SetArgReferee<1>(3000)));
+  EXPECT_CALL(mock_op, get_registration_state(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(DoAll(SetArgReferee<0>(RegistrationState::REGISTERED), SetArgReferee<1>(3000)));
+  EXPECT_CALL(mock_op, get_charging_addrs(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
+  EXPECT_CALL(mock_op, get_associated_impis(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(IMPI_IN_VECTOR));
+
+  // The reply is sent straight away, and the SAR after it.
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  t->on_success(&mock_op);
+  Mock::VerifyAndClearExpectations(_httpstack);
+  EXPECT_EQ(REGDATA_RESULT, req.content());
+  EXPECT_EQ(1u, refresher.in_progress());
+
+  // A second re-registration while the refresh is in progress is answered
+  // from the cache without another SAR.
+  EXPECT_EQ(RegDataRefresher::IN_PROGRESS, refresher.admit(IMPU, 3000));
+
+  // Time out the SAR, and check it's retried.
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+  Diameter::Transaction* timed_out_tsx = _caught_diam_tsx;
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  timed_out_tsx->on_timeout();
+  delete timed_out_tsx;
+  EXPECT_EQ(1u, refresher.retried());
+
+  Diameter::Message msg(_cx_dict, _caught_fd_msg, _mock_stack);
+  Cx::ServerAssignmentRequest sar(msg);
+  EXPECT_TRUE(sar.server_assignment_type(test_i32));
+  EXPECT_EQ(2, test_i32);
+
+  // The SAA updates the cache, but nothing more is sent to the client.
+  Cx::ServerAssignmentAnswer saa(_cx_dict,
+                                 _mock_stack,
+                                 DIAMETER_SUCCESS,
+                                 IMPU_IMS_SUBSCRIPTION,
+                                 NO_CHARGING_ADDRESSES);
+  MockCache::MockPutRegData mock_op2;
+  EXPECT_CALL(*_cache, create_PutRegData(IMPU_REG_SET, _, 7200))
+    .WillOnce(Return(&mock_op2));
+  EXPECT_CALL(mock_op2, with_xml(IMPU_IMS_SUBSCRIPTION))
+    .WillOnce(ReturnRef(mock_op2));
+  EXPECT_CALL(mock_op2, with_reg_state(RegistrationState::REGISTERED))
+    .WillOnce(ReturnRef(mock_op2));
+  EXPECT_CALL(mock_op2, with_associated_impis(IMPI_IN_VECTOR))
+    .WillOnce(ReturnRef(mock_op2));
+  EXPECT_CALL(mock_op2, with_charging_addrs(_))
+    .WillOnce(ReturnRef(mock_op2));
+  EXPECT_DO_ASYNC(*_cache, mock_op2);
+  EXPECT_CALL(*_httpstack, send_reply(_, _, _)).Times(0);
+  _caught_diam_tsx->on_response(saa);
+
+  t = mock_op2.get_trx();
+  ASSERT_FALSE(t == NULL);
+  t->on_success(&mock_op2);
+
+  EXPECT_EQ(0u, refresher.in_progress());
+  EXPECT_EQ(1u, refresher.succeeded());
+
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+  HssCacheTask::configure_reg_data_refresher(NULL);
+}
+
+// Re-registration with refresh-ahead configured, but where the record is too
+// close to expiring to refresh in the background.  The SAR is sent before
+// replying, as usual.
+TEST_F(HandlersTest, IMSSubscriptionHSS_ReregRefreshAheadNearExpiry)
+{
+  RegDataRefresher refresher(1800);
+  HssCacheTask::configure_reg_data_refresher(&refresher);
+
+  MockHttpStack::Request req = make_request("reg", true, true);
+  reg_data_template(req, true, true, false, RegistrationState::REGISTERED, 2, 500);
+
+  EXPECT_EQ(0u, refresher.started());
+  HssCacheTask::configure_reg_data_refresher(NULL);
+}
+
 // Call to a registered subscriber
 
 TEST_F(HandlersTest, IMSSubscriptionCallHSS)
@@ -2762,6 +2926,214 @@ TEST_F(HandlersTest, IMSSubscriptionGet)
   EXPECT_EQ(REGDATA_RESULT, req.content());
 }
 
+// A GET with an If-None-Match header listing the current entity tag gets a
+// 304 with no body.
+TEST_F(HandlersTest, IMSSubscriptionGetNotModified)
+{
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "",
+                             "",
+                             htp_method_GET);
+  std::string etag = ImpuRegDataTask::reg_data_etag(RegistrationState::REGISTERED,
+                                                    IMPU_IMS_SUBSCRIPTION,
+                                                    NO_CHARGING_ADDRESSES);
+  req.add_header_to_incoming_req("If-None-Match", "\"stale\", W/" + etag);
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
+
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_op, get_xml(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION));
+  EXPECT_CALL(mock_op, get_registration_state(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(RegistrationState::REGISTERED));
+  EXPECT_CALL(mock_op, get_associated_impis(_)).Times(AtLeast(1));
+  EXPECT_CALL(mock_op, get_charging_addrs(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 304, _));
+  t->on_success(&mock_op);
+
+  EXPECT_EQ("", req.content());
+}
+
+// The entity tag of a compressed copy of the current document also gets a
+// 304.
+TEST_F(HandlersTest, IMSSubscriptionGetNotModifiedCompressed)
+{
+  ResponseCompressor compressor(1);
+  HssCacheTask::configure_response_compressor(&compressor);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "",
+                             "",
+                             htp_method_GET);
+  std::string etag = ImpuRegDataTask::reg_data_etag(RegistrationState::REGISTERED,
+                                                    IMPU_IMS_SUBSCRIPTION,
+                                                    NO_CHARGING_ADDRESSES);
+  etag.insert(etag.size() - 1, "-gzip");
+  req.add_header_to_incoming_req("If-None-Match", etag);
+  req.add_header_to_incoming_req("Accept-Encoding", "gzip");
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
+
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_op, get_xml(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION));
+  EXPECT_CALL(mock_op, get_registration_state(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(RegistrationState::REGISTERED));
+  EXPECT_CALL(mock_op, get_associated_impis(_)).Times(AtLeast(1));
+  EXPECT_CALL(mock_op, get_charging_addrs(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 304, _));
+  t->on_success(&mock_op);
+
+  EXPECT_EQ("", req.content());
+  EXPECT_EQ(0u, compressor.compressions());
+
+  HssCacheTask::configure_response_compressor(NULL);
+}
+
+// If the entity tag has changed, the full document is sent.
+TEST_F(HandlersTest, IMSSubscriptionGetModified)
+{
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "",
+                             "",
+                             htp_method_GET);
+  std::string etag = ImpuRegDataTask::reg_data_etag(RegistrationState::UNREGISTERED,
+                                                    IMPU_IMS_SUBSCRIPTION,
+                                                    NO_CHARGING_ADDRESSES);
+  req.add_header_to_incoming_req("If-None-Match", etag);
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
+
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_op, get_xml(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION));
+  EXPECT_CALL(mock_op, get_registration_state(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(RegistrationState::REGISTERED));
+  EXPECT_CALL(mock_op, get_associated_impis(_)).Times(AtLeast(1));
+  EXPECT_CALL(mock_op, get_charging_addrs(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  t->on_success(&mock_op);
+
+  EXPECT_EQ(REGDATA_RESULT, req.content());
+}
+
+// Sprout can ask for the compact JSON form of the document.
+TEST_F(HandlersTest, IMSSubscriptionGetJson)
+{
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "",
+                             "",
+                             htp_method_GET);
+  req.add_header_to_incoming_req("Accept", "application/json");
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
+
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_op, get_xml(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION));
+  EXPECT_CALL(mock_op, get_registration_state(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(RegistrationState::REGISTERED));
+  EXPECT_CALL(mock_op, get_associated_impis(_)).Times(AtLeast(1));
+  EXPECT_CALL(mock_op, get_charging_addrs(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  t->on_success(&mock_op);
+
+  rapidjson::Document doc;
+  doc.Parse<0>(req.content().c_str());
+  ASSERT_FALSE(doc.HasParseError());
+  EXPECT_EQ(std::string("REGISTERED"), doc["reg-state"].GetString());
+  EXPECT_EQ(IMPU_IMS_SUBSCRIPTION, doc["ims-subscription"].GetString());
+  EXPECT_FALSE(doc.HasMember("charging-addresses"));
+}
+
+// Clients that accept gzip get a compressed body, if compression is
+// configured.
+TEST_F(HandlersTest, IMSSubscriptionGetCompressed)
+{
+  ResponseCompressor compressor(1);
+  HssCacheTask::configure_response_compressor(&compressor);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "",
+                             "",
+                             htp_method_GET);
+  req.add_header_to_incoming_req("Accept-Encoding", "gzip, deflate");
+  ImpuRegDataTask::Config cfg(true, 3600);
+  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+
+  MockCache::MockGetRegData mock_op;
+  EXPECT_CALL(*_cache, create_GetRegData(IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
+
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+  EXPECT_CALL(mock_op, get_xml(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(IMPU_IMS_SUBSCRIPTION));
+  EXPECT_CALL(mock_op, get_registration_state(_, _)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(RegistrationState::REGISTERED));
+  EXPECT_CALL(mock_op, get_associated_impis(_)).Times(AtLeast(1));
+  EXPECT_CALL(mock_op, get_charging_addrs(_)).Times(AtLeast(1))
+    .WillRepeatedly(SetArgReferee<0>(NO_CHARGING_ADDRESSES));
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  t->on_success(&mock_op);
+
+  // The body starts with the gzip magic number.
+  ASSERT_GT(req.content().size(), 2u);
+  EXPECT_EQ("\x1f\x8b", req.content().substr(0, 2));
+  EXPECT_EQ(1u, compressor.compressions());
+
+  HssCacheTask::configure_response_compressor(NULL);
+}
+
 // Test error handling
 
 // If we don't recognise the body, we should reject the request
@@ -2970,6 +3342,137 @@ TEST_F(HandlersTest, IMSSubscriptionCacheFailure)
   t->on_failure(&mock_op);
 }
 
+//
+// Batched IMPU reg-data tests
+//
+
+TEST_F(HandlersTest, RegDataBatch)
+{
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/batch/reg-data",
+                             "",
+                             "",
+                             "{\"public-ids\": [\"" + IMPU + "\", \"" + IMPU2 + "\"]}",
+                             htp_method_POST);
+  ImpuRegDataBatchTask::Config cfg;
+  ImpuRegDataBatchTask* task = new ImpuRegDataBatchTask(req, &cfg, FAKE_TRAIL_ID);
+
+  // Both public IDs are read with a single cache operation.
+  std::vector<std::string> impus = {IMPU, IMPU2};
+  MockCache::MockGetRegDataBatch mock_op;
+  EXPECT_CALL(*_cache, create_GetRegDataBatch(impus))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
+
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+
+  std::map<std::string, Cache::GetRegData::Result> results;
+  results[IMPU].xml = IMPU_IMS_SUBSCRIPTION;
+  results[IMPU].state = RegistrationState::REGISTERED;
+  results[IMPU2].state = RegistrationState::NOT_REGISTERED;
+  EXPECT_CALL(mock_op, get_result(_))
+    .WillOnce(SetArgReferee<0>(results));
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  t->on_success(&mock_op);
+
+  // Each public ID gets the same document as a GET, in the order requested.
+  rapidjson::Document doc;
+  doc.Parse<0>(req.content().c_str());
+  ASSERT_FALSE(doc.HasParseError());
+  const rapidjson::Value& reg_data = doc["reg-data"];
+  ASSERT_EQ(2u, reg_data.Size());
+  EXPECT_EQ(IMPU, reg_data[0u]["public-id"].GetString());
+  EXPECT_EQ(200, reg_data[0u]["result-code"].GetInt());
+  EXPECT_EQ(REGDATA_RESULT, reg_data[0u]["reg-data"].GetString());
+  EXPECT_EQ(IMPU2, reg_data[1u]["public-id"].GetString());
+  EXPECT_EQ(200, reg_data[1u]["result-code"].GetInt());
+  EXPECT_NE(std::string::npos,
+            std::string(reg_data[1u]["reg-data"].GetString()).find("NOT_REGISTERED"));
+}
+
+// Bodies that don't list any public IDs are rejected without reading the cache.
+TEST_F(HandlersTest, RegDataBatchInvalidBody)
+{
+  ImpuRegDataBatchTask::Config cfg;
+  std::vector<std::string> bodies = {"",
+                                     "{\"public-ids\": []}",
+                                     "{\"public-ids\": \"" + IMPU + "\"}",
+                                     "{\"public-ids\": [1]}"};
+
+  for (std::vector<std::string>::const_iterator body = bodies.begin();
+       body != bodies.end();
+       ++body)
+  {
+    MockHttpStack::Request req(_httpstack,
+                               "/impu/batch/reg-data",
+                               "",
+                               "",
+                               *body,
+                               htp_method_POST);
+    ImpuRegDataBatchTask* task = new ImpuRegDataBatchTask(req, &cfg, FAKE_TRAIL_ID);
+    EXPECT_CALL(*_httpstack, send_reply(_, 400, _));
+    task->run();
+  }
+}
+
+TEST_F(HandlersTest, RegDataBatchTooManyPublicIds)
+{
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/batch/reg-data",
+                             "",
+                             "",
+                             "{\"public-ids\": [\"" + IMPU + "\", \"" + IMPU2 + "\"]}",
+                             htp_method_POST);
+  ImpuRegDataBatchTask::Config cfg(1);
+  ImpuRegDataBatchTask* task = new ImpuRegDataBatchTask(req, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_httpstack, send_reply(_, 400, _));
+  task->run();
+}
+
+TEST_F(HandlersTest, RegDataBatchWrongMethod)
+{
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/batch/reg-data",
+                             "",
+                             "",
+                             "",
+                             htp_method_GET);
+  ImpuRegDataBatchTask::Config cfg;
+  ImpuRegDataBatchTask* task = new ImpuRegDataBatchTask(req, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_httpstack, send_reply(_, 405, _));
+  task->run();
+}
+
+// Connection failures should translate into a 503 Service Unavailable error
+TEST_F(HandlersTest, RegDataBatchCacheConnectionFailure)
+{
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/batch/reg-data",
+                             "",
+                             "",
+                             "{\"public-ids\": [\"" + IMPU + "\"]}",
+                             htp_method_POST);
+  ImpuRegDataBatchTask::Config cfg;
+  ImpuRegDataBatchTask* task = new ImpuRegDataBatchTask(req, &cfg, FAKE_TRAIL_ID);
+
+  MockCache::MockGetRegDataBatch mock_op;
+  EXPECT_CALL(*_cache, create_GetRegDataBatch(_))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
+
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 503, _));
+  mock_op._cass_status = CassandraStore::CONNECTION_ERROR;
+  mock_op._cass_error_text = "error";
+  t->on_failure(&mock_op);
+}
+
 TEST_F(HandlersTest, RegistrationStatusHSSTimeout)
 {
   // This test tests the common diameter timeout function. Build the HTTP request
@@ -3081,6 +3584,69 @@ TEST_F(HandlersTest, RegistrationStatus)
   EXPECT_EQ(build_icscf_json(DIAMETER_SUCCESS, SERVER_NAME, CAPABILITIES), req.content());
 }
 
+TEST_F(HandlersTest, RegistrationStatusCachedForSubsequentRegistration)
+{
+  // This test checks that the answer for a registered subscriber is cached,
+  // so a repeat query is answered without sending another UAR, unless it's
+  // for a de-registration.
+  AnswerCache registration_status_cache;
+  HssCacheTask::configure_registration_status_cache(&registration_status_cache);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impi/" + IMPI + "/",
+                             "registration-status",
+                             "?impu=" + IMPU);
+  ImpiRegistrationStatusTask::Config cfg(true);
+  ImpiRegistrationStatusTask* task = new ImpiRegistrationStatusTask(req, &cfg, FAKE_TRAIL_ID);
+
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  Cx::UserAuthorizationAnswer uaa(_cx_dict,
+                                  _mock_stack,
+                                  0,
+                                  DIAMETER_SUBSEQUENT_REGISTRATION,
+                                  SERVER_NAME,
+                                  NO_CAPABILITIES);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  _caught_diam_tsx->on_response(uaa);
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  // The repeat query is answered from the cache.
+  MockHttpStack::Request req2(_httpstack,
+                              "/impi/" + IMPI + "/",
+                              "registration-status",
+                              "?impu=" + IMPU);
+  task = new ImpiRegistrationStatusTask(req2, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  task->run();
+  EXPECT_EQ(req.content(), req2.content());
+  EXPECT_EQ(1u, registration_status_cache.hits());
+
+  // A de-registration query always goes to the HSS.
+  MockHttpStack::Request req3(_httpstack,
+                              "/impi/" + IMPI + "/",
+                              "registration-status",
+                              "?impu=" + IMPU + "&auth-type=DEREG");
+  task = new ImpiRegistrationStatusTask(req3, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  _caught_diam_tsx->on_response(uaa);
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+  EXPECT_EQ(1u, registration_status_cache.size());
+
+  HssCacheTask::configure_registration_status_cache(NULL);
+}
+
 // 200 OK responses to the /impi/X/registration-status URL should
 // trigger the health-checker. Test that this happens.
 TEST_F(HandlersTest, RegistrationStatusPassesHealthCheck)
@@ -3414,6 +3980,81 @@ TEST_F(HandlersTest, LocationInfoOptParamsUnregisteredService)
   EXPECT_EQ(build_icscf_json(DIAMETER_UNREGISTERED_SERVICE, "", CAPABILITIES_WITH_SERVER_NAME), req.content());
 }
 
+TEST_F(HandlersTest, LocationInfoCached)
+{
+  // This test checks that a successful Location Info answer is cached, so a
+  // repeat query is answered without sending another LIR.
+  AnswerCache location_info_cache;
+  HssCacheTask::configure_location_info_cache(&location_info_cache);
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/",
+                             "location",
+                             "");
+  ImpuLocationInfoTask::Config cfg(true);
+  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+
+  EXPECT_CALL(*_mock_stack, send(_, _, 200))
+    .Times(1)
+    .WillOnce(WithArgs<0,1>(Invoke(store_msg_tsx)));
+  task->run();
+  ASSERT_FALSE(_caught_diam_tsx == NULL);
+
+  Cx::LocationInfoAnswer lia(_cx_dict,
+                             _mock_stack,
+                             DIAMETER_SUCCESS,
+                             0,
+                             SERVER_NAME,
+                             CAPABILITIES);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  _caught_diam_tsx->on_response(lia);
+  _caught_fd_msg = NULL;
+  delete _caught_diam_tsx; _caught_diam_tsx = NULL;
+
+  // The repeat query is answered from the cache.
+  MockHttpStack::Request req2(_httpstack,
+                              "/impu/" + IMPU + "/",
+                              "location",
+                              "");
+  task = new ImpuLocationInfoTask(req2, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  task->run();
+  EXPECT_EQ(build_icscf_json(DIAMETER_SUCCESS, SERVER_NAME, CAPABILITIES), req2.content());
+  EXPECT_EQ(1u, location_info_cache.hits());
+
+  // Once the subscriber's assignment may have changed, the HSS is queried
+  // again.
+  HssCacheTask::forget_location_info(std::vector<std::string>(1, IMPU));
+  EXPECT_EQ(0u, location_info_cache.size());
+
+  HssCacheTask::configure_location_info_cache(NULL);
+}
+
+TEST_F(HandlersTest, LocationInfoHotSubscriberRejected)
+{
+  // This test checks that a subscriber who has exceeded the hot subscriber
+  // rate limit is rejected without a request being sent to the HSS.
+  HotSubscribers hot_subscribers(1, 3, 1000);
+  HssCacheTask::configure_hot_subscribers(&hot_subscribers);
+  ASSERT_TRUE(hot_subscribers.record(HotSubscribers::IMPU_LOC_INFO, IMPU));
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/",
+                             "location",
+                             "");
+
+  ImpuLocationInfoTask::Config cfg(true);
+  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 503, _));
+  task->run();
+
+  // Other subscribers are unaffected.
+  EXPECT_TRUE(hot_subscribers.record(HotSubscribers::IMPU_LOC_INFO, IMPU2));
+
+  HssCacheTask::configure_hot_subscribers(NULL);
+}
+
 TEST_F(HandlersTest, LocationInfoUnregisteredError)
 {
   // This test tests a Location-Information-Answer with a 5003 error - which
@@ -3463,6 +4104,30 @@ TEST_F(HandlersTest, LocationInfoUserUnknown)
   location_info_error_template(0, DIAMETER_ERROR_USER_UNKNOWN, 404);
 }
 
+TEST_F(HandlersTest, LocationInfoUserUnknownNegativeCached)
+{
+  NegativeCache negative_cache;
+  HssCacheTask::configure_negative_cache(&negative_cache);
+
+  // The first request goes to the HSS, which reports the user as unknown.
+  location_info_error_template(0, DIAMETER_ERROR_USER_UNKNOWN, 404);
+  EXPECT_EQ(1u, negative_cache.size());
+
+  // A repeat request is rejected without sending an LIR.
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/",
+                             "location",
+                             "");
+  ImpuLocationInfoTask::Config cfg(true);
+  ImpuLocationInfoTask* task = new ImpuLocationInfoTask(req, &cfg, FAKE_TRAIL_ID);
+  EXPECT_CALL(*_mock_stack, send(_, _, _)).Times(0);
+  EXPECT_CALL(*_httpstack, send_reply(_, 404, _));
+  task->run();
+  EXPECT_EQ(1u, negative_cache.stats(NegativeCache::LIR).hits);
+
+  HssCacheTask::configure_negative_cache(NULL);
+}
+
 TEST_F(HandlersTest, LocationInfoDiameterBusy)
 {
   location_info_error_template(DIAMETER_TOO_BUSY, 0, 504);
@@ -3606,6 +4271,22 @@ TEST_F(HandlersTest, RegistrationTerminationPermanentTermination)
   rtr_template(PERMANENT_TERMINATION, HTTP_PATH_REG_FALSE, DEREG_BODY_PAIRINGS, HTTP_OK);
 }
 
+// An RTR tells us about its subscribers, so they're removed from the
+// negative cache.
+TEST_F(HandlersTest, RegistrationTerminationForgetsUserUnknown)
+{
+  NegativeCache negative_cache;
+  HssCacheTask::configure_negative_cache(&negative_cache);
+  negative_cache.add(NegativeCache::UAR, ASSOCIATED_IDENTITY1, IMPU);
+  negative_cache.add(NegativeCache::LIR, IMPU2);
+  EXPECT_EQ(2u, negative_cache.size());
+
+  rtr_template(PERMANENT_TERMINATION, HTTP_PATH_REG_FALSE, DEREG_BODY_PAIRINGS, HTTP_OK);
+  EXPECT_EQ(0u, negative_cache.size());
+
+  HssCacheTask::configure_negative_cache(NULL);
+}
+
 TEST_F(HandlersTest, RegistrationTerminationRemoveSCSCF)
 {
   rtr_template(REMOVE_SCSCF, HTTP_PATH_REG_TRUE, DEREG_BODY_LIST, HTTP_OK);
@@ -4446,6 +5127,58 @@ TEST_F(HandlerStatsTest, DigestCache)
 }
 
 
+TEST_F(HandlerStatsTest, DigestCacheStageLatency)
+{
+  // Test that cache requests update the per-stage latency stats, including
+  // the time spent queued before a cache thread picks the request up.
+  MockHttpStack::Request req(_httpstack,
+                             "/impi/" + IMPI,
+                             "digest",
+                             "?public_id=" + IMPU);
+
+  ImpiTask::Config cfg(false);
+  ImpiDigestTask* task = new ImpiDigestTask(req, &cfg, FAKE_TRAIL_ID);
+
+  MockCache::MockGetAuthVector mock_op;
+  EXPECT_CALL(*_cache, create_GetAuthVector(IMPI, IMPU))
+    .WillOnce(Return(&mock_op));
+  EXPECT_DO_ASYNC(*_cache, mock_op);
+  task->run();
+
+  CassandraStore::Transaction* t = mock_op.get_trx();
+  ASSERT_FALSE(t == NULL);
+
+  const LatencyHistogram& read_hist =
+    _stats->stage_histogram(StatisticsManager::STAGE_CACHE_READ).current();
+  const LatencyHistogram& queue_hist =
+    _stats->stage_histogram(StatisticsManager::STAGE_CACHE_QUEUE_WAIT).current();
+  const LatencyHistogram& op_hist =
+    _stats->cache_op_histogram(Cache::OP_GET_AUTH_VECTOR);
+  uint64_t read_count = read_hist.count();
+  uint64_t queue_count = queue_hist.count();
+  uint64_t op_count = op_hist.count();
+
+  // The request waits 5ms to be picked up, then takes 12ms.
+  cwtest_advance_time_ms(5);
+  t->start_timer();
+  cwtest_advance_time_ms(12);
+  t->stop_timer();
+
+  DigestAuthVector digest;
+  digest.ha1 = "ha1";
+
+  EXPECT_CALL(*_stats, update_H_cache_latency_us(12000));
+  EXPECT_CALL(mock_op, get_result(_))
+    .WillRepeatedly(SetArgReferee<0>(digest));
+  EXPECT_CALL(*_httpstack, send_reply(_, _, _));
+  t->on_success(&mock_op);
+
+  EXPECT_EQ(read_count + 1, read_hist.count());
+  EXPECT_EQ(queue_count + 1, queue_hist.count());
+  EXPECT_EQ(op_count + 1, op_hist.count());
+}
+
+
 TEST_F(HandlerStatsTest, DigestCacheFailure)
 {
   // Test that UNsuccessful cache requests result in the latency stats being
@@ -4507,7 +5240,11 @@ TEST_F(HandlerStatsTest, DigestCacheConnectionFailure)
   CassandraStore::Transaction* t = mock_op.get_trx();
   ASSERT_FALSE(t == NULL);
 
-  // Cache latency stats are updated when the transaction fails.
+  // Cache latency stats are updated when the transaction fails, and the
+  // failure is counted against the operation type.
+  uint64_t failures =
+    _stats->cache_op_result_count(Cache::OP_GET_AUTH_VECTOR,
+                                  CassandraStore::CONNECTION_ERROR);
   EXPECT_CALL(*_httpstack, send_reply(_, 503,  _));
   EXPECT_CALL(*_stats, update_H_cache_latency_us(_));
 
@@ -4515,6 +5252,10 @@ TEST_F(HandlerStatsTest, DigestCacheConnectionFailure)
   mock_op._cass_error_text = "error";
   t->on_failure(&mock_op);
 
+  EXPECT_EQ(failures + 1,
+            _stats->cache_op_result_count(Cache::OP_GET_AUTH_VECTOR,
+                                          CassandraStore::CONNECTION_ERROR));
+
   delete _caught_diam_tsx; _caught_diam_tsx = NULL;
 }
 
@@ -4839,3 +5580,47 @@ TEST_F(HandlerStatsTest, LocationInfoOverload)
   _caught_diam_tsx->on_response(lia);
   delete _caught_diam_tsx; _caught_diam_tsx = NULL;
 }
+
+//
+// Draining tests
+//
+
+// While draining, requests are rejected without being passed to the wrapped
+// handler.
+TEST_F(HandlersTest, DrainingRejectsRequests)
+{
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "",
+                             "",
+                             htp_method_GET);
+  ImpuRegDataTask::Config cfg;
+  HttpStackUtils::SpawningHandler<ImpuRegDataTask, ImpuRegDataTask::Config> handler(&cfg);
+  DrainingHandler draining_handler(&handler);
+
+  HssCacheTask::start_draining();
+  EXPECT_TRUE(HssCacheTask::is_draining());
+  EXPECT_CALL(*_httpstack, send_reply(_, 503, _));
+  draining_handler.process_request(req, FAKE_TRAIL_ID);
+  HssCacheTask::stop_draining();
+}
+
+// Draining waits for every task to be deleted.
+TEST_F(HandlersTest, DrainWaitsForTasks)
+{
+  EXPECT_TRUE(HssCacheTask::drain(0));
+
+  MockHttpStack::Request req(_httpstack,
+                             "/impu/" + IMPU + "/reg-data",
+                             "",
+                             "",
+                             "",
+                             htp_method_GET);
+  ImpuRegDataTask::Config cfg;
+  ImpuRegDataTask* task = new ImpuRegDataTask(req, &cfg, FAKE_TRAIL_ID);
+  EXPECT_FALSE(HssCacheTask::drain(0));
+
+  delete task;
+  EXPECT_TRUE(HssCacheTask::drain(0));
+}
@@ -0,0 +1,245 @@
+/**
+ * @file heavy_hitters_test.cpp UT for the heavy hitters sketch.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+#include "test_interposer.hpp"
+
+#include <thread>
+
+#include "heavy_hitters.h"
+
+/// Fixture for HeavyHittersTest.  Time is controlled so that windows only end
+/// when the test wants them to.
+class HeavyHittersTest : public testing::Test
+{
+public:
+  HeavyHittersTest()
+  {
+    cwtest_completely_control_time();
+  }
+
+  ~HeavyHittersTest()
+  {
+    cwtest_reset_time();
+  }
+};
+
+TEST_F(HeavyHittersTest, Empty)
+{
+  HeavyHitters hitters(3, 1000);
+  EXPECT_TRUE(hitters.top().empty());
+  EXPECT_EQ(0u, hitters.estimate("kermit"));
+}
+
+TEST_F(HeavyHittersTest, ReportsHeaviestKeys)
+{
+  HeavyHitters hitters(3, 1000);
+
+  // Three heavy keys, plus lots of keys that are only seen once.
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    hitters.record("kermit");
+    hitters.record("kermit");
+    hitters.record("gonzo");
+    if (ii % 2 == 0)
+    {
+      hitters.record("fozzie");
+    }
+    hitters.record("muppet" + std::to_string(ii));
+  }
+
+  EXPECT_LE(200u, hitters.estimate("kermit"));
+
+  std::vector<HeavyHitters::Entry> top = hitters.top();
+  ASSERT_EQ(3u, top.size());
+  EXPECT_EQ("kermit", top[0].key);
+  EXPECT_LE(200u, top[0].count);
+  EXPECT_EQ("gonzo", top[1].key);
+  EXPECT_EQ("fozzie", top[2].key);
+}
+
+// A key that becomes heavy after the candidate table has filled up replaces
+// the lightest candidate.
+TEST_F(HeavyHittersTest, LateKeyReplacesLightest)
+{
+  HeavyHitters hitters(2, 1000);
+
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    hitters.record("kermit");
+  }
+  hitters.record("gonzo");
+  hitters.record("gonzo");
+
+  for (int ii = 0; ii < 5; ++ii)
+  {
+    hitters.record("fozzie");
+  }
+
+  std::vector<HeavyHitters::Entry> top = hitters.top();
+  ASSERT_EQ(2u, top.size());
+  EXPECT_EQ("fozzie", top[0].key);
+  EXPECT_EQ(5u, top[0].count);
+  EXPECT_EQ("kermit", top[1].key);
+  EXPECT_EQ(3u, top[1].count);
+}
+
+TEST_F(HeavyHittersTest, ReportsLastCompleteWindow)
+{
+  HeavyHitters hitters(3, 1000);
+
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    hitters.record("kermit");
+  }
+
+  // Once the window ends the sketch is cleared, but the heavy hitters from
+  // the window are still reported.
+  cwtest_advance_time_ms(1000);
+  hitters.record("gonzo");
+  EXPECT_EQ(0u, hitters.estimate("kermit"));
+
+  std::vector<HeavyHitters::Entry> top = hitters.top();
+  ASSERT_EQ(1u, top.size());
+  EXPECT_EQ("kermit", top[0].key);
+  EXPECT_EQ(10u, top[0].count);
+
+  // If a whole window passes without traffic there's nothing to report.
+  cwtest_advance_time_ms(2000);
+  EXPECT_TRUE(hitters.top().empty());
+}
+
+TEST_F(HeavyHittersTest, RateLimit)
+{
+  // Allow 2 requests per second over a 5 second window - so 10 requests per
+  // window.
+  HotSubscribers hot(2, 3, 5000);
+
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    EXPECT_TRUE(hot.record(HotSubscribers::IMPI_AV, "kermit"));
+  }
+  EXPECT_FALSE(hot.record(HotSubscribers::IMPI_AV, "kermit"));
+
+  // The limit is per endpoint and per subscriber.
+  EXPECT_TRUE(hot.record(HotSubscribers::IMPU_REG_DATA, "kermit"));
+  EXPECT_TRUE(hot.record(HotSubscribers::IMPI_AV, "gonzo"));
+
+  // The limit resets when the window ends.
+  cwtest_advance_time_ms(5000);
+  EXPECT_TRUE(hot.record(HotSubscribers::IMPI_AV, "kermit"));
+}
+
+TEST_F(HeavyHittersTest, NoRateLimit)
+{
+  HotSubscribers hot;
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    EXPECT_TRUE(hot.record(HotSubscribers::IMPU_REG_DATA, "kermit"));
+  }
+
+  std::vector<HeavyHitters::Entry> top = hot.top(HotSubscribers::IMPU_REG_DATA);
+  ASSERT_EQ(1u, top.size());
+  EXPECT_EQ(1000u, top[0].count);
+  EXPECT_TRUE(hot.top(HotSubscribers::IMPI_DIGEST).empty());
+}
+
+// Each thread keeps its own candidates, which are merged when reported.
+TEST_F(HeavyHittersTest, MergesThreads)
+{
+  HeavyHitters hitters(3, 1000);
+
+  std::thread thread([&hitters]()
+  {
+    for (int ii = 0; ii < 10; ++ii)
+    {
+      hitters.record("kermit");
+    }
+  });
+  thread.join();
+
+  for (int ii = 0; ii < 5; ++ii)
+  {
+    hitters.record("gonzo");
+  }
+
+  std::vector<HeavyHitters::Entry> top = hitters.top();
+  ASSERT_EQ(2u, top.size());
+  EXPECT_EQ("kermit", top[0].key);
+  EXPECT_EQ(10u, top[0].count);
+  EXPECT_EQ("gonzo", top[1].key);
+  EXPECT_EQ(5u, top[1].count);
+}
+
+TEST_F(HeavyHittersTest, ErrorBound)
+{
+  HeavyHitters hitters(3, 1000);
+  EXPECT_EQ(0u, hitters.error_bound());
+
+  for (int ii = 0; ii < 4096; ++ii)
+  {
+    hitters.record("muppet" + std::to_string(ii));
+  }
+  EXPECT_EQ(6u, hitters.error_bound());
+}
+
+// A subscriber isn't rejected just because other subscribers' requests have
+// inflated its estimated count.
+TEST_F(HeavyHittersTest, RateLimitAllowsForError)
+{
+  // 10 requests per window.
+  HotSubscribers hot(2, 3, 5000);
+
+  for (int ii = 0; ii < 20480; ++ii)
+  {
+    hot.record(HotSubscribers::IMPI_AV, "muppet" + std::to_string(ii));
+  }
+
+  for (int ii = 0; ii < 11; ++ii)
+  {
+    EXPECT_TRUE(hot.record(HotSubscribers::IMPI_AV, "kermit"));
+  }
+
+  // A subscriber that is well over the limit is still rejected.
+  bool rejected = false;
+  for (int ii = 0; (ii < 100) && (!rejected); ++ii)
+  {
+    rejected = !hot.record(HotSubscribers::IMPI_AV, "kermit");
+  }
+  EXPECT_TRUE(rejected);
+}
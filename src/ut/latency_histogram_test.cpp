@@ -0,0 +1,156 @@
+/**
+ * @file latency_histogram_test.cpp UT for LatencyHistogram class.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+#include "test_interposer.hpp"
+
+#include "latency_histogram.h"
+
+/// Fixture for LatencyHistogramTest.
+class LatencyHistogramTest : public testing::Test
+{
+public:
+  LatencyHistogramTest() {}
+
+  ~LatencyHistogramTest() {}
+
+  LatencyHistogram _histogram;
+};
+
+TEST_F(LatencyHistogramTest, Empty)
+{
+  EXPECT_EQ(0u, _histogram.count());
+  EXPECT_EQ(0u, _histogram.max());
+  EXPECT_EQ(0u, _histogram.value_at_percentile(50.0));
+}
+
+TEST_F(LatencyHistogramTest, SmallValuesExact)
+{
+  for (uint64_t ii = 1; ii <= 50; ++ii)
+  {
+    _histogram.record(ii);
+  }
+
+  EXPECT_EQ(50u, _histogram.count());
+  EXPECT_EQ(50u, _histogram.max());
+  EXPECT_EQ(25u, _histogram.value_at_percentile(50.0));
+  EXPECT_EQ(50u, _histogram.value_at_percentile(99.0));
+  EXPECT_EQ(50u, _histogram.value_at_percentile(100.0));
+}
+
+TEST_F(LatencyHistogramTest, LargeValuesWithinPrecision)
+{
+  // 990 fast samples and 10 slow ones.
+  for (int ii = 0; ii < 990; ++ii)
+  {
+    _histogram.record(1000);
+  }
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    _histogram.record(250000);
+  }
+
+  uint64_t p50 = _histogram.value_at_percentile(50.0);
+  EXPECT_GE(p50, 1000u);
+  EXPECT_LE(p50, 1032u);
+
+  // The slow samples' bucket extends above 250000, but the reported value is
+  // capped at the largest sample.
+  EXPECT_EQ(250000u, _histogram.value_at_percentile(99.9));
+  EXPECT_EQ(250000u, _histogram.max());
+}
+
+TEST_F(LatencyHistogramTest, BucketBoundaries)
+{
+  // Every value must fall in a bucket whose highest value is at least the
+  // value, and above the highest value of the previous bucket.
+  uint64_t values[] = {0, 1, 63, 64, 65, 127, 128, 1000, 65535, 1000000,
+                       LatencyHistogram::MAX_VALUE};
+
+  for (size_t ii = 0; ii < sizeof(values) / sizeof(values[0]); ++ii)
+  {
+    int index = LatencyHistogram::bucket_index(values[ii]);
+    EXPECT_GE(LatencyHistogram::bucket_highest_value(index), values[ii]);
+
+    if (index > 0)
+    {
+      EXPECT_LT(LatencyHistogram::bucket_highest_value(index - 1), values[ii]);
+    }
+  }
+}
+
+TEST_F(LatencyHistogramTest, ValuesAboveMaxAreCapped)
+{
+  _histogram.record(LatencyHistogram::MAX_VALUE + 1000);
+  EXPECT_EQ(LatencyHistogram::MAX_VALUE, _histogram.max());
+  EXPECT_EQ(LatencyHistogram::MAX_VALUE, _histogram.value_at_percentile(50.0));
+}
+
+TEST_F(LatencyHistogramTest, Reset)
+{
+  _histogram.record(10);
+  _histogram.reset();
+  EXPECT_EQ(0u, _histogram.count());
+  EXPECT_EQ(0u, _histogram.max());
+}
+
+// Samples are only reported for the current and previous periods.
+TEST(PeriodicLatencyHistogramTest, ResetEachPeriod)
+{
+  cwtest_completely_control_time();
+  PeriodicLatencyHistogram histogram(1000);
+
+  histogram.record(10);
+  histogram.record(20);
+  EXPECT_EQ(2u, histogram.current().count());
+  EXPECT_EQ(0u, histogram.previous().count());
+
+  // In the next period, the samples move to the previous histogram.
+  cwtest_advance_time_ms(1000);
+  histogram.record(30);
+  EXPECT_EQ(1u, histogram.current().count());
+  EXPECT_EQ(30u, histogram.current().max());
+  EXPECT_EQ(2u, histogram.previous().count());
+  EXPECT_EQ(20u, histogram.previous().max());
+
+  // After a quiet period, both histograms are empty.
+  cwtest_advance_time_ms(2500);
+  EXPECT_EQ(0u, histogram.current().count());
+  EXPECT_EQ(0u, histogram.previous().count());
+
+  cwtest_reset_time();
+}
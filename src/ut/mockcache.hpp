@@ -81,6 +81,8 @@ public:
                                const int32_t ttl));
   MOCK_METHOD1(create_GetRegData,
                GetRegData*(const std::string& public_id));
+  MOCK_METHOD1(create_GetRegDataBatch,
+               GetRegDataBatch*(const std::vector<std::string>& public_ids));
   MOCK_METHOD1(create_GetAssociatedPublicIDs,
                GetAssociatedPublicIDs*(const std::string& private_id));
   MOCK_METHOD1(create_GetAssociatedPublicIDs,
@@ -119,6 +121,16 @@ public:
                DissociateImplicitRegistrationSetFromImpi*(const std::vector<std::string>& impus,
                                                           const std::vector<std::string>& impis,
                                                           int64_t timestamp));
+  MOCK_METHOD4(create_ScanImpus,
+               ScanImpus*(const TokenRange& range,
+                          const ScanImpus::Callback& callback,
+                          const std::string& resume_key,
+                          int32_t page_size));
+  MOCK_METHOD4(create_ScanImpis,
+               ScanImpis*(const TokenRange& range,
+                          const ScanImpis::Callback& callback,
+                          const std::string& resume_key,
+                          int32_t page_size));
 
   // Mock request objects.
   //
@@ -152,6 +164,7 @@ public:
     virtual ~MockPutRegData() {}
 
     MOCK_METHOD1(with_xml, PutRegData&(const std::string& xml));
+    PutRegData& with_xml(const SharedPayload& xml) { return with_xml(*xml); }
     MOCK_METHOD1(with_reg_state, PutRegData&(const RegistrationState reg_state));
     MOCK_METHOD1(with_associated_impis, PutRegData&(const std::vector<std::string>& impis));
     MOCK_METHOD1(with_charging_addrs, PutRegData&(const ChargingAddresses& charging_addrs));
@@ -184,6 +197,23 @@ public:
     MOCK_METHOD2(get_registration_state, void(RegistrationState& state, int& ttl));
     MOCK_METHOD1(get_associated_impis, void(std::vector<std::string>& associated_impis));
     MOCK_METHOD1(get_charging_addrs, void(ChargingAddresses& charging_addrs));
+
+    // Shares the document returned by the mocked get_xml, so tests only need
+    // to set up one of them.
+    void get_shared_xml(SharedPayload& xml, int& ttl)
+    {
+      std::string str;
+      get_xml(str, ttl);
+      xml = make_shared_payload(str);
+    }
+  };
+
+  class MockGetRegDataBatch : public GetRegDataBatch, public MockOperationMixin
+  {
+    MockGetRegDataBatch() : GetRegDataBatch(std::vector<std::string>()) {}
+    virtual ~MockGetRegDataBatch() {}
+
+    MOCK_METHOD1(get_result, void(std::map<std::string, GetRegData::Result>& results));
   };
 
   class MockGetAssociatedPublicIDs : public GetAssociatedPublicIDs, public MockOperationMixin
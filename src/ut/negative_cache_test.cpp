@@ -0,0 +1,137 @@
+/**
+ * @file negative_cache_test.cpp UT for the negative cache.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+#include "test_interposer.hpp"
+
+#include "negative_cache.h"
+
+/// Fixture for NegativeCacheTest.  Time is controlled so that entries only
+/// expire when the test wants them to.
+class NegativeCacheTest : public testing::Test
+{
+public:
+  NegativeCacheTest()
+  {
+    cwtest_completely_control_time();
+  }
+
+  ~NegativeCacheTest()
+  {
+    cwtest_reset_time();
+  }
+};
+
+TEST_F(NegativeCacheTest, AddAndLookUp)
+{
+  NegativeCache cache(10, 1000);
+  EXPECT_FALSE(cache.contains(NegativeCache::LIR, "sip:kermit@example.com"));
+
+  cache.add(NegativeCache::LIR, "sip:kermit@example.com");
+  EXPECT_TRUE(cache.contains(NegativeCache::LIR, "sip:kermit@example.com"));
+
+  // Entries are specific to the command and the identities.
+  EXPECT_FALSE(cache.contains(NegativeCache::SAR, "sip:kermit@example.com"));
+  EXPECT_FALSE(cache.contains(NegativeCache::LIR, "sip:gonzo@example.com"));
+
+  NegativeCache::Stats stats = cache.stats(NegativeCache::LIR);
+  EXPECT_EQ(1u, stats.hits);
+  EXPECT_EQ(2u, stats.misses);
+  EXPECT_EQ(1u, stats.inserts);
+  EXPECT_EQ(1u, cache.stats(NegativeCache::SAR).misses);
+}
+
+TEST_F(NegativeCacheTest, KeyedOnBothIdentities)
+{
+  NegativeCache cache(10, 1000);
+  cache.add(NegativeCache::MAR, "kermit@example.com", "sip:nobody@example.com");
+
+  EXPECT_TRUE(cache.contains(NegativeCache::MAR, "kermit@example.com", "sip:nobody@example.com"));
+  EXPECT_FALSE(cache.contains(NegativeCache::MAR, "kermit@example.com", "sip:kermit@example.com"));
+  EXPECT_FALSE(cache.contains(NegativeCache::MAR, "kermit@example.com"));
+}
+
+TEST_F(NegativeCacheTest, EntriesExpire)
+{
+  NegativeCache cache(10, 1000);
+  cache.add(NegativeCache::UAR, "kermit@example.com");
+
+  cwtest_advance_time_ms(999);
+  EXPECT_TRUE(cache.contains(NegativeCache::UAR, "kermit@example.com"));
+
+  // Re-adding an entry extends its lifetime.
+  cache.add(NegativeCache::UAR, "kermit@example.com");
+  cwtest_advance_time_ms(999);
+  EXPECT_TRUE(cache.contains(NegativeCache::UAR, "kermit@example.com"));
+
+  cwtest_advance_time_ms(1);
+  EXPECT_FALSE(cache.contains(NegativeCache::UAR, "kermit@example.com"));
+  EXPECT_EQ(0u, cache.size());
+}
+
+TEST_F(NegativeCacheTest, OldestEvictedWhenFull)
+{
+  NegativeCache cache(2, 1000);
+  cache.add(NegativeCache::LIR, "kermit");
+  cache.add(NegativeCache::LIR, "gonzo");
+  cache.add(NegativeCache::LIR, "fozzie");
+
+  EXPECT_EQ(2u, cache.size());
+  EXPECT_EQ(1u, cache.evictions());
+  EXPECT_FALSE(cache.contains(NegativeCache::LIR, "kermit"));
+  EXPECT_TRUE(cache.contains(NegativeCache::LIR, "gonzo"));
+  EXPECT_TRUE(cache.contains(NegativeCache::LIR, "fozzie"));
+}
+
+TEST_F(NegativeCacheTest, Invalidate)
+{
+  NegativeCache cache(10, 1000);
+  cache.add(NegativeCache::MAR, "kermit@example.com", "sip:kermit@example.com");
+  cache.add(NegativeCache::UAR, "kermit@example.com", "sip:kermit@example.com");
+  cache.add(NegativeCache::LIR, "sip:kermit@example.com");
+  cache.add(NegativeCache::LIR, "sip:gonzo@example.com");
+
+  // Invalidating an identity removes every entry it appears in.
+  cache.invalidate("sip:kermit@example.com");
+  EXPECT_EQ(1u, cache.size());
+  EXPECT_EQ(3u, cache.invalidations());
+  EXPECT_TRUE(cache.contains(NegativeCache::LIR, "sip:gonzo@example.com"));
+
+  cache.clear();
+  EXPECT_EQ(0u, cache.size());
+  EXPECT_EQ(4u, cache.invalidations());
+}
@@ -0,0 +1,98 @@
+/**
+ * @file reg_data_refresher_test.cpp UT for RegDataRefresher.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+
+#include "reg_data_refresher.h"
+
+const std::string IMPU = "sip:kermit@example.com";
+const std::string IMPU2 = "sip:miss_piggy@example.com";
+
+TEST(RegDataRefresherTest, Refresh)
+{
+  RegDataRefresher refresher(600);
+
+  EXPECT_EQ(RegDataRefresher::REFRESH, refresher.admit(IMPU, 3000));
+  EXPECT_EQ(1u, refresher.in_progress());
+  EXPECT_FALSE(refresher.flush(0));
+
+  refresher.complete(IMPU, true);
+  EXPECT_EQ(0u, refresher.in_progress());
+  EXPECT_EQ(1u, refresher.started());
+  EXPECT_EQ(1u, refresher.succeeded());
+  EXPECT_TRUE(refresher.flush(0));
+}
+
+// Records that are close to expiring are refreshed inline.
+TEST(RegDataRefresherTest, NearExpiry)
+{
+  RegDataRefresher refresher(600);
+
+  EXPECT_EQ(RegDataRefresher::INLINE, refresher.admit(IMPU, 599));
+  EXPECT_EQ(0u, refresher.in_progress());
+}
+
+// Only one refresh is in progress for each public ID, even if the record is
+// close to expiring.
+TEST(RegDataRefresherTest, InProgress)
+{
+  RegDataRefresher refresher(600);
+
+  EXPECT_EQ(RegDataRefresher::REFRESH, refresher.admit(IMPU, 3000));
+  EXPECT_EQ(RegDataRefresher::IN_PROGRESS, refresher.admit(IMPU, 3000));
+  EXPECT_EQ(RegDataRefresher::IN_PROGRESS, refresher.admit(IMPU, 100));
+  EXPECT_EQ(2u, refresher.coalesced());
+
+  refresher.complete(IMPU, false);
+  EXPECT_EQ(1u, refresher.failed());
+  EXPECT_EQ(RegDataRefresher::REFRESH, refresher.admit(IMPU, 3000));
+  refresher.complete(IMPU, true);
+}
+
+// Once too many refreshes are in progress, further ones are done inline.
+TEST(RegDataRefresherTest, Overflow)
+{
+  RegDataRefresher refresher(600, 1);
+
+  EXPECT_EQ(RegDataRefresher::REFRESH, refresher.admit(IMPU, 3000));
+  EXPECT_EQ(RegDataRefresher::INLINE, refresher.admit(IMPU2, 3000));
+  EXPECT_EQ(1u, refresher.overflowed());
+
+  refresher.complete(IMPU, true);
+  EXPECT_EQ(RegDataRefresher::REFRESH, refresher.admit(IMPU2, 3000));
+  refresher.complete(IMPU2, true);
+}
@@ -0,0 +1,157 @@
+/**
+ * @file response_compressor_test.cpp UT for ResponseCompressor.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+#include <zlib.h>
+
+#include "response_compressor.h"
+
+/// Decompress a gzip or deflate body.
+static std::string inflate_body(const std::string& compressed, int window_bits)
+{
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  inflateInit2(&stream, window_bits);
+
+  std::string body(64 * 1024, '\0');
+  stream.next_in = (Bytef*)compressed.data();
+  stream.avail_in = compressed.size();
+  stream.next_out = (Bytef*)&body[0];
+  stream.avail_out = body.size();
+  int rc = inflate(&stream, Z_FINISH);
+  body.resize((rc == Z_STREAM_END) ? stream.total_out : 0);
+  inflateEnd(&stream);
+
+  return body;
+}
+
+static std::string big_body()
+{
+  std::string body;
+  while (body.size() < 8192)
+  {
+    body.append("<InitialFilterCriteria><Priority>1</Priority></InitialFilterCriteria>");
+  }
+  return body;
+}
+
+TEST(ResponseCompressorTest, ChooseEncoding)
+{
+  EXPECT_EQ(ResponseCompressor::IDENTITY, ResponseCompressor::choose_encoding(""));
+  EXPECT_EQ(ResponseCompressor::IDENTITY, ResponseCompressor::choose_encoding("br, identity"));
+  EXPECT_EQ(ResponseCompressor::GZIP, ResponseCompressor::choose_encoding("gzip"));
+  EXPECT_EQ(ResponseCompressor::GZIP, ResponseCompressor::choose_encoding("deflate, gzip;q=0.5"));
+  EXPECT_EQ(ResponseCompressor::DEFLATE, ResponseCompressor::choose_encoding(" deflate "));
+  EXPECT_EQ(ResponseCompressor::DEFLATE, ResponseCompressor::choose_encoding("gzip;q=0, deflate"));
+  EXPECT_EQ(ResponseCompressor::GZIP, ResponseCompressor::choose_encoding("*"));
+  EXPECT_EQ(ResponseCompressor::IDENTITY, ResponseCompressor::choose_encoding("gzip;q=0, deflate;q=0, *"));
+  EXPECT_EQ(ResponseCompressor::IDENTITY, ResponseCompressor::choose_encoding("*, gzip;q=0, deflate;q=0"));
+  EXPECT_EQ(ResponseCompressor::DEFLATE, ResponseCompressor::choose_encoding("*, gzip;q=0"));
+  EXPECT_EQ(ResponseCompressor::IDENTITY, ResponseCompressor::choose_encoding("*;q=0"));
+}
+
+TEST(ResponseCompressorTest, SmallBodiesNotCompressed)
+{
+  ResponseCompressor compressor(1024);
+  std::string compressed;
+
+  EXPECT_FALSE(compressor.compress("<ClearwaterRegData/>",
+                                   ResponseCompressor::GZIP,
+                                   "",
+                                   "",
+                                   compressed));
+  EXPECT_FALSE(compressor.compress(big_body(),
+                                   ResponseCompressor::IDENTITY,
+                                   "",
+                                   "",
+                                   compressed));
+  EXPECT_EQ(0u, compressor.compressions());
+}
+
+TEST(ResponseCompressorTest, CompressGzipAndDeflate)
+{
+  ResponseCompressor compressor(1024);
+  std::string body = big_body();
+  std::string compressed;
+
+  // Compress twice with each encoding, to check the streams are reset
+  // properly between uses.
+  for (int ii = 0; ii < 2; ii++)
+  {
+    ASSERT_TRUE(compressor.compress(body, ResponseCompressor::GZIP, "", "", compressed));
+    EXPECT_LT(compressed.size(), body.size());
+    EXPECT_EQ(body, inflate_body(compressed, 15 + 16));
+
+    ASSERT_TRUE(compressor.compress(body, ResponseCompressor::DEFLATE, "", "", compressed));
+    EXPECT_LT(compressed.size(), body.size());
+    EXPECT_EQ(body, inflate_body(compressed, 15));
+  }
+
+  EXPECT_EQ(4u, compressor.compressions());
+}
+
+TEST(ResponseCompressorTest, CompressedBodiesCachedPerVersion)
+{
+  ResponseCompressor compressor(1024, 10);
+  std::string body = big_body();
+  std::string compressed;
+
+  ASSERT_TRUE(compressor.compress(body, ResponseCompressor::GZIP, "sip:kermit@example.com", "\"1\"", compressed));
+  ASSERT_TRUE(compressor.compress(body, ResponseCompressor::GZIP, "sip:kermit@example.com", "\"1\"", compressed));
+  EXPECT_EQ(body, inflate_body(compressed, 15 + 16));
+  EXPECT_EQ(1u, compressor.compressions());
+  EXPECT_EQ(1u, compressor.cache_hits());
+
+  // A new version of the document, or a different encoding, is compressed
+  // again.
+  ASSERT_TRUE(compressor.compress(body, ResponseCompressor::GZIP, "sip:kermit@example.com", "\"2\"", compressed));
+  ASSERT_TRUE(compressor.compress(body, ResponseCompressor::DEFLATE, "sip:kermit@example.com", "\"2\"", compressed));
+  EXPECT_EQ(body, inflate_body(compressed, 15));
+  EXPECT_EQ(3u, compressor.compressions());
+}
+
+TEST(ResponseCompressorTest, WillCache)
+{
+  ResponseCompressor uncached(1024);
+  EXPECT_FALSE(uncached.will_cache(2048, ResponseCompressor::GZIP));
+
+  ResponseCompressor compressor(1024, 10);
+  EXPECT_TRUE(compressor.will_cache(2048, ResponseCompressor::GZIP));
+  EXPECT_TRUE(compressor.will_cache(1024, ResponseCompressor::DEFLATE));
+  EXPECT_FALSE(compressor.will_cache(1023, ResponseCompressor::GZIP));
+  EXPECT_FALSE(compressor.will_cache(2048, ResponseCompressor::IDENTITY));
+}
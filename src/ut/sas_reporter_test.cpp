@@ -0,0 +1,117 @@
+/**
+ * @file sas_reporter_test.cpp UT for SasReporter.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+
+#include <unistd.h>
+
+#include "sas_reporter.h"
+
+/// Fixture for SasReporterTest.
+class SasReporterTest : public testing::Test
+{
+public:
+  SasReporterTest() {}
+
+  ~SasReporterTest()
+  {
+    SasReporter::configure(NULL);
+  }
+};
+
+TEST_F(SasReporterTest, ReportsQueuedEvents)
+{
+  SasReporter reporter;
+  SasReporter::configure(&reporter);
+
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    DeferredSasEvent event(0, 1, 0);
+    event.add_var_param("sip:kermit@example.com");
+    event.add_compressed_param("<IMSSubscription/>", NULL);
+    event.add_static_param(ii);
+    event.report();
+  }
+
+  // Wait for the background thread to catch up.  Any events that didn't fit
+  // on the queue were reported inline.
+  for (int ii = 0;
+       (ii < 1000) && (reporter.reported() + reporter.rejected() < 100);
+       ++ii)
+  {
+    usleep(1000);
+  }
+  EXPECT_EQ(100u, reporter.reported() + reporter.rejected());
+}
+
+TEST_F(SasReporterTest, FullQueueRejectsEvents)
+{
+  SasReporter reporter(0);
+
+  DeferredSasEvent event(0, 1, 0);
+  event.add_compressed_param("<IMSSubscription/>", NULL);
+  EXPECT_FALSE(reporter.queue(event));
+  EXPECT_EQ(1u, reporter.rejected());
+  EXPECT_EQ(0u, reporter.reported());
+}
+
+TEST_F(SasReporterTest, SharedParamCompressedOnce)
+{
+  SasReporter reporter;
+  std::string xml = "<IMSSubscription/>";
+  SharedPayload shared_xml = make_shared_payload(xml);
+
+  for (int ii = 0; ii < 3; ++ii)
+  {
+    DeferredSasEvent event(0, 1, 0);
+    event.add_compressed_param(shared_xml, NULL);
+    EXPECT_TRUE(reporter.queue(event));
+  }
+
+  // A different subscription with the same contents is compressed again.
+  std::string other_xml = "<IMSSubscription/>";
+  DeferredSasEvent event(0, 1, 0);
+  event.add_compressed_param(make_shared_payload(other_xml), NULL);
+  EXPECT_TRUE(reporter.queue(event));
+
+  for (int ii = 0; (ii < 1000) && (reporter.reported() < 4); ++ii)
+  {
+    usleep(1000);
+  }
+  EXPECT_EQ(4u, reporter.reported());
+  EXPECT_EQ(2u, reporter.compressions_reused());
+}
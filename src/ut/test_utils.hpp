@@ -39,11 +39,27 @@
 
 #include "gtest/gtest.h"
 #include <algorithm>
+#include <deque>
 #include <string>
 
+#include "charging_addresses.h"
+
 /// Expect that std::list L contains value X.
 #define EXPECT_CONTAINED(X, L) \
   EXPECT_TRUE(find((L).begin(), (L).end(), (X)) != (L).end())
 
+/// Compare a deque of addresses with a set of charging functions.
+inline bool operator==(const std::deque<std::string>& lhs,
+                       const ChargingFunctions& rhs)
+{
+  return (ChargingFunctions(lhs) == rhs) && (lhs.size() == rhs.size());
+}
+
+inline bool operator==(const ChargingFunctions& lhs,
+                       const std::deque<std::string>& rhs)
+{
+  return (rhs == lhs);
+}
+
 /// The directory that contains the unit tests.
 extern const std::string UT_DIR;
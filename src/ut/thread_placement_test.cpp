@@ -0,0 +1,183 @@
+/**
+ * @file thread_placement_test.cpp UT for ThreadPlacement.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#define GTEST_HAS_POSIX_RE 0
+#include "test_utils.hpp"
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <thread>
+
+#include "thread_placement.h"
+
+TEST(ThreadPlacementTest, ParseCpuList)
+{
+  std::vector<int> cpus;
+  EXPECT_TRUE(ThreadPlacement::parse_cpu_list("0-3,8,10-11\n", cpus));
+  EXPECT_EQ(std::vector<int>({0, 1, 2, 3, 8, 10, 11}), cpus);
+
+  cpus.clear();
+  EXPECT_TRUE(ThreadPlacement::parse_cpu_list("", cpus));
+  EXPECT_TRUE(cpus.empty());
+
+  EXPECT_FALSE(ThreadPlacement::parse_cpu_list("3-1", cpus));
+  EXPECT_FALSE(ThreadPlacement::parse_cpu_list("a", cpus));
+  EXPECT_FALSE(ThreadPlacement::parse_cpu_list("1,,2", cpus));
+  EXPECT_FALSE(ThreadPlacement::parse_cpu_list("1-", cpus));
+}
+
+TEST(ThreadPlacementTest, ReadTopology)
+{
+  char dir_template[] = "/tmp/thread_placement_testXXXXXX";
+  std::string dir = mkdtemp(dir_template);
+  mkdir((dir + "/node0").c_str(), 0700);
+  mkdir((dir + "/node1").c_str(), 0700);
+  mkdir((dir + "/power").c_str(), 0700);
+  std::ofstream((dir + "/node0/cpulist").c_str()) << "0-1,4-5\n";
+  std::ofstream((dir + "/node1/cpulist").c_str()) << "2-3,6-7\n";
+
+  ThreadPlacement::Topology topology = ThreadPlacement::read_topology(dir);
+  ASSERT_EQ(2u, topology.size());
+  EXPECT_EQ(std::vector<int>({0, 1, 4, 5}), topology[0]);
+  EXPECT_EQ(std::vector<int>({2, 3, 6, 7}), topology[1]);
+
+  std::string cmd = "rm -rf " + dir;
+  EXPECT_EQ(0, system(cmd.c_str()));
+}
+
+// Without sysfs, the host is treated as a single node.
+TEST(ThreadPlacementTest, ReadTopologyMissing)
+{
+  ThreadPlacement::Topology topology =
+    ThreadPlacement::read_topology("/nonexistent");
+  ASSERT_EQ(1u, topology.size());
+  EXPECT_FALSE(topology[0].empty());
+}
+
+TEST(ThreadPlacementTest, Parse)
+{
+  ThreadPlacement::Topology topology;
+  topology[0] = {0, 1, 2, 3};
+  topology[1] = {4, 5, 6, 7};
+
+  ThreadPlacement placement;
+  EXPECT_TRUE(placement.parse("http:0-1;cache:node1;diameter:3-4", topology));
+  EXPECT_EQ("http: 2 CPUs, node 0; cache: 4 CPUs, node 1; diameter: 2 CPUs",
+            placement.to_string());
+
+  EXPECT_FALSE(placement.parse("http", topology));
+  EXPECT_FALSE(placement.parse("sip:0-1", topology));
+  EXPECT_FALSE(placement.parse("cache:node2", topology));
+  EXPECT_FALSE(placement.parse("cache:node", topology));
+  EXPECT_FALSE(placement.parse("cache:x", topology));
+}
+
+TEST(ThreadPlacementTest, DeriveSingleNode)
+{
+  ThreadPlacement::Topology topology;
+  topology[0] = {0, 1, 2, 3};
+
+  ThreadPlacement placement;
+  placement.derive(topology, 1, 10);
+  EXPECT_EQ("http: any CPU; cache: any CPU; diameter: any CPU",
+            placement.to_string());
+}
+
+TEST(ThreadPlacementTest, DeriveSameNode)
+{
+  ThreadPlacement::Topology topology;
+  topology[0] = {0, 1, 2, 3};
+  topology[1] = {4, 5, 6, 7};
+
+  ThreadPlacement placement;
+  placement.derive(topology, 1, 3);
+  EXPECT_EQ("http: 4 CPUs, node 0; cache: 4 CPUs, node 0; diameter: 4 CPUs, node 0",
+            placement.to_string());
+}
+
+TEST(ThreadPlacementTest, DeriveSplit)
+{
+  ThreadPlacement::Topology topology;
+  topology[0] = {0, 1, 2, 3};
+  topology[1] = {4, 5, 6, 7};
+
+  ThreadPlacement placement;
+  placement.derive(topology, 2, 10);
+  EXPECT_EQ("http: 4 CPUs, node 0; cache: 4 CPUs, node 1; diameter: 4 CPUs, node 0",
+            placement.to_string());
+}
+
+// Threads are placed the first time they call place_current_thread(), and not
+// moved again.
+TEST(ThreadPlacementTest, PlaceCurrentThread)
+{
+  cpu_set_t original;
+  ASSERT_EQ(0, sched_getaffinity(0, sizeof(original), &original));
+  int cpu = 0;
+  while (!CPU_ISSET(cpu, &original))
+  {
+    cpu++;
+  }
+
+  std::vector<int> all_cpus;
+  for (int ii = 0; ii < CPU_SETSIZE; ii++)
+  {
+    if (CPU_ISSET(ii, &original))
+    {
+      all_cpus.push_back(ii);
+    }
+  }
+
+  ThreadPlacement placement;
+  placement.set_group(ThreadPlacement::CACHE, {cpu}, -1);
+  placement.set_group(ThreadPlacement::HTTP, all_cpus, -1);
+  ThreadPlacement::configure(&placement);
+
+  // The second call has no effect - if it did, the thread would be allowed to
+  // run on any CPU again.
+  cpu_set_t placed;
+  std::thread thread([&placed]()
+  {
+    ThreadPlacement::place_current_thread(ThreadPlacement::CACHE);
+    ThreadPlacement::place_current_thread(ThreadPlacement::HTTP);
+    sched_getaffinity(0, sizeof(placed), &placed);
+  });
+  thread.join();
+  EXPECT_EQ(1, CPU_COUNT(&placed));
+
+  ThreadPlacement::configure(NULL);
+}
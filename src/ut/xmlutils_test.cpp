@@ -78,6 +78,31 @@ TEST_F(XmlUtilsTest, Unregistered)
   ASSERT_EQ("<ClearwaterRegData>\n\t<RegistrationState>UNREGISTERED</RegistrationState>\n\t<IMSSubscription>test</IMSSubscription>\n</ClearwaterRegData>\n\n", result);
 }
 
+TEST_F(XmlUtilsTest, JsonMainline)
+{
+  ChargingAddresses charging_addresses({"ccf1", "ccf2"}, {"ecf1"});
+  std::string result;
+  int rc = XmlUtils::build_ClearwaterRegData_json(RegistrationState::REGISTERED,
+                                                  "<?xml?><IMSSubscription>\"test\"</IMSSubscription>",
+                                                  charging_addresses,
+                                                  result);
+
+  ASSERT_EQ(200, rc);
+  ASSERT_EQ("{\"reg-state\":\"REGISTERED\",\"ims-subscription\":\"<?xml?><IMSSubscription>\\\"test\\\"</IMSSubscription>\",\"charging-addresses\":{\"ccfs\":[\"ccf1\",\"ccf2\"],\"ecfs\":[\"ecf1\"]}}", result);
+}
+
+TEST_F(XmlUtilsTest, JsonNotRegistered)
+{
+  ChargingAddresses charging_addresses;
+  std::string result;
+  int rc = XmlUtils::build_ClearwaterRegData_json(RegistrationState::NOT_REGISTERED,
+                                                  "",
+                                                  charging_addresses,
+                                                  result);
+  ASSERT_EQ(200, rc);
+  ASSERT_EQ("{\"reg-state\":\"NOT_REGISTERED\"}", result);
+}
+
 TEST_F(XmlUtilsTest, InvalidRegState)
 {
   ChargingAddresses charging_addresses;
@@ -112,6 +137,22 @@ TEST_F(XmlUtilsTest, InvalidXML)
   ASSERT_EQ(500, rc);
 }
 
+TEST_F(XmlUtilsTest, JsonUserDataIsOpaque)
+{
+  // The User-Data isn't parsed for the JSON document, so even malformed
+  // User-Data is passed straight through.
+  ChargingAddresses charging_addresses;
+  std::string result;
+  int rc = XmlUtils::build_ClearwaterRegData_json(RegistrationState::REGISTERED,
+                                                  "<?xml?><InvalidXML</IMSSubscription>",
+                                                  charging_addresses,
+                                                  result);
+  ASSERT_EQ(200, rc);
+  EXPECT_EQ("{\"reg-state\":\"REGISTERED\","
+            "\"ims-subscription\":\"<?xml?><InvalidXML</IMSSubscription>\"}",
+            result);
+}
+
 TEST_F(XmlUtilsTest, GetIds)
 {
   std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?><IMSSubscription><PrivateID>rkdtestplan1@rkd.cw-ngv.com</PrivateID><ServiceProfile><PublicIdentity><Identity>sip:rkdtestplan1@rkd.cw-ngv.com</Identity><Extension><IdentityType>0</IdentityType></Extension></PublicIdentity><PublicIdentity><Identity>sip:rkdtestplan1_a@rkd.cw-ngv.com</Identity><Extension><IdentityType>0</IdentityType></Extension></PublicIdentity><PublicIdentity><Identity>sip:rkdtestplan1_b@rkd.cw-ngv.com</Identity><Extension><IdentityType>0</IdentityType></Extension></PublicIdentity><InitialFilterCriteria><Priority>0</Priority><TriggerPoint><ConditionTypeCNF>0</ConditionTypeCNF><SPT><ConditionNegated>0</ConditionNegated><Group>0</Group><Method>PUBLISH</Method><Extension></Extension></SPT><SPT><ConditionNegated>0</ConditionNegated><Group>0</Group><SIPHeader><Header>Event</Header><Content>.*presence.*</Content></SIPHeader><Extension></Extension></SPT><SPT><ConditionNegated>0</ConditionNegated><Group>0</Group><SessionCase>0</SessionCase><Extension></Extension></SPT><SPT><ConditionNegated>0</ConditionNegated><Group>1</Group><Method>PUBLISH</Method><Extension></Extension></SPT><SPT><ConditionNegated>0</ConditionNegated><Group>1</Group><SIPHeader><Header>Event</Header><Content>.*presence.*</Content></SIPHeader><Extension></Extension></SPT><SPT><ConditionNegated>0</ConditionNegated><Group>1</Group><SessionCase>3</SessionCase><Extension></Extension></SPT><SPT><ConditionNegated>0</ConditionNegated><Group>2</Group><Method>SUBSCRIBE</Method><Extension></Extension></SPT><SPT><ConditionNegated>0</ConditionNegated><Group>2</Group><SIPHeader><Header>Event</Header><Content>.*presence.*</Content></SIPHeader><Extension></Extension></SPT><SPT><ConditionNegated>0</ConditionNegated><Group>2</Group><SessionCase>1</SessionCase><Extension></Extension></SPT><SPT><ConditionNegated>0</ConditionNegated><Group>3</Group><Method>SUBSCRIBE</Method><Extension></Extension></SPT><SPT><ConditionNegated>0</ConditionNegated><Group>3</Group><SIPHeader><Header>Event</Header><Content>.*presence.*</Content></SIPHeader><Extension></Extension></SPT><SPT><ConditionNegated>0</ConditionNegated><Group>3</Group><SessionCase>2</SessionCase><Extension></Extension></SPT></TriggerPoint><ApplicationServer><ServerName>sip:127.0.0.1:5065</ServerName><DefaultHandling>0</DefaultHandling></ApplicationServer></InitialFilterCriteria></ServiceProfile></IMSSubscription>";
@@ -120,6 +161,13 @@ TEST_F(XmlUtilsTest, GetIds)
   EXPECT_EQ(3u, public_ids.size());
   std::string private_id = XmlUtils::get_private_id(xml);
   EXPECT_EQ("rkdtestplan1@rkd.cw-ngv.com", private_id);
+
+  // Getting both IDs from a single parse gives the same answers.
+  std::vector<std::string> both_public_ids;
+  std::string both_private_id;
+  XmlUtils::get_ids(xml, both_public_ids, both_private_id);
+  EXPECT_EQ(public_ids, both_public_ids);
+  EXPECT_EQ(private_id, both_private_id);
 }
 
 TEST_F(XmlUtilsTest, GetIdsInvalidXml)
@@ -129,6 +177,10 @@ TEST_F(XmlUtilsTest, GetIdsInvalidXml)
   EXPECT_EQ(0u, public_ids.size());
   std::string private_id = XmlUtils::get_private_id(xml);
   EXPECT_EQ("", private_id);
+
+  XmlUtils::get_ids(xml, public_ids, private_id);
+  EXPECT_EQ(0u, public_ids.size());
+  EXPECT_EQ("", private_id);
 }
 
 TEST_F(XmlUtilsTest, GetIdsMissingIds)
@@ -40,6 +40,8 @@
 
 #include "rapidxml/rapidxml.hpp"
 #include "rapidxml/rapidxml_print.hpp"
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
 
 const char* CCF = "CCF";
 const char* ECF = "ECF";
@@ -53,7 +55,7 @@ namespace XmlUtils
 // Builds a ClearwaterRegData XML document for passing to Sprout,
 // based on the given registration state and User-Data XML from the HSS.
 int build_ClearwaterRegData_xml(RegistrationState state,
-                                std::string xml,
+                                const std::string& xml,
                                 const ChargingAddresses& charging_addrs,
                                 std::string& xml_str)
 {
@@ -169,17 +171,83 @@ int build_ClearwaterRegData_xml(RegistrationState state,
   return 200;
 }
 
-// Parses the given User-Data XML to retrieve a list of all the public IDs.
-std::vector<std::string> get_public_ids(const std::string& user_data)
+// Builds the compact JSON equivalent of a ClearwaterRegData document.  The
+// User-Data XML is treated as an opaque blob and passed through as a string,
+// without being parsed - unlike the XML document, malformed User-Data isn't
+// rejected, and it's up to the client to parse it.
+int build_ClearwaterRegData_json(RegistrationState state,
+                                 const std::string& xml,
+                                 const ChargingAddresses& charging_addrs,
+                                 std::string& json_str)
 {
-  std::vector<std::string> public_ids;
+  const char* regtype;
+  if (state == RegistrationState::REGISTERED)
+  {
+    regtype = "REGISTERED";
+  }
+  else if (state == RegistrationState::UNREGISTERED)
+  {
+    regtype = "UNREGISTERED";
+  }
+  else
+  {
+    regtype = "NOT_REGISTERED";
+  }
 
-  // Parse the XML document, saving off the passed-in string first (as parsing
-  // is destructive).
-  rapidxml::xml_document<> doc;
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  {
+    writer.String("reg-state");
+    writer.String(regtype);
 
-  // This doesn't need freeing - doc is on the stack, and this
-  // uses its memory pool.
+    if (!xml.empty())
+    {
+      writer.String("ims-subscription");
+      writer.String(xml.c_str(), xml.size());
+    }
+
+    if (!charging_addrs.empty())
+    {
+      writer.String("charging-addresses");
+      writer.StartObject();
+      {
+        writer.String("ccfs");
+        writer.StartArray();
+        for (ChargingFunctions::const_iterator ccf = charging_addrs.ccfs.begin();
+             ccf != charging_addrs.ccfs.end();
+             ++ccf)
+        {
+          writer.String(ccf->c_str());
+        }
+        writer.EndArray();
+
+        writer.String("ecfs");
+        writer.StartArray();
+        for (ChargingFunctions::const_iterator ecf = charging_addrs.ecfs.begin();
+             ecf != charging_addrs.ecfs.end();
+             ++ecf)
+        {
+          writer.String(ecf->c_str());
+        }
+        writer.EndArray();
+      }
+      writer.EndObject();
+    }
+  }
+  writer.EndObject();
+
+  json_str.assign(sb.GetString(), sb.GetSize());
+  return 200;
+}
+
+// Parses the given User-Data XML, saving off the passed-in string first (as
+// parsing is destructive).  On a parse error, the document is left empty.
+static void parse_user_data(const std::string& user_data,
+                            rapidxml::xml_document<>& doc)
+{
+  // This doesn't need freeing - it uses doc's memory pool.
   char* user_data_str = doc.allocate_string(user_data.c_str());
 
   try
@@ -191,6 +259,13 @@ std::vector<std::string> get_public_ids(const std::string& user_data)
     TRC_DEBUG("Parse error in IMS Subscription document: %s\n\n%s", err.what(), user_data.c_str());
     doc.clear();
   }
+}
+
+// Retrieves a list of all the public IDs from a parsed User-Data document.
+static std::vector<std::string> get_public_ids(rapidxml::xml_document<>& doc,
+                                               const std::string& user_data)
+{
+  std::vector<std::string> public_ids;
 
   // Walk through all nodes in the hierarchy IMSSubscription->ServiceProfile->PublicIdentity
   // ->Identity.
@@ -225,29 +300,12 @@ std::vector<std::string> get_public_ids(const std::string& user_data)
   return public_ids;
 }
 
-// Parses the given User-Data XML to retrieve the single PrivateID element.
-std::string get_private_id(const std::string& user_data)
+// Retrieves the single PrivateID element from a parsed User-Data document.
+static std::string get_private_id(rapidxml::xml_document<>& doc,
+                                  const std::string& user_data)
 {
   std::string impi;
 
-  // Parse the XML document, saving off the passed-in string first (as parsing
-  // is destructive).
-  rapidxml::xml_document<> doc;
-
-  // This doesn't need freeing - prev_doc is on the stack, and this
-  // uses its memory pool.
-  char* user_data_str = doc.allocate_string(user_data.c_str());
-
-  try
-  {
-    doc.parse<rapidxml::parse_strip_xml_namespaces>(user_data_str);
-  }
-  catch (rapidxml::parse_error err)
-  {
-    TRC_ERROR("Parse error in IMS Subscription document: %s\n\n%s", err.what(), user_data.c_str());
-    doc.clear();
-  }
-
   rapidxml::xml_node<>* is = doc.first_node("IMSSubscription");
   if (is)
   {
@@ -270,4 +328,32 @@ std::string get_private_id(const std::string& user_data)
   return impi;
 }
 
+// Parses the given User-Data XML to retrieve a list of all the public IDs.
+std::vector<std::string> get_public_ids(const std::string& user_data)
+{
+  rapidxml::xml_document<> doc;
+  parse_user_data(user_data, doc);
+  return get_public_ids(doc, user_data);
+}
+
+// Parses the given User-Data XML to retrieve the single PrivateID element.
+std::string get_private_id(const std::string& user_data)
+{
+  rapidxml::xml_document<> doc;
+  parse_user_data(user_data, doc);
+  return get_private_id(doc, user_data);
+}
+
+// Parses the given User-Data XML once to retrieve both the public IDs and
+// the PrivateID element.
+void get_ids(const std::string& user_data,
+             std::vector<std::string>& public_ids,
+             std::string& private_id)
+{
+  rapidxml::xml_document<> doc;
+  parse_user_data(user_data, doc);
+  public_ids = get_public_ids(doc, user_data);
+  private_id = get_private_id(doc, user_data);
+}
+
 }
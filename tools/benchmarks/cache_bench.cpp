@@ -0,0 +1,430 @@
+/**
+ * @file cache_bench.cpp Microbenchmarks for the Cache operations, run
+ *   against the embedded store.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "cache.h"
+#include "embedded_store.h"
+
+//
+// Allocation counting.  The global allocation functions are replaced so that
+// every allocation made while an operation is being measured is counted.
+// The benchmark is single-threaded so the counters don't need to be atomic.
+//
+
+static bool counting = false;
+static uint64_t alloc_count = 0;
+static uint64_t alloc_bytes = 0;
+
+void* operator new(size_t size)
+{
+  if (counting)
+  {
+    alloc_count++;
+    alloc_bytes += size;
+  }
+
+  void* ptr = malloc((size != 0) ? size : 1);
+  if (ptr == NULL)
+  {
+    throw std::bad_alloc(); // LCOV_EXCL_LINE
+  }
+  return ptr;
+}
+
+void* operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+  free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+  free(ptr);
+}
+
+/// Exposes the protected perform() method of a cache operation, so it can be
+/// run directly against a client without going through the cache's thread
+/// pool.
+template <class T>
+class Bench : public T
+{
+public:
+  using T::T;
+  using T::perform;
+};
+
+struct options
+{
+  int irs_size;
+  int impi_count;
+  int xml_size;
+  int iterations;
+  std::string filter;
+};
+
+/// The data set the operations are run against.
+struct DataSet
+{
+  std::vector<std::string> impus;
+  std::vector<std::string> impis;
+  std::string xml;
+  ChargingAddresses charging_addrs;
+  DigestAuthVector av;
+  int64_t timestamp;
+
+  DataSet(const struct options& options) : timestamp(1)
+  {
+    for (int ii = 0; ii < options.irs_size; ++ii)
+    {
+      impus.push_back("sip:bench" + std::to_string(ii) + "@example.com");
+    }
+
+    for (int ii = 0; ii < options.impi_count; ++ii)
+    {
+      impis.push_back("bench" + std::to_string(ii) + "@example.com");
+    }
+
+    // Build an IMS subscription of (roughly) the requested size by padding
+    // the service profile with iFCs.
+    xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?><IMSSubscription>"
+          "<PrivateID>" + impis[0] + "</PrivateID><ServiceProfile>";
+    for (size_t ii = 0; ii < impus.size(); ++ii)
+    {
+      xml += "<PublicIdentity><Identity>" + impus[ii] + "</Identity></PublicIdentity>";
+    }
+    const std::string tail = "</ServiceProfile></IMSSubscription>";
+    for (int ii = 0; xml.size() + tail.size() < (size_t)options.xml_size; ++ii)
+    {
+      xml += "<InitialFilterCriteria><Priority>" + std::to_string(ii) +
+             "</Priority><ApplicationServer><ServerName>sip:as.example.com"
+             "</ServerName></ApplicationServer></InitialFilterCriteria>";
+    }
+    xml += tail;
+
+    charging_addrs = ChargingAddresses({"ccf1", "ccf2"}, {"ecf1", "ecf2"});
+    av.ha1 = "1234567890abcdef1234567890abcdef";
+    av.realm = "example.com";
+    av.qop = "auth";
+  }
+
+  // Write the registration data and identity mappings for the whole data set.
+  void populate(CassandraStore::Client* client)
+  {
+    Bench<Cache::PutRegData> put_reg_data(impus, timestamp++);
+    put_reg_data.with_xml(xml)
+                .with_reg_state(RegistrationState::REGISTERED)
+                .with_associated_impis(impis)
+                .with_charging_addrs(charging_addrs);
+    put_reg_data.perform(client, 0);
+
+    for (size_t ii = 0; ii < impis.size(); ++ii)
+    {
+      Bench<Cache::PutAssociatedPublicID> put_public_id(impis[ii], impus[0], timestamp++);
+      put_public_id.perform(client, 0);
+
+      Bench<Cache::PutAuthVector> put_av(impis[ii], av, timestamp++);
+      put_av.perform(client, 0);
+    }
+  }
+};
+
+/// A single benchmark.  setup() is run (unmeasured) before each iteration
+/// and run() is the operation being measured.
+struct Benchmark
+{
+  const char* name;
+  std::function<void(DataSet&, CassandraStore::Client*)> setup;
+  std::function<Cache::CacheOperation*(DataSet&, CassandraStore::Client*)> run;
+};
+
+// Helpers for benchmarks that need no setup and ones that need the data set
+// to be present.
+static void no_setup(DataSet& data, CassandraStore::Client* client) {}
+static void populate(DataSet& data, CassandraStore::Client* client)
+{
+  data.populate(client);
+}
+
+template <class T>
+static Cache::CacheOperation* perform(T* op, CassandraStore::Client* client)
+{
+  op->perform(client, 0);
+  return op;
+}
+
+static const std::vector<Benchmark> BENCHMARKS =
+{
+  {"put_reg_data", no_setup,
+   [](DataSet& data, CassandraStore::Client* client)
+   {
+     Bench<Cache::PutRegData>* op = new Bench<Cache::PutRegData>(data.impus, data.timestamp++);
+     op->with_xml(data.xml)
+        .with_reg_state(RegistrationState::REGISTERED)
+        .with_associated_impis(data.impis)
+        .with_charging_addrs(data.charging_addrs);
+     return perform(op, client);
+   }},
+  {"put_associated_private_id", no_setup,
+   [](DataSet& data, CassandraStore::Client* client)
+   {
+     return perform(new Bench<Cache::PutAssociatedPrivateID>(data.impus, data.impis[0], data.timestamp++),
+                    client);
+   }},
+  {"put_associated_public_id", no_setup,
+   [](DataSet& data, CassandraStore::Client* client)
+   {
+     return perform(new Bench<Cache::PutAssociatedPublicID>(data.impis[0], data.impus[0], data.timestamp++),
+                    client);
+   }},
+  {"put_auth_vector", no_setup,
+   [](DataSet& data, CassandraStore::Client* client)
+   {
+     return perform(new Bench<Cache::PutAuthVector>(data.impis[0], data.av, data.timestamp++),
+                    client);
+   }},
+  {"get_reg_data", no_setup,
+   [](DataSet& data, CassandraStore::Client* client)
+   {
+     Bench<Cache::GetRegData>* op = new Bench<Cache::GetRegData>(data.impus[0]);
+     perform(op, client);
+     Cache::GetRegData::Result result;
+     op->get_result(result);
+     return op;
+   }},
+  {"get_associated_public_ids", no_setup,
+   [](DataSet& data, CassandraStore::Client* client)
+   {
+     Bench<Cache::GetAssociatedPublicIDs>* op = new Bench<Cache::GetAssociatedPublicIDs>(data.impis);
+     perform(op, client);
+     std::vector<std::string> result;
+     op->get_result(result);
+     return op;
+   }},
+  {"get_associated_primary_public_ids", no_setup,
+   [](DataSet& data, CassandraStore::Client* client)
+   {
+     Bench<Cache::GetAssociatedPrimaryPublicIDs>* op = new Bench<Cache::GetAssociatedPrimaryPublicIDs>(data.impis);
+     perform(op, client);
+     std::vector<std::string> result;
+     op->get_result(result);
+     return op;
+   }},
+  {"get_auth_vector", no_setup,
+   [](DataSet& data, CassandraStore::Client* client)
+   {
+     Bench<Cache::GetAuthVector>* op = new Bench<Cache::GetAuthVector>(data.impis[0]);
+     perform(op, client);
+     DigestAuthVector result;
+     op->get_result(result);
+     return op;
+   }},
+  {"delete_public_ids", populate,
+   [](DataSet& data, CassandraStore::Client* client)
+   {
+     return perform(new Bench<Cache::DeletePublicIDs>(data.impus, data.impis, data.timestamp++),
+                    client);
+   }},
+  {"delete_private_ids", populate,
+   [](DataSet& data, CassandraStore::Client* client)
+   {
+     return perform(new Bench<Cache::DeletePrivateIDs>(data.impis, data.timestamp++),
+                    client);
+   }},
+  {"delete_impi_mapping", populate,
+   [](DataSet& data, CassandraStore::Client* client)
+   {
+     return perform(new Bench<Cache::DeleteIMPIMapping>(data.impis, data.timestamp++),
+                    client);
+   }},
+  {"dissociate_irs_from_impi", populate,
+   [](DataSet& data, CassandraStore::Client* client)
+   {
+     return perform(new Bench<Cache::DissociateImplicitRegistrationSetFromImpi>(data.impus, data.impis, data.timestamp++),
+                    client);
+   }},
+};
+
+// The benchmarks run on the main thread, so only count its CPU time rather
+// than that of any threads the store or logging might have started.
+static uint64_t cpu_time_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static void run_benchmark(const Benchmark& benchmark,
+                          const struct options& options)
+{
+  EmbeddedStore client;
+  DataSet data(options);
+
+  // The read benchmarks need the data set to be present.  This is harmless
+  // for the others.
+  data.populate(&client);
+
+  uint64_t cpu_ns = 0;
+  uint64_t allocs = 0;
+  uint64_t bytes_allocated = 0;
+  uint64_t rows = 0;
+  uint64_t payload_bytes = 0;
+
+  for (int ii = 0; ii < options.iterations; ++ii)
+  {
+    benchmark.setup(data, &client);
+
+    alloc_count = 0;
+    alloc_bytes = 0;
+    counting = true;
+    uint64_t start_ns = cpu_time_ns();
+
+    Cache::CacheOperation* op = benchmark.run(data, &client);
+    rows += op->rows_touched();
+    payload_bytes += op->bytes_read() + op->bytes_written();
+    delete op;
+
+    cpu_ns += cpu_time_ns() - start_ns;
+    counting = false;
+    allocs += alloc_count;
+    bytes_allocated += alloc_bytes;
+  }
+
+  printf("%-34s %10.0f %10.1f %12.0f %8.1f %12.0f\n",
+         benchmark.name,
+         (double)cpu_ns / options.iterations,
+         (double)allocs / options.iterations,
+         (double)bytes_allocated / options.iterations,
+         (double)rows / options.iterations,
+         (double)payload_bytes / options.iterations);
+}
+
+const static struct option long_opt[] =
+{
+  {"irs-size",   required_argument, NULL, 'r'},
+  {"impis",      required_argument, NULL, 'p'},
+  {"xml-size",   required_argument, NULL, 'x'},
+  {"iterations", required_argument, NULL, 'n'},
+  {"filter",     required_argument, NULL, 'f'},
+  {"help",       no_argument,       NULL, 'h'},
+  {NULL,         0,                 NULL, 0},
+};
+
+void usage(void)
+{
+  puts("Options:\n"
+       "\n"
+       " -r, --irs-size N           Number of public IDs in the IRS (default: 1)\n"
+       " -p, --impis N              Number of private IDs associated with the IRS\n"
+       "                            (default: 1)\n"
+       " -x, --xml-size N           Approximate size of the subscription XML in\n"
+       "                            bytes (default: 2048)\n"
+       " -n, --iterations N         Iterations of each operation (default: 10000)\n"
+       " -f, --filter <name>        Only run benchmarks whose names contain <name>\n"
+       " -h, --help                 Show this help screen\n");
+}
+
+int main(int argc, char** argv)
+{
+  struct options options;
+  options.irs_size = 1;
+  options.impi_count = 1;
+  options.xml_size = 2048;
+  options.iterations = 10000;
+
+  int opt;
+  int long_opt_ind;
+  while ((opt = getopt_long(argc, argv, "r:p:x:n:f:h", long_opt, &long_opt_ind)) != -1)
+  {
+    switch (opt)
+    {
+    case 'r':
+      options.irs_size = std::max(atoi(optarg), 1);
+      break;
+
+    case 'p':
+      options.impi_count = std::max(atoi(optarg), 1);
+      break;
+
+    case 'x':
+      options.xml_size = std::max(atoi(optarg), 0);
+      break;
+
+    case 'n':
+      options.iterations = std::max(atoi(optarg), 1);
+      break;
+
+    case 'f':
+      options.filter = std::string(optarg);
+      break;
+
+    case 'h':
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  printf("IRS size %d, %d IMPIs, %d byte XML, %d iterations\n\n",
+         options.irs_size, options.impi_count, options.xml_size, options.iterations);
+  printf("%-34s %10s %10s %12s %8s %12s\n",
+         "operation", "cpu ns/op", "allocs/op", "alloc B/op", "rows/op", "payload B/op");
+
+  for (std::vector<Benchmark>::const_iterator it = BENCHMARKS.begin();
+       it != BENCHMARKS.end();
+       ++it)
+  {
+    if (options.filter.empty() ||
+        (std::string(it->name).find(options.filter) != std::string::npos))
+    {
+      run_benchmark(*it, options);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,766 @@
+/**
+ * @file bulk_import.cpp Bulk importer for subscriber data in the
+ *   homestead_cache keyspace.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <getopt.h>
+#include <openssl/md5.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rapidjson/document.h"
+
+#include "cache.h"
+#include "embedded_store.h"
+
+using namespace org::apache::cassandra;
+
+/// A subscriber to import.
+struct Subscriber
+{
+  std::string impi;
+  std::vector<std::string> impus;
+  DigestAuthVector av;
+  std::string xml;
+};
+
+/// A chunk of subscribers, written to the store as one mutation batch.
+struct Chunk
+{
+  uint64_t seq;
+  uint64_t last_line;
+  std::vector<Subscriber> subscribers;
+};
+
+/// Exposes the protected perform() method of a cache operation, so the
+/// importer can run it against its own client.
+template <class T>
+class Exposed : public T
+{
+public:
+  using T::T;
+  using T::perform;
+};
+
+/// A client that collects the mutations made by the cache operations run
+/// against it into a single mutation batch, so they can be sent to the store
+/// together.  The operations the importer uses only write, so the read
+/// methods are never called.
+class CollectingClient : public CassandraStore::Client
+{
+public:
+  CollectingClient(int64_t timestamp) : batch(timestamp) {}
+
+  Cache::MutationBatch batch;
+
+  void set_keyspace(const std::string& keyspace) {}
+
+  void batch_mutate(
+    const std::map<std::string, std::map<std::string, std::vector<Mutation> > >& mutation_map,
+    const ConsistencyLevel::type consistency_level)
+  {
+    for (std::map<std::string, std::map<std::string, std::vector<Mutation> > >::const_iterator key = mutation_map.begin();
+         key != mutation_map.end();
+         ++key)
+    {
+      for (std::map<std::string, std::vector<Mutation> >::const_iterator table = key->second.begin();
+           table != key->second.end();
+           ++table)
+      {
+        for (std::vector<Mutation>::const_iterator mut = table->second.begin();
+             mut != table->second.end();
+             ++mut)
+        {
+          batch.add_mutation(table->first, key->first, *mut);
+        }
+      }
+    }
+  }
+
+  void get_slice(std::vector<ColumnOrSuperColumn>& _return,
+                 const std::string& key,
+                 const ColumnParent& column_parent,
+                 const SlicePredicate& predicate,
+                 const ConsistencyLevel::type consistency_level) {}
+
+  void multiget_slice(std::map<std::string, std::vector<ColumnOrSuperColumn> >& _return,
+                      const std::vector<std::string>& keys,
+                      const ColumnParent& column_parent,
+                      const SlicePredicate& predicate,
+                      const ConsistencyLevel::type consistency_level) {}
+
+  void remove(const std::string& key,
+              const ColumnPath& column_path,
+              const int64_t timestamp,
+              const ConsistencyLevel::type consistency_level) {}
+
+  void get_range_slices(std::vector<KeySlice>& _return,
+                        const ColumnParent& column_parent,
+                        const SlicePredicate& predicate,
+                        const KeyRange& range,
+                        const ConsistencyLevel::type consistency_level) {}
+};
+
+/// Writes a chunk of subscribers.  The columns for each subscriber are built
+/// by the normal cache operations, and then sent as one mutation batch, which
+/// splits them into batch_mutate calls no bigger than the usual cap.
+class PutSubscribers : public CassandraStore::Operation
+{
+public:
+  PutSubscribers(const std::vector<Subscriber>& subscribers, int64_t timestamp) :
+    _subscribers(subscribers), _timestamp(timestamp)
+  {}
+
+protected:
+  bool perform(CassandraStore::Client* client, SAS::TrailId trail)
+  {
+    CollectingClient collector(_timestamp);
+
+    for (std::vector<Subscriber>::const_iterator sub = _subscribers.begin();
+         sub != _subscribers.end();
+         ++sub)
+    {
+      Exposed<Cache::PutAuthVector> put_av(sub->impi, sub->av, _timestamp);
+      put_av.perform(&collector, trail);
+
+      for (std::vector<std::string>::const_iterator impu = sub->impus.begin();
+           impu != sub->impus.end();
+           ++impu)
+      {
+        Exposed<Cache::PutAssociatedPublicID> put_public_id(sub->impi, *impu, _timestamp);
+        put_public_id.perform(&collector, trail);
+      }
+
+      Exposed<Cache::PutRegData> put_reg_data(sub->impus, _timestamp);
+      put_reg_data.with_xml(sub->xml)
+                  .with_associated_impis(std::vector<std::string>(1, sub->impi));
+      put_reg_data.perform(&collector, trail);
+    }
+
+    collector.batch.execute(client);
+    return true;
+  }
+
+  const std::vector<Subscriber>& _subscribers;
+  int64_t _timestamp;
+};
+
+struct options
+{
+  std::string input;
+  std::string format;
+  std::string cassandra;
+  std::string embedded_store;
+  std::string checkpoint;
+  int threads;
+  int chunk_size;
+  int progress_interval_s;
+};
+
+enum OptionTypes
+{
+  EMBEDDED_STORE = 128,
+  CHUNK_SIZE,
+  PROGRESS_INTERVAL
+};
+
+const static struct option long_opt[] =
+{
+  {"format",            required_argument, NULL, 'f'},
+  {"cassandra",         required_argument, NULL, 'S'},
+  {"embedded-store",    required_argument, NULL, EMBEDDED_STORE},
+  {"checkpoint",        required_argument, NULL, 'k'},
+  {"threads",           required_argument, NULL, 't'},
+  {"chunk-size",        required_argument, NULL, CHUNK_SIZE},
+  {"progress-interval", required_argument, NULL, PROGRESS_INTERVAL},
+  {"help",              no_argument,       NULL, 'h'},
+  {NULL,                0,                 NULL, 0},
+};
+
+void usage(void)
+{
+  puts("Usage: bulk_import [options] <subscriber file>\n"
+       "\n"
+       "Options:\n"
+       "\n"
+       " -f, --format csv|json      Format of the subscriber file (default: from the file\n"
+       "                            extension, or csv)\n"
+       " -S, --cassandra <address>  Cassandra to import into (default: localhost)\n"
+       "     --embedded-store <directory>\n"
+       "                            Import into an embedded store rather than Cassandra.\n"
+       "                            Homestead must not be running\n"
+       " -k, --checkpoint <file>    File recording progress, so a failed import can be\n"
+       "                            resumed (default: <subscriber file>.checkpoint)\n"
+       " -t, --threads N            Number of batches written in parallel (default: 8)\n"
+       "     --chunk-size N         Subscribers written per batch (default: 50)\n"
+       "     --progress-interval N  Seconds between progress reports (default: 5)\n"
+       " -h, --help                 Show this help screen\n"
+       "\n"
+       "CSV files have one subscriber per line, in the form\n"
+       "  <public id>,<private id>,<realm>,<password>\n"
+       "JSON files have one object per line, in the form\n"
+       "  {\"private_id\": ..., \"public_ids\": [...], \"realm\": ...,\n"
+       "   \"password\": ... or \"digest_ha1\": ..., \"ims_subscription\": ... (optional)}");
+}
+
+static std::string digest_ha1(const std::string& impi,
+                              const std::string& realm,
+                              const std::string& password)
+{
+  std::string input = impi + ":" + realm + ":" + password;
+  unsigned char digest[MD5_DIGEST_LENGTH];
+  MD5((const unsigned char*)input.data(), input.length(), digest);
+
+  char hex[MD5_DIGEST_LENGTH * 2 + 1];
+  for (int ii = 0; ii < MD5_DIGEST_LENGTH; ++ii)
+  {
+    sprintf(hex + (ii * 2), "%02x", digest[ii]);
+  }
+  return std::string(hex, MD5_DIGEST_LENGTH * 2);
+}
+
+// The IMS subscription given to subscribers that don't specify one - a single
+// service profile containing all their public IDs.
+static std::string default_ims_subscription(const Subscriber& sub)
+{
+  std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+                    "<IMSSubscription><PrivateID>" + sub.impi + "</PrivateID>"
+                    "<ServiceProfile>";
+  for (std::vector<std::string>::const_iterator impu = sub.impus.begin();
+       impu != sub.impus.end();
+       ++impu)
+  {
+    xml += "<PublicIdentity><Identity>" + *impu + "</Identity></PublicIdentity>";
+  }
+  xml += "</ServiceProfile></IMSSubscription>";
+  return xml;
+}
+
+static bool parse_csv(const std::string& line, Subscriber& sub)
+{
+  std::vector<std::string> fields;
+  size_t start = 0;
+  size_t comma;
+  while ((comma = line.find(',', start)) != std::string::npos)
+  {
+    fields.push_back(line.substr(start, comma - start));
+    start = comma + 1;
+  }
+  fields.push_back(line.substr(start));
+
+  if ((fields.size() != 4) || fields[0].empty() || fields[1].empty())
+  {
+    return false;
+  }
+
+  sub.impus.push_back(fields[0]);
+  sub.impi = fields[1];
+  sub.av.realm = fields[2];
+  sub.av.ha1 = digest_ha1(sub.impi, sub.av.realm, fields[3]);
+  return true;
+}
+
+static bool parse_json(const std::string& line, Subscriber& sub)
+{
+  rapidjson::Document doc;
+  doc.Parse<0>(line.c_str());
+
+  if (doc.HasParseError() || !doc.IsObject() ||
+      !doc.HasMember("private_id") || !doc["private_id"].IsString() ||
+      !doc.HasMember("public_ids") || !doc["public_ids"].IsArray() ||
+      !doc.HasMember("realm") || !doc["realm"].IsString())
+  {
+    return false;
+  }
+
+  sub.impi = doc["private_id"].GetString();
+  sub.av.realm = doc["realm"].GetString();
+
+  const rapidjson::Value& impus = doc["public_ids"];
+  for (rapidjson::SizeType ii = 0; ii < impus.Size(); ++ii)
+  {
+    if (!impus[ii].IsString())
+    {
+      return false;
+    }
+    sub.impus.push_back(impus[ii].GetString());
+  }
+
+  if (doc.HasMember("digest_ha1") && doc["digest_ha1"].IsString())
+  {
+    sub.av.ha1 = doc["digest_ha1"].GetString();
+  }
+  else if (doc.HasMember("password") && doc["password"].IsString())
+  {
+    sub.av.ha1 = digest_ha1(sub.impi, sub.av.realm, doc["password"].GetString());
+  }
+  else
+  {
+    return false;
+  }
+
+  if (doc.HasMember("ims_subscription") && doc["ims_subscription"].IsString())
+  {
+    sub.xml = doc["ims_subscription"].GetString();
+  }
+
+  return !sub.impus.empty();
+}
+
+/// Runs the import - a reader feeds chunks of subscribers through a bounded
+/// queue (so that reading is held back when the store can't keep up) to a
+/// pool of writer threads.
+///
+/// Chunks can complete out of order, so the checkpoint records the last
+/// input line before which every chunk has been written.  Resuming from
+/// there may rewrite a few subscribers, which is harmless.
+class Importer
+{
+public:
+  Importer(Cache* cache, const struct options& options) :
+    _cache(cache),
+    _options(options),
+    _max_queued(options.threads * 2),
+    _next_complete_seq(0),
+    _checkpoint_line(0),
+    _imported(0),
+    _bad_lines(0),
+    _start_time(0),
+    _reading_done(false),
+    _finished(false),
+    _failed(false)
+  {}
+
+  bool run(uint64_t resume_line)
+  {
+    _checkpoint_line = resume_line;
+    _start_time = time(NULL);
+
+    std::vector<std::thread> writers;
+    for (int ii = 0; ii < _options.threads; ++ii)
+    {
+      writers.push_back(std::thread(&Importer::writer, this));
+    }
+    std::thread reporter(&Importer::reporter, this);
+
+    read(resume_line);
+
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      _reading_done = true;
+    }
+    _not_empty.notify_all();
+
+    for (std::vector<std::thread>::iterator it = writers.begin();
+         it != writers.end();
+         ++it)
+    {
+      it->join();
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      _finished = true;
+    }
+    _finished_cond.notify_all();
+    reporter.join();
+
+    report();
+    write_checkpoint();
+    return !_failed;
+  }
+
+private:
+  void read(uint64_t resume_line)
+  {
+    std::ifstream input(_options.input.c_str());
+    std::string line;
+    uint64_t line_number = 0;
+    Chunk chunk;
+    chunk.seq = 0;
+
+    while (std::getline(input, line) && !_failed)
+    {
+      line_number++;
+
+      if ((line_number <= resume_line) || line.empty() || (line[0] == '#'))
+      {
+        continue;
+      }
+
+      Subscriber sub;
+      bool ok = (_options.format == "json") ? parse_json(line, sub) :
+                                              parse_csv(line, sub);
+      if (!ok)
+      {
+        fprintf(stderr, "Skipping invalid line %lu: %s\n", line_number, line.c_str());
+        _bad_lines++;
+        continue;
+      }
+
+      if (sub.xml.empty())
+      {
+        sub.xml = default_ims_subscription(sub);
+      }
+
+      chunk.subscribers.push_back(sub);
+      chunk.last_line = line_number;
+
+      if (chunk.subscribers.size() >= (size_t)_options.chunk_size)
+      {
+        uint64_t next_seq = chunk.seq + 1;
+        push(chunk);
+        chunk.subscribers.clear();
+        chunk.seq = next_seq;
+      }
+    }
+
+    if (!chunk.subscribers.empty())
+    {
+      push(chunk);
+    }
+  }
+
+  void push(Chunk& chunk)
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    _not_full.wait(lock, [this]() { return (_queue.size() < _max_queued) || _failed; });
+    _queue.push_back(Chunk());
+    _queue.back().seq = chunk.seq;
+    _queue.back().last_line = chunk.last_line;
+    _queue.back().subscribers.swap(chunk.subscribers);
+    lock.unlock();
+    _not_empty.notify_one();
+  }
+
+  void writer()
+  {
+    while (true)
+    {
+      Chunk chunk;
+      {
+        std::unique_lock<std::mutex> lock(_lock);
+        _not_empty.wait(lock, [this]() { return !_queue.empty() || _reading_done || _failed; });
+
+        if (_queue.empty() || _failed)
+        {
+          return;
+        }
+
+        chunk = _queue.front();
+        _queue.pop_front();
+      }
+      _not_full.notify_one();
+
+      if (!write(chunk))
+      {
+        std::lock_guard<std::mutex> lock(_lock);
+        _failed = true;
+        _not_full.notify_all();
+        _not_empty.notify_all();
+        return;
+      }
+
+      complete(chunk);
+    }
+  }
+
+  // Write a chunk, retrying with backoff if the store is unavailable.
+  bool write(const Chunk& chunk)
+  {
+    for (int attempt = 0; attempt < MAX_ATTEMPTS; ++attempt)
+    {
+      if (attempt > 0)
+      {
+        sleep(1 << attempt);
+      }
+
+      PutSubscribers op(chunk.subscribers, Cache::generate_timestamp());
+      if (_cache->do_sync(&op, 0))
+      {
+        return true;
+      }
+
+      fprintf(stderr, "Failed to write subscribers ending at line %lu (attempt %d): %s\n",
+              chunk.last_line, attempt + 1, op.get_error_text().c_str());
+    }
+
+    return false;
+  }
+
+  void complete(const Chunk& chunk)
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    _imported += chunk.subscribers.size();
+    _completed[chunk.seq] = chunk.last_line;
+
+    // Advance the checkpoint past every chunk that has now been written.
+    std::map<uint64_t, uint64_t>::iterator it;
+    while ((it = _completed.find(_next_complete_seq)) != _completed.end())
+    {
+      _checkpoint_line = it->second;
+      _completed.erase(it);
+      _next_complete_seq++;
+    }
+  }
+
+  void reporter()
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    while (!_finished_cond.wait_for(lock,
+                                    std::chrono::seconds(_options.progress_interval_s),
+                                    [this]() { return _finished; }))
+    {
+      lock.unlock();
+      report();
+      write_checkpoint();
+      lock.lock();
+    }
+  }
+
+  void report()
+  {
+    uint64_t imported = _imported;
+    time_t elapsed = std::max(time(NULL) - _start_time, (time_t)1);
+    printf("Imported %lu subscribers in %lds (%.0f/s), %lu invalid lines, checkpoint at line %lu\n",
+           imported,
+           (long)elapsed,
+           (double)imported / elapsed,
+           (uint64_t)_bad_lines,
+           (uint64_t)_checkpoint_line);
+    fflush(stdout);
+  }
+
+  void write_checkpoint()
+  {
+    std::string tmp = _options.checkpoint + ".tmp";
+    FILE* file = fopen(tmp.c_str(), "w");
+    if (file == NULL)
+    {
+      fprintf(stderr, "Failed to write checkpoint %s\n", tmp.c_str());
+      return;
+    }
+    fprintf(file, "%lu\n", (uint64_t)_checkpoint_line);
+    fclose(file);
+    rename(tmp.c_str(), _options.checkpoint.c_str());
+  }
+
+  static const int MAX_ATTEMPTS = 4;
+
+  Cache* _cache;
+  const struct options& _options;
+
+  std::mutex _lock;
+  std::condition_variable _not_full;
+  std::condition_variable _not_empty;
+  std::condition_variable _finished_cond;
+  std::deque<Chunk> _queue;
+  size_t _max_queued;
+
+  std::map<uint64_t, uint64_t> _completed;
+  uint64_t _next_complete_seq;
+  std::atomic<uint64_t> _checkpoint_line;
+
+  std::atomic<uint64_t> _imported;
+  std::atomic<uint64_t> _bad_lines;
+  time_t _start_time;
+  bool _reading_done;
+  bool _finished;
+  std::atomic<bool> _failed;
+};
+
+int main(int argc, char** argv)
+{
+  struct options options;
+  options.cassandra = "localhost";
+  options.threads = 8;
+  options.chunk_size = 50;
+  options.progress_interval_s = 5;
+
+  int opt;
+  int long_opt_ind;
+  while ((opt = getopt_long(argc, argv, "f:S:k:t:h", long_opt, &long_opt_ind)) != -1)
+  {
+    switch (opt)
+    {
+    case 'f':
+      options.format = std::string(optarg);
+      break;
+
+    case 'S':
+      options.cassandra = std::string(optarg);
+      break;
+
+    case EMBEDDED_STORE:
+      options.embedded_store = std::string(optarg);
+      break;
+
+    case 'k':
+      options.checkpoint = std::string(optarg);
+      break;
+
+    case 't':
+      options.threads = std::max(atoi(optarg), 1);
+      break;
+
+    case CHUNK_SIZE:
+      options.chunk_size = std::max(atoi(optarg), 1);
+      break;
+
+    case PROGRESS_INTERVAL:
+      options.progress_interval_s = std::max(atoi(optarg), 1);
+      break;
+
+    case 'h':
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  if (optind != argc - 1)
+  {
+    usage();
+    return 1;
+  }
+
+  options.input = argv[optind];
+
+  if (options.format.empty())
+  {
+    size_t dot = options.input.rfind('.');
+    options.format = ((dot != std::string::npos) &&
+                      ((options.input.substr(dot) == ".json") ||
+                       (options.input.substr(dot) == ".jsonl"))) ? "json" : "csv";
+  }
+
+  if ((options.format != "csv") && (options.format != "json"))
+  {
+    fprintf(stderr, "Unknown format %s\n", options.format.c_str());
+    return 1;
+  }
+
+  if (options.checkpoint.empty())
+  {
+    options.checkpoint = options.input + ".checkpoint";
+  }
+
+  if (access(options.input.c_str(), R_OK) != 0)
+  {
+    fprintf(stderr, "Can't read %s\n", options.input.c_str());
+    return 1;
+  }
+
+  // If a previous import of this file failed, carry on from its checkpoint.
+  uint64_t resume_line = 0;
+  FILE* checkpoint = fopen(options.checkpoint.c_str(), "r");
+  if (checkpoint != NULL)
+  {
+    if (fscanf(checkpoint, "%lu", &resume_line) == 1)
+    {
+      printf("Resuming after line %lu (from %s)\n", resume_line, options.checkpoint.c_str());
+    }
+    fclose(checkpoint);
+  }
+
+  Cache* cache = Cache::get_instance();
+  cache->configure_connection(options.cassandra, 9160, NULL);
+  cache->configure_workers(NULL, options.threads, 0);
+
+  EmbeddedStore* embedded_store = NULL;
+  CassandraStore::ResultCode rc = CassandraStore::OK;
+
+  if (!options.embedded_store.empty())
+  {
+    // The store is snapshotted (and so synced) once the import is complete,
+    // so there's no need to sync each write.
+    embedded_store = new EmbeddedStore(options.embedded_store,
+                                       EmbeddedStore::DEFAULT_SNAPSHOT_LOG_BYTES,
+                                       0,
+                                       EmbeddedStore::SYNC_NONE);
+    if (!embedded_store->open())
+    {
+      fprintf(stderr, "Failed to open embedded store %s\n", options.embedded_store.c_str());
+      return 2;
+    }
+    cache->configure_embedded_store(embedded_store);
+  }
+  else
+  {
+    rc = cache->connection_test();
+  }
+
+  if ((rc != CassandraStore::OK) || ((rc = cache->start()) != CassandraStore::OK))
+  {
+    fprintf(stderr, "Failed to connect to Cassandra at %s (error %d)\n",
+            options.cassandra.c_str(), rc);
+    return 2;
+  }
+
+  Importer importer(cache, options);
+  bool ok = importer.run(resume_line);
+
+  cache->stop();
+  cache->wait_stopped();
+
+  if (embedded_store != NULL)
+  {
+    // Leave the store compact for homestead to load.
+    embedded_store->snapshot();
+    delete embedded_store; embedded_store = NULL;
+  }
+
+  if (!ok)
+  {
+    fprintf(stderr, "Import failed - run the same command again to resume from the checkpoint\n");
+    return 1;
+  }
+
+  unlink(options.checkpoint.c_str());
+  printf("Import complete\n");
+  return 0;
+}
@@ -0,0 +1,552 @@
+/**
+ * @file cache_export.cpp Export the homestead cache tables.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+
+#include "cache.h"
+#include "embedded_store.h"
+
+/// A token range of one table, scanned by a single thread.
+struct Job
+{
+  std::string table;
+  Cache::TokenRange range;
+};
+
+struct options
+{
+  std::string output;
+  std::string cassandra;
+  std::string embedded_store;
+  std::vector<std::string> tables;
+  int ranges;
+  int page_size;
+  int max_rows_per_sec;
+  int progress_interval_s;
+};
+
+enum OptionTypes
+{
+  EMBEDDED_STORE = 128,
+  PAGE_SIZE,
+  MAX_ROWS_PER_SEC,
+  PROGRESS_INTERVAL
+};
+
+const static struct option long_opt[] =
+{
+  {"cassandra",         required_argument, NULL, 'S'},
+  {"embedded-store",    required_argument, NULL, EMBEDDED_STORE},
+  {"table",             required_argument, NULL, 'T'},
+  {"ranges",            required_argument, NULL, 'r'},
+  {"page-size",         required_argument, NULL, PAGE_SIZE},
+  {"max-rows-per-sec",  required_argument, NULL, MAX_ROWS_PER_SEC},
+  {"progress-interval", required_argument, NULL, PROGRESS_INTERVAL},
+  {"help",              no_argument,       NULL, 'h'},
+  {NULL,                0,                 NULL, 0},
+};
+
+void usage(void)
+{
+  puts("Usage: cache_export [options] <output file, or - for stdout>\n"
+       "\n"
+       "Options:\n"
+       "\n"
+       " -S, --cassandra <address>  Cassandra to export from (default: localhost)\n"
+       "     --embedded-store <directory>\n"
+       "                            Export from an embedded store rather than Cassandra.\n"
+       "                            Homestead must not be running\n"
+       " -T, --table impu|impi|all  Table to export (default: all)\n"
+       " -r, --ranges N             Number of token ranges scanned in parallel (default: 8)\n"
+       "     --page-size N          Rows read from Cassandra at a time (default: 100)\n"
+       "     --max-rows-per-sec N   Limit the export rate, to protect live traffic\n"
+       "                            (default: no limit)\n"
+       "     --progress-interval N  Seconds between progress reports (default: 5)\n"
+       " -h, --help                 Show this help screen\n"
+       "\n"
+       "Each row is written as a JSON object on its own line.  IMPI rows are in the\n"
+       "format read by bulk_import.");
+}
+
+static const char* reg_state_name(RegistrationState state)
+{
+  switch (state)
+  {
+  case REGISTERED:
+    return "registered";
+  case UNREGISTERED:
+    return "unregistered";
+  default:
+    return "not_registered";
+  }
+}
+
+template <class C>
+static void write_strings(rapidjson::Writer<rapidjson::StringBuffer>& writer,
+                          const char* name,
+                          const C& strings)
+{
+  writer.String(name);
+  writer.StartArray();
+  for (typename C::const_iterator it = strings.begin(); it != strings.end(); ++it)
+  {
+    writer.String(it->c_str());
+  }
+  writer.EndArray();
+}
+
+/// Runs the export - a pool of threads each takes a token range of a table
+/// and scans it, buffering the output and writing it in large blocks.  Only
+/// one page of each range is held in memory at a time.
+///
+/// If a scan fails it is retried from the last row it exported, so the
+/// output contains each row exactly once.
+class Exporter
+{
+public:
+  Exporter(Cache* cache, const struct options& options, FILE* output) :
+    _cache(cache),
+    _options(options),
+    _output(output),
+    _next_job(0),
+    _exported(0),
+    _start(std::chrono::steady_clock::now()),
+    _finished(false),
+    _failed(false)
+  {
+    std::vector<Cache::TokenRange> ranges = Cache::split_token_ring(options.ranges);
+    for (std::vector<std::string>::const_iterator table = options.tables.begin();
+         table != options.tables.end();
+         ++table)
+    {
+      for (std::vector<Cache::TokenRange>::const_iterator range = ranges.begin();
+           range != ranges.end();
+           ++range)
+      {
+        Job job = {*table, *range};
+        _jobs.push_back(job);
+      }
+    }
+  }
+
+  bool run()
+  {
+    std::vector<std::thread> scanners;
+    for (int ii = 0; ii < _options.ranges; ++ii)
+    {
+      scanners.push_back(std::thread(&Exporter::scanner, this));
+    }
+    std::thread reporter(&Exporter::reporter, this);
+
+    for (std::vector<std::thread>::iterator it = scanners.begin();
+         it != scanners.end();
+         ++it)
+    {
+      it->join();
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      _finished = true;
+    }
+    _finished_cond.notify_all();
+    reporter.join();
+
+    report();
+    return !_failed;
+  }
+
+private:
+  void scanner()
+  {
+    std::string buffer;
+
+    while (!_failed)
+    {
+      size_t job = _next_job++;
+      if (job >= _jobs.size())
+      {
+        break;
+      }
+
+      if (!scan(_jobs[job], buffer))
+      {
+        _failed = true;
+      }
+
+      flush(buffer);
+    }
+  }
+
+  // Scan a range, retrying with backoff (and carrying on from the last row
+  // exported) if the store is unavailable.
+  bool scan(const Job& job, std::string& buffer)
+  {
+    std::string resume_key;
+
+    for (int attempt = 0; attempt < MAX_ATTEMPTS; ++attempt)
+    {
+      if (attempt > 0)
+      {
+        sleep(1 << attempt);
+      }
+
+      bool ok;
+      std::string error_text;
+
+      if (job.table == "impu")
+      {
+        Cache::ScanImpus op(job.range,
+                            [&](const Cache::ImpuRecord& record)
+                            {
+                              write_impu(record, buffer);
+                              return row_done(buffer);
+                            },
+                            resume_key,
+                            _options.page_size);
+        ok = _cache->do_sync(&op, 0);
+        resume_key = op.last_key();
+        error_text = op.get_error_text();
+      }
+      else
+      {
+        Cache::ScanImpis op(job.range,
+                            [&](const Cache::ImpiRecord& record)
+                            {
+                              write_impi(record, buffer);
+                              return row_done(buffer);
+                            },
+                            resume_key,
+                            _options.page_size);
+        ok = _cache->do_sync(&op, 0);
+        resume_key = op.last_key();
+        error_text = op.get_error_text();
+      }
+
+      if (ok)
+      {
+        return !_failed;
+      }
+
+      fprintf(stderr, "Failed to scan %s tokens %s to %s (attempt %d): %s\n",
+              job.table.c_str(),
+              job.range.start_token.c_str(),
+              job.range.end_token.c_str(),
+              attempt + 1,
+              error_text.c_str());
+    }
+
+    return false;
+  }
+
+  void write_impu(const Cache::ImpuRecord& record, std::string& buffer)
+  {
+    rapidjson::StringBuffer sb;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+    writer.StartObject();
+    writer.String("table");
+    writer.String("impu");
+    writer.String("public_id");
+    writer.String(record.public_id.c_str());
+    writer.String("reg_state");
+    writer.String(reg_state_name(record.reg_state));
+    writer.String("reg_state_ttl");
+    writer.Int(record.reg_state_ttl);
+    writer.String("ims_subscription");
+    writer.String(record.xml.c_str());
+    writer.String("ims_subscription_ttl");
+    writer.Int(record.xml_ttl);
+    write_strings(writer, "private_ids", record.impis);
+    write_strings(writer, "ccfs", record.charging_addrs.ccfs);
+    write_strings(writer, "ecfs", record.charging_addrs.ecfs);
+    writer.EndObject();
+
+    buffer.append(sb.GetString(), sb.GetSize());
+    buffer.push_back('\n');
+  }
+
+  void write_impi(const Cache::ImpiRecord& record, std::string& buffer)
+  {
+    rapidjson::StringBuffer sb;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+    writer.StartObject();
+    writer.String("table");
+    writer.String("impi");
+    writer.String("private_id");
+    writer.String(record.private_id.c_str());
+    writer.String("realm");
+    writer.String(record.auth_vector.realm.c_str());
+    writer.String("digest_ha1");
+    writer.String(record.auth_vector.ha1.c_str());
+    writer.String("qop");
+    writer.String(record.auth_vector.qop.c_str());
+    write_strings(writer, "public_ids", record.public_ids);
+    writer.EndObject();
+
+    buffer.append(sb.GetString(), sb.GetSize());
+    buffer.push_back('\n');
+  }
+
+  // Called after each row is exported.  Writes out the buffer when it is
+  // full, and holds the scan back if it is running faster than the
+  // configured rate.
+  bool row_done(std::string& buffer)
+  {
+    uint64_t exported = ++_exported;
+
+    if (buffer.size() >= FLUSH_BYTES)
+    {
+      flush(buffer);
+    }
+
+    if (_options.max_rows_per_sec > 0)
+    {
+      std::chrono::steady_clock::time_point due =
+        _start + std::chrono::microseconds(exported * 1000000 / _options.max_rows_per_sec);
+      std::this_thread::sleep_until(due);
+    }
+
+    return !_failed;
+  }
+
+  void flush(std::string& buffer)
+  {
+    if (!buffer.empty())
+    {
+      std::lock_guard<std::mutex> lock(_output_lock);
+      if (fwrite(buffer.data(), 1, buffer.size(), _output) != buffer.size())
+      {
+        fprintf(stderr, "Failed to write output\n");
+        _failed = true;
+      }
+      buffer.clear();
+    }
+  }
+
+  void reporter()
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    while (!_finished_cond.wait_for(lock,
+                                    std::chrono::seconds(_options.progress_interval_s),
+                                    [this]() { return _finished; }))
+    {
+      lock.unlock();
+      report();
+      lock.lock();
+    }
+  }
+
+  void report()
+  {
+    uint64_t exported = _exported;
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+    size_t done = std::min((size_t)_next_job, _jobs.size());
+    fprintf(stderr, "Exported %lu rows in %.0fs (%.0f/s), started %lu of %lu ranges\n",
+            exported,
+            elapsed,
+            exported / std::max(elapsed, 1.0),
+            done,
+            _jobs.size());
+  }
+
+  static const int MAX_ATTEMPTS = 4;
+  static const size_t FLUSH_BYTES = 64 * 1024;
+
+  Cache* _cache;
+  const struct options& _options;
+  FILE* _output;
+  std::mutex _output_lock;
+
+  std::vector<Job> _jobs;
+  std::atomic<size_t> _next_job;
+
+  std::atomic<uint64_t> _exported;
+  std::chrono::steady_clock::time_point _start;
+
+  std::mutex _lock;
+  std::condition_variable _finished_cond;
+  bool _finished;
+  std::atomic<bool> _failed;
+};
+
+int main(int argc, char** argv)
+{
+  struct options options;
+  options.cassandra = "localhost";
+  options.ranges = 8;
+  options.page_size = Cache::DEFAULT_SCAN_PAGE_SIZE;
+  options.max_rows_per_sec = 0;
+  options.progress_interval_s = 5;
+  std::string table = "all";
+
+  int opt;
+  int long_opt_ind;
+  while ((opt = getopt_long(argc, argv, "S:T:r:h", long_opt, &long_opt_ind)) != -1)
+  {
+    switch (opt)
+    {
+    case 'S':
+      options.cassandra = std::string(optarg);
+      break;
+
+    case EMBEDDED_STORE:
+      options.embedded_store = std::string(optarg);
+      break;
+
+    case 'T':
+      table = std::string(optarg);
+      break;
+
+    case 'r':
+      options.ranges = std::max(atoi(optarg), 1);
+      break;
+
+    case PAGE_SIZE:
+      options.page_size = std::max(atoi(optarg), 1);
+      break;
+
+    case MAX_ROWS_PER_SEC:
+      options.max_rows_per_sec = std::max(atoi(optarg), 0);
+      break;
+
+    case PROGRESS_INTERVAL:
+      options.progress_interval_s = std::max(atoi(optarg), 1);
+      break;
+
+    case 'h':
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  if (optind != argc - 1)
+  {
+    usage();
+    return 1;
+  }
+
+  options.output = argv[optind];
+
+  if ((table == "impu") || (table == "all"))
+  {
+    options.tables.push_back("impu");
+  }
+  if ((table == "impi") || (table == "all"))
+  {
+    options.tables.push_back("impi");
+  }
+  if (options.tables.empty())
+  {
+    fprintf(stderr, "Unknown table %s\n", table.c_str());
+    return 1;
+  }
+
+  FILE* output = (options.output == "-") ? stdout : fopen(options.output.c_str(), "w");
+  if (output == NULL)
+  {
+    fprintf(stderr, "Can't write %s\n", options.output.c_str());
+    return 1;
+  }
+
+  Cache* cache = Cache::get_instance();
+  cache->configure_connection(options.cassandra, 9160, NULL);
+  cache->configure_workers(NULL, options.ranges, 0);
+
+  EmbeddedStore* embedded_store = NULL;
+  CassandraStore::ResultCode rc = CassandraStore::OK;
+
+  if (!options.embedded_store.empty())
+  {
+    embedded_store = new EmbeddedStore(options.embedded_store);
+    if (!embedded_store->open())
+    {
+      fprintf(stderr, "Failed to open embedded store %s\n", options.embedded_store.c_str());
+      return 2;
+    }
+    cache->configure_embedded_store(embedded_store);
+  }
+  else
+  {
+    rc = cache->connection_test();
+  }
+
+  if ((rc != CassandraStore::OK) || ((rc = cache->start()) != CassandraStore::OK))
+  {
+    fprintf(stderr, "Failed to connect to Cassandra at %s (error %d)\n",
+            options.cassandra.c_str(), rc);
+    return 2;
+  }
+
+  Exporter exporter(cache, options, output);
+  bool ok = exporter.run();
+
+  cache->stop();
+  cache->wait_stopped();
+  delete embedded_store; embedded_store = NULL;
+
+  if ((fflush(output) != 0) || ((output != stdout) && (fclose(output) != 0)))
+  {
+    fprintf(stderr, "Failed to write %s\n", options.output.c_str());
+    ok = false;
+  }
+
+  if (!ok)
+  {
+    fprintf(stderr, "Export failed\n");
+    return 1;
+  }
+
+  fprintf(stderr, "Export complete\n");
+  return 0;
+}
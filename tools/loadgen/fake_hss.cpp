@@ -0,0 +1,502 @@
+/**
+ * @file fake_hss.cpp A fake HSS that answers the Cx requests sent by
+ *   homestead, for load testing.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <getopt.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "cx.h"
+#include "diameterstack.h"
+#include "log.h"
+#include "utils.h"
+
+const int32_t DIAMETER_SUCCESS = 2001;
+
+struct options
+{
+  std::string diameter_conf;
+  int latency_ms;
+  int32_t result_code;
+  int32_t experimental_result_code;
+  std::string scscf;
+  int ifc_count;
+  int threads;
+};
+
+enum OptionTypes
+{
+  LATENCY_MS = 128,
+  RESULT_CODE,
+  EXPERIMENTAL_RESULT_CODE,
+  SCSCF,
+  IFC_COUNT,
+  THREADS
+};
+
+const static struct option long_opt[] =
+{
+  {"diameter-conf",            required_argument, NULL, 'c'},
+  {"latency-ms",               required_argument, NULL, LATENCY_MS},
+  {"result-code",              required_argument, NULL, RESULT_CODE},
+  {"experimental-result-code", required_argument, NULL, EXPERIMENTAL_RESULT_CODE},
+  {"scscf",                    required_argument, NULL, SCSCF},
+  {"ifc-count",                required_argument, NULL, IFC_COUNT},
+  {"threads",                  required_argument, NULL, THREADS},
+  {"help",                     no_argument,       NULL, 'h'},
+  {NULL,                       0,                 NULL, 0},
+};
+
+void usage(void)
+{
+  puts("Options:\n"
+       "\n"
+       " -c, --diameter-conf <file> File name for Diameter configuration\n"
+       "     --latency-ms N         Delay before answering each request (default: 0)\n"
+       "     --result-code N        Result-Code to return (default: 2001).  If 0,\n"
+       "                            an Experimental-Result-Code is returned instead\n"
+       "     --experimental-result-code N\n"
+       "                            Experimental-Result-Code to return when the\n"
+       "                            Result-Code is 0 (default: 5001)\n"
+       "     --scscf <uri>          Server-Name to return on UAAs and LIAs\n"
+       "                            (default: sip:scscf.example.com)\n"
+       "     --ifc-count N          Number of iFCs in each subscriber's service\n"
+       "                            profile (default: 1)\n"
+       "     --threads N            Number of threads sending answers (default: 4)\n"
+       " -h, --help                 Show this help screen\n");
+}
+
+/// Runs functions after a delay, on a pool of worker threads.  Used to add
+/// latency to the answers without blocking the Diameter stack's threads.
+class DelayQueue
+{
+public:
+  DelayQueue(int threads) : _terminated(false)
+  {
+    for (int ii = 0; ii < threads; ++ii)
+    {
+      _threads.push_back(std::thread(&DelayQueue::worker, this));
+    }
+  }
+
+  ~DelayQueue()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      _terminated = true;
+    }
+    _cond.notify_all();
+
+    for (std::vector<std::thread>::iterator it = _threads.begin();
+         it != _threads.end();
+         ++it)
+    {
+      it->join();
+    }
+  }
+
+  void run_after(int delay_ms, std::function<void()> fn)
+  {
+    Item item;
+    item.due = std::chrono::steady_clock::now() +
+               std::chrono::milliseconds(delay_ms);
+    item.fn = fn;
+
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      _queue.push(item);
+    }
+    _cond.notify_one();
+  }
+
+private:
+  struct Item
+  {
+    std::chrono::steady_clock::time_point due;
+    std::function<void()> fn;
+
+    // Order the priority queue with the earliest item at the top.
+    bool operator<(const Item& other) const { return due > other.due; }
+  };
+
+  void worker()
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+
+    while (!_terminated)
+    {
+      if (_queue.empty())
+      {
+        _cond.wait(lock);
+      }
+      else if (_queue.top().due > std::chrono::steady_clock::now())
+      {
+        _cond.wait_until(lock, _queue.top().due);
+      }
+      else
+      {
+        Item item = _queue.top();
+        _queue.pop();
+        lock.unlock();
+        item.fn();
+        lock.lock();
+      }
+    }
+  }
+
+  std::mutex _lock;
+  std::condition_variable _cond;
+  std::priority_queue<Item> _queue;
+  std::vector<std::thread> _threads;
+  bool _terminated;
+};
+
+struct FakeHssConfig
+{
+  Cx::Dictionary* dict;
+  DelayQueue* delay_queue;
+  int latency_ms;
+  int32_t result_code;
+  int32_t experimental_result_code;
+  std::string scscf;
+  int ifc_count;
+};
+
+/// An answer to a request received by the fake HSS, carrying the configured
+/// Result-Code or Experimental-Result-Code.
+class FakeAnswer : public Diameter::Message
+{
+public:
+  FakeAnswer(Diameter::Message& req, const FakeHssConfig* cfg) :
+    Diameter::Message(req)
+  {
+    build_response(req);
+    add_app_id(Diameter::Dictionary::Application::AUTH,
+               cfg->dict->TGPP,
+               cfg->dict->CX);
+    add(Diameter::AVP(cfg->dict->AUTH_SESSION_STATE).val_i32(1));
+
+    if (cfg->result_code != 0)
+    {
+      add(Diameter::AVP(cfg->dict->RESULT_CODE).val_i32(cfg->result_code));
+    }
+    else
+    {
+      Diameter::AVP experimental_result(cfg->dict->EXPERIMENTAL_RESULT);
+      experimental_result.add(
+        Diameter::AVP(cfg->dict->EXPERIMENTAL_RESULT_CODE).val_i32(cfg->experimental_result_code));
+      add(experimental_result);
+    }
+  }
+};
+
+/// Base class for the fake HSS tasks.  Each task builds its answer after the
+/// configured latency, sends it and then deletes itself.
+class FakeHssTask : public Diameter::Task
+{
+public:
+  FakeHssTask(const Diameter::Dictionary* dict,
+              struct msg** fd_msg,
+              const FakeHssConfig* cfg,
+              SAS::TrailId trail) :
+    Diameter::Task(dict, fd_msg, trail), _cfg(cfg)
+  {}
+
+  void run()
+  {
+    _cfg->delay_queue->run_after(_cfg->latency_ms,
+                                 std::bind(&FakeHssTask::answer, this));
+  }
+
+protected:
+  virtual void answer() = 0;
+
+  const FakeHssConfig* _cfg;
+};
+
+class FakeMarTask : public FakeHssTask
+{
+public:
+  FakeMarTask(const Diameter::Dictionary* dict,
+              struct msg** fd_msg,
+              const FakeHssConfig* cfg,
+              SAS::TrailId trail) :
+    FakeHssTask(dict, fd_msg, cfg, trail)
+  {}
+
+protected:
+  void answer()
+  {
+    Cx::MultimediaAuthRequest mar(_msg);
+    FakeAnswer maa(_msg, _cfg);
+
+    if (_cfg->result_code == DIAMETER_SUCCESS)
+    {
+      // Return a digest AV whose HA1 depends on the subscriber.
+      Diameter::AVP sip_auth_data_item(_cfg->dict->SIP_AUTH_DATA_ITEM);
+      sip_auth_data_item.add(Diameter::AVP(_cfg->dict->SIP_AUTH_SCHEME).val_str("SIP Digest"));
+      Diameter::AVP sip_digest_authenticate(_cfg->dict->SIP_DIGEST_AUTHENTICATE);
+      sip_digest_authenticate.add(
+        Diameter::AVP(_cfg->dict->CX_DIGEST_HA1).val_str(
+          std::to_string(std::hash<std::string>()(mar.impi()))));
+      sip_digest_authenticate.add(Diameter::AVP(_cfg->dict->CX_DIGEST_REALM).val_str("example.com"));
+      sip_digest_authenticate.add(Diameter::AVP(_cfg->dict->CX_DIGEST_QOP).val_str("auth"));
+      sip_auth_data_item.add(sip_digest_authenticate);
+      maa.add(sip_auth_data_item);
+    }
+
+    maa.send(trail());
+    delete this;
+  }
+};
+
+class FakeSarTask : public FakeHssTask
+{
+public:
+  FakeSarTask(const Diameter::Dictionary* dict,
+              struct msg** fd_msg,
+              const FakeHssConfig* cfg,
+              SAS::TrailId trail) :
+    FakeHssTask(dict, fd_msg, cfg, trail)
+  {}
+
+protected:
+  void answer()
+  {
+    Cx::ServerAssignmentRequest sar(_msg);
+    FakeAnswer saa(_msg, _cfg);
+
+    int32_t type = 0;
+    sar.server_assignment_type(type);
+
+    if ((_cfg->result_code == DIAMETER_SUCCESS) &&
+        ((type == Cx::REGISTRATION) ||
+         (type == Cx::RE_REGISTRATION) ||
+         (type == Cx::UNREGISTERED_USER)))
+    {
+      saa.add(Diameter::AVP(_cfg->dict->USER_DATA).val_str(
+                ims_subscription(sar.impi(), sar.impu())));
+    }
+
+    saa.send(trail());
+    delete this;
+  }
+
+  // Build an IMS subscription for a subscriber with a single public ID and
+  // the configured number of iFCs.
+  std::string ims_subscription(const std::string& impi, const std::string& impu)
+  {
+    std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+                      "<IMSSubscription>"
+                      "<PrivateID>" + impi + "</PrivateID>"
+                      "<ServiceProfile>"
+                      "<PublicIdentity><Identity>" + impu + "</Identity></PublicIdentity>";
+
+    for (int ii = 0; ii < _cfg->ifc_count; ++ii)
+    {
+      xml += "<InitialFilterCriteria>"
+             "<Priority>" + std::to_string(ii) + "</Priority>"
+             "<TriggerPoint><ConditionTypeCNF>0</ConditionTypeCNF>"
+             "<SPT><ConditionNegated>0</ConditionNegated><Group>0</Group>"
+             "<Method>INVITE</Method><Extension></Extension></SPT>"
+             "</TriggerPoint>"
+             "<ApplicationServer><ServerName>sip:as" + std::to_string(ii) +
+             ".example.com</ServerName><DefaultHandling>0</DefaultHandling>"
+             "</ApplicationServer>"
+             "</InitialFilterCriteria>";
+    }
+
+    xml += "</ServiceProfile></IMSSubscription>";
+    return xml;
+  }
+};
+
+/// UARs and LIRs get the same answer - the configured S-CSCF.
+class FakeUarLirTask : public FakeHssTask
+{
+public:
+  FakeUarLirTask(const Diameter::Dictionary* dict,
+                 struct msg** fd_msg,
+                 const FakeHssConfig* cfg,
+                 SAS::TrailId trail) :
+    FakeHssTask(dict, fd_msg, cfg, trail)
+  {}
+
+protected:
+  void answer()
+  {
+    FakeAnswer ans(_msg, _cfg);
+
+    if (_cfg->result_code == DIAMETER_SUCCESS)
+    {
+      ans.add(Diameter::AVP(_cfg->dict->SERVER_NAME).val_str(_cfg->scscf));
+    }
+
+    ans.send(trail());
+    delete this;
+  }
+};
+
+sem_t term_sem;
+
+void terminate_handler(int sig)
+{
+  sem_post(&term_sem);
+}
+
+int main(int argc, char** argv)
+{
+  struct options options;
+  options.diameter_conf = "fake_hss.conf";
+  options.latency_ms = 0;
+  options.result_code = DIAMETER_SUCCESS;
+  options.experimental_result_code = 5001;
+  options.scscf = "sip:scscf.example.com";
+  options.ifc_count = 1;
+  options.threads = 4;
+
+  int opt;
+  int long_opt_ind;
+  while ((opt = getopt_long(argc, argv, "c:h", long_opt, &long_opt_ind)) != -1)
+  {
+    switch (opt)
+    {
+    case 'c':
+      options.diameter_conf = std::string(optarg);
+      break;
+
+    case LATENCY_MS:
+      options.latency_ms = atoi(optarg);
+      break;
+
+    case RESULT_CODE:
+      options.result_code = atoi(optarg);
+      break;
+
+    case EXPERIMENTAL_RESULT_CODE:
+      options.experimental_result_code = atoi(optarg);
+      break;
+
+    case SCSCF:
+      options.scscf = std::string(optarg);
+      break;
+
+    case IFC_COUNT:
+      options.ifc_count = atoi(optarg);
+      break;
+
+    case THREADS:
+      options.threads = std::max(atoi(optarg), 1);
+      break;
+
+    case 'h':
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  sem_init(&term_sem, 0, 0);
+  signal(SIGTERM, terminate_handler);
+  signal(SIGINT, terminate_handler);
+
+  DelayQueue delay_queue(options.threads);
+  Diameter::Stack* diameter_stack = Diameter::Stack::get_instance();
+  Cx::Dictionary* dict = NULL;
+
+  FakeHssConfig cfg;
+  cfg.delay_queue = &delay_queue;
+  cfg.latency_ms = options.latency_ms;
+  cfg.result_code = options.result_code;
+  cfg.experimental_result_code = options.experimental_result_code;
+  cfg.scscf = options.scscf;
+  cfg.ifc_count = options.ifc_count;
+
+  Diameter::SpawningHandler<FakeMarTask, FakeHssConfig>* mar_handler = NULL;
+  Diameter::SpawningHandler<FakeSarTask, FakeHssConfig>* sar_handler = NULL;
+  Diameter::SpawningHandler<FakeUarLirTask, FakeHssConfig>* uar_lir_handler = NULL;
+
+  try
+  {
+    diameter_stack->initialize();
+    diameter_stack->configure(options.diameter_conf, NULL, NULL, NULL, NULL);
+    dict = new Cx::Dictionary();
+    cfg.dict = dict;
+
+    mar_handler = new Diameter::SpawningHandler<FakeMarTask, FakeHssConfig>(dict, &cfg);
+    sar_handler = new Diameter::SpawningHandler<FakeSarTask, FakeHssConfig>(dict, &cfg);
+    uar_lir_handler = new Diameter::SpawningHandler<FakeUarLirTask, FakeHssConfig>(dict, &cfg);
+
+    diameter_stack->advertize_application(Diameter::Dictionary::Application::AUTH,
+                                          dict->TGPP, dict->CX);
+    diameter_stack->register_handler(dict->CX, dict->MULTIMEDIA_AUTH_REQUEST, mar_handler);
+    diameter_stack->register_handler(dict->CX, dict->SERVER_ASSIGNMENT_REQUEST, sar_handler);
+    diameter_stack->register_handler(dict->CX, dict->USER_AUTHORIZATION_REQUEST, uar_lir_handler);
+    diameter_stack->register_handler(dict->CX, dict->LOCATION_INFO_REQUEST, uar_lir_handler);
+    diameter_stack->register_fallback_handler(dict->CX);
+    diameter_stack->start();
+  }
+  catch (Diameter::Stack::Exception& e)
+  {
+    fprintf(stderr, "Failed to initialize Diameter stack - function %s, rc %d\n",
+            e._func, e._rc);
+    return 2;
+  }
+
+  printf("Fake HSS running - latency %dms, result code %d\n",
+         options.latency_ms, options.result_code);
+
+  sem_wait(&term_sem);
+
+  diameter_stack->stop();
+  diameter_stack->wait_stopped();
+
+  delete mar_handler; mar_handler = NULL;
+  delete sar_handler; sar_handler = NULL;
+  delete uar_lir_handler; uar_lir_handler = NULL;
+  delete dict; dict = NULL;
+
+  return 0;
+}
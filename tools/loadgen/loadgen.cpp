@@ -0,0 +1,496 @@
+/**
+ * @file loadgen.cpp HTTP load generator for homestead, driving a
+ *   realistic mix of registration, call and authentication traffic.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <curl/curl.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "latency_histogram.h"
+
+/// The types of request the load generator sends.
+enum RequestKind
+{
+  REG = 0,
+  REREG,
+  CALL,
+  DEREG,
+  AV,
+  LOC,
+  NUM_REQUEST_KINDS
+};
+
+static const char* REQUEST_KIND_NAMES[NUM_REQUEST_KINDS] =
+{
+  "reg", "rereg", "call", "dereg", "av", "loc"
+};
+
+struct options
+{
+  std::string server;
+  std::string domain;
+  std::string server_name;
+  int subscribers;
+  int threads;
+  int duration_s;
+  int weights[NUM_REQUEST_KINDS];
+};
+
+enum OptionTypes
+{
+  SERVER_NAME = 128,
+  SUBSCRIBERS,
+  THREADS,
+  DURATION,
+  MIX
+};
+
+const static struct option long_opt[] =
+{
+  {"server",      required_argument, NULL, 's'},
+  {"domain",      required_argument, NULL, 'd'},
+  {"server-name", required_argument, NULL, SERVER_NAME},
+  {"subscribers", required_argument, NULL, SUBSCRIBERS},
+  {"threads",     required_argument, NULL, THREADS},
+  {"duration",    required_argument, NULL, DURATION},
+  {"mix",         required_argument, NULL, MIX},
+  {"help",        no_argument,       NULL, 'h'},
+  {NULL,          0,                 NULL, 0},
+};
+
+void usage(void)
+{
+  puts("Options:\n"
+       "\n"
+       " -s, --server <host:port>   Homestead HTTP address (default: 127.0.0.1:8888)\n"
+       " -d, --domain <domain>      Home domain of the subscribers (default: example.com)\n"
+       "     --server-name <uri>    S-CSCF name sent on registrations\n"
+       "                            (default: sip:scscf.example.com)\n"
+       "     --subscribers N        Number of subscribers (default: 10000)\n"
+       "     --threads N            Number of sending threads (default: 8)\n"
+       "     --duration N           Length of the run in seconds (default: 60)\n"
+       "     --mix R,RR,C,D,A,L     Relative weights of registrations,\n"
+       "                            re-registrations, calls, deregistrations,\n"
+       "                            authentication vector requests and location\n"
+       "                            queries (default: 5,30,45,5,10,5)\n"
+       " -h, --help                 Show this help screen\n");
+}
+
+/// The subscribers owned by one sending thread, split into those it has
+/// registered and those it hasn't, so that re-registrations and
+/// deregistrations are only sent for registered subscribers (as Sprout
+/// would).  Each subscriber is owned by a single thread, so its state can't
+/// be changed by another thread's requests.
+class SubscriberSet
+{
+public:
+  SubscriberSet(int first, int step, int count)
+  {
+    for (int subscriber = first; subscriber < count; subscriber += step)
+    {
+      _slot[subscriber] = _unregistered.size();
+      _unregistered.push_back(subscriber);
+    }
+  }
+
+  bool empty() const { return _registered.empty() && _unregistered.empty(); }
+  bool any_registered() const { return !_registered.empty(); }
+  bool any_unregistered() const { return !_unregistered.empty(); }
+
+  int pick_registered(std::mt19937& rng) const { return pick(_registered, rng); }
+  int pick_unregistered(std::mt19937& rng) const { return pick(_unregistered, rng); }
+
+  int pick_any(std::mt19937& rng) const
+  {
+    size_t total = _registered.size() + _unregistered.size();
+    size_t ii = std::uniform_int_distribution<size_t>(0, total - 1)(rng);
+    return (ii < _registered.size()) ?
+             _registered[ii] : _unregistered[ii - _registered.size()];
+  }
+
+  void set_registered(int subscriber, bool registered)
+  {
+    std::vector<int>& from = registered ? _unregistered : _registered;
+    std::vector<int>& to = registered ? _registered : _unregistered;
+
+    size_t slot = _slot[subscriber];
+    if ((slot < from.size()) && (from[slot] == subscriber))
+    {
+      // Move the last subscriber into this one's slot.
+      from[slot] = from.back();
+      _slot[from[slot]] = slot;
+      from.pop_back();
+
+      _slot[subscriber] = to.size();
+      to.push_back(subscriber);
+    }
+  }
+
+private:
+  static int pick(const std::vector<int>& subscribers, std::mt19937& rng)
+  {
+    return subscribers[std::uniform_int_distribution<size_t>(0, subscribers.size() - 1)(rng)];
+  }
+
+  std::vector<int> _registered;
+  std::vector<int> _unregistered;
+  std::map<int, size_t> _slot;
+};
+
+/// Results for one kind of request, shared by all the sending threads.
+struct KindStats
+{
+  LatencyHistogram latency;
+  std::atomic<uint64_t> errors;
+
+  KindStats() : errors(0) {}
+};
+
+struct LoadGenerator
+{
+  const struct options* options;
+  KindStats stats[NUM_REQUEST_KINDS];
+  std::atomic<bool> stop;
+
+  LoadGenerator(const struct options* options_) : options(options_), stop(false) {}
+
+  // Pick the next kind of request according to the traffic mix.
+  RequestKind pick_kind(std::mt19937& rng, int total_weight) const
+  {
+    int choice = std::uniform_int_distribution<int>(0, total_weight - 1)(rng);
+
+    for (int kind = 0; kind < NUM_REQUEST_KINDS; ++kind)
+    {
+      choice -= options->weights[kind];
+      if (choice < 0)
+      {
+        return (RequestKind)kind;
+      }
+    }
+
+    return CALL; // LCOV_EXCL_LINE
+  }
+
+  // Pick the subscriber for a request.  Registrations are for unregistered
+  // subscribers, and re-registrations and deregistrations for registered
+  // ones.  If there are none in the right state, the request kind is changed
+  // to one that makes sense.
+  int pick_subscriber(std::mt19937& rng, SubscriberSet& subscribers, RequestKind& kind) const
+  {
+    if ((kind == REREG) || (kind == DEREG))
+    {
+      if (subscribers.any_registered())
+      {
+        return subscribers.pick_registered(rng);
+      }
+      kind = REG;
+    }
+
+    if (kind == REG)
+    {
+      if (subscribers.any_unregistered())
+      {
+        return subscribers.pick_unregistered(rng);
+      }
+      kind = REREG;
+      return subscribers.pick_registered(rng);
+    }
+
+    return subscribers.pick_any(rng);
+  }
+
+  // Send a single request of the given kind, returning the HTTP status code
+  // (or 0 on a connection failure).
+  long send_request(CURL* curl, RequestKind kind, int subscriber)
+  {
+    std::string impi = "user" + std::to_string(subscriber) + "@" + options->domain;
+    std::string impu = "sip:" + impi;
+    std::string url = "http://" + options->server;
+    std::string body;
+
+    if ((kind == AV) || (kind == LOC))
+    {
+      url += (kind == AV) ? "/impi/" + impi + "/av?impu=" + impu :
+                            "/impu/" + impu + "/location";
+      curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+      curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, NULL);
+    }
+    else
+    {
+      // Sprout sends the same reqtype for registrations and
+      // re-registrations.  Homestead treats a registration as a
+      // re-registration if the subscriber is already registered with the
+      // same private ID, which it is here, as each subscriber always uses
+      // the same private and public ID pair.
+      const char* reqtype = (kind == CALL) ? "call" :
+                            (kind == DEREG) ? "dereg-user" : "reg";
+      url += "/impu/" + impu + "/reg-data?private_id=" + impi;
+      body = std::string("{\"reqtype\": \"") + reqtype + "\", " +
+             "\"server_name\": \"" + options->server_name + "\"}";
+      curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
+      curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
+      curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)body.size());
+    }
+
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+
+    long http_rc = 0;
+    if (curl_easy_perform(curl) == CURLE_OK)
+    {
+      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_rc);
+    }
+
+    return http_rc;
+  }
+
+  void run_thread(int thread_index)
+  {
+    std::mt19937 rng(1 + thread_index);
+    SubscriberSet subscribers(thread_index, options->threads, options->subscribers);
+
+    int total_weight = 0;
+    for (int kind = 0; kind < NUM_REQUEST_KINDS; ++kind)
+    {
+      total_weight += options->weights[kind];
+    }
+
+    CURL* curl = curl_easy_init();
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &discard_body);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, 5000L);
+
+    while (!stop.load(std::memory_order_relaxed))
+    {
+      RequestKind kind = pick_kind(rng, total_weight);
+      int subscriber = pick_subscriber(rng, subscribers, kind);
+
+      uint64_t start_us = now_us();
+      long http_rc = send_request(curl, kind, subscriber);
+      uint64_t latency_us = now_us() - start_us;
+
+      // A deregistration of a subscriber that homestead doesn't think is
+      // registered (for example because its registration expired) is
+      // legitimately rejected, so don't count it as an error.
+      bool ok = ((http_rc == 200) ||
+                 ((kind == DEREG) && (http_rc == 400)));
+
+      if ((kind == REG) || (kind == REREG))
+      {
+        subscribers.set_registered(subscriber, (http_rc == 200));
+      }
+      else if (kind == DEREG)
+      {
+        subscribers.set_registered(subscriber, false);
+      }
+
+      stats[kind].latency.record(latency_us);
+      if (!ok)
+      {
+        stats[kind].errors++;
+      }
+    }
+
+    curl_easy_cleanup(curl);
+  }
+
+  static size_t discard_body(char* ptr, size_t size, size_t nmemb, void* userdata)
+  {
+    return size * nmemb;
+  }
+
+  static uint64_t now_us()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+  }
+
+  void report(double elapsed_s) const
+  {
+    printf("%-8s %10s %10s %8s %10s %10s %10s %10s\n",
+           "request", "count", "rate/s", "errors",
+           "p50(us)", "p99(us)", "p999(us)", "max(us)");
+
+    uint64_t total = 0;
+    uint64_t total_errors = 0;
+
+    for (int kind = 0; kind < NUM_REQUEST_KINDS; ++kind)
+    {
+      const KindStats& s = stats[kind];
+      uint64_t count = s.latency.count();
+      total += count;
+      total_errors += s.errors;
+
+      printf("%-8s %10lu %10.1f %8lu %10lu %10lu %10lu %10lu\n",
+             REQUEST_KIND_NAMES[kind],
+             count,
+             count / elapsed_s,
+             (uint64_t)s.errors,
+             s.latency.value_at_percentile(50),
+             s.latency.value_at_percentile(99),
+             s.latency.value_at_percentile(99.9),
+             s.latency.max());
+    }
+
+    printf("%-8s %10lu %10.1f %8lu\n", "total", total, total / elapsed_s, total_errors);
+  }
+};
+
+bool parse_mix(const char* str, int* weights)
+{
+  return (sscanf(str, "%d,%d,%d,%d,%d,%d",
+                 &weights[REG],
+                 &weights[REREG],
+                 &weights[CALL],
+                 &weights[DEREG],
+                 &weights[AV],
+                 &weights[LOC]) == NUM_REQUEST_KINDS);
+}
+
+int main(int argc, char** argv)
+{
+  struct options options;
+  options.server = "127.0.0.1:8888";
+  options.domain = "example.com";
+  options.server_name = "sip:scscf.example.com";
+  options.subscribers = 10000;
+  options.threads = 8;
+  options.duration_s = 60;
+  parse_mix("5,30,45,5,10,5", options.weights);
+
+  int opt;
+  int long_opt_ind;
+  while ((opt = getopt_long(argc, argv, "s:d:h", long_opt, &long_opt_ind)) != -1)
+  {
+    switch (opt)
+    {
+    case 's':
+      options.server = std::string(optarg);
+      break;
+
+    case 'd':
+      options.domain = std::string(optarg);
+      break;
+
+    case SERVER_NAME:
+      options.server_name = std::string(optarg);
+      break;
+
+    case SUBSCRIBERS:
+      options.subscribers = std::max(atoi(optarg), 1);
+      break;
+
+    case THREADS:
+      options.threads = std::max(atoi(optarg), 1);
+      break;
+
+    case DURATION:
+      options.duration_s = std::max(atoi(optarg), 1);
+      break;
+
+    case MIX:
+      if (!parse_mix(optarg, options.weights))
+      {
+        fprintf(stderr, "Invalid traffic mix %s\n", optarg);
+        return 1;
+      }
+      break;
+
+    case 'h':
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  int total_weight = 0;
+  for (int kind = 0; kind < NUM_REQUEST_KINDS; ++kind)
+  {
+    if (options.weights[kind] < 0)
+    {
+      total_weight = 0;
+      break;
+    }
+    total_weight += options.weights[kind];
+  }
+
+  if (total_weight <= 0)
+  {
+    fprintf(stderr, "The traffic mix must have non-negative weights and a positive total\n");
+    return 1;
+  }
+
+  // Each thread owns a share of the subscribers, so there can't be more
+  // threads than subscribers.
+  options.threads = std::min(options.threads, options.subscribers);
+
+  curl_global_init(CURL_GLOBAL_ALL);
+
+  LoadGenerator generator(&options);
+  std::vector<std::thread> threads;
+  uint64_t start_us = LoadGenerator::now_us();
+
+  for (int ii = 0; ii < options.threads; ++ii)
+  {
+    threads.push_back(std::thread(&LoadGenerator::run_thread, &generator, ii));
+  }
+
+  std::this_thread::sleep_for(std::chrono::seconds(options.duration_s));
+  generator.stop = true;
+
+  for (std::vector<std::thread>::iterator it = threads.begin();
+       it != threads.end();
+       ++it)
+  {
+    it->join();
+  }
+
+  double elapsed_s = (LoadGenerator::now_us() - start_us) / 1000000.0;
+  generator.report(elapsed_s);
+
+  curl_global_cleanup();
+
+  return 0;
+}
@@ -0,0 +1,153 @@
+/**
+ * @file memory_cassandra.cpp A Thrift server that stands in for Cassandra,
+ *   storing data in memory, for load testing.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2015  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <getopt.h>
+#include <stdlib.h>
+
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/server/TThreadedServer.h>
+#include <thrift/transport/TServerSocket.h>
+#include <thrift/transport/TBufferTransports.h>
+
+#include "embedded_store.h"
+
+using namespace apache::thrift;
+using namespace apache::thrift::protocol;
+using namespace apache::thrift::server;
+using namespace apache::thrift::transport;
+using namespace org::apache::cassandra;
+
+/// Thrift handler that serves the subset of the Cassandra API used by
+/// homestead from an EmbeddedStore.  All other methods are no-ops.
+class MemoryCassandraHandler : public CassandraNull
+{
+public:
+  MemoryCassandraHandler(EmbeddedStore* store) : _store(store) {}
+
+  void set_keyspace(const std::string& keyspace)
+  {
+    _store->set_keyspace(keyspace);
+  }
+
+  void batch_mutate(const std::map<std::string, std::map<std::string, std::vector<Mutation> > >& mutation_map,
+                    const ConsistencyLevel::type consistency_level)
+  {
+    _store->batch_mutate(mutation_map, consistency_level);
+  }
+
+  void get_slice(std::vector<ColumnOrSuperColumn>& _return,
+                 const std::string& key,
+                 const ColumnParent& column_parent,
+                 const SlicePredicate& predicate,
+                 const ConsistencyLevel::type consistency_level)
+  {
+    _store->get_slice(_return, key, column_parent, predicate, consistency_level);
+  }
+
+  void multiget_slice(std::map<std::string, std::vector<ColumnOrSuperColumn> >& _return,
+                      const std::vector<std::string>& keys,
+                      const ColumnParent& column_parent,
+                      const SlicePredicate& predicate,
+                      const ConsistencyLevel::type consistency_level)
+  {
+    _store->multiget_slice(_return, keys, column_parent, predicate, consistency_level);
+  }
+
+  void remove(const std::string& key,
+              const ColumnPath& column_path,
+              const int64_t timestamp,
+              const ConsistencyLevel::type consistency_level)
+  {
+    _store->remove(key, column_path, timestamp, consistency_level);
+  }
+
+  void get_range_slices(std::vector<KeySlice>& _return,
+                        const ColumnParent& column_parent,
+                        const SlicePredicate& predicate,
+                        const KeyRange& range,
+                        const ConsistencyLevel::type consistency_level)
+  {
+    _store->get_range_slices(_return, column_parent, predicate, range, consistency_level);
+  }
+
+private:
+  EmbeddedStore* _store;
+};
+
+int main(int argc, char** argv)
+{
+  int port = 9160;
+  std::string dir;
+
+  if (argc > 1)
+  {
+    port = atoi(argv[1]);
+  }
+
+  if (argc > 2)
+  {
+    dir = argv[2];
+  }
+
+  if (port <= 0)
+  {
+    fprintf(stderr, "Usage: %s [<port> [<persistence directory>]]\n", argv[0]);
+    return 1;
+  }
+
+  EmbeddedStore store(dir);
+  if (!store.open())
+  {
+    fprintf(stderr, "Failed to load store from %s\n", dir.c_str());
+    return 1;
+  }
+  boost::shared_ptr<MemoryCassandraHandler> handler(new MemoryCassandraHandler(&store));
+  boost::shared_ptr<TProcessor> processor(new CassandraProcessor(handler));
+  boost::shared_ptr<TServerTransport> server_transport(new TServerSocket(port));
+  boost::shared_ptr<TTransportFactory> transport_factory(new TFramedTransportFactory());
+  boost::shared_ptr<TProtocolFactory> protocol_factory(new TBinaryProtocolFactory());
+
+  TThreadedServer server(processor,
+                         server_transport,
+                         transport_factory,
+                         protocol_factory);
+
+  printf("In-memory Cassandra listening on port %d\n", port);
+  server.serve();
+
+  return 0;
+}